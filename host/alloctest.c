@@ -0,0 +1,326 @@
+/*
+ * Host test and benchmark driver for the kernel's allocators. kernel/malloc.c
+ * and kernel/pmm.c are compiled unmodified against the shims in host/include,
+ * with the kernel heap backed by ordinary host memory. Run with "make
+ * alloctest", or directly as
+ *
+ *     host/alloctest [seed] [iterations]
+ *
+ * It runs randomized stress tests of both allocators, which check every block
+ * for overlaps and corruption, then reports fragmentation and throughput.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kernel/malloc.h>
+#include <kernel/pmm.h>
+
+#define PAGE_SIZE 4096
+#define HEAP_BYTES (HEAP_PAGES * PAGE_SIZE)
+
+/* Most blocks the kmalloc stress test keeps live at once */
+#define MAX_LIVE 512
+
+/* Fake physical memory handed to the page allocator */
+#define PMM_BASE 0x200000
+
+static uint8_t *arena;
+static int arena_next;
+
+struct block {
+        uint8_t *ptr;
+        size_t size;
+        uint8_t fill;
+};
+
+/* Support functions the allocators expect from the kernel */
+
+void kpanic(char *msg)
+{
+        fprintf(stderr, "kpanic: %s\n", msg);
+        abort();
+}
+
+void kprintf(char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+}
+
+static void fail(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+        exit(1);
+}
+
+/* Page source for the heap, handing out consecutive pages of the arena */
+static void *arena_page()
+{
+        if (arena_next == HEAP_PAGES)
+                return NULL;
+        return arena + PAGE_SIZE * arena_next++;
+}
+
+static void reset_heap()
+{
+        memset(arena, 0xdd, HEAP_BYTES);
+        arena_next = 0;
+        heap_init(arena_page);
+}
+
+static double now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Picks allocation sizes skewed towards small objects, like the kernel's */
+static size_t random_size()
+{
+        switch (rand() % 8) {
+        case 0:
+                return rand() % 1024 + 1;
+        case 1:
+        case 2:
+                return rand() % 128 + 1;
+        default:
+                return rand() % 32 + 1;
+        }
+}
+
+static void check_block(struct block *b)
+{
+        for (size_t i = 0; i < b->size; i++) {
+                if (b->ptr[i] != b->fill)
+                        fail("block %p (%zu bytes) corrupted at offset %zu",
+                             b->ptr, b->size, i);
+        }
+}
+
+/*
+ * Random mix of kmalloc and kfree, filling each block with its own byte so
+ * that overlapping blocks or a clobbered heap show up as a corrupted block.
+ */
+static void stress_kmalloc(int iters)
+{
+        struct block live[MAX_LIVE];
+        int nlive = 0, nfail = 0, i, j;
+        struct block *b;
+
+        reset_heap();
+        for (i = 0; i < iters; i++) {
+                if (nlive < MAX_LIVE && (nlive == 0 || rand() % 100 < 55)) {
+                        b = &live[nlive];
+                        b->size = random_size();
+                        b->ptr = kmalloc(b->size, 0);
+                        if (!b->ptr) {
+                                nfail++;
+                                continue;
+                        }
+                        if ((uintptr_t) b->ptr % 4)
+                                fail("unaligned block %p", b->ptr);
+                        if (b->ptr < arena
+                            || b->ptr + b->size > arena + HEAP_BYTES)
+                                fail("block %p outside of heap", b->ptr);
+                        b->fill = rand() % 255 + 1;
+                        memset(b->ptr, b->fill, b->size);
+                        nlive++;
+                }
+                else {
+                        j = rand() % nlive;
+                        check_block(&live[j]);
+                        kfree(live[j].ptr);
+                        live[j] = live[--nlive];
+                }
+        }
+
+        for (j = 0; j < nlive; j++) {
+                check_block(&live[j]);
+                kfree(live[j].ptr);
+        }
+
+        /* With everything freed, the whole heap must be usable again */
+        b = &live[0];
+        b->ptr = kmalloc(HEAP_BYTES - 4, 0);
+        if (!b->ptr)
+                fail("heap not fully reusable after freeing everything");
+        kfree(b->ptr);
+
+        printf("kmalloc stress: %d ops ok (%d out of memory)\n", iters, nfail);
+}
+
+/*
+ * Random mix of page allocations and frees, checking that no page is handed
+ * out twice and that every page comes back.
+ */
+static void stress_pmm(int iters)
+{
+        static uint8_t used[PMM_MAX_PAGES];
+        static uint32_t held[PMM_MAX_PAGES];
+        int nheld = 0, i, j;
+        uint32_t paddr, idx, total;
+
+        while (pmm_alloc());
+        for (i = 0; i < PMM_MAX_PAGES; i++)
+                pmm_free(PMM_BASE + i * PAGE_SIZE);
+        total = pmm_count();
+
+        for (i = 0; i < iters; i++) {
+                if (nheld == 0 || rand() % 100 < 50) {
+                        paddr = pmm_alloc();
+                        if (!paddr) {
+                                if (nheld != total)
+                                        fail("pmm empty with %d of %u held",
+                                             nheld, total);
+                                continue;
+                        }
+                        idx = (paddr - PMM_BASE) / PAGE_SIZE;
+                        if (paddr % PAGE_SIZE || idx >= PMM_MAX_PAGES)
+                                fail("bad page %08x", paddr);
+                        if (used[idx])
+                                fail("page %08x allocated twice", paddr);
+                        used[idx] = 1;
+                        held[nheld++] = paddr;
+                }
+                else {
+                        j = rand() % nheld;
+                        used[(held[j] - PMM_BASE) / PAGE_SIZE] = 0;
+                        pmm_free(held[j]);
+                        held[j] = held[--nheld];
+                }
+        }
+
+        while (nheld)
+                pmm_free(held[--nheld]);
+        if (pmm_count() != total)
+                fail("pmm lost pages: %u of %u free", pmm_count(), total);
+
+        printf("pmm stress: %d ops ok\n", iters);
+}
+
+/* Finds the largest single allocation that currently succeeds */
+static size_t largest_block()
+{
+        size_t lo = 0, hi = HEAP_BYTES;
+        void *p;
+
+        while (lo < hi) {
+                size_t mid = (lo + hi + 1) / 2;
+                p = kmalloc(mid, 0);
+                if (p) {
+                        kfree(p);
+                        lo = mid;
+                }
+                else {
+                        hi = mid - 1;
+                }
+        }
+        return lo;
+}
+
+/*
+ * Fills the heap with small blocks, frees every other one, and reports how
+ * much memory is free against the largest block that can still be allocated.
+ */
+static void bench_fragmentation()
+{
+        static void *ptrs[HEAP_BYTES / 8];
+        static size_t sizes[HEAP_BYTES / 8];
+        int n = 0, i;
+        size_t freed = 0;
+
+        reset_heap();
+        for (;;) {
+                sizes[n] = random_size();
+                ptrs[n] = kmalloc(sizes[n], 0);
+                if (!ptrs[n])
+                        break;
+                n++;
+        }
+        for (i = 0; i < n; i += 2) {
+                freed += sizes[i];
+                kfree(ptrs[i]);
+        }
+
+        printf("fragmentation: %d blocks, %zu bytes freed in holes, "
+               "largest allocatable %zu bytes\n", n, freed, largest_block());
+
+        for (i = 1; i < n; i += 2)
+                kfree(ptrs[i]);
+        printf("fragmentation: largest allocatable after freeing all "
+               "%zu of %d bytes\n", largest_block(), HEAP_BYTES);
+}
+
+static void bench_throughput(int iters)
+{
+        void *live[64] = { NULL };
+        double start, elapsed;
+        uint32_t paddr;
+        int i, j;
+
+        reset_heap();
+        start = now();
+        for (i = 0; i < iters; i++)
+                kfree(kmalloc(64, 0));
+        elapsed = now() - start;
+        printf("throughput: kmalloc/kfree 64 bytes: %.1f ns/pair\n",
+               elapsed * 1e9 / iters);
+
+        start = now();
+        for (i = 0; i < iters; i++) {
+                j = rand() % 64;
+                if (live[j])
+                        kfree(live[j]);
+                live[j] = kmalloc(random_size(), 0);
+        }
+        elapsed = now() - start;
+        printf("throughput: kmalloc/kfree random, 64 live: %.1f ns/pair\n",
+               elapsed * 1e9 / iters);
+        for (j = 0; j < 64; j++) {
+                if (live[j])
+                        kfree(live[j]);
+        }
+
+        start = now();
+        for (i = 0; i < iters; i++) {
+                paddr = pmm_alloc();
+                pmm_free(paddr);
+        }
+        elapsed = now() - start;
+        printf("throughput: pmm_alloc/pmm_free: %.1f ns/pair\n",
+               elapsed * 1e9 / iters);
+}
+
+int main(int argc, char **argv)
+{
+        unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 0) : time(NULL);
+        int iters = argc > 2 ? atoi(argv[2]) : 1000000;
+
+        printf("seed %u, %d iterations\n", seed, iters);
+        srand(seed);
+
+        arena = aligned_alloc(PAGE_SIZE, HEAP_BYTES);
+        if (!arena)
+                fail("out of host memory");
+
+        stress_kmalloc(iters);
+        stress_pmm(iters);
+        bench_fragmentation();
+        bench_throughput(iters);
+        return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Host test driver for boot modules and the tar reader. kernel/bootmod.c and
+ * kernel/tar.c are compiled unmodified against the shims in host/include, with
+ * "physical" memory being host memory below 4 GiB, mapped as is. Run with
+ * "make bootmodtest", or directly as
+ *
+ *     host/bootmodtest
+ *
+ * It has tar --format=ustar archive a directory holding a path too long for
+ * the name field alone, and checks lookups of every file, lookups that must
+ * fail, and archives that aren't tar or are damaged. Each archive truncated
+ * at every length is read from the end of a page followed by an unmapped one,
+ * so reading past the size given faults. Then the archive and a raw image are
+ * passed through bootmod_init as Multiboot modules and looked up, read from
+ * and written to as RAM disks.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <kernel/errno.h>
+#include <kernel/bootmod.h>
+#include <kernel/paging.h>
+#include <kernel/tar.h>
+
+/* A directory name that only fits a path with the prefix field */
+#define LONG_DIR "a_directory_name_long_enough_that_the_path_below_it_" \
+                 "cannot_fit_the_hundred_byte_name_field_of_ustar"
+
+#define RAW_SIZE (2 * SECTOR_SIZE + 100)
+
+struct test_file {
+        char *path;
+        uint32_t size;
+};
+
+static struct test_file files[] = {
+        { "hello.txt", 26 },
+        { "empty", 0 },
+        { "dir/sector.bin", SECTOR_SIZE },
+        { "dir/sub/odd.bin", 3 * SECTOR_SIZE + 7 },
+        { LONG_DIR "/deep/file.txt", 100 },
+        { NULL }
+};
+
+static struct blkdev *registered[MAX_BOOTMODS];
+static int nregistered;
+static int completions, last_status;
+
+/* Support functions the sources expect from the kernel */
+
+void kprintf(char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+}
+
+int str_eq(char *a, char *b)
+{
+        return !strcmp(a, b);
+}
+
+uintptr_t map_phys(uint32_t paddr, uint32_t size, uint32_t flags)
+{
+        return paddr;
+}
+
+int blkdev_register(struct blkdev *dev)
+{
+        registered[nregistered++] = dev;
+        return 0;
+}
+
+void blk_complete(struct blk_request *req, int status)
+{
+        completions++;
+        last_status = status;
+}
+
+static void fail(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+        exit(1);
+}
+
+/* Memory with a 32-bit address, standing in for physical memory */
+static void *alloc32(uint32_t size)
+{
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+
+        if (p == MAP_FAILED)
+                fail("out of host memory");
+        return p;
+}
+
+static uint8_t file_byte(int file, uint32_t i)
+{
+        return i * 13 + file * 29 + 1;
+}
+
+/* Archives the test files, returning the archive and its size */
+static uint8_t *make_archive(uint32_t *size)
+{
+        char dir[] = "/tmp/bootmodtest.XXXXXX", path[512], cmd[1024];
+        uint8_t *archive;
+        FILE *f;
+        long len;
+
+        if (!mkdtemp(dir))
+                fail("can't make a temporary directory");
+        for (int i = 0; files[i].path; i++) {
+                snprintf(cmd, sizeof(cmd), "mkdir -p \"$(dirname %s/%s)\"",
+                         dir, files[i].path);
+                if (system(cmd))
+                        fail("can't make the directory of %s", files[i].path);
+                snprintf(path, sizeof(path), "%s/%s", dir, files[i].path);
+                f = fopen(path, "wb");
+                if (!f)
+                        fail("can't create %s", path);
+                for (uint32_t j = 0; j < files[i].size; j++)
+                        fputc(file_byte(i, j), f);
+                fclose(f);
+        }
+
+        snprintf(cmd, sizeof(cmd), "tar --format=ustar -C %s -cf %s.tar .",
+                 dir, dir);
+        if (system(cmd))
+                fail("tar failed");
+        snprintf(path, sizeof(path), "%s.tar", dir);
+        f = fopen(path, "rb");
+        if (!f)
+                fail("can't open %s", path);
+        fseek(f, 0, SEEK_END);
+        len = ftell(f);
+        rewind(f);
+        archive = alloc32(len);
+        if (fread(archive, 1, len, f) != (size_t) len)
+                fail("can't read %s", path);
+        fclose(f);
+
+        snprintf(cmd, sizeof(cmd), "rm -rf %s %s.tar", dir, dir);
+        system(cmd);
+        *size = len;
+        return archive;
+}
+
+static void check_file(uint8_t *archive, uint32_t size, char *path, int file)
+{
+        void *data;
+        uint32_t len;
+        int ret = tar_find(archive, size, path, &data, &len);
+
+        if (ret)
+                fail("%s: %d", path, ret);
+        if (len != files[file].size)
+                fail("%s: %u bytes, expected %u", path, len, files[file].size);
+        if ((uint8_t*) data < archive || (uint8_t*) data + len
+                                         > archive + size)
+                fail("%s: data outside the archive", path);
+        for (uint32_t i = 0; i < len; i++) {
+                if (((uint8_t*) data)[i] != file_byte(file, i))
+                        fail("%s: wrong at offset %u", path, i);
+        }
+}
+
+static void check_missing(uint8_t *archive, uint32_t size, char *path,
+                          int expect)
+{
+        void *data;
+        uint32_t len;
+        int ret = tar_find(archive, size, path, &data, &len);
+
+        if (ret != expect)
+                fail("%s: %d, expected %d", path, ret, expect);
+}
+
+static void test_lookups(uint8_t *archive, uint32_t size)
+{
+        char path[512];
+        bool prefixed = false;
+
+        for (int i = 0; files[i].path; i++) {
+                check_file(archive, size, files[i].path, i);
+                snprintf(path, sizeof(path), "/%s", files[i].path);
+                check_file(archive, size, path, i);
+                snprintf(path, sizeof(path), "./%s", files[i].path);
+                check_file(archive, size, path, i);
+        }
+        for (uint32_t off = 0; off + TAR_BLOCK_SIZE <= size;
+             off += TAR_BLOCK_SIZE) {
+                if (!memcmp(archive + off + 257, "ustar", 5)
+                    && archive[off + 345])
+                        prefixed = true;
+        }
+        if (!prefixed)
+                fail("tar didn't use the prefix field");
+
+        check_missing(archive, size, "dir", -ENOENT);
+        check_missing(archive, size, "dir/sub", -ENOENT);
+        check_missing(archive, size, "hello", -ENOENT);
+        check_missing(archive, size, "hello.txt/x", -ENOENT);
+        check_missing(archive, size, "deep/file.txt", -ENOENT);
+        check_missing(archive, size, LONG_DIR "/deep", -ENOENT);
+        printf("tar lookups ok\n");
+}
+
+/* Recomputes a header's checksum after it's been changed */
+static void set_checksum(uint8_t *hdr)
+{
+        uint32_t sum = 0;
+
+        memset(hdr + 148, ' ', 8);
+        for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+                sum += hdr[i];
+        snprintf((char*) hdr + 148, 8, "%06o", sum);
+}
+
+static void test_damaged(uint8_t *archive, uint32_t size)
+{
+        uint8_t *copy = alloc32(size);
+
+        check_missing(copy, size, "hello.txt", -ENOENT);
+        for (uint32_t i = 0; i < size; i++)
+                copy[i] = i * 7 + 5;
+        check_missing(copy, size, "hello.txt", -EINVAL);
+
+        /* A wrong checksum on the first header means it's not tar */
+        memcpy(copy, archive, size);
+        copy[0] ^= 1;
+        check_missing(copy, size, "hello.txt", -EINVAL);
+
+        /* A size running past the end can't be trusted */
+        memcpy(copy, archive, size);
+        for (uint32_t off = 0; off + TAR_BLOCK_SIZE <= size;
+             off += TAR_BLOCK_SIZE) {
+                if (!memcmp(copy + off + 257, "ustar", 5)) {
+                        memcpy(copy + off + 124, "77777777777", 11);
+                        set_checksum(copy + off);
+                        break;
+                }
+        }
+        check_missing(copy, size, "hello.txt", -ENOENT);
+        munmap(copy, size);
+        printf("damaged archives ok\n");
+}
+
+/* Returns where a file's data ends, from the archive's own headers */
+static uint32_t data_end(uint8_t *archive, uint32_t size, char *path)
+{
+        void *data;
+        uint32_t len;
+
+        if (tar_find(archive, size, path, &data, &len))
+                fail("%s not found", path);
+        return (uint8_t*) data - archive + len;
+}
+
+/*
+ * Looks up every file in every truncation of the archive, which must find
+ * it just when its data is all there, and never read past the end.
+ */
+static void test_truncated(uint8_t *archive, uint32_t size)
+{
+        uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE + 1, end;
+        uint8_t *mem = alloc32(pages * PAGE_SIZE), *copy;
+        uint8_t *guard = mem + (pages - 1) * PAGE_SIZE;
+        void *data;
+        uint32_t len;
+        int ret;
+
+        mprotect(guard, PAGE_SIZE, PROT_NONE);
+        for (int i = 0; files[i].path; i++) {
+                end = data_end(archive, size, files[i].path);
+                for (uint32_t n = 0; n <= size; n++) {
+                        copy = guard - n;
+                        memcpy(copy, archive, n);
+                        ret = tar_find(copy, n, files[i].path, &data, &len);
+                        if (n >= end ? ret : ret != -ENOENT)
+                                fail("%s in %u of %u bytes: %d",
+                                     files[i].path, n, size, ret);
+                }
+        }
+        munmap(mem, pages * PAGE_SIZE);
+        printf("truncated archives ok\n");
+}
+
+static void add_module(struct multiboot_module *mod, void *data, uint32_t size,
+                       char *cmdline)
+{
+        char *s = alloc32(strlen(cmdline) + 1);
+
+        strcpy(s, cmdline);
+        mod->mod_start = virt_to_phys(data);
+        mod->mod_end = mod->mod_start + size;
+        mod->cmdline = virt_to_phys(s);
+}
+
+static void check_rw(struct blkdev *dev, uint8_t *raw)
+{
+        static uint8_t buf[2 * SECTOR_SIZE];
+        struct blk_request req = { .dev = dev, .lba = 1, .count = 1,
+                                   .buf = buf };
+
+        dev->submit(dev, &req);
+        if (completions != 1 || last_status
+            || memcmp(buf, raw + SECTOR_SIZE, SECTOR_SIZE))
+                fail("RAM disk read wrong");
+
+        memset(buf, 0x5a, sizeof(buf));
+        req.lba = 0;
+        req.count = 2;
+        req.write = true;
+        dev->submit(dev, &req);
+        if (completions != 2 || last_status || raw[0] != 0x5a
+            || raw[2 * SECTOR_SIZE - 1] != 0x5a)
+                fail("RAM disk write wrong");
+}
+
+static void test_bootmods(uint8_t *archive, uint32_t size)
+{
+        struct multiboot_info mbi = { .flags = MULTIBOOT_INFO_MODS };
+        struct multiboot_module *mods = alloc32(PAGE_SIZE);
+        uint8_t *raw = alloc32(RAW_SIZE);
+        struct bootmod *bm;
+        uint32_t paddr, len;
+        void *data;
+
+        for (uint32_t i = 0; i < RAW_SIZE; i++)
+                raw[i] = i * 3;
+        add_module(&mods[0], raw, RAW_SIZE, "/boot/disk.img rw");
+        add_module(&mods[1], archive, size, "/boot/initrd.tar");
+        mbi.mods_count = 2;
+        mbi.mods_addr = virt_to_phys(mods);
+
+        bootmod_init(&mbi);
+        paddr = virt_to_phys(raw);
+        if (!bootmod_reserved(paddr) || !bootmod_reserved(paddr + RAW_SIZE - 1)
+            || !bootmod_reserved(virt_to_phys(archive) + size - 1))
+                fail("module pages not reserved");
+        if (bootmod_reserved(virt_to_phys(mods)))
+                fail("module list reserved");
+
+        bootmod_setup();
+        if (nregistered != 2 || strcmp(registered[0]->name, "ram0")
+            || registered[0]->sectors != RAW_SIZE / SECTOR_SIZE
+            || registered[1]->sectors != size / SECTOR_SIZE)
+                fail("RAM disks not registered as expected");
+
+        bm = bootmod_get("disk.img");
+        if (!bm || bm != bootmod_get("ram0") || bm->data != raw
+            || bm->size != RAW_SIZE || strcmp(bm->cmdline, "/boot/disk.img rw"))
+                fail("disk.img lookup wrong");
+        bm = bootmod_get("initrd.tar");
+        if (!bm || bm != bootmod_get("ram1") || bootmod_get("boot")
+            || bootmod_get("initrd") || bootmod_get("ram2"))
+                fail("initrd.tar lookup wrong");
+
+        if (bootmod_file("dir/sector.bin", &data, &len)
+            || (uint8_t*) data < archive || len != SECTOR_SIZE)
+                fail("bootmod_file didn't find dir/sector.bin in place");
+        if (bootmod_file("missing", &data, &len) != -ENOENT)
+                fail("bootmod_file found a missing file");
+
+        check_rw(registered[0], raw);
+        printf("boot modules ok\n");
+}
+
+int main(int argc, char **argv)
+{
+        uint32_t size;
+        uint8_t *archive = make_archive(&size);
+
+        test_lookups(archive, size);
+        test_damaged(archive, size);
+        test_truncated(archive, size);
+        test_bootmods(archive, size);
+        return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Host test driver for the FAT driver. kernel/fat.c is compiled unmodified
+ * against the shims in host/include, with the buffer cache replaced by reads
+ * straight from an image in host memory, counted so the tests can tell when
+ * the disk was touched. Run with "make fattest", or directly as
+ *
+ *     host/fattest [image]
+ *
+ * It builds a small FAT12 volume in memory with a subdirectory and a file
+ * more fragmented than an open file's extents cover, and checks directory
+ * listings, reads at every kind of offset, failed lookups, and that opening
+ * paths already looked up reads nothing from the disk. Given an image, such
+ * as boot/bootgrub.img, it then lists the image's root directory as well.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <kernel/errno.h>
+#include <kernel/buffer.h>
+#include <kernel/fat.h>
+#include <kernel/pmm.h>
+
+/* Geometry of the test volume, that of a 1.44 MB floppy */
+#define TEST_SECTORS 2880
+#define TEST_FAT_START 1
+#define TEST_FAT_SECTORS 9
+#define TEST_ROOT_START (TEST_FAT_START + 2 * TEST_FAT_SECTORS)
+#define TEST_ROOT_ENTRIES 224
+#define TEST_DATA_START (TEST_ROOT_START + TEST_ROOT_ENTRIES * 32 / SECTOR_SIZE)
+
+/* The fragmented file takes every other cluster from DATA_FIRST */
+#define DATA_FIRST 10
+#define DATA_CLUSTERS (FAT_MAX_EXTENTS + 4)
+#define DATA_SIZE ((DATA_CLUSTERS - 1) * SECTOR_SIZE + 100)
+
+#define HELLO_CLUSTER 2
+#define DIR_CLUSTER 3
+
+static const char hello[] = "Hello from a FAT12 volume\n";
+
+static uint8_t *image;
+static uint32_t image_sectors;
+static int nreads;
+static int npages;
+
+/* Support functions fat.c expects from the kernel */
+
+void kprintf(char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+}
+
+struct buffer *bread(struct blkdev *dev, uint32_t block)
+{
+        struct buffer *b;
+
+        if (block >= image_sectors)
+                return NULL;
+        b = calloc(1, sizeof(*b));
+        b->dev = dev;
+        b->block = block;
+        b->data = malloc(SECTOR_SIZE);
+        memcpy(b->data, image + block * SECTOR_SIZE, SECTOR_SIZE);
+        nreads++;
+        return b;
+}
+
+void brelse(struct buffer *b)
+{
+        free(b->data);
+        free(b);
+}
+
+/* Pages must have 32-bit addresses, which stand in for physical ones */
+uint32_t pmm_alloc()
+{
+        void *p = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+
+        if (p == MAP_FAILED)
+                return 0;
+        npages++;
+        return virt_to_phys(p);
+}
+
+void pmm_free(uint32_t paddr)
+{
+        munmap(phys_to_virt(paddr), PAGE_SIZE);
+        npages--;
+}
+
+static void fail(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+        exit(1);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+        put16(p, v & 0xffff);
+        put16(p + 2, v >> 16);
+}
+
+/* Sets a FAT12 entry in both copies of the FAT */
+static void fat12_set(uint32_t cluster, uint32_t val)
+{
+        uint8_t *fat;
+        uint32_t off = cluster + cluster / 2;
+
+        for (int i = 0; i < 2; i++) {
+                fat = image + (TEST_FAT_START + i * TEST_FAT_SECTORS)
+                      * SECTOR_SIZE;
+                if (cluster & 1) {
+                        fat[off] = (fat[off] & 0x0f) | (val << 4 & 0xf0);
+                        fat[off + 1] = val >> 4;
+                }
+                else {
+                        fat[off] = val & 0xff;
+                        fat[off + 1] = (fat[off + 1] & 0xf0)
+                                       | (val >> 8 & 0x0f);
+                }
+        }
+}
+
+static uint8_t *cluster_data(uint32_t cluster)
+{
+        return image + (TEST_DATA_START + cluster - 2) * SECTOR_SIZE;
+}
+
+static void put_dirent(uint8_t *p, char *name, uint8_t attr, uint32_t cluster,
+                       uint32_t size)
+{
+        memcpy(p, name, FAT_NAME_LEN);
+        p[11] = attr;
+        put16(p + 26, cluster);
+        put32(p + 28, size);
+}
+
+static uint8_t data_byte(uint32_t i)
+{
+        return i * 7 + i / 251 + 3;
+}
+
+/*
+ * Builds the test volume: HELLO.TXT and DIR in the root, next to a volume
+ * label, a long name entry and a deleted file, which listings must skip, and
+ * DIR/DATA.BIN spread over DATA_CLUSTERS clusters that are all apart.
+ */
+static void build_image()
+{
+        uint8_t *root, *dir, *data;
+        uint32_t c;
+
+        image_sectors = TEST_SECTORS;
+        image = calloc(TEST_SECTORS, SECTOR_SIZE);
+
+        put16(image + 11, SECTOR_SIZE);
+        image[13] = 1;
+        put16(image + 14, TEST_FAT_START);
+        image[16] = 2;
+        put16(image + 17, TEST_ROOT_ENTRIES);
+        put16(image + 19, TEST_SECTORS);
+        image[21] = 0xf0;
+        put16(image + 22, TEST_FAT_SECTORS);
+        image[38] = 0x29;
+        memcpy(image + 43, "TESTVOL    ", FAT_NAME_LEN);
+        memcpy(image + 54, "FAT12   ", 8);
+
+        fat12_set(0, 0xff0);
+        fat12_set(1, 0xfff);
+        fat12_set(HELLO_CLUSTER, 0xfff);
+        fat12_set(DIR_CLUSTER, 0xfff);
+        for (int i = 0; i < DATA_CLUSTERS; i++) {
+                c = DATA_FIRST + 2 * i;
+                fat12_set(c, i == DATA_CLUSTERS - 1 ? 0xfff : c + 2);
+        }
+
+        root = image + TEST_ROOT_START * SECTOR_SIZE;
+        put_dirent(root, "TESTVOL    ", FAT_ATTR_VOLUME, 0, 0);
+        put_dirent(root + 32, "A\0B\0C\0D\0E\0F", FAT_ATTR_LFN, 0, 0);
+        put_dirent(root + 64, "HELLO   TXT", FAT_ATTR_ARCHIVE, HELLO_CLUSTER,
+                   sizeof(hello) - 1);
+        put_dirent(root + 96, "GONE    TXT", FAT_ATTR_ARCHIVE, 5, 10);
+        root[96] = 0xe5;
+        put_dirent(root + 128, "DIR        ", FAT_ATTR_DIR, DIR_CLUSTER, 0);
+        memcpy(cluster_data(HELLO_CLUSTER), hello, sizeof(hello) - 1);
+
+        dir = cluster_data(DIR_CLUSTER);
+        put_dirent(dir, ".          ", FAT_ATTR_DIR, DIR_CLUSTER, 0);
+        put_dirent(dir + 32, "..         ", FAT_ATTR_DIR, 0, 0);
+        put_dirent(dir + 64, "DATA    BIN", FAT_ATTR_ARCHIVE, DATA_FIRST,
+                   DATA_SIZE);
+        for (uint32_t i = 0; i < DATA_SIZE; i++) {
+                data = cluster_data(DATA_FIRST + 2 * (i / SECTOR_SIZE));
+                data[i % SECTOR_SIZE] = data_byte(i);
+        }
+}
+
+/* Checks a directory lists exactly the names given, in order */
+static void check_listing(struct fat_fs *fs, char *path, char **names)
+{
+        struct fat_file dir;
+        struct fat_dirent ent;
+        int i = 0, ret;
+
+        if ((ret = fat_open(fs, path, &dir)))
+                fail("open %s: %d", path, ret);
+        while ((ret = fat_readdir(&dir, &ent)) > 0) {
+                if (!names[i] || strcmp(ent.name, names[i]))
+                        fail("%s: listed %s, expected %s", path, ent.name,
+                             names[i] ? names[i] : "nothing");
+                i++;
+        }
+        if (ret < 0)
+                fail("readdir %s: %d", path, ret);
+        if (names[i])
+                fail("%s: %s not listed", path, names[i]);
+        printf("listing %s ok\n", path);
+}
+
+static void check_data(uint8_t *buf, uint32_t pos, uint32_t len)
+{
+        for (uint32_t i = 0; i < len; i++) {
+                if (buf[i] != data_byte(pos + i))
+                        fail("DATA.BIN wrong at offset %u", pos + i);
+        }
+}
+
+/*
+ * Reads the fragmented file whole, then at random offsets and lengths, which
+ * land in clusters both within and past the extents it keeps.
+ */
+static void check_reads(struct fat_fs *fs)
+{
+        static uint8_t buf[DATA_SIZE + SECTOR_SIZE];
+        struct fat_file f;
+        uint32_t pos, len;
+        int ret;
+
+        if ((ret = fat_open(fs, "/dir/data.bin", &f)))
+                fail("open /dir/data.bin: %d", ret);
+        if (f.size != DATA_SIZE)
+                fail("DATA.BIN size %u, expected %u", f.size, DATA_SIZE);
+        if (f.nextents != FAT_MAX_EXTENTS)
+                fail("DATA.BIN has %d extents", f.nextents);
+
+        ret = fat_read(&f, buf, sizeof(buf));
+        if (ret != DATA_SIZE)
+                fail("read %d bytes of DATA.BIN", ret);
+        check_data(buf, 0, DATA_SIZE);
+        if (fat_read(&f, buf, 1))
+                fail("read past the end of DATA.BIN");
+
+        for (int i = 0; i < 1000; i++) {
+                pos = rand() % (DATA_SIZE + 1);
+                len = rand() % (3 * SECTOR_SIZE);
+                if (fat_seek(&f, pos))
+                        fail("seek to %u", pos);
+                ret = fat_read(&f, buf, len);
+                if (ret < 0 || (uint32_t) ret != (len < DATA_SIZE - pos
+                                                  ? len : DATA_SIZE - pos))
+                        fail("read %u at %u returned %d", len, pos, ret);
+                check_data(buf, pos, ret);
+        }
+        if (fat_seek(&f, DATA_SIZE + 1) != -EINVAL)
+                fail("seek past the end allowed");
+
+        if ((ret = fat_open(fs, "/hello.txt", &f)))
+                fail("open /hello.txt: %d", ret);
+        ret = fat_read(&f, buf, sizeof(buf));
+        if (ret != sizeof(hello) - 1 || memcmp(buf, hello, ret))
+                fail("HELLO.TXT read wrong");
+
+        if ((ret = fat_open(fs, "/dir", &f)) || fat_read(&f, buf, 1) != -EINVAL)
+                fail("read of a directory allowed");
+        printf("reads ok\n");
+}
+
+static void check_missing(struct fat_fs *fs, char *path)
+{
+        struct fat_file f;
+        int ret = fat_open(fs, path, &f);
+
+        if (ret != -ENOENT)
+                fail("open %s: %d, expected -ENOENT", path, ret);
+}
+
+/* Opens each path again, which must be answered by the dentry cache */
+static void check_cached(struct fat_fs *fs, char **paths)
+{
+        struct fat_file f;
+
+        nreads = 0;
+        for (int i = 0; paths[i]; i++)
+                fat_open(fs, paths[i], &f);
+        if (nreads)
+                fail("re-opening looked up paths read %d sectors", nreads);
+        printf("re-open from dentry cache ok\n");
+}
+
+static void test_volume()
+{
+        static char *root[] = { "HELLO.TXT", "DIR", NULL };
+        static char *dir[] = { ".", "..", "DATA.BIN", NULL };
+        static char *paths[] = { "/dir/data.bin", "/HELLO.TXT", "/dir/..",
+                                 "/nope", "/dir/nope.txt", NULL };
+        struct blkdev dev = { .name = "test", .sectors = TEST_SECTORS };
+        struct fat_fs fs;
+        int ret;
+
+        build_image();
+        if ((ret = fat_mount(&fs, &dev)))
+                fail("mount: %d", ret);
+        if (fs.bits != 12 || strcmp(fs.label, "TESTVOL    "))
+                fail("mounted as FAT%d \"%s\"", fs.bits, fs.label);
+
+        check_listing(&fs, "/", root);
+        check_listing(&fs, "/dir", dir);
+        check_listing(&fs, "/dir/..", root);
+        check_reads(&fs);
+
+        check_missing(&fs, "/nope");
+        check_missing(&fs, "/dir/nope.txt");
+        check_missing(&fs, "/hello.txt/x");
+        check_missing(&fs, "/toolongname.txt");
+        check_missing(&fs, "/gone.txt");
+        check_cached(&fs, paths);
+
+        fat_unmount(&fs);
+        if (npages)
+                fail("%d FAT pages left after unmount", npages);
+        free(image);
+}
+
+/* Lists the root directory of an image file */
+static void list_image(char *path)
+{
+        struct blkdev dev = { .name = path };
+        struct fat_dirent ent;
+        struct fat_file dir;
+        struct fat_fs fs;
+        FILE *f = fopen(path, "rb");
+        long size;
+        int ret;
+
+        if (!f)
+                fail("can't open %s", path);
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        image_sectors = dev.sectors = size / SECTOR_SIZE;
+        image = malloc(size);
+        if (fread(image, 1, size, f) != (size_t) size)
+                fail("can't read %s", path);
+        fclose(f);
+
+        if ((ret = fat_mount(&fs, &dev)))
+                fail("mount %s: %d", path, ret);
+        if ((ret = fat_open(&fs, "/", &dir)))
+                fail("open / of %s: %d", path, ret);
+        while ((ret = fat_readdir(&dir, &ent)) > 0)
+                printf("  %-12s %s %u\n", ent.name,
+                       ent.attr & FAT_ATTR_DIR ? "dir " : "file", ent.size);
+        if (ret < 0)
+                fail("readdir / of %s: %d", path, ret);
+        fat_unmount(&fs);
+        free(image);
+}
+
+int main(int argc, char **argv)
+{
+        test_volume();
+        if (argc > 1)
+                list_image(argv[1]);
+        return 0;
+}
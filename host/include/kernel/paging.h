@@ -0,0 +1,21 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+/* Host replacement for the kernel's paging.h. There's no direct map, so the
+   harness's "physical" pages are host addresses below 4 GiB, used as is. */
+
+#include <kernel/types.h>
+
+#define PAGE_SIZE 4096
+
+#define PAGE_PRESENT   (1<<0)
+#define PAGE_WRITABLE  (1<<1)
+
+#define phys_to_virt(paddr) ((void*) (uintptr_t) (paddr))
+#define virt_to_phys(vaddr) ((uint32_t) (uintptr_t) (vaddr))
+
+/* Returns a whole host address, which the kernel's map_phys can't */
+uintptr_t host_map_phys(uint32_t paddr, uint32_t size, uint32_t flags);
+#define map_phys host_map_phys
+
+#endif
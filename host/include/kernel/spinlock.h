@@ -0,0 +1,19 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+/* Host replacement for the kernel's spinlock.h. The test harness is single
+   threaded, so locks do nothing. */
+
+typedef struct {
+        int locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+#define spin_lock_init(lock) ((void) (lock))
+#define spin_lock(lock) ((void) (lock))
+#define spin_unlock(lock) ((void) (lock))
+#define spin_lock_irqsave(lock) ((void) (lock), 0)
+#define spin_unlock_irqrestore(lock, flags) ((void) (lock), (void) (flags))
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef STDARG_H
+#define STDARG_H
+
+/* Host replacement for the kernel's stdarg.h, so the harness and the kernel
+   sources it includes share the C library's va_list */
+
+#include <stdarg.h>
+
+#endif
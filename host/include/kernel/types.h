@@ -0,0 +1,13 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+/*
+ * Stands in for the kernel's own types.h when building kernel sources into the
+ * host test harness, so they agree with the C library on every type.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+/* Host replacement for the kernel's util.h, using the C library instead */
+
+#include <string.h>
+#include <kernel/types.h>
+
+/* Left for each harness to provide, as the C library has no equivalent */
+int str_eq(char *a, char *b);
+
+#endif
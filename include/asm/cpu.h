@@ -0,0 +1,31 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <kernel/types.h>
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPUID_FEAT_MSR  (1<<5)
+#define CPUID_FEAT_APIC (1<<9)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+			 uint32_t *ecx, uint32_t *edx)
+{
+	asm volatile("cpuid"
+		     : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		     : "0" (leaf), "2" (0));
+}
+
+/* Reads a model specific register */
+static inline uint64_t rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+#endif
@@ -42,6 +42,9 @@ enum {
 	INUM_IRQ14,
 	INUM_IRQ15,
 
+	/* Where the local APIC delivers spurious interrupts, which are ignored */
+	INUM_SPURIOUS = 0xef,
+
 	INUM_SYSCALL = 255
 };
 
@@ -87,9 +90,76 @@ struct exception {
         int32_t ss;
 };
 
-#define kernel_exception(e) (e.cs == 0x8)
-#define user_exception(e) (e.cs != 0x8)
+#define kernel_exception(e) ((e).cs == 0x8)
+#define user_exception(e) ((e).cs != 0x8)
 
 extern void setup_idt();
 
+#define EFLAGS_IF (1<<9)
+
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+/* Source location of the current line, identifying where interrupts were
+   disabled in the IRQs-off latency records */
+#define IRQ_SITE __FILE__ ":" __stringify(__LINE__)
+
+/* Records the start and end of a stretch with interrupts disabled */
+void irqsoff_begin(const char *site);
+void irqsoff_end(const char *site);
+
+/* Disables interrupts, returning the previous EFLAGS to pass to irq_restore.
+   Use irq_save/irq_restore rather than these, so the section is tracked. */
+static inline uint32_t raw_irq_save()
+{
+	uint32_t flags;
+	asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+static inline void raw_irq_restore(uint32_t flags)
+{
+	asm volatile("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+static inline bool irqs_disabled()
+{
+	uint32_t flags;
+	asm volatile("pushf; pop %0" : "=r" (flags));
+	return !(flags & EFLAGS_IF);
+}
+
+static inline uint32_t __irq_save(const char *site)
+{
+	uint32_t flags = raw_irq_save();
+
+	if (flags & EFLAGS_IF)
+		irqsoff_begin(site);
+	return flags;
+}
+
+static inline void __irq_restore(uint32_t flags, const char *site)
+{
+	if (flags & EFLAGS_IF)
+		irqsoff_end(site);
+	raw_irq_restore(flags);
+}
+
+static inline void __irq_enable(const char *site)
+{
+	irqsoff_end(site);
+	asm volatile("sti" : : : "memory");
+}
+
+static inline void __irq_disable(const char *site)
+{
+	asm volatile("cli" : : : "memory");
+	irqsoff_begin(site);
+}
+
+#define irq_save() __irq_save(IRQ_SITE)
+#define irq_restore(flags) __irq_restore(flags, IRQ_SITE)
+#define irq_enable() __irq_enable(IRQ_SITE)
+#define irq_disable() __irq_disable(IRQ_SITE)
+
 #endif
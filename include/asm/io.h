@@ -9,5 +9,7 @@ uint16_t inw(uint16_t port, bool wait);
 void outw(uint16_t port, uint16_t data, bool wait);
 uint32_t inl(uint16_t port, bool wait);
 void outl(uint16_t port, uint32_t data, bool wait);
+void insw(uint16_t port, void *buf, uint32_t count);
+void outsw(uint16_t port, const void *buf, uint32_t count);
 
 #endif
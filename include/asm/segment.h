@@ -0,0 +1,12 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+/* Segment selectors of the GDT entries defined in start.s */
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define USER_CS 0x1b
+#define USER_DS 0x23
+#define GDT_TSS 0x28
+#define GDT_PERCPU 0x30
+
+#endif
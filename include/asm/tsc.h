@@ -0,0 +1,14 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <kernel/types.h>
+
+/* Reads the processor's time stamp counter */
+static inline uint64_t rdtsc()
+{
+	uint64_t t;
+	asm volatile("rdtsc" : "=A" (t));
+	return t;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <kernel/types.h>
+
+/* Common header of every ACPI system description table */
+struct acpi_header {
+        char sig[4];
+        uint32_t length;
+        uint8_t revision;
+        uint8_t checksum;
+        char oem_id[6];
+        char oem_table_id[8];
+        uint32_t oem_revision;
+        uint32_t creator_id;
+        uint32_t creator_revision;
+} __attribute__((packed));
+
+void acpi_init();
+struct acpi_header *acpi_find_table(char *sig);
+
+#endif
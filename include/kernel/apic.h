@@ -0,0 +1,16 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <kernel/types.h>
+
+/* Most I/O APICs supported */
+#define MAX_IOAPICS 4
+
+bool apic_init();
+uint32_t lapic_id();
+bool lapic_eoi(int irq);
+int apic_msi_msg(int irq, uint32_t *addr, uint32_t *data);
+int lapic_timer_start(uint32_t hz);
+void lapic_timer_stop();
+
+#endif
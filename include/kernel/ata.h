@@ -0,0 +1,12 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include <kernel/types.h>
+
+/* Largest transfer issued as one command. A full LBA28 sector count, which
+   also bounds the PRD table a DMA transfer needs. */
+#define ATA_MAX_SECTORS 256
+
+int ata_init();
+
+#endif
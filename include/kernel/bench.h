@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* I/O port of QEMU's isa-debug-exit device, used to quit when done */
+#define DEBUG_EXIT_PORT 0xf4
+
+void bench_main();
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <kernel/types.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
+#include <kernel/spinlock.h>
+
+/* Size of the sectors block devices are addressed in */
+#define SECTOR_SIZE 512
+
+#define MAX_BLKDEVS 8
+
+/* Time a queued request may be passed over by the elevator before it's
+   started regardless of the head position */
+#define READ_EXPIRE (HZ / 2)
+#define WRITE_EXPIRE (5 * HZ)
+
+struct blkdev;
+
+/*
+ * A request to read or write a run of sectors. The submitter fills in
+ * everything up to private and keeps the request alive until done is called,
+ * with status 0 or a negated error code, which may happen from any context
+ * including interrupts. The rest belongs to the driver while it has the
+ * request, with progress for drivers that carry it out in several pieces.
+ */
+struct blk_request {
+        struct blkdev *dev;
+        uint32_t lba;
+        uint32_t count;
+        void *buf;
+        bool write;
+        void (*done)(struct blk_request *req);
+        void *private;
+
+        int status;
+        uint32_t progress;
+        struct blk_request *next;
+
+        /* Kept by the request queue for the first request of a run of
+           merged ones: the next run in LBA order, the run's last request and
+           length, and when it should be started by */
+        struct blk_request *queue_next;
+        struct blk_request *run_tail;
+        uint32_t run_sectors;
+        uint32_t deadline;
+};
+
+/*
+ * Request queue of a device whose driver carries out requests synchronously.
+ * Submitted requests are merged with queued ones they directly follow or
+ * precede into runs, linked through next, and a worker thread hands the runs
+ * to the driver's xfer function one at a time. Runs are taken in one-way
+ * elevator order (C-SCAN) from the last position transferred, unless one has
+ * been waiting past its deadline.
+ */
+struct request_queue {
+        /* First, so the worker can find the queue from the work item */
+        struct work work;
+        struct workqueue *wq;
+        struct blkdev *dev;
+
+        /* Carries out a run, returning its status */
+        int (*xfer)(struct blkdev *dev, struct blk_request *run);
+        uint32_t max_sectors;
+
+        spinlock_t lock;
+        struct blk_request *runs;
+        uint32_t head_pos;
+};
+
+/*
+ * A block device. Drivers fill in everything up to private and register it,
+ * or set up a request queue, which provides submit and unplug.
+ * submit starts a request and may complete it before returning; it may sleep,
+ * so requests are only submitted from process context. Drivers that batch
+ * requests also provide unplug, and submit only queues requests until it's
+ * called, so a run of requests costs the device a single notification.
+ */
+struct blkdev {
+        char *name;
+        uint32_t sectors;
+        void (*submit)(struct blkdev *dev, struct blk_request *req);
+        void (*unplug)(struct blkdev *dev);
+        void *private;
+        struct request_queue *queue;
+
+        /* Readahead state of the buffer cache: the block after the last
+           one read, and the end of the last readahead window */
+        uint32_t ra_next;
+        uint32_t ra_end;
+};
+
+int blkdev_register(struct blkdev *dev);
+struct blkdev *blkdev_get(char *name);
+void blk_queue(struct blk_request *req);
+void blk_unplug(struct blkdev *dev);
+void blk_submit(struct blk_request *req);
+void blk_complete(struct blk_request *req, int status);
+int blk_rw(struct blkdev *dev, uint32_t lba, uint32_t count, void *buf,
+           bool write);
+int blk_init_queue(struct blkdev *dev, struct request_queue *q,
+                   int (*xfer)(struct blkdev *dev, struct blk_request *run),
+                   uint32_t max_sectors);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef BOOTMOD_H
+#define BOOTMOD_H
+
+#include <kernel/types.h>
+#include <kernel/blkdev.h>
+#include <kernel/multiboot.h>
+
+#define MAX_BOOTMODS 8
+
+/* Longest module command line kept, the rest is cut off */
+#define BOOTMOD_CMDLINE_SIZE 64
+
+/*
+ * A module the bootloader loaded along with the kernel. It stays where it was
+ * loaded, at physical address paddr, and is mapped at data, so its contents
+ * are used in place. Each is also a RAM disk named ramN.
+ */
+struct bootmod {
+        char name[8];
+        char cmdline[BOOTMOD_CMDLINE_SIZE];
+        uint32_t paddr;
+        uint32_t size;
+        uint8_t *data;
+        struct blkdev blkdev;
+};
+
+void bootmod_init(const struct multiboot_info *mbi);
+bool bootmod_reserved(uint32_t paddr);
+void bootmod_setup();
+struct bootmod *bootmod_get(char *name);
+int bootmod_file(char *path, void **data, uint32_t *size);
+
+#endif
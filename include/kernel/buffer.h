@@ -0,0 +1,52 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <kernel/types.h>
+#include <kernel/blkdev.h>
+#include <kernel/sched.h>
+
+/* Number of cached blocks, each SECTOR_SIZE bytes */
+#define NR_BUFFERS 256
+#define BUFFER_HASH_SIZE 64
+
+/* Most blocks read ahead of a sequential reader */
+#define READAHEAD_MAX 16
+
+/* How often the flusher writes back dirty buffers, and how many may pile up
+   before it's woken early */
+#define FLUSH_INTERVAL (5 * HZ)
+#define DIRTY_THRESHOLD (NR_BUFFERS / 4)
+
+/* Buffer flags */
+#define BUF_VALID 0x1 /* data matches the disk, or is newer if dirty */
+#define BUF_DIRTY 0x2 /* data must be written back */
+#define BUF_BUSY  0x4 /* a transfer to or from the disk is in progress */
+
+/*
+ * A cached disk block. A buffer is held while its refcount is nonzero, and
+ * only unheld clean buffers are reused for other blocks, least recently
+ * released first.
+ */
+struct buffer {
+        struct blkdev *dev;
+        uint32_t block;
+        uint8_t *data;
+        uint32_t flags;
+        uint32_t refcount;
+
+        /* Tasks waiting for the transfer in progress */
+        wait_queue_t wait;
+
+        struct buffer *hash_next;
+        struct buffer *lru_prev;
+        struct buffer *lru_next;
+        struct blk_request req;
+};
+
+void buffer_init();
+struct buffer *bread(struct blkdev *dev, uint32_t block);
+void brelse(struct buffer *b);
+void bdirty(struct buffer *b);
+int bsync(struct blkdev *dev);
+
+#endif
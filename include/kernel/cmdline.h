@@ -0,0 +1,13 @@
+#ifndef CMDLINE_H
+#define CMDLINE_H
+
+#include <kernel/types.h>
+
+/* Longest kernel command line kept, the rest is ignored */
+#define CMDLINE_SIZE 256
+
+void cmdline_init(char *cmdline);
+char *cmdline_get(char *name);
+uint32_t cmdline_uint(char *name, uint32_t def);
+
+#endif
@@ -7,8 +7,13 @@
 #define NUM_SCREENS 4
 #define DEFAULT_COLOR 0x0f
 
+/* Size of the VGA text memory window at 0xb8000 */
+#define VGA_TEXT_SIZE 0x8000
+
 void console_init();
-void console_clear();
+void console_clear(int s);
+void console_flush();
+void console_write(char *buf, int len);
 void putc(char c);
 void put_char(int s, char c);
 void switch_screen(int s);
@@ -0,0 +1,17 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <kernel/types.h>
+
+/* ISA DMA transfer directions, from the device's point of view */
+#define DMA_MODE_READ  0x44 /* single transfer, device to memory */
+#define DMA_MODE_WRITE 0x48 /* single transfer, memory to device */
+
+/* ISA DMA can only reach the first 16 MiB, and a transfer can't cross a
+   64 KiB boundary */
+#define DMA_LIMIT 0x1000000
+#define DMA_BOUNDARY 0x10000
+
+int isa_dma_setup(int chan, uint32_t paddr, uint32_t len, uint8_t mode);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef ERRNO_H
+#define ERRNO_H
+
+/* Error codes, returned negated by system calls and kernel functions */
+enum {
+        SUCCESS,
+        EINVAL,
+        ENOSYS,
+        EPERM,
+        ENOMEM,
+        EAGAIN,
+        EBUSY,
+        ENOENT,
+        ENODEV,
+        ECHILD,
+        EIO,
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <kernel/types.h>
+#include <kernel/blkdev.h>
+#include <kernel/paging.h>
+
+/* Length of a short name, space padded and without the dot */
+#define FAT_NAME_LEN 11
+
+/* Largest FAT16 has 65536 entries, 2048 to a page */
+#define FAT_MAX_PAGES 32
+#define FAT_PAGE_ENTRIES (PAGE_SIZE / 2)
+
+/* Extents of a file's cluster chain kept while it's open */
+#define FAT_MAX_EXTENTS 8
+
+#define DCACHE_SIZE 64
+#define DCACHE_HASH_SIZE 32
+
+/* Directory entry attributes */
+#define FAT_ATTR_RO 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIR 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0f
+
+/*
+ * A mounted FAT12 or FAT16 volume. The whole FAT is decoded into memory at
+ * mount time, one 16-bit entry per cluster whatever the on-disk width, so
+ * following a chain never touches the disk. Sector numbers are the device's.
+ */
+struct fat_fs {
+        struct blkdev *dev;
+        int bits;
+        uint32_t cluster_sectors;
+        uint32_t cluster_size;
+        uint32_t fat_start;
+        uint32_t root_start;
+        uint32_t root_entries;
+        uint32_t data_start;
+        uint32_t nclusters;
+        uint16_t *fat[FAT_MAX_PAGES];
+        char label[FAT_NAME_LEN + 1];
+};
+
+/* A run of count consecutive clusters, the index-th onwards of a file */
+struct fat_extent {
+        uint32_t index;
+        uint32_t cluster;
+        uint32_t count;
+};
+
+/*
+ * An open file or directory. Its cluster chain is cached as extents when it's
+ * opened, so finding the cluster at any offset is a lookup among a few of
+ * them; only a file more fragmented than FAT_MAX_EXTENTS has its tail found by
+ * walking the in-memory FAT. The root directory of FAT12/16 lies outside the
+ * data area and has no chain.
+ */
+struct fat_file {
+        struct fat_fs *fs;
+        uint32_t cluster;
+        uint32_t size;
+        uint8_t attr;
+        bool root;
+        uint32_t pos;
+        int nextents;
+        struct fat_extent extents[FAT_MAX_EXTENTS];
+};
+
+/* What fat_readdir returns, with the name as name.ext */
+struct fat_dirent {
+        char name[FAT_NAME_LEN + 2];
+        uint8_t attr;
+        uint32_t size;
+};
+
+int fat_mount(struct fat_fs *fs, struct blkdev *dev);
+void fat_unmount(struct fat_fs *fs);
+int fat_open(struct fat_fs *fs, char *path, struct fat_file *file);
+int fat_read(struct fat_file *file, void *buf, uint32_t len);
+int fat_seek(struct fat_file *file, uint32_t pos);
+int fat_readdir(struct fat_file *dir, struct fat_dirent *ent);
+
+#endif
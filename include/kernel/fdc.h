@@ -0,0 +1,17 @@
+#ifndef FDC_H
+#define FDC_H
+
+#include <kernel/types.h>
+
+/* Geometry of the 1.44 MB 3.5" floppy disks the driver supports */
+#define FDC_SECTOR_SIZE 512
+#define FDC_SECTORS 18
+#define FDC_HEADS 2
+#define FDC_CYLINDERS 80
+#define FDC_TOTAL_SECTORS (FDC_SECTORS * FDC_HEADS * FDC_CYLINDERS)
+
+int fdc_init();
+int fdc_read(uint32_t lba, uint32_t count, void *buf);
+int fdc_write(uint32_t lba, uint32_t count, const void *buf);
+
+#endif
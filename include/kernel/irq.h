@@ -0,0 +1,50 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <kernel/types.h>
+#include <asm/interrupt.h>
+
+/*
+ * IRQ numbers. 0-15 are the ISA lines and 16-23 the remaining I/O APIC inputs,
+ * followed by interrupts local to the processor, and the rest are handed out by
+ * irq_alloc for message signalled interrupts. IRQ n is always delivered on
+ * vector INUM_IRQ0 + n, whichever controller raises it.
+ */
+#define NR_IRQS 32
+#define NR_ISA_IRQS 16
+#define IRQ_LAPIC_TIMER 24
+#define IRQ_DYNAMIC_BASE 25
+
+/* Return values of IRQ handlers */
+#define IRQ_NONE 0
+#define IRQ_HANDLED 1
+
+/*
+ * An IRQ handler is called with interrupts disabled. Edge triggered lines have
+ * already been acknowledged at the interrupt controller, level triggered ones
+ * are acknowledged after all handlers ran so the line doesn't refire while the
+ * device still asserts it. It gets the device cookie it was registered with,
+ * and returns IRQ_HANDLED if its device raised the interrupt, so shared lines
+ * can tell which handler it was for. Handlers of level triggered lines must not
+ * switch tasks.
+ */
+typedef int (*irq_handler_t)(int irq, void *dev, struct exception *e);
+
+/* Operations of the interrupt controller an IRQ is routed through */
+struct irq_chip {
+        char *name;
+        void (*mask)(int irq);
+        void (*unmask)(int irq);
+
+        /* Acknowledges the interrupt, returning false if it was spurious */
+        bool (*eoi)(int irq);
+};
+
+void irq_set_chip(int irq, struct irq_chip *chip, bool level);
+int irq_alloc(int n, struct irq_chip *chip);
+void irq_free(int irq, int n);
+int irq_register(int irq, irq_handler_t handler, void *dev, char *name);
+void irq_unregister(int irq, void *dev);
+void handle_irq(struct exception *e);
+
+#endif
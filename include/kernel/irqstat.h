@@ -0,0 +1,12 @@
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <kernel/types.h>
+
+/* Number of longest IRQs-off sections remembered */
+#define IRQSOFF_TOP 8
+
+void irqstat_account(int vector, uint64_t cycles, bool switched);
+void irqstat_dump();
+
+#endif
@@ -2,9 +2,20 @@
 #define KERNEL_H
 
 #include <kernel/types.h>
+#include <kernel/stdarg.h>
 #include <kernel/util.h>
 
+/* Stops the compiler from moving memory accesses across this point */
+#define barrier() asm volatile("" : : : "memory")
+
+/* Also stops the processor from moving loads before earlier stores, which it
+   otherwise may. A locked instruction works on every x86, unlike mfence. */
+#define mb() asm volatile("lock; addl $0, (%%esp)" : : : "memory", "cc")
+
 void kprintf(char *fmt, ...);
-void kpanic(char *msg);
+void kpanic(char *msg) __attribute__((noreturn));
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int snprintf(char *buf, size_t size, const char *fmt, ...);
 
 #endif
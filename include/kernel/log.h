@@ -0,0 +1,30 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <kernel/types.h>
+#include <kernel/stdarg.h>
+
+/* Number of messages kept in the kernel log ring */
+#define LOG_ENTRIES 256
+
+/* Longest message stored, including the null, longer ones are truncated */
+#define LOG_MSG_SIZE 120
+
+/* A message in the kernel log ring */
+struct log_entry {
+        /* Sequence number + 1 once the message is complete, 0 while it's
+           still being written */
+        volatile uint32_t seq;
+
+        /* Value of jiffies when the message was logged */
+        uint32_t time;
+
+        char msg[LOG_MSG_SIZE];
+};
+
+void log_init();
+void log_vprintf(char *fmt, va_list ap);
+int log_read(uint32_t *seq, struct log_entry *e);
+void log_flush();
+
+#endif
@@ -6,7 +6,7 @@
 /* Number of pages to allocate for use as kernel heap */
 #define HEAP_PAGES 4
 
-void heap_init();
+void heap_init(void *(*page_source)());
 
 void *kmalloc(size_t size, uint32_t flags);
 
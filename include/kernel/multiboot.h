@@ -0,0 +1,31 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <kernel/types.h>
+
+/* multiboot_info.flags bits, saying which fields are valid */
+#define MULTIBOOT_INFO_MEMORY  (1<<0)
+#define MULTIBOOT_INFO_CMDLINE (1<<2)
+#define MULTIBOOT_INFO_MODS    (1<<3)
+
+/* Information structure passed to the kernel by the bootloader in ebx */
+struct multiboot_info {
+        uint32_t flags;
+        uint32_t mem_lower;
+        uint32_t mem_upper;
+        uint32_t boot_device;
+        uint32_t cmdline;
+        uint32_t mods_count;
+        uint32_t mods_addr;
+};
+
+/* Entry of the module list at mods_addr, with physical addresses. The module
+   occupies mod_start up to but not including mod_end. */
+struct multiboot_module {
+        uint32_t mod_start;
+        uint32_t mod_end;
+        uint32_t cmdline;
+        uint32_t reserved;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef NET_H
+#define NET_H
+
+#include <kernel/types.h>
+#include <kernel/netdev.h>
+
+#define ETH_P_IP 0x0800
+#define ETH_P_ARP 0x0806
+
+#define IP_PROTO_UDP 17
+
+#define UDP_ECHO_PORT 7
+
+#define ARP_CACHE_SIZE 16
+#define MAX_UDP_PORTS 8
+
+/* QEMU's user networking, unless the ip option says otherwise */
+#define NET_DEFAULT_IP 0x0a00020f /* 10.0.2.15 */
+#define NET_DEFAULT_NETMASK 0xffffff00
+#define NET_DEFAULT_GATEWAY 0x0a000202 /* 10.0.2.2 */
+
+struct eth_hdr {
+        uint8_t dst[ETH_ALEN];
+        uint8_t src[ETH_ALEN];
+        uint16_t type;
+} __attribute__((packed));
+
+struct arp_pkt {
+        uint16_t htype;
+        uint16_t ptype;
+        uint8_t hlen;
+        uint8_t plen;
+        uint16_t op;
+        uint8_t sha[ETH_ALEN];
+        uint32_t spa;
+        uint8_t tha[ETH_ALEN];
+        uint32_t tpa;
+} __attribute__((packed));
+
+struct ip_hdr {
+        uint8_t ver_ihl;
+        uint8_t tos;
+        uint16_t len;
+        uint16_t id;
+        uint16_t frag;
+        uint8_t ttl;
+        uint8_t proto;
+        uint16_t csum;
+        uint32_t src;
+        uint32_t dst;
+} __attribute__((packed));
+
+struct udp_hdr {
+        uint16_t sport;
+        uint16_t dport;
+        uint16_t len;
+        uint16_t csum;
+} __attribute__((packed));
+
+/* Where the payload of a UDP datagram sent by this stack starts in its
+   frame, as it never adds IP options */
+#define UDP_PAYLOAD_OFFSET \
+        (sizeof(struct eth_hdr) + sizeof(struct ip_hdr) + sizeof(struct udp_hdr))
+#define UDP_PAYLOAD_MAX (ETH_FRAME_MAX - UDP_PAYLOAD_OFFSET)
+
+/*
+ * Handler of datagrams to a bound UDP port, called from softirq context with
+ * the buffer, which it must free, send or pass to udp_reply, and the payload
+ * and where it came from, in host byte order.
+ */
+typedef void (*udp_handler_t)(struct netbuf *nb, uint8_t *data, uint32_t len,
+                              uint32_t src, uint16_t sport);
+
+static inline uint16_t htons(uint16_t x)
+{
+        return x << 8 | x >> 8;
+}
+
+static inline uint32_t htonl(uint32_t x)
+{
+        return x << 24 | (x & 0xff00) << 8 | (x >> 8 & 0xff00) | x >> 24;
+}
+
+#define ntohs(x) htons(x)
+#define ntohl(x) htonl(x)
+
+/* Start of the payload of a UDP datagram to be sent in a fresh buffer */
+static inline uint8_t *udp_payload(struct netbuf *nb)
+{
+        return nb->data + UDP_PAYLOAD_OFFSET;
+}
+
+void net_config(struct netdev *dev);
+void eth_rx(struct netbuf *nb);
+int udp_bind(uint16_t port, udp_handler_t handler);
+int udp_send(struct netbuf *nb, uint32_t dst, uint16_t sport, uint16_t dport,
+             uint32_t len);
+int udp_reply(struct netbuf *nb, uint8_t *data, uint32_t len);
+void net_init();
+
+#endif
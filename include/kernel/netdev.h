@@ -0,0 +1,69 @@
+#ifndef NETDEV_H
+#define NETDEV_H
+
+#include <kernel/types.h>
+#include <kernel/spinlock.h>
+
+#define MAX_NETDEVS 4
+
+#define ETH_ALEN 6
+#define ETH_FRAME_MAX 1514
+
+/* Packet buffers are half a page, with room in front of the frame for the
+   driver's own header */
+#define NETBUF_SIZE 2048
+#define NETBUF_HEADROOM 16
+
+struct netdev;
+
+/*
+ * A packet buffer, from its device's pool. Received frames are handed up the
+ * stack in the buffer the device wrote them to, and whoever ends up with it
+ * either frees it back to the pool or transmits it, turned around in place,
+ * so a packet is never copied on its way through. head is the start of the
+ * buffer, at physical address paddr, and data the start of the frame, len
+ * bytes long.
+ */
+struct netbuf {
+        struct netdev *dev;
+        uint8_t *head;
+        uint32_t paddr;
+        uint8_t *data;
+        uint32_t len;
+        struct netbuf *next;
+};
+
+/*
+ * A network interface. Drivers fill in everything up to private and register
+ * it, which sets up its buffer pool. xmit takes ownership of the buffer it's
+ * given, freeing it once sent or if it can't be, and may be called from any
+ * context but interrupt handlers. Addresses are in host byte order.
+ */
+struct netdev {
+        char *name;
+        uint8_t mac[ETH_ALEN];
+        int (*xmit)(struct netdev *dev, struct netbuf *nb);
+        void *private;
+
+        uint32_t ip;
+        uint32_t netmask;
+        uint32_t gateway;
+
+        spinlock_t pool_lock;
+        struct netbuf *pool;
+        int pool_free;
+
+        uint32_t rx_packets;
+        uint32_t tx_packets;
+        uint32_t rx_dropped;
+        uint32_t tx_dropped;
+};
+
+int netdev_register(struct netdev *dev, int nbufs);
+struct netdev *netdev_get(char *name);
+struct netbuf *netbuf_alloc(struct netdev *dev);
+void netbuf_free(struct netbuf *nb);
+int netdev_xmit(struct netbuf *nb);
+void netif_rx(struct netbuf *nb);
+
+#endif
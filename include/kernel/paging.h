@@ -2,19 +2,51 @@
 #define PAGING_H
 
 #include <kernel/types.h>
-#include <kernel/sched.h>
+
+struct task;
 
 #define PAGE_SIZE 4096
 
 #define PAGE_PRESENT   (1<<0)
 #define PAGE_WRITABLE  (1<<1)
 #define PAGE_USER      (1<<2)
+#define PAGE_WRITETHROUGH (1<<3)
+#define PAGE_NOCACHE   (1<<4)
+
+/* Set in page directory entries mapping a whole 4 MiB page */
+#define PAGE_LARGE     (1<<7)
+#define LARGE_PAGE_SIZE 0x400000
+
+/*
+ * Virtual memory layout. User processes own everything below KERNEL_BASE. The
+ * kernel is linked at KERNEL_BASE + 1 MiB, inside a direct map of physical
+ * memory starting at KERNEL_BASE, so any frame is reachable at a fixed offset.
+ * Above it, pages mapped one at a time, such as the heap and device registers,
+ * go in the window from VMALLOC_START to VMALLOC_END. Page tables for the whole
+ * kernel range are set up at boot and shared by every page directory.
+ */
+#define KERNEL_BASE 0xc0000000
+#define VMALLOC_START 0xfc000000
+#define VMALLOC_END 0xffc00000
+#define DIRECT_MAP_SIZE (VMALLOC_START - KERNEL_BASE)
+
+#define KERNEL_PDE (KERNEL_BASE >> 22)
+
+/* Conversions for the direct map, which only covers physical memory below
+   DIRECT_MAP_SIZE */
+#define phys_to_virt(paddr) ((void*) ((uint32_t) (paddr) + KERNEL_BASE))
+#define virt_to_phys(vaddr) ((uint32_t) (vaddr) - KERNEL_BASE)
 
 void paging_init();
 uint32_t alloc_page(uint32_t vaddr, uint32_t flags);
 uint32_t alloc_kernel_page(uint32_t flags);
+uint32_t map_phys(uint32_t paddr, uint32_t size, uint32_t flags);
+void *alloc_heap_page();
 void free_page(uint32_t vaddr);
 uint32_t vtophys(uint32_t vaddr);
+uint32_t page_flags(uint32_t vaddr);
+uint32_t *alloc_page_directory(uint32_t *cr3);
 uint32_t alloc_user_page(struct task *t, uint32_t uvaddr);
+void free_address_space(struct task *t);
 
 #endif
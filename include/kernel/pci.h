@@ -3,12 +3,170 @@
 
 #include <kernel/kernel.h>
 
+/* Configuration space registers common to every header type */
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0a
+#define PCI_CLASS 0x0b
+#define PCI_HEADER_TYPE 0x0e
+#define PCI_BAR0 0x10
+#define PCI_CAP_PTR 0x34
+#define PCI_INTERRUPT_LINE 0x3c
+
+/* Bridges' bus numbers */
+#define PCI_SECONDARY_BUS 0x19
+
+/* Header type register fields */
+#define PCI_HEADER_MASK 0x7f
+#define PCI_HEADER_MULTI 0x80
+#define PCI_HEADER_NORMAL 0
+#define PCI_HEADER_BRIDGE 1
+
+/* Command register bits */
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_MASTER 0x4
+#define PCI_COMMAND_INTX_DISABLE 0x400
+
+/* Status register bits */
+#define PCI_STATUS_CAP_LIST 0x10
+
+/* Capability IDs */
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+
+/* MSI capability registers, the data and mask ones following a 32 or 64-bit
+   address */
+#define PCI_MSI_CTRL 2
+#define PCI_MSI_ADDR_LO 4
+#define PCI_MSI_ADDR_HI 8
+#define PCI_MSI_DATA_32 8
+#define PCI_MSI_MASK_32 0xc
+#define PCI_MSI_DATA_64 0xc
+#define PCI_MSI_MASK_64 0x10
+#define PCI_MSI_CTRL_ENABLE 0x1
+#define PCI_MSI_CTRL_MMC(ctrl) (((ctrl) >> 1) & 0x7)
+#define PCI_MSI_CTRL_MME_SHIFT 4
+#define PCI_MSI_CTRL_MME_MASK 0x70
+#define PCI_MSI_CTRL_64BIT 0x80
+#define PCI_MSI_CTRL_MASKABLE 0x100
+
+/* MSI-X capability registers, and the vector table in memory the BAR
+   indicator in the low bits of PCI_MSIX_TABLE points to */
+#define PCI_MSIX_CTRL 2
+#define PCI_MSIX_TABLE 4
+#define PCI_MSIX_CTRL_SIZE(ctrl) (((ctrl) & 0x7ff) + 1)
+#define PCI_MSIX_CTRL_MASKALL 0x4000
+#define PCI_MSIX_CTRL_ENABLE 0x8000
+#define PCI_MSIX_BIR_MASK 0x7
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_ADDR_LO 0
+#define PCI_MSIX_ENTRY_ADDR_HI 4
+#define PCI_MSIX_ENTRY_DATA 8
+#define PCI_MSIX_ENTRY_CTRL 12
+#define PCI_MSIX_ENTRY_MASKED 0x1
+
+/* I/O space BARs have bit 0 set, and the port number in the rest */
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_IO_MASK 0xfffffffc
+#define PCI_BAR_MEM_MASK 0xfffffff0
+#define PCI_BAR_TYPE_MASK 0x6
+#define PCI_BAR_TYPE_64 0x4
+#define PCI_BAR_PREFETCH 0x8
+
+#define PCI_NUM_BARS 6
+#define PCI_MAX_DEVICES 32
+
+/* Most IRQs one device gets from pci_alloc_irqs */
+#define PCI_MAX_IRQS 8
+
+/* Interrupt delivery types of pci_alloc_irqs */
+#define PCI_IRQ_INTX 0x1
+#define PCI_IRQ_MSI 0x2
+#define PCI_IRQ_MSIX 0x4
+
+/* Wildcard of a pci_device_id field */
+#define PCI_ANY_ID 0xffff
+
 struct pci_addr {
         uint8_t bus;
         uint8_t device;
         uint8_t function;
 };
 
+/* A decoded BAR. Unimplemented ones, and memory above 4 GiB, have size 0. */
+struct pci_bar {
+        uint32_t base;
+        uint32_t size;
+        bool io;
+        bool prefetch;
+};
+
+struct pci_driver;
+
+/* A function found at boot, with its configuration as the firmware left it */
+struct pci_device {
+        struct pci_addr addr;
+        uint16_t vendor;
+        uint16_t device;
+        uint8_t class;
+        uint8_t subclass;
+        uint8_t prog_if;
+        uint8_t revision;
+        uint8_t irq;
+        struct pci_bar bars[PCI_NUM_BARS];
+
+        /* Offsets of the MSI and MSI-X capabilities, 0 if absent */
+        uint8_t msi_cap;
+        uint8_t msix_cap;
+
+        /* IRQs handed out by pci_alloc_irqs, and which type they are */
+        int irq_type;
+        int nirqs;
+        int irqs[PCI_MAX_IRQS];
+        volatile uint8_t *msix_table;
+
+        struct pci_driver *driver;
+        void *driver_data;
+};
+
+/* Devices a driver handles. Fields set to PCI_ANY_ID match anything, and a
+   list of them ends with a zero vendor. */
+struct pci_device_id {
+        uint16_t vendor;
+        uint16_t device;
+        uint16_t class;
+        uint16_t subclass;
+};
+
+/*
+ * A PCI driver, bound to each matching device for which probe returns 0. A
+ * device is only ever bound to one driver.
+ */
+struct pci_driver {
+        char *name;
+        const struct pci_device_id *ids;
+        int (*probe)(struct pci_device *dev);
+        struct pci_driver *next;
+};
+
+uint8_t pci_config_read8(struct pci_addr addr, uint8_t offset);
+uint16_t pci_config_read16(struct pci_addr addr, uint8_t offset);
+uint32_t pci_config_read32(struct pci_addr addr, uint8_t offset);
+void pci_config_write16(struct pci_addr addr, uint8_t offset, uint16_t val);
+void pci_config_write32(struct pci_addr addr, uint8_t offset, uint32_t val);
+int pci_register_driver(struct pci_driver *drv);
+struct pci_device *pci_get_device(uint16_t vendor, uint16_t device,
+                                  struct pci_device *from);
+void pci_enable_device(struct pci_device *dev, bool master);
+uint8_t pci_find_capability(struct pci_addr addr, uint8_t id);
+int pci_alloc_irqs(struct pci_device *dev, int min, int max, int types);
+int pci_irq(struct pci_device *dev, int n);
+void pci_free_irqs(struct pci_device *dev);
 void pci_init();
 
 #endif
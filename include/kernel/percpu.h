@@ -0,0 +1,73 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <kernel/types.h>
+
+/* Only the boot processor is brought up so far */
+#define NR_CPUS 1
+
+struct task;
+
+/* 32-bit Task State Segment. Only esp0 and ss0 are used, to switch to the
+   kernel stack when interrupting user mode. */
+struct tss {
+        uint32_t link;
+        uint32_t esp0;
+        uint32_t ss0;
+        uint32_t unused[22];
+        uint16_t trap;
+        uint16_t iomap_base;
+};
+
+/*
+ * State private to one processor. %fs holds a segment based at the running
+ * CPU's block whenever the kernel runs, so a field can be read or written in a
+ * single instruction without knowing which CPU this is. switch_task in start.s
+ * uses the offsets of curr_task, next_task and tss, so keep them in sync.
+ */
+struct percpu {
+        struct percpu *self;
+        struct task *curr_task;
+        struct task *next_task;
+        uint32_t cpu;
+
+        /* Set when the running task should give up the CPU as soon as it's
+           preemptible */
+        uint32_t need_resched;
+
+        /* Counters */
+        uint32_t nr_switches;
+
+        /* Deferred interrupt work, see softirq.c */
+        uint32_t softirq_pending;
+        uint32_t softirq_running;
+
+        struct tss tss;
+
+        /* Page directory loaded in CR3, which kernel threads borrow from the
+           last task that had one */
+        uint32_t *active_pdir;
+} __attribute__((aligned(64)));
+
+#define percpu_offset(field) __builtin_offsetof(struct percpu, field)
+
+/* Accessors for 32-bit fields of the running CPU's block */
+#define percpu_read(field) ({ \
+        typeof(((struct percpu*) 0)->field) __val; \
+        asm volatile("mov %%fs:%c1, %0" \
+                     : "=r" (__val) : "i" (percpu_offset(field))); \
+        __val; })
+
+#define percpu_write(field, val) \
+        asm volatile("mov %0, %%fs:%c1" \
+                     : : "r" (val), "i" (percpu_offset(field)) : "memory")
+
+#define percpu_inc(field) \
+        asm volatile("incl %%fs:%c0" : : "i" (percpu_offset(field)) : "memory")
+
+/* The running CPU's whole block */
+#define this_cpu() percpu_read(self)
+
+void percpu_init();
+
+#endif
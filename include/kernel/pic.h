@@ -0,0 +1,7 @@
+#ifndef PIC_H
+#define PIC_H
+
+void pic_init();
+void pic_disable();
+
+#endif
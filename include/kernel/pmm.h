@@ -0,0 +1,13 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <kernel/types.h>
+
+/* Most physical pages the free page stack can track (16 MiB worth) */
+#define PMM_MAX_PAGES 4096
+
+uint32_t pmm_alloc();
+void pmm_free(uint32_t paddr);
+uint32_t pmm_count();
+
+#endif
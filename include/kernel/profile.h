@@ -0,0 +1,27 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <kernel/types.h>
+
+/* Number of samples the profiler can hold before it stops recording */
+#define PROF_SAMPLES 2048
+
+/* Deepest kernel call stack recorded per sample */
+#define PROF_DEPTH 12
+
+/* Highest sampling rate allowed, in Hz */
+#define PROF_MAX_HZ 10000
+
+/* A single profiler sample: the interrupted task and its call stack,
+   innermost frame first. User mode samples only record the EIP. */
+struct prof_sample {
+        uint16_t pid;
+        uint8_t user;
+        uint8_t depth;
+        uint32_t pc[PROF_DEPTH];
+};
+
+void prof_init();
+void prof_request_dump();
+
+#endif
@@ -1,11 +1,17 @@
 #ifndef SCHED_H
 #define SCHED_H
 
-#include <kernel/types.h>
+#include <kernel/kernel.h>
+#include <asm/interrupt.h>
+#include <kernel/percpu.h>
 
-/* Divider frequency for the PIT chip, which should cause an IRQ 0 interrupt
-   approximately 99.998 times per second, the closest we can get to 100 Hz */
-#define TIMER_DIVIDER 11932
+/* Input clock frequency of the PIT chip. Divided by 11932 it causes an IRQ 0
+   interrupt approximately 99.998 times per second, the closest we can get to
+   100 Hz. */
+#define PIT_FREQ 1193182
+
+/* Jiffies per second */
+#define HZ 100
 
 /* Programmable Interrupt Timer (PIT) I/O ports */
 #define PIT_DATA 0x40
@@ -19,15 +25,24 @@ enum {
         TASK_RUN,
         TASK_SLEEP,
         TASK_WAIT,
+        TASK_ZOMBIE, /* Exited, holding its status until its parent waits */
+        TASK_DEAD,   /* Exited with no parent, freed by the next schedule() */
 };
 
-/* List entry defining a page mapped into a user process's address space */
+/* Exit status of a task killed by an exception */
+#define EXIT_FAULT(eno) (128 + (eno))
+
+/* List entry defining a page mapped into a user process's address space, and
+   its address in the kernel's direct map */
 struct user_page {
         uint32_t kvaddr;
         uint32_t uvaddr;
         struct user_page *next;
 };
 
+/* A wait queue is just the head of a list of sleeping tasks */
+typedef struct task *wait_queue_t;
+
 /* Process table entry, containing a task's state */
 struct task {
         /* Used for task switching */
@@ -37,6 +52,11 @@ struct task {
 
         uint32_t state;
         uint32_t pid;
+        uint32_t ppid;
+        int exit_status;
+
+        /* Bottom of the kernel stack, from the direct map */
+        uint32_t kstack;
 
         /* Scheduling and timekeeping */
         uint32_t counter;
@@ -45,26 +65,77 @@ struct task {
         uint32_t utime;
         uint32_t ktime;
 
-        /* Virtual memory management */
+        /* Virtual memory management. Kernel threads have no address space
+           of their own, and leave cr3 and pdir zero. */
         uint32_t *pdir;
         struct user_page *pages;
-        struct user_page *ptabs;
+
+        /* Next task sleeping on the same wait queue */
+        struct task *wait_next;
+
+        /* Where the task sleeps in do_wait() until a child exits */
+        wait_queue_t child_exit;
+
+        /* Preemption is disabled while this is nonzero */
+        uint32_t preempt_count;
 };
 
+
 #define in_user(t) (t->regs.cs == 0x1b)
 #define in_kernel(t) (t->regs.cs == 0x8)
 
-/* The currently executing task */
-extern struct task *current;
+/* The task executing on this CPU */
+#define current percpu_read(curr_task)
 
-/* System uptime in jiffies */
+/* System uptime in jiffies. There is one system clock, ticked by a single
+   timer interrupt, so this stays global rather than per-CPU. */
 extern uint32_t jiffies;
 
 void sched_init();
+void timer_init();
 void schedule();
+void preempt_schedule();
+void preempt_schedule_irq();
+void cond_resched();
+void yield();
 struct task *spawn_task();
 struct task *spawn_kthread(void (*code)());
 struct task *get_process(int pid);
+void do_exit(int status) __attribute__((noreturn));
+int do_wait(int *status);
 void idle_task();
+void timer_set_rate(uint32_t hz);
+void sleep_on(wait_queue_t *wq);
+void wake_up(wait_queue_t *wq);
+
+/*
+ * Preemption control. While a task has preemption disabled it keeps the CPU
+ * when an interrupt asks for a reschedule, until it enables it again. Calls
+ * nest.
+ */
+static inline void preempt_disable()
+{
+        current->preempt_count++;
+        barrier();
+}
+
+/* Re-enables preemption without acting on a pending reschedule */
+static inline void preempt_enable_no_resched()
+{
+        barrier();
+        current->preempt_count--;
+}
+
+static inline void preempt_enable()
+{
+        preempt_enable_no_resched();
+        if (!current->preempt_count && percpu_read(need_resched))
+                preempt_schedule();
+}
+
+static inline bool preemptible()
+{
+        return !current->preempt_count;
+}
 
 #endif
@@ -0,0 +1,13 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+/* I/O base of the first serial port */
+#define COM1 0x3f8
+
+#define SERIAL_BAUD 115200
+
+void serial_init();
+void serial_putc(char c);
+void serial_write(char *buf, int len);
+
+#endif
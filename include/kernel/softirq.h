@@ -0,0 +1,67 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <kernel/types.h>
+#include <kernel/sched.h>
+
+/* Softirq slots, run in this order */
+enum {
+        SOFTIRQ_TIMER,
+        SOFTIRQ_TASKLET,
+        NR_SOFTIRQS
+};
+
+/* Times pending softirqs are rerun on one IRQ exit before leaving the rest
+   for the next one */
+#define SOFTIRQ_RESTARTS 4
+
+#define MAX_WORKQUEUES 8
+
+/*
+ * A tasklet is a function run once from softirq context, with interrupts
+ * enabled, after being scheduled from an interrupt handler. Scheduling it again
+ * before it ran has no effect. Tasklets must not sleep.
+ */
+struct tasklet {
+        void (*func)(void *data);
+        void *data;
+        bool scheduled;
+        struct tasklet *next;
+};
+
+/*
+ * A work item is a function run by a workqueue's worker thread, in process
+ * context, so it may sleep. Queueing it again before it ran has no effect.
+ */
+struct work {
+        void (*func)(struct work *work);
+        bool pending;
+        struct work *next;
+};
+
+struct workqueue {
+        char *name;
+        struct task *worker;
+        wait_queue_t wait;
+        struct work *head;
+        struct work **tail;
+};
+
+/* Shared workqueue for work items without a queue of their own */
+extern struct workqueue *system_wq;
+
+void softirq_init();
+void open_softirq(int nr, void (*handler)());
+void raise_softirq(int nr);
+void do_softirq();
+bool in_softirq();
+
+void tasklet_init(struct tasklet *t, void (*func)(void *data), void *data);
+void tasklet_schedule(struct tasklet *t);
+
+struct workqueue *workqueue_create(char *name);
+void work_init(struct work *work, void (*func)(struct work *work));
+void queue_work(struct workqueue *wq, struct work *work);
+void schedule_work(struct work *work);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <kernel/types.h>
+#include <kernel/sched.h>
+#include <asm/interrupt.h>
+
+/*
+ * Spinlocks. Holding one disables preemption, so the holder can't be switched
+ * away from while another task spins on it. Data also touched by interrupt
+ * handlers must be locked with the irqsave variants, or the handler could spin
+ * forever on a lock held by the code it interrupted.
+ */
+typedef struct {
+        volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+        lock->locked = 0;
+}
+
+static inline bool spin_trylock(spinlock_t *lock)
+{
+        preempt_disable();
+        if (__sync_lock_test_and_set(&lock->locked, 1)) {
+                preempt_enable();
+                return false;
+        }
+        return true;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+        preempt_disable();
+        while (__sync_lock_test_and_set(&lock->locked, 1)) {
+                while (lock->locked)
+                        asm volatile("pause" : : : "memory");
+        }
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+        __sync_lock_release(&lock->locked);
+        preempt_enable();
+}
+
+/* Disables interrupts and takes the lock, returning the flags to restore */
+#define spin_lock_irqsave(lock) ({ \
+        uint32_t __flags = irq_save(); \
+        spin_lock(lock); \
+        __flags; })
+
+#define spin_unlock_irqrestore(lock, flags) do { \
+        spin_unlock(lock); \
+        irq_restore(flags); \
+} while (0)
+
+#endif
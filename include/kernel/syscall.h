@@ -2,7 +2,16 @@
 #define SYSCALL_H
 
 #include <kernel/types.h>
+#include <kernel/errno.h>
 
+/* System call numbers, passed in eax */
+enum {
+        SYS_NONE,
+        SYS_EXIT,
+        SYS_WAIT,
+};
+
+/* Arguments of a system call, passed in ebx, ecx, edx, esi and edi */
 struct syscall_args {
         int32_t _1;
         int32_t _2;
@@ -11,13 +20,4 @@ struct syscall_args {
         int32_t _5;
 };
 
-enum {
-        SUCCESS,
-        EINVAL,
-        ENOSYS,
-        EPERM,
-        ENOMEM,
-        EAGAIN,
-};
-
 #endif
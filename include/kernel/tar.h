@@ -0,0 +1,13 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <kernel/types.h>
+
+/* Archives are a sequence of 512-byte blocks, each file a header block
+   followed by its data */
+#define TAR_BLOCK_SIZE 512
+
+int tar_find(void *archive, uint32_t size, char *path, void **data,
+             uint32_t *len);
+
+#endif
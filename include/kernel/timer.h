@@ -0,0 +1,29 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <kernel/types.h>
+
+/*
+ * A kernel timer calls a function once, from the timer softirq, when jiffies
+ * reaches its expiry time. Like tasklets, timer functions run with interrupts
+ * enabled and must not sleep.
+ */
+struct timer {
+        uint32_t expires;
+        void (*func)(void *data);
+        void *data;
+        bool pending;
+        struct timer *next;
+};
+
+/* True if jiffies value a is later than b, allowing for wraparound */
+#define time_after(a, b) ((int32_t) ((b) - (a)) < 0)
+
+void timer_setup(struct timer *t, void (*func)(void *data), void *data);
+void mod_timer(struct timer *t, uint32_t expires);
+bool del_timer(struct timer *t);
+void timer_tick();
+void run_timers();
+void msleep(uint32_t ms);
+
+#endif
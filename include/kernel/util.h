@@ -5,6 +5,8 @@
 
 void memset(void *s, uint8_t c, uint32_t n);
 void memcpy(void *dst, void *src, uint32_t n);
+int memcmp(void *a, void *b, uint32_t n);
 int str_eq(char *a, char *b);
+uint32_t div64(uint64_t *n, uint32_t base);
 
 #endif
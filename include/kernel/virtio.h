@@ -0,0 +1,131 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <kernel/types.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+
+#define VIRTIO_VENDOR 0x1af4
+
+/* Transitional device IDs, which keep the legacy interface */
+#define VIRTIO_DEV_NET 0x1000
+#define VIRTIO_DEV_BLK 0x1001
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACK 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+/* ISR status bits, cleared by reading it */
+#define VIRTIO_ISR_QUEUE 0x1
+#define VIRTIO_ISR_CONFIG 0x2
+
+/* Device-independent feature bits */
+#define VIRTIO_F_EVENT_IDX (1 << 29)
+
+/* Largest queue the drivers allocate memory for */
+#define VIRTQ_MAX_SIZE 256
+
+/* Descriptor flags */
+#define VIRTQ_DESC_NEXT 0x1
+#define VIRTQ_DESC_WRITE 0x2 /* device writes the buffer */
+
+#define VIRTQ_AVAIL_NO_INTERRUPT 0x1
+#define VIRTQ_USED_NO_NOTIFY 0x1
+
+struct virtq_desc {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+        uint16_t next;
+} __attribute__((packed));
+
+/* With VIRTIO_F_EVENT_IDX, the entry after the last of each ring holds the
+   other side's event index: avail's is used_event, and used's avail_event */
+struct virtq_avail {
+        uint16_t flags;
+        uint16_t idx;
+        uint16_t ring[];
+} __attribute__((packed));
+
+struct virtq_used_elem {
+        uint32_t id;
+        uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+        uint16_t flags;
+        uint16_t idx;
+        struct virtq_used_elem ring[];
+} __attribute__((packed));
+
+/* Memory of a legacy queue, which puts the used ring on a page boundary */
+#define VIRTQ_ALIGN(n) (((n) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define VIRTQ_MEM_SIZE(size) \
+        (VIRTQ_ALIGN(16 * (size) + 2 * (3 + (size))) \
+         + VIRTQ_ALIGN(2 * 3 + 8 * (size)))
+
+/* A legacy virtio device, driven through the I/O ports of its BAR 0 */
+struct virtio_dev {
+        struct pci_device *pdev;
+        uint16_t io;
+        uint32_t features;
+
+        /* Queues interrupt on MSI-X vectors of their own, without the ISR */
+        bool msix;
+};
+
+/* One buffer of a chain added to a queue */
+struct virtq_buf {
+        uint32_t paddr;
+        uint32_t len;
+        bool write;
+};
+
+struct virtq {
+        struct virtio_dev *dev;
+        uint16_t index;
+        uint16_t size;
+        bool event_idx;
+
+        struct virtq_desc *desc;
+        struct virtq_avail *avail;
+        struct virtq_used *used;
+
+        /* Head of the free descriptor list, linked through next */
+        uint16_t free_head;
+        uint16_t num_free;
+
+        /* Avail index as far as buffers have been added, and as of the last
+           notification */
+        uint16_t avail_idx;
+        uint16_t kicked_idx;
+
+        /* Next used entry to consume */
+        uint16_t last_used;
+
+        /* Caller's cookie of each chain, by head descriptor */
+        void *cookies[VIRTQ_MAX_SIZE];
+};
+
+int virtio_pci_init(struct virtio_dev *dev, struct pci_device *pdev);
+int virtio_setup_irqs(struct virtio_dev *dev, int n);
+int virtio_irq(struct virtio_dev *dev, int n);
+uint32_t virtio_negotiate(struct virtio_dev *dev, uint32_t wanted);
+void virtio_driver_ok(struct virtio_dev *dev);
+void virtio_fail(struct virtio_dev *dev);
+uint8_t virtio_isr(struct virtio_dev *dev);
+uint8_t virtio_config_read8(struct virtio_dev *dev, int offset);
+uint32_t virtio_config_read32(struct virtio_dev *dev, int offset);
+
+int virtq_init(struct virtq *vq, struct virtio_dev *dev, uint16_t index,
+               void *mem);
+int virtq_set_vector(struct virtq *vq, int n);
+int virtq_add(struct virtq *vq, struct virtq_buf *bufs, int n, void *cookie);
+void virtq_kick(struct virtq *vq);
+void *virtq_get(struct virtq *vq, uint32_t *len);
+bool virtq_enable_cb(struct virtq *vq);
+void virtq_disable_cb(struct virtq *vq);
+
+#endif
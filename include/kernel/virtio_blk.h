@@ -0,0 +1,6 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+int virtio_blk_init();
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+int virtio_net_init();
+
+#endif
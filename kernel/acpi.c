@@ -0,0 +1,122 @@
+#include <kernel/kernel.h>
+#include <kernel/paging.h>
+#include <kernel/acpi.h>
+
+/*
+ * Just enough ACPI to find the static tables the firmware leaves in memory,
+ * such as the MADT describing the interrupt controllers. Tables are mapped
+ * into kernel space as they're found and never unmapped.
+ */
+
+/* Where the real mode segment of the Extended BIOS Data Area is stored */
+#define EBDA_SEG_PTR 0x40e
+
+#define BIOS_ROM_START 0xe0000
+#define BIOS_ROM_SIZE 0x20000
+
+/* Root System Description Pointer, the firmware's entry into the tables */
+struct acpi_rsdp {
+        char sig[8];
+        uint8_t checksum;
+        char oem_id[6];
+        uint8_t revision;
+        uint32_t rsdt;
+} __attribute__((packed));
+
+/* Root System Description Table, listing the physical addresses of the rest */
+struct acpi_rsdt {
+        struct acpi_header header;
+        uint32_t tables[];
+} __attribute__((packed));
+
+static struct acpi_rsdt *rsdt;
+
+static bool checksum_ok(void *p, uint32_t len)
+{
+        uint8_t sum = 0, *b = p;
+
+        while (len--)
+                sum += *(b++);
+        return sum == 0;
+}
+
+/* Searches a physical memory range for the RSDP, on 16 byte boundaries */
+static struct acpi_rsdp *scan_rsdp(uint32_t paddr, uint32_t len)
+{
+        uint8_t *p = (uint8_t*) map_phys(paddr, len, 0);
+        uint32_t i;
+
+        if (!p)
+                return NULL;
+        for (i = 0; i + sizeof(struct acpi_rsdp) <= len; i += 16) {
+                if (!memcmp(p + i, "RSD PTR ", 8)
+                    && checksum_ok(p + i, sizeof(struct acpi_rsdp)))
+                        return (struct acpi_rsdp*) (p + i);
+        }
+        return NULL;
+}
+
+/*
+ * Maps a whole table given its physical address, checking it's intact.
+ */
+static struct acpi_header *map_table(uint32_t paddr)
+{
+        struct acpi_header *h;
+
+        h = (struct acpi_header*) map_phys(paddr, sizeof(*h), 0);
+        if (!h || h->length < sizeof(*h))
+                return NULL;
+        h = (struct acpi_header*) map_phys(paddr, h->length, 0);
+        if (!h || !checksum_ok(h, h->length))
+                return NULL;
+        return h;
+}
+
+/*
+ * Locates the ACPI root table. The RSDP lives either in the first KiB of the
+ * EBDA or somewhere in the BIOS ROM area below 1M. Without it, acpi_find_table
+ * finds nothing.
+ */
+void acpi_init()
+{
+        struct acpi_rsdp *rsdp = NULL;
+        uint16_t *ebda_seg;
+
+        ebda_seg = (uint16_t*) map_phys(EBDA_SEG_PTR, 2, 0);
+        if (ebda_seg && *ebda_seg)
+                rsdp = scan_rsdp(*ebda_seg << 4, 1024);
+        if (!rsdp)
+                rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_SIZE);
+        if (!rsdp) {
+                kprintf("acpi: no RSDP found\n");
+                return;
+        }
+
+        rsdt = (struct acpi_rsdt*) map_table(rsdp->rsdt);
+        if (!rsdt || memcmp(rsdt->header.sig, "RSDT", 4)) {
+                kprintf("acpi: bad RSDT at %p\n", rsdp->rsdt);
+                rsdt = NULL;
+        }
+}
+
+/*
+ * Returns the first table with the given four character signature, mapped
+ * into kernel space, or NULL if there's no such table.
+ */
+struct acpi_header *acpi_find_table(char *sig)
+{
+        struct acpi_header *h;
+        uint32_t i, n;
+
+        if (!rsdt)
+                return NULL;
+
+        n = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(uint32_t);
+        for (i = 0; i < n; i++) {
+                h = (struct acpi_header*) map_phys(rsdt->tables[i],
+                                                   sizeof(*h), 0);
+                if (h && !memcmp(h->sig, sig, 4))
+                        return map_table(rsdt->tables[i]);
+        }
+        return NULL;
+}
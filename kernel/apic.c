@@ -0,0 +1,460 @@
+#include <asm/cpu.h>
+#include <asm/io.h>
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/acpi.h>
+#include <kernel/cmdline.h>
+#include <kernel/errno.h>
+#include <kernel/irq.h>
+#include <kernel/paging.h>
+#include <kernel/pic.h>
+#include <kernel/sched.h>
+#include <kernel/apic.h>
+
+/*
+ * Drivers for the processor's local APIC and the I/O APICs, found through the
+ * ACPI MADT. When present they replace the 8259s: every IRQ gets a redirection
+ * entry in an I/O APIC pointing at its own vector, and all interrupts are
+ * acknowledged at the local APIC. Booting with noapic keeps the 8259s.
+ */
+
+#define MSR_APIC_BASE 0x1b
+#define APIC_BASE_ENABLE (1<<11)
+
+/* Local APIC registers, as byte offsets into its MMIO page */
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3e0
+
+#define LAPIC_SVR_ENABLE (1<<8)
+#define LVT_MASKED (1<<16)
+#define LVT_TIMER_PERIODIC (1<<17)
+#define LAPIC_DIV_16 0x3
+
+/* I/O APIC registers, accessed indirectly through IOREGSEL and IOWIN */
+#define IOAPIC_IOREGSEL 0
+#define IOAPIC_IOWIN 4 /* dword index */
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL(pin) (0x10 + 2 * (pin))
+
+/* Redirection entry bits, besides the vector in the low byte */
+#define REDIR_ACTIVE_LOW (1<<13)
+#define REDIR_LEVEL (1<<15)
+#define REDIR_MASKED (1<<16)
+
+/* MSI address, targeting a local APIC by ID, and data, which is the vector
+   with fixed delivery and edge triggering */
+#define MSI_ADDR_BASE 0xfee00000
+#define MSI_ADDR_DEST(id) ((id) << 12)
+
+/* MADT entry types */
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_OVERRIDE 2
+
+/* Polarity and trigger mode fields of an interrupt source override, where 0
+   means whatever is standard for the bus */
+#define INTI_POLARITY_MASK 0x3
+#define INTI_ACTIVE_LOW 0x3
+#define INTI_TRIGGER_MASK 0xc
+#define INTI_LEVEL 0xc
+
+/* PIT channel 2, which can be polled for calibrating the LAPIC timer */
+#define PIT_CH2_DATA 0x42
+#define PIT_CH2_GATE 0x61
+#define PIT_CH2_OUT 0x20
+#define CALIBRATE_HZ 100
+
+struct madt {
+        struct acpi_header header;
+        uint32_t lapic_addr;
+        uint32_t flags;
+        uint8_t entries[];
+} __attribute__((packed));
+
+struct madt_ioapic {
+        uint8_t type;
+        uint8_t length;
+        uint8_t id;
+        uint8_t reserved;
+        uint32_t addr;
+        uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_override {
+        uint8_t type;
+        uint8_t length;
+        uint8_t bus;
+        uint8_t source;
+        uint32_t gsi;
+        uint16_t flags;
+} __attribute__((packed));
+
+struct ioapic {
+        volatile uint32_t *regs;
+        uint8_t id;
+        uint32_t gsi_base;
+        uint32_t npins;
+};
+
+/* Where an IRQ is wired to, and how the line is driven */
+struct irq_route {
+        struct ioapic *ioapic;
+        uint8_t pin;
+        uint32_t gsi;
+        uint16_t flags;
+        bool routed;
+};
+
+static volatile uint32_t *lapic;
+static struct ioapic ioapics[MAX_IOAPICS];
+static int nioapics;
+static struct irq_route routes[NR_IRQS];
+
+/* LAPIC timer ticks per second, measured the first time it's started */
+static uint32_t lapic_timer_freq;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+        return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val)
+{
+        lapic[reg / 4] = val;
+}
+
+static uint32_t ioapic_read(struct ioapic *io, uint8_t reg)
+{
+        io->regs[IOAPIC_IOREGSEL] = reg;
+        return io->regs[IOAPIC_IOWIN];
+}
+
+static void ioapic_write(struct ioapic *io, uint8_t reg, uint32_t val)
+{
+        io->regs[IOAPIC_IOREGSEL] = reg;
+        io->regs[IOAPIC_IOWIN] = val;
+}
+
+uint32_t lapic_id()
+{
+        return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+bool lapic_eoi(int irq)
+{
+        lapic_write(LAPIC_EOI, 0);
+        return true;
+}
+
+/*
+ * Composes the message a PCI device writes to raise irq, which goes straight to
+ * this processor's local APIC. Returns -ENODEV while the 8259s are in use, as
+ * messages would bypass them.
+ */
+int apic_msi_msg(int irq, uint32_t *addr, uint32_t *data)
+{
+        if (!lapic)
+                return -ENODEV;
+        *addr = MSI_ADDR_BASE | MSI_ADDR_DEST(lapic_id());
+        *data = INUM_IRQ0 + irq;
+        return 0;
+}
+
+static void ioapic_mask(int irq)
+{
+        struct irq_route *r = &routes[irq];
+        uint8_t reg = IOAPIC_REDTBL(r->pin);
+
+        ioapic_write(r->ioapic, reg, ioapic_read(r->ioapic, reg) | REDIR_MASKED);
+}
+
+static void ioapic_unmask(int irq)
+{
+        struct irq_route *r = &routes[irq];
+        uint8_t reg = IOAPIC_REDTBL(r->pin);
+
+        ioapic_write(r->ioapic, reg,
+                     ioapic_read(r->ioapic, reg) & ~REDIR_MASKED);
+}
+
+static struct irq_chip ioapic_chip = {
+        .name = "IO-APIC",
+        .mask = ioapic_mask,
+        .unmask = ioapic_unmask,
+        .eoi = lapic_eoi,
+};
+
+static void lapic_timer_mask(int irq)
+{
+        lapic_write(LAPIC_LVT_TIMER, lapic_read(LAPIC_LVT_TIMER) | LVT_MASKED);
+}
+
+static void lapic_timer_unmask(int irq)
+{
+        lapic_write(LAPIC_LVT_TIMER,
+                    lapic_read(LAPIC_LVT_TIMER) & ~LVT_MASKED);
+}
+
+static struct irq_chip lapic_chip = {
+        .name = "LAPIC",
+        .mask = lapic_timer_mask,
+        .unmask = lapic_timer_unmask,
+        .eoi = lapic_eoi,
+};
+
+/*
+ * Collects the I/O APICs and ISA interrupt source overrides from the MADT.
+ * ISA IRQs are identity mapped to global system interrupts unless overridden.
+ */
+static void parse_madt(struct madt *madt)
+{
+        struct madt_ioapic *mi;
+        struct madt_override *mo;
+        struct ioapic *io;
+        uint8_t *p = madt->entries;
+        uint8_t *end = (uint8_t*) madt + madt->header.length;
+        int irq;
+
+        for (irq = 0; irq < NR_ISA_IRQS + 8; irq++)
+                routes[irq].gsi = irq;
+
+        for (; p + 2 <= end && p[1] >= 2; p += p[1]) {
+                switch (p[0]) {
+                case MADT_IOAPIC:
+                        mi = (struct madt_ioapic*) p;
+                        if (nioapics == MAX_IOAPICS)
+                                break;
+                        io = &ioapics[nioapics];
+                        io->regs = (uint32_t*) map_phys(mi->addr, PAGE_SIZE,
+                                        PAGE_WRITABLE | PAGE_NOCACHE);
+                        if (!io->regs)
+                                break;
+                        io->id = mi->id;
+                        io->gsi_base = mi->gsi_base;
+                        io->npins = ((ioapic_read(io, IOAPIC_VER) >> 16)
+                                     & 0xff) + 1;
+                        nioapics++;
+                        break;
+                case MADT_OVERRIDE:
+                        mo = (struct madt_override*) p;
+                        if (mo->bus != 0 || mo->source >= NR_ISA_IRQS)
+                                break;
+                        routes[mo->source].gsi = mo->gsi;
+                        routes[mo->source].flags = mo->flags;
+                        break;
+                }
+        }
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi)
+{
+        for (int i = 0; i < nioapics; i++) {
+                if (gsi >= ioapics[i].gsi_base
+                    && gsi < ioapics[i].gsi_base + ioapics[i].npins)
+                        return &ioapics[i];
+        }
+        return NULL;
+}
+
+/*
+ * Points the redirection entry of an IRQ's pin at the IRQ's vector on this
+ * processor, masked until a handler is registered. ISA lines default to active
+ * high edge triggered, PCI lines to active low level triggered.
+ */
+static void route_irq(int irq)
+{
+        struct irq_route *r = &routes[irq];
+        uint32_t redir = INUM_IRQ0 + irq;
+        bool level, low;
+
+        r->ioapic = ioapic_for_gsi(r->gsi);
+        if (!r->ioapic) {
+                irq_set_chip(irq, NULL, false);
+                return;
+        }
+        r->pin = r->gsi - r->ioapic->gsi_base;
+
+        level = irq >= NR_ISA_IRQS;
+        if (r->flags & INTI_TRIGGER_MASK)
+                level = (r->flags & INTI_TRIGGER_MASK) == INTI_LEVEL;
+        low = irq >= NR_ISA_IRQS;
+        if (r->flags & INTI_POLARITY_MASK)
+                low = (r->flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW;
+
+        if (level)
+                redir |= REDIR_LEVEL;
+        if (low)
+                redir |= REDIR_ACTIVE_LOW;
+        ioapic_write(r->ioapic, IOAPIC_REDTBL(r->pin) + 1, lapic_id() << 24);
+        ioapic_write(r->ioapic, IOAPIC_REDTBL(r->pin), redir | REDIR_MASKED);
+
+        r->routed = true;
+        irq_set_chip(irq, &ioapic_chip, level);
+}
+
+/*
+ * Routes every IRQ which has an I/O APIC input of its own. An input taken by an
+ * overridden ISA IRQ, like the PIT moving to input 2, is lost to the IRQ whose
+ * number matches it.
+ */
+static void route_irqs()
+{
+        int irq, other;
+
+        for (irq = 0; irq < NR_ISA_IRQS + 8; irq++) {
+                for (other = 0; other < NR_ISA_IRQS; other++) {
+                        if (other != irq && routes[other].gsi == routes[irq].gsi)
+                                break;
+                }
+                if (other < NR_ISA_IRQS && routes[irq].gsi == irq)
+                        irq_set_chip(irq, NULL, false);
+                else
+                        route_irq(irq);
+        }
+}
+
+static void ioapic_mask_all(struct ioapic *io)
+{
+        for (uint32_t pin = 0; pin < io->npins; pin++)
+                ioapic_write(io, IOAPIC_REDTBL(pin), REDIR_MASKED);
+}
+
+static bool lapic_init(uint32_t paddr)
+{
+        uint64_t base = rdmsr(MSR_APIC_BASE);
+
+        if (!(base & APIC_BASE_ENABLE))
+                wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+        lapic = (uint32_t*) map_phys(paddr, PAGE_SIZE,
+                                     PAGE_WRITABLE | PAGE_NOCACHE);
+        if (!lapic)
+                return false;
+
+        /* Accept all priorities, mask what the BIOS may have left pointing at
+           the 8259s, and deliver spurious interrupts to a vector that ignores
+           them */
+        lapic_write(LAPIC_TPR, 0);
+        lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+        lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+        lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | (INUM_IRQ0 + IRQ_LAPIC_TIMER));
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INUM_SPURIOUS);
+        lapic_write(LAPIC_EOI, 0);
+
+        irq_set_chip(IRQ_LAPIC_TIMER, &lapic_chip, false);
+        return true;
+}
+
+/*
+ * Switches interrupt delivery from the 8259s to the APICs, if the processor
+ * has a local APIC and the firmware describes at least one I/O APIC. Returns
+ * false, leaving the 8259s in charge, otherwise. Must be called before any
+ * IRQ handler is registered.
+ */
+bool apic_init()
+{
+        uint32_t eax, ebx, ecx, edx;
+        struct madt *madt;
+        int i;
+
+        if (cmdline_get("noapic"))
+                return false;
+
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        if (!(edx & CPUID_FEAT_APIC) || !(edx & CPUID_FEAT_MSR))
+                return false;
+
+        madt = (struct madt*) acpi_find_table("APIC");
+        if (!madt) {
+                kprintf("apic: no MADT, using the 8259s\n");
+                return false;
+        }
+
+        parse_madt(madt);
+        if (!nioapics) {
+                kprintf("apic: no I/O APIC, using the 8259s\n");
+                return false;
+        }
+        if (!lapic_init(madt->lapic_addr)) {
+                kprintf("apic: failed to map the local APIC\n");
+                return false;
+        }
+
+        pic_disable();
+        for (i = 0; i < nioapics; i++)
+                ioapic_mask_all(&ioapics[i]);
+        route_irqs();
+
+        kprintf("apic: local APIC %u at %p\n", lapic_id(), madt->lapic_addr);
+        for (i = 0; i < nioapics; i++)
+                kprintf("apic: I/O APIC %u, GSIs %u-%u\n", ioapics[i].id,
+                        ioapics[i].gsi_base,
+                        ioapics[i].gsi_base + ioapics[i].npins - 1);
+        return true;
+}
+
+/*
+ * Measures the LAPIC timer's frequency against a one-shot countdown of PIT
+ * channel 2, which can be polled without involving IRQ 0.
+ */
+static uint32_t lapic_timer_calibrate()
+{
+        uint32_t count = PIT_FREQ / CALIBRATE_HZ, elapsed;
+        uint32_t flags = irq_save();
+        uint8_t gate;
+
+        /* Hold the counter with the gate low, and keep the speaker off */
+        gate = inb(PIT_CH2_GATE, false) & ~0x03;
+        outb(PIT_CH2_GATE, gate, false);
+        outb(PIT_CMD, 0xb0, false); /* binary, one-shot, 16-bit, counter 2 */
+        outb(PIT_CH2_DATA, count & 0xff, false);
+        outb(PIT_CH2_DATA, (count >> 8) & 0xff, false);
+
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+        lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+        outb(PIT_CH2_GATE, gate | 1, false);
+        while (!(inb(PIT_CH2_GATE, false) & PIT_CH2_OUT));
+        elapsed = 0xffffffff - lapic_read(LAPIC_TIMER_CUR);
+
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        outb(PIT_CH2_GATE, gate, false);
+        irq_restore(flags);
+        return elapsed * CALIBRATE_HZ;
+}
+
+/*
+ * Starts the local APIC timer interrupting hz times per second, delivered as
+ * IRQ_LAPIC_TIMER once a handler is registered for it.
+ */
+int lapic_timer_start(uint32_t hz)
+{
+        if (!lapic)
+                return -ENODEV;
+        if (!hz)
+                return -EINVAL;
+        if (!lapic_timer_freq)
+                lapic_timer_freq = lapic_timer_calibrate();
+        if (lapic_timer_freq < hz)
+                return -EINVAL;
+
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, (lapic_read(LAPIC_LVT_TIMER) & LVT_MASKED)
+                    | LVT_TIMER_PERIODIC | (INUM_IRQ0 + IRQ_LAPIC_TIMER));
+        lapic_write(LAPIC_TIMER_INIT, lapic_timer_freq / hz);
+        return 0;
+}
+
+void lapic_timer_stop()
+{
+        if (lapic)
+                lapic_write(LAPIC_TIMER_INIT, 0);
+}
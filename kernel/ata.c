@@ -0,0 +1,820 @@
+#include <asm/io.h>
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/ata.h>
+#include <kernel/blkdev.h>
+#include <kernel/irq.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+#include <kernel/pmm.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+
+/*
+ * Driver for ATA disks on the two channels of a PCI IDE controller such as the
+ * PIIX, or on the legacy ISA ports if there's no such controller. Each disk has
+ * a request queue, and a run of merged requests goes out as one command of up
+ * to ATA_MAX_SECTORS. Transfers use bus-master DMA when both the controller and
+ * the drive support it, scattering straight to and from each request's buffer,
+ * and otherwise READ/WRITE MULTIPLE, which takes an interrupt per block of
+ * sectors instead of one per sector. Disks past 2^28 sectors are addressed
+ * with LBA48 commands, the rest with the shorter LBA28 ones. Commands complete
+ * on the channel's IRQ, with the requesting task asleep meanwhile.
+ */
+
+/* Task file registers, from the channel's command block base */
+enum {
+        ATA_REG_DATA = 0,
+        ATA_REG_ERROR = 1,
+        ATA_REG_FEATURES = 1,
+        ATA_REG_COUNT = 2,
+        ATA_REG_LBA0 = 3,
+        ATA_REG_LBA1 = 4,
+        ATA_REG_LBA2 = 5,
+        ATA_REG_DEVICE = 6,
+        ATA_REG_STATUS = 7,
+        ATA_REG_COMMAND = 7
+};
+
+/* Status register bits */
+enum {
+        ATA_SR_ERR = 0x01,
+        ATA_SR_DRQ = 0x08,
+        ATA_SR_DF = 0x20,
+        ATA_SR_DRDY = 0x40,
+        ATA_SR_BSY = 0x80
+};
+
+/* Device control register bits, written to the control block */
+#define ATA_CTL_NIEN 0x02
+#define ATA_CTL_SRST 0x04
+
+/* Device register bits */
+#define ATA_DEV_LBA 0x40
+#define ATA_DEV_SLAVE 0x10
+#define ATA_DEV_OBS 0xa0
+
+/* Commands */
+enum {
+        ATA_CMD_READ_PIO = 0x20,
+        ATA_CMD_READ_PIO_EXT = 0x24,
+        ATA_CMD_READ_DMA_EXT = 0x25,
+        ATA_CMD_READ_MULTIPLE_EXT = 0x29,
+        ATA_CMD_WRITE_PIO = 0x30,
+        ATA_CMD_WRITE_PIO_EXT = 0x34,
+        ATA_CMD_WRITE_DMA_EXT = 0x35,
+        ATA_CMD_WRITE_MULTIPLE_EXT = 0x39,
+        ATA_CMD_READ_MULTIPLE = 0xc4,
+        ATA_CMD_WRITE_MULTIPLE = 0xc5,
+        ATA_CMD_SET_MULTIPLE = 0xc6,
+        ATA_CMD_READ_DMA = 0xc8,
+        ATA_CMD_WRITE_DMA = 0xca,
+        ATA_CMD_IDENTIFY = 0xec,
+        ATA_CMD_SET_FEATURES = 0xef
+};
+
+#define ATA_FEATURE_XFER_MODE 0x03
+#define ATA_XFER_MWDMA 0x20
+#define ATA_XFER_UDMA 0x40
+
+/* IDENTIFY DEVICE words */
+enum {
+        ATA_ID_MODEL = 27,
+        ATA_ID_MAX_MULTIPLE = 47,
+        ATA_ID_CAPABILITIES = 49,
+        ATA_ID_FIELD_VALID = 53,
+        ATA_ID_LBA_SECTORS = 60,
+        ATA_ID_MWDMA_MODES = 63,
+        ATA_ID_COMMAND_SET2 = 83,
+        ATA_ID_UDMA_MODES = 88,
+        ATA_ID_LBA48_SECTORS = 100
+};
+
+#define ATA_CAP_DMA (1 << 8)
+#define ATA_CAP_LBA (1 << 9)
+#define ATA_CMDSET2_LBA48 (1 << 10)
+#define ATA_FIELD_UDMA_VALID (1 << 2)
+
+/* Bus master registers, from the channel's bus master base */
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08 /* device to memory */
+#define BM_STATUS_ERR 0x02
+#define BM_STATUS_IRQ 0x04
+
+/* PCI class of IDE controllers, and their programming interface bits */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define IDE_PROG_IF_NATIVE(chan) (1 << (2 * (chan)))
+#define IDE_PROG_IF_BUS_MASTER 0x80
+
+/* Highest sector LBA28 commands can reach */
+#define LBA28_LIMIT (1 << 28)
+
+/* Time allowed for a command, including spinning up an idle disk */
+#define ATA_TIMEOUT (5 * HZ)
+
+/* Rounds of ata_poll, each at least 400 ns of port reads, making it 5 s */
+#define ATA_POLL_ROUNDS 12500000
+
+#define ATA_RETRIES 2
+
+/* A physical region descriptor of a bus master transfer. A count of 0 means
+   64 KiB, and a region can't cross a 64 KiB boundary. */
+struct prd {
+        uint32_t addr;
+        uint16_t count;
+        uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT 0x8000
+#define PRD_BOUNDARY 0x10000
+#define MAX_PRDS (PAGE_SIZE / sizeof(struct prd))
+
+struct ata_drive;
+
+struct ata_channel {
+        uint16_t io;
+        uint16_t ctl;
+        uint16_t bm;    /* 0 if the channel can't bus master */
+        int irq;
+
+        struct prd *prdt;
+        uint32_t prdt_phys;
+
+        /* Completion of the command in progress, signalled by the IRQ or the
+           timeout, with the status register read by the IRQ handler */
+        wait_queue_t irq_wait;
+        volatile bool irq_done;
+        volatile bool timed_out;
+        volatile uint8_t status;
+        struct timer timeout_timer;
+
+        /* Serializes commands to the channel's drives, which share it */
+        bool busy;
+        wait_queue_t busy_wait;
+
+        struct ata_drive *drives[2];
+};
+
+struct ata_drive {
+        struct ata_channel *chan;
+        bool slave;
+        bool lba48;
+        bool dma;
+
+        /* Sectors per interrupt of READ/WRITE MULTIPLE, 0 if not supported */
+        uint32_t multiple;
+
+        char name[4];
+        char model[41];
+        struct blkdev blkdev;
+        struct request_queue queue;
+};
+
+static struct ata_channel channels[2];
+static struct ata_drive drives[4];
+
+/* Legacy ports and IRQs, used unless a channel is in PCI native mode */
+static const uint16_t legacy_io[] = { 0x1f0, 0x170 };
+static const uint16_t legacy_ctl[] = { 0x3f6, 0x376 };
+static const int legacy_irq[] = { 14, 15 };
+
+/*
+ * In PCI native mode both channels share the controller's IRQ, so the handler
+ * first checks that it's this channel interrupting: the bus master status has
+ * a bit latched by the drive's interrupt line, and without bus mastering a
+ * drive still busy with its command can't have interrupted.
+ */
+static int ata_irq(int irq, void *dev, struct exception *e)
+{
+        struct ata_channel *chan = dev;
+        uint8_t bmstatus;
+
+        if (chan->bm) {
+                bmstatus = inb(chan->bm + BM_STATUS, false);
+                if (!(bmstatus & BM_STATUS_IRQ))
+                        return IRQ_NONE;
+                /* Write one to clear, leaving an error for ata_dma to see */
+                outb(chan->bm + BM_STATUS, (bmstatus & ~BM_STATUS_ERR)
+                     | BM_STATUS_IRQ, false);
+        }
+        else if (inb(chan->ctl, false) & ATA_SR_BSY) {
+                return IRQ_NONE;
+        }
+
+        /* Reading the status acknowledges the interrupt at the drive */
+        chan->status = inb(chan->io + ATA_REG_STATUS, false);
+        chan->irq_done = true;
+        wake_up(&chan->irq_wait);
+        return IRQ_HANDLED;
+}
+
+static void ata_timeout(void *data)
+{
+        struct ata_channel *chan = data;
+
+        chan->timed_out = true;
+        wake_up(&chan->irq_wait);
+}
+
+/*
+ * Sleeps until the channel raises its interrupt for the command or data block
+ * just issued, which must have cleared irq_done before issuing it. Returns the
+ * status register, or -EIO if there's no interrupt within ATA_TIMEOUT.
+ */
+static int wait_irq(struct ata_channel *chan)
+{
+        uint32_t flags = irq_save();
+        int ret;
+
+        chan->timed_out = false;
+        mod_timer(&chan->timeout_timer, jiffies + ATA_TIMEOUT);
+        while (!chan->irq_done && !chan->timed_out)
+                sleep_on(&chan->irq_wait);
+        del_timer(&chan->timeout_timer);
+        ret = chan->irq_done ? chan->status : -EIO;
+        chan->irq_done = false;
+        irq_restore(flags);
+        return ret;
+}
+
+/* The status is only valid 400 ns after selecting a drive */
+static void ata_delay(struct ata_channel *chan)
+{
+        for (int i = 0; i < 4; i++)
+                inb(chan->ctl, false);
+}
+
+/*
+ * Polls the alternate status, which doesn't acknowledge interrupts, until the
+ * bits in mask match val. Returns the status, or -EIO after ATA_POLL_ROUNDS.
+ * The drives are probed with interrupts off, when jiffies stands still, so
+ * the time is counted in rounds of port reads instead.
+ */
+static int ata_poll(struct ata_channel *chan, uint8_t mask, uint8_t val)
+{
+        uint8_t status;
+
+        for (uint32_t i = 0; i < ATA_POLL_ROUNDS; i++) {
+                status = inb(chan->ctl, false);
+                if ((status & mask) == val)
+                        return status;
+                ata_delay(chan);
+        }
+        return -EIO;
+}
+
+static int ata_select(struct ata_drive *drive, uint8_t device)
+{
+        struct ata_channel *chan = drive->chan;
+
+        if (ata_poll(chan, ATA_SR_BSY | ATA_SR_DRQ, 0) < 0)
+                return -EIO;
+        outb(chan->io + ATA_REG_DEVICE, ATA_DEV_OBS | device
+             | (drive->slave ? ATA_DEV_SLAVE : 0), false);
+        ata_delay(chan);
+        return ata_poll(chan, ATA_SR_BSY, 0) < 0 ? -EIO : 0;
+}
+
+/*
+ * Selects the drive and loads the address and sector count of a transfer,
+ * using LBA48 if it reaches past LBA28, returning whether it does. A count of
+ * ATA_MAX_SECTORS is written as 0 in LBA28.
+ */
+static int ata_setup(struct ata_drive *drive, uint32_t lba, uint32_t count,
+                     bool *ext)
+{
+        struct ata_channel *chan = drive->chan;
+        uint16_t io = chan->io;
+
+        *ext = lba + count > LBA28_LIMIT;
+        if (*ext) {
+                if (ata_select(drive, ATA_DEV_LBA))
+                        return -EIO;
+
+                /* High order bytes first, each register keeps the last two */
+                outb(io + ATA_REG_COUNT, count >> 8, false);
+                outb(io + ATA_REG_LBA0, lba >> 24, false);
+                outb(io + ATA_REG_LBA1, 0, false);
+                outb(io + ATA_REG_LBA2, 0, false);
+        }
+        else if (ata_select(drive, ATA_DEV_LBA | ((lba >> 24) & 0xf))) {
+                return -EIO;
+        }
+        outb(io + ATA_REG_COUNT, count & 0xff, false);
+        outb(io + ATA_REG_LBA0, lba & 0xff, false);
+        outb(io + ATA_REG_LBA1, (lba >> 8) & 0xff, false);
+        outb(io + ATA_REG_LBA2, (lba >> 16) & 0xff, false);
+        return 0;
+}
+
+static inline bool status_error(int status)
+{
+        return status < 0 || (status & (ATA_SR_ERR | ATA_SR_DF));
+}
+
+/* Issues a command without data, waiting for its interrupt */
+static int ata_command(struct ata_drive *drive, uint8_t cmd, uint8_t features,
+                       uint8_t count)
+{
+        struct ata_channel *chan = drive->chan;
+
+        if (ata_select(drive, 0))
+                return -EIO;
+        outb(chan->io + ATA_REG_FEATURES, features, false);
+        outb(chan->io + ATA_REG_COUNT, count, false);
+        chan->irq_done = false;
+        outb(chan->io + ATA_REG_COMMAND, cmd, false);
+        return status_error(wait_irq(chan)) ? -EIO : 0;
+}
+
+/* Position within a run of requests, in sectors into req */
+struct run_pos {
+        struct blk_request *req;
+        uint32_t off;
+};
+
+/* Moves pos on by n sectors, returning the buffer of the piece up to m
+   sectors long that starts at the old position */
+static void *run_take(struct run_pos *pos, uint32_t n, uint32_t *m)
+{
+        void *buf = (uint8_t*) pos->req->buf + pos->off * SECTOR_SIZE;
+
+        *m = pos->req->count - pos->off;
+        if (*m > n)
+                *m = n;
+        pos->off += *m;
+        if (pos->off == pos->req->count) {
+                pos->req = pos->req->next;
+                pos->off = 0;
+        }
+        return buf;
+}
+
+static void run_advance(struct run_pos *pos, uint32_t n)
+{
+        uint32_t m;
+
+        while (n) {
+                run_take(pos, n, &m);
+                n -= m;
+        }
+}
+
+/* Moves n sectors of PIO data between the data port and the run */
+static void pio_data(struct ata_channel *chan, struct run_pos *pos, uint32_t n,
+                     bool write)
+{
+        uint32_t m;
+        void *buf;
+
+        while (n) {
+                buf = run_take(pos, n, &m);
+                if (write)
+                        outsw(chan->io + ATA_REG_DATA, buf, m * SECTOR_SIZE / 2);
+                else
+                        insw(chan->io + ATA_REG_DATA, buf, m * SECTOR_SIZE / 2);
+                n -= m;
+        }
+}
+
+/*
+ * Transfers count sectors of a run from pos by PIO, a block of
+ * drive->multiple sectors per interrupt if READ/WRITE MULTIPLE is enabled, or
+ * one at a time otherwise.
+ */
+static int ata_pio(struct ata_drive *drive, uint32_t lba, uint32_t count,
+                   struct run_pos pos, bool write)
+{
+        struct ata_channel *chan = drive->chan;
+        uint32_t block = drive->multiple ? drive->multiple : 1, n;
+        uint8_t cmd;
+        int status;
+        bool ext;
+
+        if (ata_setup(drive, lba, count, &ext))
+                return -EIO;
+        if (drive->multiple) {
+                cmd = write ? (ext ? ATA_CMD_WRITE_MULTIPLE_EXT
+                                   : ATA_CMD_WRITE_MULTIPLE)
+                            : (ext ? ATA_CMD_READ_MULTIPLE_EXT
+                                   : ATA_CMD_READ_MULTIPLE);
+        }
+        else {
+                cmd = write ? (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                            : (ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+        }
+        chan->irq_done = false;
+        outb(chan->io + ATA_REG_COMMAND, cmd, false);
+
+        /* Reads interrupt when each block is ready, writes once each block
+           has been taken, the first one being asked for without one */
+        if (write)
+                status = ata_poll(chan, ATA_SR_BSY | ATA_SR_DRQ, ATA_SR_DRQ);
+        while (count) {
+                n = count < block ? count : block;
+                if (!write)
+                        status = wait_irq(chan);
+                if (status_error(status) || !(status & ATA_SR_DRQ))
+                        return -EIO;
+
+                pio_data(chan, &pos, n, write);
+                count -= n;
+
+                if (write) {
+                        status = wait_irq(chan);
+                        if (!count && status_error(status))
+                                return -EIO;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Fills the channel's PRD table with the physical regions of count sectors of
+ * a run from pos, merging pieces that are contiguous. Returns -EINVAL if the
+ * buffers can't be described, as bus masters need them word aligned.
+ */
+static int build_prdt(struct ata_channel *chan, struct run_pos pos,
+                      uint32_t count)
+{
+        uint32_t vaddr, len, paddr, chunk, end = 0, n = 0, m;
+        struct prd *prd = NULL;
+
+        while (count) {
+                vaddr = (uint32_t) run_take(&pos, count, &m);
+                len = m * SECTOR_SIZE;
+                count -= m;
+                if (vaddr & 1)
+                        return -EINVAL;
+
+                while (len) {
+                        paddr = vtophys(vaddr);
+                        if (!paddr)
+                                return -EINVAL;
+                        chunk = PAGE_SIZE - (vaddr & 0xfff);
+                        if (chunk > len)
+                                chunk = len;
+
+                        if (prd && paddr == end && paddr % PRD_BOUNDARY) {
+                                prd->count += chunk;
+                        }
+                        else {
+                                if (n == MAX_PRDS)
+                                        return -EINVAL;
+                                prd = &chan->prdt[n++];
+                                prd->addr = paddr;
+                                prd->count = chunk;
+                                prd->flags = 0;
+                        }
+                        end = paddr + chunk;
+                        vaddr += chunk;
+                        len -= chunk;
+                }
+        }
+        prd->flags = PRD_EOT;
+        return 0;
+}
+
+/*
+ * Transfers count sectors of a run from pos by bus-master DMA. Returns -EAGAIN
+ * if the buffers can't be used for DMA, for the caller to fall back to PIO.
+ */
+static int ata_dma(struct ata_drive *drive, uint32_t lba, uint32_t count,
+                   struct run_pos pos, bool write)
+{
+        struct ata_channel *chan = drive->chan;
+        uint8_t bmcmd = write ? 0 : BM_CMD_READ, bmstatus, cmd;
+        int status;
+        bool ext;
+
+        if (build_prdt(chan, pos, count))
+                return -EAGAIN;
+
+        outl(chan->bm + BM_PRDT, chan->prdt_phys, false);
+        outb(chan->bm + BM_COMMAND, bmcmd, false);
+        outb(chan->bm + BM_STATUS, inb(chan->bm + BM_STATUS, false)
+             | BM_STATUS_ERR | BM_STATUS_IRQ, false);
+
+        if (ata_setup(drive, lba, count, &ext))
+                return -EIO;
+        cmd = write ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                    : (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+        chan->irq_done = false;
+        outb(chan->io + ATA_REG_COMMAND, cmd, false);
+        outb(chan->bm + BM_COMMAND, bmcmd | BM_CMD_START, false);
+
+        status = wait_irq(chan);
+        outb(chan->bm + BM_COMMAND, bmcmd, false);
+        bmstatus = inb(chan->bm + BM_STATUS, false);
+        outb(chan->bm + BM_STATUS, bmstatus | BM_STATUS_ERR | BM_STATUS_IRQ,
+             false);
+
+        if (status_error(status) || (bmstatus & BM_STATUS_ERR))
+                return -EIO;
+        return 0;
+}
+
+static int set_multiple(struct ata_drive *drive)
+{
+        if (drive->multiple
+            && ata_command(drive, ATA_CMD_SET_MULTIPLE, 0, drive->multiple)) {
+                drive->multiple = 0;
+                return -EIO;
+        }
+        return 0;
+}
+
+/*
+ * Resets both drives of a channel after an error or timeout. The block size
+ * of READ/WRITE MULTIPLE doesn't survive it, so it's set again.
+ */
+static void ata_reset(struct ata_channel *chan)
+{
+        outb(chan->ctl, ATA_CTL_SRST | ATA_CTL_NIEN, true);
+        outb(chan->ctl, 0, false);
+        msleep(2);
+        ata_poll(chan, ATA_SR_BSY, 0);
+
+        for (int i = 0; i < 2; i++) {
+                if (chan->drives[i])
+                        set_multiple(chan->drives[i]);
+        }
+}
+
+static void chan_lock(struct ata_channel *chan)
+{
+        uint32_t flags = irq_save();
+
+        while (chan->busy)
+                sleep_on(&chan->busy_wait);
+        chan->busy = true;
+        irq_restore(flags);
+}
+
+static void chan_unlock(struct ata_channel *chan)
+{
+        uint32_t flags = irq_save();
+
+        chan->busy = false;
+        wake_up(&chan->busy_wait);
+        irq_restore(flags);
+}
+
+/*
+ * Carries out a run of requests from the queue, ATA_MAX_SECTORS per command,
+ * resetting the channel and retrying on errors. Returns 0 or -EIO.
+ */
+static int ata_xfer(struct blkdev *dev, struct blk_request *run)
+{
+        struct ata_drive *drive = dev->private;
+        struct ata_channel *chan = drive->chan;
+        struct run_pos pos = { run, 0 };
+        uint32_t lba = run->lba, count = run->run_sectors, n;
+        bool write = run->write;
+        int ret = 0, tries;
+
+        chan_lock(chan);
+        while (count) {
+                n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+                for (tries = 0; tries < ATA_RETRIES; tries++) {
+                        ret = drive->dma ? ata_dma(drive, lba, n, pos, write)
+                                         : -EAGAIN;
+                        if (ret == -EAGAIN)
+                                ret = ata_pio(drive, lba, n, pos, write);
+                        if (!ret)
+                                break;
+                        ata_reset(chan);
+                }
+                if (ret) {
+                        kprintf("ata: %s: %s of sectors %u-%u failed\n",
+                                drive->name, write ? "write" : "read",
+                                lba, lba + n - 1);
+                        break;
+                }
+                run_advance(&pos, n);
+                lba += n;
+                count -= n;
+        }
+        chan_unlock(chan);
+        return ret;
+}
+
+/* IDENTIFY strings have the two characters of each word swapped */
+static void id_string(char *dst, uint16_t *id, int words)
+{
+        int len = words * 2;
+
+        for (int i = 0; i < words; i++) {
+                dst[2*i] = id[i] >> 8;
+                dst[2*i + 1] = id[i] & 0xff;
+        }
+        while (len && dst[len - 1] == ' ')
+                len--;
+        dst[len] = '\0';
+}
+
+/*
+ * Selects the fastest DMA mode the drive supports unless the firmware has
+ * already selected one. The controller's timings are left as the firmware
+ * programmed them. Returns false if the drive can't do DMA.
+ */
+static bool setup_dma_mode(struct ata_drive *drive, uint16_t *id)
+{
+        uint16_t modes;
+        uint8_t mode;
+
+        if (!(id[ATA_ID_CAPABILITIES] & ATA_CAP_DMA))
+                return false;
+        if ((id[ATA_ID_FIELD_VALID] & ATA_FIELD_UDMA_VALID)
+            && (id[ATA_ID_UDMA_MODES] & 0x7f)) {
+                modes = id[ATA_ID_UDMA_MODES];
+                mode = ATA_XFER_UDMA;
+        }
+        else if (id[ATA_ID_MWDMA_MODES] & 0x7) {
+                modes = id[ATA_ID_MWDMA_MODES];
+                mode = ATA_XFER_MWDMA;
+        }
+        else {
+                return false;
+        }
+
+        if (modes >> 8)
+                return true;
+        mode |= 31 - __builtin_clz(modes & 0x7f);
+        return !ata_command(drive, ATA_CMD_SET_FEATURES,
+                            ATA_FEATURE_XFER_MODE, mode);
+}
+
+/*
+ * Probes for an ATA disk as one of a channel's drives, registering it as a
+ * block device if there's one. ATAPI drives are left alone.
+ */
+static void ata_probe(struct ata_channel *chan, int slave)
+{
+        struct ata_drive *drive = &drives[(chan - channels) * 2 + slave];
+        uint16_t id[256];
+        uint32_t sectors;
+        int status;
+
+        drive->chan = chan;
+        drive->slave = slave;
+        if (ata_select(drive, 0))
+                return;
+        outb(chan->io + ATA_REG_COUNT, 0, false);
+        outb(chan->io + ATA_REG_LBA0, 0, false);
+        outb(chan->io + ATA_REG_LBA1, 0, false);
+        outb(chan->io + ATA_REG_LBA2, 0, false);
+        chan->irq_done = false;
+        outb(chan->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY, false);
+        if (!inb(chan->ctl, false))
+                return;
+
+        if (ata_poll(chan, ATA_SR_BSY, 0) < 0)
+                return;
+        if (inb(chan->io + ATA_REG_LBA1, false)
+            || inb(chan->io + ATA_REG_LBA2, false))
+                return;
+        status = wait_irq(chan);
+        if (status_error(status) || !(status & ATA_SR_DRQ))
+                return;
+        insw(chan->io + ATA_REG_DATA, id, 256);
+
+        if (!(id[ATA_ID_CAPABILITIES] & ATA_CAP_LBA))
+                return;
+        sectors = id[ATA_ID_LBA_SECTORS] | id[ATA_ID_LBA_SECTORS + 1] << 16;
+        drive->lba48 = id[ATA_ID_COMMAND_SET2] & ATA_CMDSET2_LBA48;
+        if (drive->lba48) {
+                if (id[ATA_ID_LBA48_SECTORS + 2] || id[ATA_ID_LBA48_SECTORS + 3])
+                        sectors = 0xffffffff;
+                else
+                        sectors = id[ATA_ID_LBA48_SECTORS]
+                                  | id[ATA_ID_LBA48_SECTORS + 1] << 16;
+        }
+        else if (sectors > LBA28_LIMIT) {
+                sectors = LBA28_LIMIT;
+        }
+        id_string(drive->model, id + ATA_ID_MODEL, 20);
+
+        drive->multiple = id[ATA_ID_MAX_MULTIPLE] & 0xff;
+        set_multiple(drive);
+        drive->dma = chan->bm && setup_dma_mode(drive, id);
+
+        drive->name[0] = 'h';
+        drive->name[1] = 'd';
+        drive->name[2] = 'a' + (drive - drives);
+        drive->name[3] = '\0';
+        kprintf("ata: %s: %s, %u sectors, %s, %s\n", drive->name,
+                drive->model, sectors, drive->lba48 ? "LBA48" : "LBA28",
+                drive->dma ? "DMA" : "PIO");
+
+        chan->drives[slave] = drive;
+        drive->blkdev.name = drive->name;
+        drive->blkdev.sectors = sectors;
+        drive->blkdev.private = drive;
+        blk_init_queue(&drive->blkdev, &drive->queue, ata_xfer,
+                       ATA_MAX_SECTORS);
+        blkdev_register(&drive->blkdev);
+}
+
+static void ata_channel_init(struct ata_channel *chan)
+{
+        uint32_t paddr;
+
+        /* A floating bus reads as all ones */
+        if (inb(chan->io + ATA_REG_STATUS, false) == 0xff)
+                return;
+
+        if (chan->bm) {
+                paddr = pmm_alloc();
+                if (paddr) {
+                        chan->prdt = phys_to_virt(paddr);
+                        chan->prdt_phys = paddr;
+                }
+                else {
+                        chan->bm = 0;
+                }
+        }
+
+        timer_setup(&chan->timeout_timer, ata_timeout, chan);
+        if (irq_register(chan->irq, ata_irq, chan, "ata"))
+                return;
+        outb(chan->ctl, 0, false);
+
+        chan->busy = true;
+        ata_probe(chan, 0);
+        ata_probe(chan, 1);
+        chan_unlock(chan);
+}
+
+/*
+ * Sets up both channels of a controller, in PCI native mode or at the legacy
+ * ports as prog_if says, with bus mastering through the I/O ports at bm if it
+ * isn't 0.
+ */
+static void ata_setup_channels(struct pci_device *dev, uint8_t prog_if,
+                               uint32_t bm)
+{
+        for (int i = 0; i < 2; i++) {
+                if (prog_if & IDE_PROG_IF_NATIVE(i)) {
+                        channels[i].io = dev->bars[2 * i].base;
+                        channels[i].ctl = dev->bars[2 * i + 1].base + 2;
+                        channels[i].irq = dev->irq;
+                }
+                else {
+                        channels[i].io = legacy_io[i];
+                        channels[i].ctl = legacy_ctl[i];
+                        channels[i].irq = legacy_irq[i];
+                }
+                channels[i].bm = bm ? bm + 8 * i : 0;
+                ata_channel_init(&channels[i]);
+        }
+}
+
+/* Takes the first IDE controller, enabling bus mastering if it can */
+static int ata_pci_probe(struct pci_device *dev)
+{
+        struct pci_bar *bar = &dev->bars[4];
+        uint32_t bm = 0;
+
+        if (channels[0].io)
+                return -EBUSY;
+        if ((dev->prog_if & IDE_PROG_IF_BUS_MASTER) && bar->io && bar->size)
+                bm = bar->base;
+        pci_enable_device(dev, bm);
+        ata_setup_channels(dev, dev->prog_if, bm);
+        return 0;
+}
+
+static const struct pci_device_id ata_ids[] = {
+        { PCI_ANY_ID, PCI_ANY_ID, PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE },
+        { 0 }
+};
+
+static struct pci_driver ata_driver = {
+        .name = "ata",
+        .ids = ata_ids,
+        .probe = ata_pci_probe,
+};
+
+/*
+ * Binds to the IDE controller on the PCI bus and probes the drives on both its
+ * channels. Without one, only the legacy ports are probed, for PIO transfers.
+ * Returns -ENODEV if there are no disks.
+ */
+int ata_init()
+{
+        if (!pci_register_driver(&ata_driver))
+                ata_setup_channels(NULL, 0, 0);
+
+        for (int i = 0; i < 4; i++) {
+                if (drives[i].blkdev.submit)
+                        return 0;
+        }
+        return -ENODEV;
+}
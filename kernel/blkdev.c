@@ -0,0 +1,295 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/blkdev.h>
+#include <kernel/timer.h>
+
+/*
+ * Generic block device layer. Drivers register a blkdev with a submit function
+ * taking sector-addressed requests, and everything above, such as the buffer
+ * cache, talks to devices through requests rather than driver calls. Drivers
+ * that can only do one transfer at a time get a request queue, which makes
+ * submission asynchronous and orders and merges what's waiting.
+ */
+
+static struct blkdev *blkdevs[MAX_BLKDEVS];
+
+int blkdev_register(struct blkdev *dev)
+{
+        for (int i = 0; i < MAX_BLKDEVS; i++) {
+                if (!blkdevs[i]) {
+                        dev->ra_next = 0;
+                        dev->ra_end = 0;
+                        blkdevs[i] = dev;
+                        kprintf("blkdev: %s, %u sectors\n", dev->name,
+                                dev->sectors);
+                        return 0;
+                }
+        }
+        return -ENOMEM;
+}
+
+/* Looks up a registered device by name, returning NULL if there's none */
+struct blkdev *blkdev_get(char *name)
+{
+        for (int i = 0; i < MAX_BLKDEVS; i++) {
+                if (blkdevs[i] && str_eq(blkdevs[i]->name, name))
+                        return blkdevs[i];
+        }
+        return NULL;
+}
+
+/*
+ * Hands a request to its device, failing it if it runs past the end. The
+ * device may hold it back until blk_unplug() is called, so that a batch of
+ * requests queued together goes out at once.
+ */
+void blk_queue(struct blk_request *req)
+{
+        struct blkdev *dev = req->dev;
+
+        req->status = 0;
+        req->progress = 0;
+        req->next = NULL;
+        if (!req->count || req->lba >= dev->sectors
+            || req->count > dev->sectors - req->lba) {
+                blk_complete(req, -EINVAL);
+                return;
+        }
+        dev->submit(dev, req);
+}
+
+/* Starts the requests a device has queued */
+void blk_unplug(struct blkdev *dev)
+{
+        if (dev->unplug)
+                dev->unplug(dev);
+}
+
+void blk_submit(struct blk_request *req)
+{
+        /* The request may be gone once it's queued */
+        struct blkdev *dev = req->dev;
+
+        blk_queue(req);
+        blk_unplug(dev);
+}
+
+/* Called by drivers when a request has finished */
+void blk_complete(struct blk_request *req, int status)
+{
+        req->status = status;
+        if (req->done)
+                req->done(req);
+}
+
+struct blk_waiter {
+        wait_queue_t wait;
+        bool done;
+};
+
+static void blk_wake(struct blk_request *req)
+{
+        struct blk_waiter *w = req->private;
+
+        w->done = true;
+        wake_up(&w->wait);
+}
+
+/*
+ * Reads or writes count sectors at lba and waits for the transfer to finish.
+ * Returns 0 or a negated error code.
+ */
+int blk_rw(struct blkdev *dev, uint32_t lba, uint32_t count, void *buf,
+           bool write)
+{
+        struct blk_waiter w = { NULL, false };
+        struct blk_request req = {
+                .dev = dev,
+                .lba = lba,
+                .count = count,
+                .buf = buf,
+                .write = write,
+                .done = blk_wake,
+                .private = &w,
+        };
+        uint32_t flags;
+
+        blk_submit(&req);
+
+        flags = irq_save();
+        while (!w.done)
+                sleep_on(&w.wait);
+        irq_restore(flags);
+        return req.status;
+}
+
+/* True if sectors more in the given direction fit in a run */
+static bool can_merge(struct request_queue *q, struct blk_request *run,
+                      bool write, uint32_t sectors)
+{
+        return run->write == write
+               && run->run_sectors + sectors <= q->max_sectors;
+}
+
+/*
+ * Adds a request to the queue, appending it to a run it directly follows or
+ * prepending it to one it directly precedes, or else inserting it as a run of
+ * its own in LBA order.
+ */
+static void elv_insert(struct request_queue *q, struct blk_request *req)
+{
+        struct blk_request **p, *run, *next;
+
+        for (p = &q->runs; *p; p = &(*p)->queue_next) {
+                run = *p;
+                if (!can_merge(q, run, req->write, req->count))
+                        continue;
+
+                if (run->lba + run->run_sectors == req->lba) {
+                        run->run_tail->next = req;
+                        run->run_tail = req;
+                        run->run_sectors += req->count;
+
+                        /* The gap to the next run may just have closed */
+                        next = run->queue_next;
+                        if (next && run->lba + run->run_sectors == next->lba
+                            && can_merge(q, run, next->write,
+                                         next->run_sectors)) {
+                                run->run_tail->next = next;
+                                run->run_tail = next->run_tail;
+                                run->run_sectors += next->run_sectors;
+                                if (time_after(run->deadline, next->deadline))
+                                        run->deadline = next->deadline;
+                                run->queue_next = next->queue_next;
+                        }
+                        return;
+                }
+                if (req->lba + req->count == run->lba) {
+                        req->next = run;
+                        req->run_tail = run->run_tail;
+                        req->run_sectors += run->run_sectors;
+                        if (time_after(req->deadline, run->deadline))
+                                req->deadline = run->deadline;
+                        req->queue_next = run->queue_next;
+                        *p = req;
+                        return;
+                }
+        }
+
+        for (p = &q->runs; *p && (*p)->lba < req->lba; p = &(*p)->queue_next);
+        req->queue_next = *p;
+        *p = req;
+}
+
+/*
+ * Takes the next run to start: the one that expired first if any have, or the
+ * first at or past the head position, wrapping around to the lowest LBA once
+ * there are none left ahead of it.
+ */
+static struct blk_request *elv_next(struct request_queue *q)
+{
+        struct blk_request **p, **pick = NULL, *run;
+
+        for (p = &q->runs; *p; p = &(*p)->queue_next) {
+                if (time_after(jiffies, (*p)->deadline)
+                    && (!pick || time_after((*pick)->deadline,
+                                            (*p)->deadline)))
+                        pick = p;
+        }
+        if (!pick) {
+                for (p = &q->runs; *p && (*p)->lba < q->head_pos;
+                     p = &(*p)->queue_next);
+                pick = *p ? p : &q->runs;
+        }
+
+        run = *pick;
+        if (run) {
+                *pick = run->queue_next;
+                q->head_pos = run->lba + run->run_sectors;
+        }
+        return run;
+}
+
+/* Hands each request of a run its status, reading the links first since
+   their submitters may reuse them at once */
+static void complete_run(struct blk_request *run, int status)
+{
+        struct blk_request *next;
+
+        for (; run; run = next) {
+                next = run->next;
+                blk_complete(run, status);
+        }
+}
+
+/* Worker of a request queue, running runs until the queue is empty */
+static void queue_run(struct work *work)
+{
+        struct request_queue *q = (struct request_queue*) work;
+        struct blk_request *run;
+        uint32_t flags;
+
+        for (;;) {
+                flags = spin_lock_irqsave(&q->lock);
+                run = elv_next(q);
+                spin_unlock_irqrestore(&q->lock, flags);
+                if (!run)
+                        break;
+                complete_run(run, q->xfer(q->dev, run));
+        }
+}
+
+static void queue_submit(struct blkdev *dev, struct blk_request *req)
+{
+        struct request_queue *q = dev->queue;
+        uint32_t flags;
+
+        req->next = NULL;
+        req->queue_next = NULL;
+        req->run_tail = req;
+        req->run_sectors = req->count;
+        req->deadline = jiffies + (req->write ? WRITE_EXPIRE : READ_EXPIRE);
+
+        /* Without a worker, requests are carried out as they come */
+        if (!q->wq) {
+                blk_complete(req, q->xfer(dev, req));
+                return;
+        }
+
+        flags = spin_lock_irqsave(&q->lock);
+        elv_insert(q, req);
+        spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void queue_unplug(struct blkdev *dev)
+{
+        struct request_queue *q = dev->queue;
+
+        if (q->wq)
+                queue_work(q->wq, &q->work);
+}
+
+/*
+ * Gives a device a request queue feeding xfer runs of at most max_sectors,
+ * from a worker thread of its own. Called before registering it. If there's
+ * no thread to be had, requests are carried out synchronously instead and
+ * -ENOMEM is returned.
+ */
+int blk_init_queue(struct blkdev *dev, struct request_queue *q,
+                   int (*xfer)(struct blkdev *dev, struct blk_request *run),
+                   uint32_t max_sectors)
+{
+        memset(q, 0, sizeof(*q));
+        q->dev = dev;
+        q->xfer = xfer;
+        q->max_sectors = max_sectors;
+        spin_lock_init(&q->lock);
+        work_init(&q->work, queue_run);
+        q->wq = workqueue_create(dev->name);
+
+        dev->queue = q;
+        dev->submit = queue_submit;
+        dev->unplug = queue_unplug;
+        return q->wq ? 0 : -ENOMEM;
+}
@@ -0,0 +1,156 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/bootmod.h>
+#include <kernel/paging.h>
+#include <kernel/tar.h>
+
+/*
+ * Modules loaded by the bootloader, such as an initrd. They're left where
+ * they were loaded rather than copied: their pages are kept out of the page
+ * allocator, and each module is mapped once and served from there, both as a
+ * RAM disk whose requests are a memcpy and as a tar archive whose files are
+ * pointers into it.
+ */
+
+static struct bootmod bootmods[MAX_BOOTMODS];
+static int nbootmods;
+
+/*
+ * Copies the module list out of bootloader memory. Like cmdline_init, must
+ * be called before paging_init, both because that memory is about to be
+ * given away and so that the modules' own pages aren't.
+ */
+void bootmod_init(const struct multiboot_info *mbi)
+{
+        struct multiboot_module *mods;
+        struct bootmod *bm;
+        char *s;
+        int i;
+
+        if (!(mbi->flags & MULTIBOOT_INFO_MODS))
+                return;
+        mods = phys_to_virt(mbi->mods_addr);
+        for (uint32_t n = 0; n < mbi->mods_count; n++) {
+                if (nbootmods == MAX_BOOTMODS)
+                        break;
+                if (mods[n].mod_end <= mods[n].mod_start)
+                        continue;
+
+                bm = &bootmods[nbootmods];
+                snprintf(bm->name, sizeof(bm->name), "ram%d", nbootmods);
+                bm->paddr = mods[n].mod_start;
+                bm->size = mods[n].mod_end - mods[n].mod_start;
+                if (mods[n].cmdline) {
+                        s = phys_to_virt(mods[n].cmdline);
+                        for (i = 0; s[i] && i < BOOTMOD_CMDLINE_SIZE - 1; i++)
+                                bm->cmdline[i] = s[i];
+                        bm->cmdline[i] = '\0';
+                }
+                nbootmods++;
+        }
+}
+
+/* Returns whether the page at paddr holds any part of a module */
+bool bootmod_reserved(uint32_t paddr)
+{
+        struct bootmod *bm;
+
+        for (int i = 0; i < nbootmods; i++) {
+                bm = &bootmods[i];
+                if (paddr < bm->paddr + bm->size
+                    && paddr + PAGE_SIZE > bm->paddr)
+                        return true;
+        }
+        return false;
+}
+
+static void ram_submit(struct blkdev *dev, struct blk_request *req)
+{
+        struct bootmod *bm = dev->private;
+        uint8_t *p = bm->data + req->lba * SECTOR_SIZE;
+
+        if (req->write)
+                memcpy(p, req->buf, req->count * SECTOR_SIZE);
+        else
+                memcpy(req->buf, p, req->count * SECTOR_SIZE);
+        blk_complete(req, 0);
+}
+
+/*
+ * Maps the modules and registers them as RAM disks. Any bytes past the last
+ * whole sector of a module are only reachable through bootmod_get.
+ */
+void bootmod_setup()
+{
+        struct bootmod *bm;
+
+        for (int i = 0; i < nbootmods; i++) {
+                bm = &bootmods[i];
+                /* Writable, as the RAM disk takes writes */
+                bm->data = (uint8_t*) map_phys(bm->paddr, bm->size,
+                                               PAGE_WRITABLE);
+                if (!bm->data) {
+                        kprintf("bootmod: can't map %s\n", bm->name);
+                        continue;
+                }
+                kprintf("bootmod: %s at %x, %u bytes, %s\n", bm->name,
+                        bm->paddr, bm->size, bm->cmdline);
+
+                bm->blkdev.name = bm->name;
+                bm->blkdev.sectors = bm->size / SECTOR_SIZE;
+                bm->blkdev.submit = ram_submit;
+                bm->blkdev.private = bm;
+                if (bm->blkdev.sectors)
+                        blkdev_register(&bm->blkdev);
+        }
+}
+
+/* Compares the last path component of the first word of a command line */
+static bool basename_eq(char *cmdline, char *name)
+{
+        char *base = cmdline, *s;
+
+        for (s = cmdline; *s && *s != ' '; s++) {
+                if (*s == '/')
+                        base = s + 1;
+        }
+        for (; base < s; base++, name++) {
+                if (*base != *name)
+                        return false;
+        }
+        return !*name;
+}
+
+/*
+ * Looks up a mapped module by its ramN name or by the file name it was
+ * loaded from, returning NULL if there's none.
+ */
+struct bootmod *bootmod_get(char *name)
+{
+        struct bootmod *bm;
+
+        for (int i = 0; i < nbootmods; i++) {
+                bm = &bootmods[i];
+                if (bm->data && (str_eq(bm->name, name)
+                                 || basename_eq(bm->cmdline, name)))
+                        return bm;
+        }
+        return NULL;
+}
+
+/*
+ * Looks up a file in the modules that are tar archives, in the order they
+ * were loaded, returning its data in place. Returns -ENOENT if none has it.
+ */
+int bootmod_file(char *path, void **data, uint32_t *size)
+{
+        struct bootmod *bm;
+
+        for (int i = 0; i < nbootmods; i++) {
+                bm = &bootmods[i];
+                if (bm->data && !tar_find(bm->data, bm->size, path, data,
+                                          size))
+                        return 0;
+        }
+        return -ENOENT;
+}
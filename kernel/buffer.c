@@ -0,0 +1,403 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/buffer.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+/*
+ * Buffer cache of disk blocks, looked up by (device, block) in a hash table.
+ * Buffers nobody holds sit on an LRU list, from which the least recently used
+ * clean one is taken when a block that isn't cached is needed. Writes only
+ * dirty the cached copy, and the bflushd kernel thread writes dirty buffers
+ * back periodically, or sooner when they pile up. Sequential reads trigger
+ * readahead of the following blocks.
+ */
+
+static struct buffer buffers[NR_BUFFERS];
+static struct buffer *buffer_hash[BUFFER_HASH_SIZE];
+
+/* Sentinel of the LRU list, least recently used first */
+static struct buffer lru = { .lru_prev = &lru, .lru_next = &lru };
+
+/* Protects the hash table, the LRU list, and buffer flags and refcounts */
+static spinlock_t buffer_lock = SPINLOCK_INIT;
+
+static uint32_t ndirty;
+
+/* Where tasks wait for a buffer to become free for reuse */
+static wait_queue_t free_wait;
+
+static bool flush_kick;
+static wait_queue_t flusher_wait;
+static struct timer flush_timer;
+
+static inline uint32_t hashfn(struct blkdev *dev, uint32_t block)
+{
+        return (block ^ ((uint32_t) dev >> 4)) % BUFFER_HASH_SIZE;
+}
+
+static void lru_remove(struct buffer *b)
+{
+        b->lru_prev->lru_next = b->lru_next;
+        b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_add_tail(struct buffer *b)
+{
+        b->lru_prev = lru.lru_prev;
+        b->lru_next = &lru;
+        lru.lru_prev->lru_next = b;
+        lru.lru_prev = b;
+}
+
+static struct buffer *lookup(struct blkdev *dev, uint32_t block)
+{
+        struct buffer *b;
+
+        for (b = buffer_hash[hashfn(dev, block)]; b; b = b->hash_next) {
+                if (b->dev == dev && b->block == block)
+                        return b;
+        }
+        return NULL;
+}
+
+static void unhash(struct buffer *b)
+{
+        struct buffer **p;
+
+        if (!b->dev)
+                return;
+        for (p = &buffer_hash[hashfn(b->dev, b->block)]; *p;
+             p = &(*p)->hash_next) {
+                if (*p == b) {
+                        *p = b->hash_next;
+                        break;
+                }
+        }
+}
+
+/* Least recently used buffer that can be reused, or NULL */
+static struct buffer *find_reusable()
+{
+        struct buffer *b;
+
+        for (b = lru.lru_next; b != &lru; b = b->lru_next) {
+                if (!(b->flags & (BUF_DIRTY | BUF_BUSY)))
+                        return b;
+        }
+        return NULL;
+}
+
+static void wake_flusher()
+{
+        flush_kick = true;
+        wake_up(&flusher_wait);
+}
+
+/*
+ * Returns the buffer for a block, held, reusing the least recently used clean
+ * buffer if the block isn't cached, in which case it isn't valid yet. If every
+ * buffer is held or dirty, waits for one to be freed, or returns NULL if
+ * can_wait is false.
+ */
+static struct buffer *getblk(struct blkdev *dev, uint32_t block, bool can_wait)
+{
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+        uint32_t h = hashfn(dev, block);
+        struct buffer *b;
+
+        for (;;) {
+                b = lookup(dev, block);
+                if (b) {
+                        if (!b->refcount++)
+                                lru_remove(b);
+                        break;
+                }
+
+                b = find_reusable();
+                if (b) {
+                        lru_remove(b);
+                        unhash(b);
+                        b->dev = dev;
+                        b->block = block;
+                        b->flags = 0;
+                        b->refcount = 1;
+                        b->hash_next = buffer_hash[h];
+                        buffer_hash[h] = b;
+                        break;
+                }
+                if (!can_wait)
+                        break;
+
+                wake_flusher();
+                spin_unlock(&buffer_lock);
+                sleep_on(&free_wait);
+                spin_lock(&buffer_lock);
+        }
+        spin_unlock_irqrestore(&buffer_lock, flags);
+        return b;
+}
+
+static bool is_cached(struct blkdev *dev, uint32_t block)
+{
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+        bool cached = lookup(dev, block) != NULL;
+
+        spin_unlock_irqrestore(&buffer_lock, flags);
+        return cached;
+}
+
+void brelse(struct buffer *b)
+{
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+
+        if (!--b->refcount) {
+                lru_add_tail(b);
+                wake_up(&free_wait);
+        }
+        spin_unlock_irqrestore(&buffer_lock, flags);
+}
+
+/* Marks a held buffer's data as modified, to be written back later */
+void bdirty(struct buffer *b)
+{
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+
+        b->flags |= BUF_VALID;
+        if (!(b->flags & BUF_DIRTY)) {
+                b->flags |= BUF_DIRTY;
+                if (++ndirty >= DIRTY_THRESHOLD)
+                        wake_flusher();
+        }
+        spin_unlock_irqrestore(&buffer_lock, flags);
+}
+
+/*
+ * Claims a buffer for a transfer. Reads are only claimed if the data isn't
+ * valid, writes only if it's dirty, and neither if a transfer is already in
+ * progress. Claiming a write marks the buffer clean, so changes made while it
+ * is written out dirty it again, and holds it so it isn't reused before the
+ * writer has seen the result.
+ */
+static bool claim_io(struct buffer *b, bool write)
+{
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+        bool claimed = false;
+
+        if (!(b->flags & BUF_BUSY)) {
+                if (write && (b->flags & BUF_DIRTY)) {
+                        b->flags &= ~BUF_DIRTY;
+                        ndirty--;
+                        if (!b->refcount++)
+                                lru_remove(b);
+                        claimed = true;
+                }
+                else if (!write && !(b->flags & BUF_VALID)) {
+                        claimed = true;
+                }
+        }
+        if (claimed)
+                b->flags |= BUF_BUSY;
+        spin_unlock_irqrestore(&buffer_lock, flags);
+        return claimed;
+}
+
+/* Completion of a buffer's transfer, possibly in interrupt context */
+static void end_io(struct blk_request *req)
+{
+        struct buffer *b = req->private;
+        uint32_t flags = spin_lock_irqsave(&buffer_lock);
+
+        b->flags &= ~BUF_BUSY;
+        if (!req->status) {
+                b->flags |= BUF_VALID;
+        }
+        else if (req->write && !(b->flags & BUF_DIRTY)) {
+                /* Keep the data around to try again later */
+                b->flags |= BUF_DIRTY;
+                ndirty++;
+        }
+        wake_up(&b->wait);
+        spin_unlock_irqrestore(&buffer_lock, flags);
+}
+
+/* Readahead holds its buffers only until they've been read */
+static void readahead_done(struct blk_request *req)
+{
+        end_io(req);
+        brelse(req->private);
+}
+
+/* Queues a buffer's transfer, which starts once its device is unplugged */
+static void queue_io(struct buffer *b, bool write,
+                     void (*done)(struct blk_request *req))
+{
+        b->req.dev = b->dev;
+        b->req.lba = b->block;
+        b->req.count = 1;
+        b->req.buf = b->data;
+        b->req.write = write;
+        b->req.done = done;
+        b->req.private = b;
+        blk_queue(&b->req);
+}
+
+static void wait_io(struct buffer *b)
+{
+        uint32_t flags = irq_save();
+
+        while (b->flags & BUF_BUSY)
+                sleep_on(&b->wait);
+        irq_restore(flags);
+}
+
+/*
+ * Starts reading the blocks after a sequential reader's current one, keeping
+ * up to READAHEAD_MAX of them in flight or cached ahead of it. The window is
+ * topped up once the reader is halfway through it, and reset by any read that
+ * isn't sequential. The reads are only queued, for the caller to unplug.
+ */
+static void readahead(struct blkdev *dev, uint32_t block)
+{
+        struct buffer *b;
+        uint32_t start, end;
+
+        if (block != dev->ra_next) {
+                dev->ra_next = block + 1;
+                dev->ra_end = block + 1;
+                return;
+        }
+        dev->ra_next = block + 1;
+        if (dev->ra_end > block + READAHEAD_MAX / 2)
+                return;
+
+        start = dev->ra_end > block + 1 ? dev->ra_end : block + 1;
+        end = block + 1 + READAHEAD_MAX;
+        if (end > dev->sectors)
+                end = dev->sectors;
+
+        for (; start < end; start++) {
+                if (is_cached(dev, start))
+                        continue;
+                b = getblk(dev, start, false);
+                if (!b)
+                        break;
+                if (claim_io(b, false))
+                        queue_io(b, false, readahead_done);
+                else
+                        brelse(b);
+        }
+        dev->ra_end = start;
+}
+
+/*
+ * Returns a held buffer with the contents of a block, reading it from the
+ * device if it isn't cached. Returns NULL on read errors.
+ */
+struct buffer *bread(struct blkdev *dev, uint32_t block)
+{
+        struct buffer *b = getblk(dev, block, true);
+
+        /* The block and its readahead go to the device as one batch */
+        if (claim_io(b, false))
+                queue_io(b, false, end_io);
+        readahead(dev, block);
+        blk_unplug(dev);
+        wait_io(b);
+
+        if (!(b->flags & BUF_VALID)) {
+                brelse(b);
+                return NULL;
+        }
+        return b;
+}
+
+/*
+ * Writes back the dirty buffers of a device, or of every device if dev is
+ * NULL, and waits for them. The writes are all queued before any is waited
+ * for, so each device gets them as one batch. Returns -EIO if any failed.
+ */
+int bsync(struct blkdev *dev)
+{
+        uint32_t claimed[NR_BUFFERS / 32] = { 0 };
+        struct blkdev *plugged = NULL;
+        struct buffer *b;
+        int i, ret = 0;
+
+        for (i = 0; i < NR_BUFFERS; i++) {
+                b = &buffers[i];
+                if ((dev && b->dev != dev) || !(b->flags & BUF_DIRTY))
+                        continue;
+                if (!claim_io(b, true))
+                        continue;
+                if (plugged && plugged != b->dev)
+                        blk_unplug(plugged);
+                plugged = b->dev;
+                queue_io(b, true, end_io);
+                claimed[i / 32] |= 1 << (i % 32);
+        }
+        if (plugged)
+                blk_unplug(plugged);
+
+        for (i = 0; i < NR_BUFFERS; i++) {
+                if (!(claimed[i / 32] & (1 << (i % 32))))
+                        continue;
+                b = &buffers[i];
+                wait_io(b);
+                if (b->req.status)
+                        ret = -EIO;
+                brelse(b);
+        }
+        return ret;
+}
+
+static void flush_tick(void *data)
+{
+        wake_flusher();
+        mod_timer(&flush_timer, jiffies + FLUSH_INTERVAL);
+}
+
+static void bflushd()
+{
+        uint32_t flags;
+
+        for (;;) {
+                flags = irq_save();
+                while (!flush_kick)
+                        sleep_on(&flusher_wait);
+                flush_kick = false;
+                irq_restore(flags);
+
+                if (bsync(NULL))
+                        kprintf("bflushd: write back failed\n");
+        }
+}
+
+/*
+ * Allocates the buffers' memory, a page at a time through the direct map, and
+ * starts the flusher.
+ */
+void buffer_init()
+{
+        uint32_t paddr = 0;
+
+        for (int i = 0; i < NR_BUFFERS; i++) {
+                if (i % (PAGE_SIZE / SECTOR_SIZE) == 0) {
+                        paddr = pmm_alloc();
+                        if (!paddr)
+                                kpanic("out of memory for buffer cache");
+                }
+                buffers[i].data = (uint8_t*) phys_to_virt(paddr)
+                                  + (i % (PAGE_SIZE / SECTOR_SIZE))
+                                    * SECTOR_SIZE;
+                lru_add_tail(&buffers[i]);
+        }
+
+        if (!spawn_kthread(bflushd))
+                kpanic("failed to start bflushd");
+        timer_setup(&flush_timer, flush_tick, NULL);
+        mod_timer(&flush_timer, jiffies + FLUSH_INTERVAL);
+}
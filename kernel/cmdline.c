@@ -0,0 +1,67 @@
+#include <kernel/kernel.h>
+#include <kernel/cmdline.h>
+
+/*
+ * The command line given by the bootloader, split into null-terminated words
+ * in place. The first word is the kernel image path, the rest are options of
+ * the form name or name=value.
+ */
+static char cmdline[CMDLINE_SIZE];
+static int cmdline_len;
+
+/*
+ * Copies the command line out of bootloader memory. Must be called before
+ * paging_init, which gives that memory to the page allocator.
+ */
+void cmdline_init(char *s)
+{
+        int i;
+
+        for (i = 0; s[i] && i < CMDLINE_SIZE - 1; i++)
+                cmdline[i] = (s[i] == ' ') ? '\0' : s[i];
+        cmdline[i] = '\0';
+        cmdline_len = i;
+}
+
+/*
+ * Looks up an option, returning its value, the empty string if it was given
+ * without one, or NULL if it's not on the command line.
+ */
+char *cmdline_get(char *name)
+{
+        char *word, *n;
+        int i;
+
+        for (i = 0; i < cmdline_len; i++) {
+                if (!cmdline[i] || (i > 0 && cmdline[i-1]))
+                        continue;
+
+                word = &cmdline[i];
+                for (n = name; *n && *n == *word; n++, word++);
+                if (*n)
+                        continue;
+                if (*word == '=')
+                        return word + 1;
+                if (*word == '\0')
+                        return word;
+        }
+        return NULL;
+}
+
+/*
+ * Returns the value of a decimal option, or def if missing or malformed.
+ */
+uint32_t cmdline_uint(char *name, uint32_t def)
+{
+        char *val = cmdline_get(name);
+        uint32_t n = 0;
+
+        if (!val || !*val)
+                return def;
+        for (; *val; val++) {
+                if (*val < '0' || *val > '9')
+                        return def;
+                n = n * 10 + *val - '0';
+        }
+        return n;
+}
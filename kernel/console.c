@@ -1,57 +1,165 @@
 #include <asm/io.h>
+#include <asm/interrupt.h>
 #include <kernel/kernel.h>
 #include <kernel/console.h>
+#include <kernel/paging.h>
 
 #define INDEX_REG 0x3d4
 #define DATA_REG 0x3d5
 
-#define POS_HIGH_INDEX 0xf
-#define POS_LOW_INDEX 0xe
 #define START_SCAN_INDEX 0xa
 #define END_SCAN_INDEX 0xb
-
-static char *text_mem = (char*) 0xff000;
-
-struct {
-	char buf[CONSOLE_HEIGHT*CONSOLE_WIDTH*2];
+#define START_HIGH_INDEX 0xc
+#define START_LOW_INDEX 0xd
+#define POS_HIGH_INDEX 0xe
+#define POS_LOW_INDEX 0xf
+
+/* The whole 32 KiB text window at 0xb8000, reached through the direct map.
+   The visible screen is a 25 row window into it, selected by the CRTC start
+   address, so scrolling only needs to move that window down a row. */
+static uint16_t *text_mem = (uint16_t*) phys_to_virt(0xb8000);
+
+#define VGA_ROWS (VGA_TEXT_SIZE / (2*CONSOLE_WIDTH))
+#define ALL_ROWS ((1 << CONSOLE_HEIGHT) - 1)
+
+/*
+ * Shadow copy of a virtual screen. Rows are kept in a ring starting at top, so
+ * a linefeed only has to clear one row. Writes land here, and the rows touched
+ * since the last console_flush() are recorded in dirty (bit n = visible row n).
+ */
+struct screen {
+	uint16_t buf[CONSOLE_HEIGHT*CONSOLE_WIDTH];
+	int top;
 	char color;
 	int pos;
+	uint32_t dirty;
+	int scrolled;
 } screens[NUM_SCREENS];
 static int cur_screen;
 
+/* VGA row at the top of the display, and last cursor location programmed */
+static int origin;
+static int cursor = -1;
+
+/* Set while a flush is in progress. Flushes copy a row at a time with
+   interrupts enabled in between, and anyone flushing meanwhile leaves the rows
+   they dirtied to the flush already running. */
+static bool flushing;
+
+/* Display origin that the rows copied so far were placed for */
+static int target;
+
+static inline uint16_t *screen_row(struct screen *scr, int row)
+{
+	return scr->buf + ((scr->top + row) % CONSOLE_HEIGHT) * CONSOLE_WIDTH;
+}
+
+static void crtc_write16(uint8_t high_index, uint16_t val)
+{
+	outb(INDEX_REG, high_index, false);
+	outb(DATA_REG, (val >> 8) & 0xff, false);
+	outb(INDEX_REG, high_index + 1, false);
+	outb(DATA_REG, val & 0xff, false);
+}
+
 static void update_cursor()
 {
-	outb(INDEX_REG, POS_HIGH_INDEX, false);
-	outb(DATA_REG, screens[cur_screen].pos & 0xff, false);
-	outb(INDEX_REG, POS_LOW_INDEX, false);
-	outb(DATA_REG, (screens[cur_screen].pos >> 8) & 0xff, false);
+	int pos = origin * CONSOLE_WIDTH + screens[cur_screen].pos;
+
+	if (pos == cursor)
+		return;
+	crtc_write16(POS_HIGH_INDEX, pos);
+	cursor = pos;
+}
+
+/*
+ * Brings VGA memory up to date with the current screen's shadow buffer. Lines
+ * scrolled since the last flush advance the display origin instead of being
+ * copied, and only rows written to are transferred. When the origin reaches
+ * the end of VGA memory it wraps back to the top with a full redraw.
+ *
+ * Interrupts are only disabled while copying each row, so a full redraw
+ * doesn't hold them off. Rows already copied stay valid if more lines scroll
+ * in meanwhile, since they keep their place in VGA memory relative to the new
+ * origin.
+ */
+void console_flush()
+{
+	uint32_t flags = irq_save();
+	struct screen *scr;
+	int row;
+
+	if (flushing) {
+		irq_restore(flags);
+		return;
+	}
+	flushing = true;
+
+	for (;;) {
+		scr = &screens[cur_screen];
+		if (scr->scrolled) {
+			target += scr->scrolled;
+			if (target + CONSOLE_HEIGHT > VGA_ROWS) {
+				target = 0;
+				scr->dirty = ALL_ROWS;
+			}
+			scr->scrolled = 0;
+		}
+		if (!scr->dirty)
+			break;
+
+		row = __builtin_ctz(scr->dirty);
+		scr->dirty &= ~(1 << row);
+		memcpy(text_mem + (target + row) * CONSOLE_WIDTH,
+		       screen_row(scr, row), 2*CONSOLE_WIDTH);
+
+		irq_restore(flags);
+		flags = irq_save();
+	}
+
+	if (target != origin) {
+		origin = target;
+		crtc_write16(START_HIGH_INDEX, origin * CONSOLE_WIDTH);
+	}
+	update_cursor();
+	flushing = false;
+	irq_restore(flags);
 }
 
 void switch_screen(int s)
 {
+	uint32_t flags;
+
 	if (s >= NUM_SCREENS)
 		return;
-	
-	for (int i = 0; i < CONSOLE_HEIGHT*CONSOLE_WIDTH*2; i++)
-		text_mem[i] = screens[s].buf[i];
+
+	flags = irq_save();
 	cur_screen = s;
-	update_cursor();
+	screens[s].dirty = ALL_ROWS;
+	screens[s].scrolled = 0;
+	irq_restore(flags);
+	console_flush();
 }
 
 void console_clear(int s)
 {
-	for (int i = 0; i < 2 * CONSOLE_WIDTH * CONSOLE_HEIGHT; i += 2) {
-		screens[s].buf[i] = '\0';
-		screens[s].buf[i+1] = DEFAULT_COLOR;
-	}
+	for (int i = 0; i < CONSOLE_WIDTH * CONSOLE_HEIGHT; i++)
+		screens[s].buf[i] = DEFAULT_COLOR << 8;
 	screens[s].color = DEFAULT_COLOR;
+	screens[s].top = 0;
 	screens[s].pos = 0;
+	screens[s].dirty = ALL_ROWS;
+	screens[s].scrolled = 0;
 }
 
 void console_init()
 {
 	for (int s = 0; s < NUM_SCREENS; s++)
 		console_clear(s);
+
+	origin = 0;
+	target = 0;
+	crtc_write16(START_HIGH_INDEX, 0);
 	switch_screen(0);
 
 	outb(INDEX_REG, START_SCAN_INDEX, false);
@@ -62,47 +170,40 @@ void console_init()
 
 static void linefeed(int s)
 {
-	int line, i, bottom;
-	char *dst, *src;
-
-	for (line = 1; line < CONSOLE_HEIGHT; line++) {
-		dst = screens[s].buf + (line-1) * 2*CONSOLE_WIDTH;
-		src = screens[s].buf + line * 2*CONSOLE_WIDTH;
-		memcpy(dst, src, 2*CONSOLE_WIDTH);
-
-		if (s == cur_screen) {
-			dst = text_mem + (line-1) * 2*CONSOLE_WIDTH;
-			src = text_mem + line * 2*CONSOLE_WIDTH;
-			memcpy(dst, src, 2*CONSOLE_WIDTH);
-		}
-	}
+	struct screen *scr = &screens[s];
+	uint16_t *bottom;
+	int i;
 
-	bottom = (CONSOLE_HEIGHT - 1) * CONSOLE_WIDTH;
-	for (i = 0; i < CONSOLE_WIDTH; i++) {
-		screens[s].buf[2*(bottom+i)] = '\0';
-		if (s == cur_screen)
-			text_mem[2*(bottom+i)] = '\0';
-	}
+	scr->top = (scr->top + 1) % CONSOLE_HEIGHT;
+	bottom = screen_row(scr, CONSOLE_HEIGHT - 1);
+	for (i = 0; i < CONSOLE_WIDTH; i++)
+		bottom[i] = scr->color << 8;
+
+	scr->dirty = (scr->dirty >> 1) | (1 << (CONSOLE_HEIGHT - 1));
+	scr->scrolled++;
 }
 
-static int write_screen(int s, char c)
+static void write_screen(int s, char c)
 {
-	int pos = 2 * screens[s].pos;
-	screens[s].buf[pos] = c;
-	screens[s].buf[pos+1] = screens[cur_screen].color;
-	if (s == cur_screen) {
-		text_mem[pos] = c;
-		text_mem[pos+1] = screens[cur_screen].color;
-	}
+	struct screen *scr = &screens[s];
+	int row = scr->pos / CONSOLE_WIDTH;
+
+	screen_row(scr, row)[scr->pos % CONSOLE_WIDTH] =
+		(uint8_t) c | (scr->color << 8);
+	scr->dirty |= 1 << row;
 }
 
+/*
+ * Writes a character to the shadow buffer of screen s. Nothing reaches VGA
+ * memory or the cursor until console_flush() is called.
+ */
 void put_char(int s, char c)
 {
 	int i;
 
 	if (!c)
 		return;
-    
+
 	switch (c) {
 	case '\n':
 		do {
@@ -110,7 +211,8 @@ void put_char(int s, char c)
 		} while (screens[s].pos % CONSOLE_WIDTH);
 		break;
 	case '\b':
-		screens[s].pos--;
+		if (screens[s].pos > 0)
+			screens[s].pos--;
 		break;
 	case '\t':
 		for (i = 0; i < CONSOLE_TABSTOP; i++)
@@ -125,8 +227,19 @@ void put_char(int s, char c)
 		screens[s].pos = CONSOLE_WIDTH * (CONSOLE_HEIGHT - 1);
 		linefeed(s);
 	}
-	if (s == cur_screen)
-		update_cursor();
+}
+
+/*
+ * Writes a buffer to the first screen and flushes it to VGA memory.
+ */
+void console_write(char *buf, int len)
+{
+	uint32_t flags = irq_save();
+
+	while (len--)
+		put_char(0, *(buf++));
+	irq_restore(flags);
+	console_flush();
 }
 
 void putc(char c)
@@ -0,0 +1,49 @@
+#include <asm/io.h>
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/dma.h>
+
+/*
+ * Programming of the 8-bit channels 0-3 of the 8237 ISA DMA controller, which
+ * the floppy controller still needs.
+ */
+
+#define DMA_MASK 0x0a
+#define DMA_MODE 0x0b
+#define DMA_FLIP_FLOP 0x0c
+
+#define DMA_MASK_ON 0x04
+
+/* Address, count and page register of each channel */
+static const uint8_t dma_addr_port[] = { 0x00, 0x02, 0x04, 0x06 };
+static const uint8_t dma_count_port[] = { 0x01, 0x03, 0x05, 0x07 };
+static const uint8_t dma_page_port[] = { 0x87, 0x83, 0x81, 0x82 };
+
+/*
+ * Sets up channel chan for a transfer of len bytes to or from paddr, which
+ * starts once the device asks for it. Returns -EINVAL if the buffer is out of
+ * the controller's reach.
+ */
+int isa_dma_setup(int chan, uint32_t paddr, uint32_t len, uint8_t mode)
+{
+        uint32_t flags;
+
+        if (chan < 0 || chan > 3 || !len || paddr + len > DMA_LIMIT
+            || paddr / DMA_BOUNDARY != (paddr + len - 1) / DMA_BOUNDARY)
+                return -EINVAL;
+
+        flags = irq_save();
+        outb(DMA_MASK, DMA_MASK_ON | chan, false);
+        outb(DMA_FLIP_FLOP, 0, false);
+        outb(dma_addr_port[chan], paddr & 0xff, false);
+        outb(dma_addr_port[chan], (paddr >> 8) & 0xff, false);
+        outb(dma_page_port[chan], (paddr >> 16) & 0xff, false);
+        outb(DMA_FLIP_FLOP, 0, false);
+        outb(dma_count_port[chan], (len - 1) & 0xff, false);
+        outb(dma_count_port[chan], ((len - 1) >> 8) & 0xff, false);
+        outb(DMA_MODE, mode | chan, false);
+        outb(DMA_MASK, chan, false);
+        irq_restore(flags);
+        return 0;
+}
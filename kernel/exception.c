@@ -1,142 +1,117 @@
 #include <kernel/kernel.h>
 #include <kernel/sched.h>
+#include <kernel/irqstat.h>
 #include <asm/interrupt.h>
-
-extern void handle_timer();
-extern void handle_keyboard();
+#include <asm/tsc.h>
 
 extern void handle_syscall(struct exception *e);
 
-/* Array of IRQ handlers for drivers. */
-static void (*irq_handlers[16])() = {
-	handle_timer,
-	handle_keyboard,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL
-};
-
 static void dump_exception(struct exception *e)
 {
-	kprintf("\nException %d (%x):\n", e->eno, e->err);
-	kprintf("    EIP %x  PID %d\n", e->eip, current->pid);
-	kprintf("    EAX %x  EBX %x  ECX %x  EDX %x\n",
+	kprintf("\nException %d (%08x):\n", e->eno, e->err);
+	kprintf("    EIP %08x  PID %d\n", e->eip, current->pid);
+	kprintf("    EAX %08x  EBX %08x  ECX %08x  EDX %08x\n",
 	        e->eax, e->ebx, e->ecx, e->edx);
-	kprintf("    ESI %x  EDI %x  EBP %x  ESP %x\n",
+	kprintf("    ESI %08x  EDI %08x  EBP %08x  ESP %08x\n",
 	        e->esi, e->edi, e->ebp, e->esp);
-	kprintf("    EFL %x  CR0 %x  CR2 %x  CR3 %x\n",
+	kprintf("    EFL %08x  CR0 %08x  CR2 %08x  CR3 %08x\n",
 	        e->eflags, e->cr0, e->cr2, e->cr3);
 }
 
-/* Main exception handler, which both catches processor exceptions and redirects
-   interrupt requests to ISRs installed by drivers. */
-void handle_exception(struct exception e)
+static void handle_fault(struct exception *e)
 {
-	/* Handle system call */
-	if (e.eno == INUM_SYSCALL) {
-		handle_syscall(&e);
-		return;
-	}
-
-	/* Call appropriate driver ISR (if installed) for IRQs */
-	if (e.eno >= INUM_IRQ0 && e.eno <= INUM_IRQ15) {
-		if (irq_handlers[e.eno-INUM_IRQ0])
-			irq_handlers[e.eno-INUM_IRQ0]();
-		return;
-	}
-	
-	/* Handle processor exceptions */
-	switch (e.eno) {
+	switch (e->eno) {
 	case INUM_DIVISION_BY_ZERO:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("divide by zero exception");
 		}
 		else {
-			current->state = TASK_NONE;
 			kprintf("Divide by zero error: killed %d\n", current->pid);
-			schedule();
-			break;
+			do_exit(EXIT_FAULT(e->eno));
 		}
 
 	case INUM_BREAKPOINT:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("breakpoint exception");
 		}
 
 	case INUM_OUT_OF_BOUNDS:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("out of bounds exception");
 		}
 		else {
-			current->state = TASK_NONE;
 			kprintf("Bounds error: killed %d\n", current->pid);
-			schedule();
-			break;
+			do_exit(EXIT_FAULT(e->eno));
 		}
 
 	case INUM_INVALID_OPCODE:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("invalid opcode exception");
 		}
 		else {
-			current->state = TASK_NONE;
 			kprintf("Invalid opcode: killed %d\n", current->pid);
-			schedule();
-			break;
+			do_exit(EXIT_FAULT(e->eno));
 		}
 
 	case INUM_DOUBLE_FAULT:
-		dump_exception(&e);
+		dump_exception(e);
 		kpanic("double fault exception");
 
 	case INUM_STACK_FAULT:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("stack fault exception");
 		}
 
 	case INUM_GENERAL_PROTECTION_FAULT:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("general protection fault");
 		}
 		else {
-			current->state = TASK_NONE;
 			kprintf("General protection fault: killed %d\n", current->pid);
-			schedule();
-			break;
+			do_exit(EXIT_FAULT(e->eno));
 		}
 
 	case INUM_PAGE_FAULT:
-		if (kernel_exception(e)) {
-			dump_exception(&e);
+		if (kernel_exception(*e)) {
+			dump_exception(e);
 			kpanic("unexpected page fault");
 		}
 		else {
 			/* To be potentially replaced by swapping someday... */
-			current->state = TASK_NONE;
 			kprintf("Page fault: killed %d\n", current->pid);
-			schedule();
-			break;
+			do_exit(EXIT_FAULT(e->eno));
 		}
 
 	default:
-		dump_exception(&e);
+		dump_exception(e);
 		kpanic("unhandled exception");
 	}
 }
+
+/* Main exception handler, which catches processor exceptions and system calls.
+   Hardware interrupts take a separate path through handle_irq. */
+void handle_exception(struct exception *e)
+{
+	uint32_t switches = percpu_read(nr_switches);
+	uint64_t start = rdtsc();
+
+	if (e->eflags & EFLAGS_IF)
+		irqsoff_begin(IRQ_SITE);
+
+	if (e->eno == INUM_SYSCALL)
+		handle_syscall(e);
+	else
+		handle_fault(e);
+
+	irqstat_account(e->eno, rdtsc() - start,
+			switches != percpu_read(nr_switches));
+	preempt_schedule_irq();
+	if (e->eflags & EFLAGS_IF)
+		irqsoff_end(IRQ_SITE);
+}
@@ -0,0 +1,577 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/buffer.h>
+#include <kernel/fat.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+
+/*
+ * Read-only FAT12 and FAT16, on any block device through the buffer cache.
+ * Metadata is read from the disk as little as possible: the FAT is decoded
+ * into memory at mount time, open files keep their cluster chain as extents,
+ * and the results of name lookups, including failed ones, are kept in a
+ * dentry cache, so opening a path already seen costs no directory reads at
+ * all. Only short 8.3 names are supported; long name entries are skipped.
+ */
+
+#define FAT12_MAX_CLUSTERS 4085
+#define FAT16_MAX_CLUSTERS 65525
+
+/* In-memory FAT values for the end of a chain and bad clusters, which both
+   end it. Free clusters are 0. */
+#define FAT_EOC 0xffff
+#define FAT_BAD 0xfff7
+
+#define DIRENT_END 0x00
+#define DIRENT_DELETED 0xe5
+
+#define BPB_SIGNATURE 0x29
+
+/* BIOS parameter block, in the first sector of the volume */
+struct fat_bpb {
+        uint8_t jump[3];
+        char oem[8];
+        uint16_t sector_size;
+        uint8_t cluster_sectors;
+        uint16_t reserved_sectors;
+        uint8_t nfats;
+        uint16_t root_entries;
+        uint16_t total_sectors16;
+        uint8_t media;
+        uint16_t fat_sectors;
+        uint16_t track_sectors;
+        uint16_t heads;
+        uint32_t hidden_sectors;
+        uint32_t total_sectors32;
+        uint8_t drive;
+        uint8_t reserved;
+        uint8_t signature;
+        uint32_t serial;
+        char label[FAT_NAME_LEN];
+        char fs_type[8];
+} __attribute__((packed));
+
+struct fat_raw_dirent {
+        char name[FAT_NAME_LEN];
+        uint8_t attr;
+        uint8_t reserved[10];
+        uint16_t time;
+        uint16_t date;
+        uint16_t cluster;
+        uint32_t size;
+} __attribute__((packed));
+
+/*
+ * A cached lookup of a name in a directory, identified by its first cluster
+ * or 0 for the root. Negative entries record that the name isn't there.
+ */
+struct dentry {
+        struct fat_fs *fs;
+        uint32_t parent;
+        char name[FAT_NAME_LEN];
+        bool negative;
+        uint32_t cluster;
+        uint32_t size;
+        uint8_t attr;
+        struct dentry *hash_next;
+};
+
+/* Entries are replaced round robin once the cache is full */
+static struct dentry dcache[DCACHE_SIZE];
+static struct dentry *dcache_hash[DCACHE_HASH_SIZE];
+static int dcache_next;
+static spinlock_t dcache_lock = SPINLOCK_INIT;
+
+static inline uint32_t fat_next(struct fat_fs *fs, uint32_t cluster)
+{
+        return fs->fat[cluster / FAT_PAGE_ENTRIES][cluster % FAT_PAGE_ENTRIES];
+}
+
+static inline bool valid_cluster(struct fat_fs *fs, uint32_t cluster)
+{
+        return cluster >= 2 && cluster < fs->nclusters + 2;
+}
+
+static inline uint32_t cluster_sector(struct fat_fs *fs, uint32_t cluster)
+{
+        return fs->data_start + (cluster - 2) * fs->cluster_sectors;
+}
+
+/*
+ * Returns the byte at offset into the on-disk FAT, keeping the sector it's in
+ * held in *b for the next call. Returns -EIO if it can't be read.
+ */
+static int fat_byte(struct fat_fs *fs, uint32_t offset, struct buffer **b)
+{
+        uint32_t sector = fs->fat_start + offset / SECTOR_SIZE;
+
+        if (!*b || (*b)->block != sector) {
+                if (*b)
+                        brelse(*b);
+                *b = bread(fs->dev, sector);
+                if (!*b)
+                        return -EIO;
+        }
+        return (*b)->data[offset % SECTOR_SIZE];
+}
+
+/* Decodes the first FAT into memory, widening FAT12 entries to 16 bits */
+static int fat_load(struct fat_fs *fs)
+{
+        uint32_t entries = fs->nclusters + 2, val, offset, paddr;
+        struct buffer *b = NULL;
+        int lo, hi, ret = 0;
+
+        for (uint32_t i = 0; i < entries; i += FAT_PAGE_ENTRIES) {
+                paddr = pmm_alloc();
+                if (!paddr)
+                        return -ENOMEM;
+                fs->fat[i / FAT_PAGE_ENTRIES] = phys_to_virt(paddr);
+        }
+
+        for (uint32_t c = 0; c < entries; c++) {
+                offset = fs->bits == 12 ? c + c / 2 : 2 * c;
+                lo = fat_byte(fs, offset, &b);
+                hi = lo < 0 ? lo : fat_byte(fs, offset + 1, &b);
+                if (hi < 0) {
+                        ret = hi;
+                        break;
+                }
+                val = lo | hi << 8;
+                if (fs->bits == 12) {
+                        val = c & 1 ? val >> 4 : val & 0xfff;
+                        if (val >= 0xff8)
+                                val = FAT_EOC;
+                        else if (val == 0xff7)
+                                val = FAT_BAD;
+                }
+                else if (val >= 0xfff8) {
+                        val = FAT_EOC;
+                }
+                fs->fat[c / FAT_PAGE_ENTRIES][c % FAT_PAGE_ENTRIES] = val;
+        }
+        if (b)
+                brelse(b);
+        return ret;
+}
+
+static void fat_free_pages(struct fat_fs *fs)
+{
+        for (int i = 0; i < FAT_MAX_PAGES; i++) {
+                if (fs->fat[i])
+                        pmm_free(virt_to_phys(fs->fat[i]));
+                fs->fat[i] = NULL;
+        }
+}
+
+/*
+ * Mounts the FAT12 or FAT16 volume on dev. Returns -EINVAL if it doesn't hold
+ * one, -EIO if it can't be read, or -ENOMEM.
+ */
+int fat_mount(struct fat_fs *fs, struct blkdev *dev)
+{
+        struct buffer *b = bread(dev, 0);
+        struct fat_bpb *bpb;
+        uint32_t total, root_sectors, nfats, fat_sectors;
+        int ret;
+
+        if (!b)
+                return -EIO;
+        bpb = (struct fat_bpb*) b->data;
+        total = bpb->total_sectors16 ? bpb->total_sectors16
+                                     : bpb->total_sectors32;
+        nfats = bpb->nfats;
+        fat_sectors = bpb->fat_sectors;
+        root_sectors = (bpb->root_entries * sizeof(struct fat_raw_dirent)
+                        + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+        memset(fs, 0, sizeof(*fs));
+        fs->dev = dev;
+        fs->cluster_sectors = bpb->cluster_sectors;
+        fs->fat_start = bpb->reserved_sectors;
+        fs->root_start = fs->fat_start + nfats * fat_sectors;
+        fs->root_entries = bpb->root_entries;
+        fs->data_start = fs->root_start + root_sectors;
+        memcpy(fs->label, bpb->signature == BPB_SIGNATURE ? bpb->label
+                                                          : "NO NAME    ",
+               FAT_NAME_LEN);
+        ret = bpb->sector_size == SECTOR_SIZE && fs->cluster_sectors
+              && !(fs->cluster_sectors & (fs->cluster_sectors - 1))
+              && fs->fat_start && nfats && fat_sectors && fs->root_entries
+              && total > fs->data_start && total <= dev->sectors;
+        brelse(b);
+        if (!ret)
+                return -EINVAL;
+
+        fs->cluster_size = fs->cluster_sectors * SECTOR_SIZE;
+        fs->nclusters = (total - fs->data_start) / fs->cluster_sectors;
+        if (fs->nclusters < FAT12_MAX_CLUSTERS)
+                fs->bits = 12;
+        else if (fs->nclusters < FAT16_MAX_CLUSTERS)
+                fs->bits = 16;
+        else
+                return -EINVAL;
+        if ((fs->nclusters + 2) * fs->bits / 8 > fat_sectors * SECTOR_SIZE)
+                return -EINVAL;
+
+        ret = fat_load(fs);
+        if (ret) {
+                fat_free_pages(fs);
+                return ret;
+        }
+        kprintf("fat: %s, FAT%d \"%s\", %u clusters of %u bytes\n",
+                dev->name, fs->bits, fs->label, fs->nclusters,
+                fs->cluster_size);
+        return 0;
+}
+
+/* Drops a volume's cached lookups and frees its FAT. Open files go stale. */
+void fat_unmount(struct fat_fs *fs)
+{
+        struct dentry **p;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&dcache_lock);
+        for (int i = 0; i < DCACHE_HASH_SIZE; i++) {
+                for (p = &dcache_hash[i]; *p;) {
+                        if ((*p)->fs == fs) {
+                                (*p)->fs = NULL;
+                                *p = (*p)->hash_next;
+                        }
+                        else {
+                                p = &(*p)->hash_next;
+                        }
+                }
+        }
+        spin_unlock_irqrestore(&dcache_lock, flags);
+        fat_free_pages(fs);
+}
+
+static uint32_t dcache_hashfn(struct fat_fs *fs, uint32_t parent, char *name)
+{
+        uint32_t h = (size_t) fs ^ parent * 31;
+
+        for (int i = 0; i < FAT_NAME_LEN; i++)
+                h = h * 31 + (uint8_t) name[i];
+        return h % DCACHE_HASH_SIZE;
+}
+
+static bool dcache_lookup(struct fat_fs *fs, uint32_t parent, char *name,
+                          struct dentry *out)
+{
+        struct dentry *d;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&dcache_lock);
+        d = dcache_hash[dcache_hashfn(fs, parent, name)];
+        for (; d; d = d->hash_next) {
+                if (d->fs == fs && d->parent == parent
+                    && !memcmp(d->name, name, FAT_NAME_LEN)) {
+                        *out = *d;
+                        break;
+                }
+        }
+        spin_unlock_irqrestore(&dcache_lock, flags);
+        return d != NULL;
+}
+
+static void dcache_insert(struct dentry *entry)
+{
+        struct dentry *d, **p;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&dcache_lock);
+        d = &dcache[dcache_next];
+        dcache_next = (dcache_next + 1) % DCACHE_SIZE;
+        if (d->fs) {
+                p = &dcache_hash[dcache_hashfn(d->fs, d->parent, d->name)];
+                for (; *p != d; p = &(*p)->hash_next);
+                *p = d->hash_next;
+        }
+        *d = *entry;
+        p = &dcache_hash[dcache_hashfn(d->fs, d->parent, d->name)];
+        d->hash_next = *p;
+        *p = d;
+        spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+/*
+ * Caches a file's cluster chain as extents, and sizes directories, whose
+ * entries don't record one, by the length of their chain.
+ */
+static void build_extents(struct fat_file *f)
+{
+        struct fat_fs *fs = f->fs;
+        struct fat_extent *e = NULL;
+        uint32_t c = f->cluster, n = 0;
+
+        f->nextents = 0;
+        for (; valid_cluster(fs, c) && n <= fs->nclusters; n++) {
+                if (e && c == e->cluster + e->count) {
+                        e->count++;
+                }
+                else if (f->nextents < FAT_MAX_EXTENTS) {
+                        e = &f->extents[f->nextents++];
+                        e->index = n;
+                        e->cluster = c;
+                        e->count = 1;
+                }
+                else if (!(f->attr & FAT_ATTR_DIR)) {
+                        break;
+                }
+                else {
+                        /* Past the last extent, only counting */
+                        e = NULL;
+                }
+                c = fat_next(fs, c);
+        }
+        if (f->attr & FAT_ATTR_DIR)
+                f->size = n * fs->cluster_size;
+}
+
+/* Returns the index-th cluster of a file, or 0 if its chain is shorter */
+static uint32_t file_cluster(struct fat_file *f, uint32_t index)
+{
+        struct fat_extent *e;
+        uint32_t c;
+
+        for (int i = 0; i < f->nextents; i++) {
+                e = &f->extents[i];
+                if (index >= e->index && index < e->index + e->count)
+                        return e->cluster + index - e->index;
+        }
+        if (f->nextents < FAT_MAX_EXTENTS)
+                return 0;
+
+        /* More fragmented than the extents cover */
+        e = &f->extents[FAT_MAX_EXTENTS - 1];
+        c = e->cluster + e->count - 1;
+        for (uint32_t i = e->index + e->count - 1; i < index; i++) {
+                c = fat_next(f->fs, c);
+                if (!valid_cluster(f->fs, c))
+                        return 0;
+        }
+        return c;
+}
+
+/* Reads from the current position, which must be within the file */
+static int file_read(struct fat_file *f, void *buf, uint32_t len)
+{
+        struct fat_fs *fs = f->fs;
+        uint32_t done = 0, sector, offset, chunk, cluster;
+        struct buffer *b;
+
+        if (f->pos >= f->size)
+                return 0;
+        if (len > f->size - f->pos)
+                len = f->size - f->pos;
+
+        while (done < len) {
+                if (f->root) {
+                        sector = fs->root_start + f->pos / SECTOR_SIZE;
+                }
+                else {
+                        cluster = file_cluster(f, f->pos / fs->cluster_size);
+                        if (!cluster)
+                                break;
+                        sector = cluster_sector(fs, cluster)
+                                 + f->pos % fs->cluster_size / SECTOR_SIZE;
+                }
+                b = bread(fs->dev, sector);
+                if (!b)
+                        break;
+                offset = f->pos % SECTOR_SIZE;
+                chunk = SECTOR_SIZE - offset;
+                if (chunk > len - done)
+                        chunk = len - done;
+                memcpy((uint8_t*) buf + done, b->data + offset, chunk);
+                brelse(b);
+                done += chunk;
+                f->pos += chunk;
+        }
+        return done || !len ? (int) done : -EIO;
+}
+
+/* Reads the next live short name entry of a directory, returning 0 at the
+   end */
+static int next_dirent(struct fat_file *dir, struct fat_raw_dirent *raw)
+{
+        int ret;
+
+        for (;;) {
+                ret = file_read(dir, raw, sizeof(*raw));
+                if (ret <= 0)
+                        return ret;
+                if ((uint8_t) raw->name[0] == DIRENT_END) {
+                        dir->pos = dir->size;
+                        return 0;
+                }
+                if ((uint8_t) raw->name[0] == DIRENT_DELETED
+                    || (raw->attr & FAT_ATTR_LFN) == FAT_ATTR_LFN
+                    || (raw->attr & FAT_ATTR_VOLUME))
+                        continue;
+                return 1;
+        }
+}
+
+static void open_entry(struct fat_file *f, struct fat_fs *fs, uint32_t cluster,
+                       uint32_t size, uint8_t attr)
+{
+        f->fs = fs;
+        f->cluster = cluster;
+        f->size = size;
+        f->attr = attr;
+        f->pos = 0;
+
+        /* ".." of a top level directory points at the root as cluster 0 */
+        f->root = (attr & FAT_ATTR_DIR) && !cluster;
+        if (f->root) {
+                f->size = fs->root_entries * sizeof(struct fat_raw_dirent);
+                f->nextents = 0;
+        }
+        else {
+                build_extents(f);
+        }
+}
+
+/*
+ * Looks a name up in a directory, from the dentry cache if it's been looked
+ * up before, or by scanning the directory, whose answer is then cached.
+ */
+static int lookup(struct fat_file *dir, char *name, struct dentry *d)
+{
+        struct fat_raw_dirent raw;
+        uint32_t parent = dir->root ? 0 : dir->cluster;
+        int ret;
+
+        if (dcache_lookup(dir->fs, parent, name, d))
+                return d->negative ? -ENOENT : 0;
+
+        dir->pos = 0;
+        while ((ret = next_dirent(dir, &raw)) > 0) {
+                if (!memcmp(raw.name, name, FAT_NAME_LEN))
+                        break;
+        }
+        if (ret < 0)
+                return ret;
+
+        d->fs = dir->fs;
+        d->parent = parent;
+        memcpy(d->name, name, FAT_NAME_LEN);
+        d->negative = !ret;
+        d->cluster = raw.cluster;
+        d->size = raw.size;
+        d->attr = raw.attr;
+        dcache_insert(d);
+        return d->negative ? -ENOENT : 0;
+}
+
+/*
+ * Converts a path component of len characters to its space padded short name,
+ * returning false if it can't be one.
+ */
+static bool short_name(char *s, int len, char *name)
+{
+        int i = 0, n = 0;
+
+        memset(name, ' ', FAT_NAME_LEN);
+        if ((len == 1 || len == 2) && s[0] == '.' && s[len - 1] == '.') {
+                memcpy(name, s, len);
+                return true;
+        }
+        for (; i < len && s[i] != '.'; i++, n++) {
+                if (n == 8)
+                        return false;
+                name[n] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - 'a' + 'A' : s[i];
+        }
+        if (!n)
+                return false;
+        if (i < len)
+                i++;
+        for (n = 8; i < len; i++, n++) {
+                if (n == FAT_NAME_LEN || s[i] == '.')
+                        return false;
+                name[n] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - 'a' + 'A' : s[i];
+        }
+        return true;
+}
+
+/*
+ * Opens the file or directory at a path from the root, like
+ * /boot/grub/menu.lst.
+ * Returns -ENOENT if there's no such thing, or -EIO.
+ */
+int fat_open(struct fat_fs *fs, char *path, struct fat_file *file)
+{
+        char name[FAT_NAME_LEN];
+        struct dentry d;
+        int len, ret;
+
+        open_entry(file, fs, 0, 0, FAT_ATTR_DIR);
+        for (;;) {
+                while (*path == '/')
+                        path++;
+                if (!*path)
+                        break;
+                for (len = 0; path[len] && path[len] != '/'; len++);
+                if (!(file->attr & FAT_ATTR_DIR))
+                        return -ENOENT;
+                if (!short_name(path, len, name))
+                        return -ENOENT;
+
+                ret = lookup(file, name, &d);
+                if (ret)
+                        return ret;
+                open_entry(file, fs, d.cluster, d.size, d.attr);
+                path += len;
+        }
+        file->pos = 0;
+        return 0;
+}
+
+/*
+ * Reads up to len bytes of a file from its position. Returns the number read,
+ * 0 at the end of the file, -EINVAL on a directory, or -EIO.
+ */
+int fat_read(struct fat_file *file, void *buf, uint32_t len)
+{
+        if (file->attr & FAT_ATTR_DIR)
+                return -EINVAL;
+        return file_read(file, buf, len);
+}
+
+int fat_seek(struct fat_file *file, uint32_t pos)
+{
+        if (pos > file->size)
+                return -EINVAL;
+        file->pos = pos;
+        return 0;
+}
+
+/*
+ * Reads the next entry of a directory, returning 1, or 0 at the end, or a
+ * negative error.
+ */
+int fat_readdir(struct fat_file *dir, struct fat_dirent *ent)
+{
+        struct fat_raw_dirent raw;
+        int ret, n = 0;
+
+        if (!(dir->attr & FAT_ATTR_DIR))
+                return -EINVAL;
+        ret = next_dirent(dir, &raw);
+        if (ret <= 0)
+                return ret;
+
+        for (int i = 0; i < 8 && raw.name[i] != ' '; i++)
+                ent->name[n++] = raw.name[i];
+        if (raw.name[8] != ' ')
+                ent->name[n++] = '.';
+        for (int i = 8; i < FAT_NAME_LEN && raw.name[i] != ' '; i++)
+                ent->name[n++] = raw.name[i];
+        ent->name[n] = '\0';
+        ent->attr = raw.attr;
+        ent->size = raw.attr & FAT_ATTR_DIR ? 0 : raw.size;
+        return 1;
+}
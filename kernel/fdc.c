@@ -1,9 +1,23 @@
-#include "io.h"
-#include "idt.h"
-#include "timer.h"
-#include "console.h"
+#include <asm/io.h>
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/blkdev.h>
+#include <kernel/dma.h>
+#include <kernel/fdc.h>
+#include <kernel/irq.h>
+#include <kernel/paging.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
 
-#include "fdc.h"
+/*
+ * Driver for the first drive on the floppy controller, which must be a 1.44 MB
+ * 3.5" drive. Data moves by ISA DMA a whole cylinder (both tracks) at a time,
+ * into a buffer which then caches that cylinder, so reading a run of sectors
+ * costs one command per cylinder rather than one per sector. Commands complete
+ * on IRQ 6, with the requesting task asleep meanwhile. The motor is left
+ * running between requests until it has been idle for FDC_MOTOR_IDLE.
+ */
 
 /* Floppy controller I/O ports */
 enum {
@@ -49,167 +63,449 @@ enum {
         FDC_CMD_CALIBRATE = 7,
         FDC_CMD_SENSE_INTERRUPT = 8,
         FDC_CMD_FORMAT_TRACK = 13,
-        FDC_CMD_SEEK = 15
+        FDC_CMD_SEEK = 15,
+        FDC_CMD_CONFIGURE = 19
 };
 
-static uint8_t wait_done = 0;
+/* Command option bits */
+#define FDC_CMD_MT 0x80  /* multitrack, continue onto the other head */
+#define FDC_CMD_MFM 0x40 /* double density */
 
-void fdc_irq(struct exception *e)
+#define FDC_IRQ 6
+#define FDC_DMA_CHANNEL 2
+
+/* CMOS register holding the floppy drive types, drive 0 in the high nibble */
+#define CMOS_ADDR 0x70
+#define CMOS_DATA 0x71
+#define CMOS_FLOPPY_TYPES 0x10
+#define CMOS_FLOPPY_1440K 4
+
+#define CYLINDER_SECTORS (FDC_SECTORS * FDC_HEADS)
+#define CYLINDER_SIZE (CYLINDER_SECTORS * FDC_SECTOR_SIZE)
+
+/* Timings, in milliseconds and jiffies */
+#define FDC_SPINUP_MS 300
+#define FDC_MOTOR_IDLE (2 * HZ)
+#define FDC_TIMEOUT (HZ / 2)
+
+#define FDC_RETRIES 3
+
+/* Polls of the MSR before giving up on the controller taking a command byte */
+#define FDC_POLLS 100000
+
+/* DMA buffer for one cylinder. Being aligned to its size rounded up to a
+   power of two keeps it from crossing a 64 KiB boundary, and as part of the
+   kernel image it's well within the first 16 MiB. */
+static uint8_t dma_buf[CYLINDER_SIZE] __attribute__((aligned(32768)));
+
+/* Cylinder held in dma_buf, or -1 */
+static int cached_cyl = -1;
+
+static bool present;
+static bool motor_running;
+static struct timer motor_timer;
+
+/* Completion of the command in progress, signalled by IRQ 6 or the timeout */
+static wait_queue_t irq_wait;
+static volatile bool irq_done;
+static volatile bool timed_out;
+static struct timer timeout_timer;
+
+/* Serializes requests, which sleep while the controller works */
+static bool busy;
+static wait_queue_t busy_wait;
+
+static int fdc_irq(int irq, void *dev, struct exception *e)
 {
-        wait_done = 1;
+        irq_done = true;
+        wake_up(&irq_wait);
+        return IRQ_HANDLED;
+}
+
+static void fdc_timeout(void *data)
+{
+        timed_out = true;
+        wake_up(&irq_wait);
+}
+
+/*
+ * Sleeps until the controller raises its interrupt for the command just
+ * issued, which must have cleared irq_done before issuing it. Returns -EIO if
+ * it doesn't within FDC_TIMEOUT.
+ */
+static int wait_irq()
+{
+        uint32_t flags = irq_save();
+        int ret;
+
+        timed_out = false;
+        mod_timer(&timeout_timer, jiffies + FDC_TIMEOUT);
+        while (!irq_done && !timed_out)
+                sleep_on(&irq_wait);
+        del_timer(&timeout_timer);
+        ret = irq_done ? 0 : -EIO;
+        irq_done = false;
+        irq_restore(flags);
+        return ret;
+}
+
+static int fdc_send(uint8_t val)
+{
+        for (int i = 0; i < FDC_POLLS; i++) {
+                if ((inb(FDC_MSR, false) & (FDC_MSR_RDY | FDC_MSR_DATADIR))
+                    == FDC_MSR_RDY) {
+                        outb(FDC_DATA, val, false);
+                        return 0;
+                }
+        }
+        return -EIO;
 }
 
-static void fdc_wait_irq()
+static int fdc_recv()
 {
-        while (!wait_done);
-        wait_done = 0;
-        kprintf("fdc: done int wait\n");
+        uint8_t msr;
+
+        for (int i = 0; i < FDC_POLLS; i++) {
+                msr = inb(FDC_MSR, false);
+                if ((msr & (FDC_MSR_RDY | FDC_MSR_DATADIR))
+                    == (FDC_MSR_RDY | FDC_MSR_DATADIR))
+                        return inb(FDC_DATA, false);
+        }
+        return -EIO;
 }
 
-static void fdc_send_data(uint8_t val)
+/* Sends a whole command, returning -EIO if the controller stops taking it */
+static int fdc_command(const uint8_t *cmd, int len)
 {
-        while (!(inb(FDC_MSR) & FDC_MSR_RDY));
-        outb(FDC_DATA, val);
+        for (int i = 0; i < len; i++) {
+                if (fdc_send(cmd[i]))
+                        return -EIO;
+        }
+        return 0;
 }
 
-static uint8_t fdc_read_data()
+/* Reads a command's result bytes */
+static int fdc_result(uint8_t *res, int len)
 {
-        while (!(inb(FDC_MSR) & FDC_MSR_RDY));
-        return inb(FDC_DATA);
+        int val;
+
+        for (int i = 0; i < len; i++) {
+                val = fdc_recv();
+                if (val < 0)
+                        return -EIO;
+                res[i] = val;
+        }
+        return 0;
 }
 
-static void fdc_set_motor(uint8_t drive, uint8_t setting)
+static int fdc_sense_interrupt(uint8_t *st0, uint8_t *cyl)
 {
-        outb(FDC_DOR, FDC_DOR_ENABLE
-                      | ((FDC_DOR_MOTOR0 * setting) << drive));
-        int jif = jiffies();
-        while (jiffies() < jif+30);
+        uint8_t res[2];
+
+        if (fdc_send(FDC_CMD_SENSE_INTERRUPT) || fdc_result(res, 2))
+                return -EIO;
+        *st0 = res[0];
+        *cyl = res[1];
+        return 0;
 }
 
-static void fdc_sense_interrupt(uint8_t *st0, uint8_t *cyl)
+/* Turns the motor on, waiting for it to spin up if it was off */
+static void motor_on()
 {
-        kprintf("fdc: sense interrupt\n");
-        fdc_send_data(FDC_CMD_SENSE_INTERRUPT);
-        *st0 = fdc_read_data();
-        *cyl = fdc_read_data();
+        del_timer(&motor_timer);
+        if (motor_running)
+                return;
+        outb(FDC_DOR, FDC_DOR_ENABLE | FDC_DOR_DMA | FDC_DOR_MOTOR0
+                      | FDC_DOR_DRIVE0, false);
+        motor_running = true;
+        msleep(FDC_SPINUP_MS);
 }
 
-static void fdc_specify(uint8_t steprate, uint8_t loadt, uint8_t unloadt)
+static void motor_off(void *data)
 {
-        kprintf("fdc: specify %d,%d,%d\n", steprate, loadt, unloadt);
-        fdc_send_data(FDC_CMD_SPECIFY);
-        fdc_send_data((steprate << 4) | unloadt);
-        fdc_send_data((loadt << 1) | 1);
+        outb(FDC_DOR, FDC_DOR_ENABLE | FDC_DOR_DMA | FDC_DOR_DRIVE0, false);
+        motor_running = false;
 }
 
-static int fdc_calibrate(uint8_t drive)
+static int fdc_calibrate()
 {
+        uint8_t cmd[] = { FDC_CMD_CALIBRATE, 0 };
         uint8_t st0, cyl;
 
-        if (drive > 3)
-                return -1;
-        
-        fdc_set_motor(drive, 1);
-
-        for (int i = 0; i < 5; i++) {
-                kprintf("fdc: calibrate attempt %d\n", i+1);
-                fdc_send_data(FDC_CMD_CALIBRATE);
-                fdc_send_data(drive);
-                //fdc_wait_irq();
-                int jif = jiffies();
-                while (jiffies() < jif+100);
-                fdc_sense_interrupt(&st0, &cyl);
-                if (!cyl) {
-                        fdc_set_motor(drive, 0);
+        /* A single calibrate steps at most 77 times, short of 80 cylinders */
+        for (int i = 0; i < 2; i++) {
+                irq_done = false;
+                if (fdc_command(cmd, sizeof(cmd)) || wait_irq()
+                    || fdc_sense_interrupt(&st0, &cyl))
+                        return -EIO;
+                if (!cyl)
+                        return 0;
+        }
+        return -EIO;
+}
+
+/*
+ * Resets the controller and sets it up for DMA transfers at 500 kb/s, with
+ * implied seeks so reads and writes move the head themselves.
+ */
+static int fdc_reset()
+{
+        uint8_t configure[] = { FDC_CMD_CONFIGURE, 0, 0x57, 0 };
+        uint8_t specify[] = { FDC_CMD_SPECIFY, 0x8f, 0x0a };
+        uint8_t st0, cyl;
+
+        irq_done = false;
+        outb(FDC_DOR, 0, false);
+        outb(FDC_DOR, FDC_DOR_ENABLE | FDC_DOR_DMA | FDC_DOR_DRIVE0, false);
+        motor_running = false;
+        cached_cyl = -1;
+        if (wait_irq())
+                return -EIO;
+
+        /* The reset raises a pending interrupt for each drive */
+        for (int i = 0; i < 4; i++) {
+                if (fdc_sense_interrupt(&st0, &cyl))
+                        return -EIO;
+        }
+
+        outb(FDC_CCR, 0, false);
+        if (fdc_command(configure, sizeof(configure))
+            || fdc_command(specify, sizeof(specify)))
+                return -EIO;
+
+        motor_on();
+        return fdc_calibrate();
+}
+
+/*
+ * Reads or writes a whole cylinder between the disk and dma_buf, resetting the
+ * controller and retrying on errors.
+ */
+static int transfer_cylinder(int cyl, bool write)
+{
+        uint8_t cmd[] = {
+                (write ? FDC_CMD_WRITE_SECTOR : FDC_CMD_READ_SECTOR)
+                | FDC_CMD_MT | FDC_CMD_MFM,
+                0,            /* head 0, drive 0 */
+                cyl, 0, 1,    /* cylinder, head, first sector */
+                2,            /* 512 byte sectors */
+                FDC_SECTORS,  /* last sector on the track */
+                0x1b,         /* gap length */
+                0xff
+        };
+        uint8_t res[7];
+        int tries;
+
+        for (tries = 0; tries < FDC_RETRIES; tries++) {
+                if (tries && fdc_reset())
+                        continue;
+                if (isa_dma_setup(FDC_DMA_CHANNEL, virt_to_phys(dma_buf),
+                                  CYLINDER_SIZE, write ? DMA_MODE_WRITE
+                                                       : DMA_MODE_READ))
+                        return -EIO;
+
+                irq_done = false;
+                if (fdc_command(cmd, sizeof(cmd)) || wait_irq()
+                    || fdc_result(res, sizeof(res)))
+                        continue;
+
+                /* Normal termination in ST0 and no errors in ST1 and ST2 */
+                if (!(res[0] & 0xc0) && !res[1] && !res[2])
                         return 0;
-                }
         }
 
-        kprintf("fdc: calibrate failed\n");
-        fdc_set_motor(drive, 0);
-        return -1;
+        kprintf("fdc: %s of cylinder %d failed\n",
+                write ? "write" : "read", cyl);
+        return -EIO;
 }
 
-static void fdc_configure()
+static void fdc_lock()
 {
-        fdc_send_data(0x13);
-        fdc_send_data(0);
-        fdc_send_data((1<<6) | (0<<5) | (0<<4) | 0);
-        fdc_send_data(0);
+        uint32_t flags = irq_save();
+
+        while (busy)
+                sleep_on(&busy_wait);
+        busy = true;
+        irq_restore(flags);
+        motor_on();
 }
 
-void fdc_timeout()
+/* Ends a request, leaving the motor on a while for the next */
+static void fdc_unlock()
 {
-        kprintf("fdc: msr %w\n", inb(FDC_MSR));
-        kpanic("fdc: reset timed out\n");
+        uint32_t flags = irq_save();
+
+        mod_timer(&motor_timer, jiffies + FDC_MOTOR_IDLE);
+        busy = false;
+        wake_up(&busy_wait);
+        irq_restore(flags);
 }
 
-static int fdc_reset()
+/* Makes cyl the cached cylinder, reading it in if needed */
+static int load_cylinder(int cyl)
 {
-        int id = timer_set_timeout(1000, fdc_timeout);
-        kprintf("fdc: reset\n");
-        wait_done = 0;
-        outb(FDC_DOR, 0);
-        outb(FDC_DOR, FDC_DOR_ENABLE);
-        //fdc_wait_irq();
+        if (cyl == cached_cyl)
+                return 0;
+        cached_cyl = -1;
+        if (transfer_cylinder(cyl, false))
+                return -EIO;
+        cached_cyl = cyl;
+        return 0;
+}
 
-        uint8_t st0, cyl;
-        fdc_sense_interrupt(&st0, &cyl);
-        fdc_sense_interrupt(&st0, &cyl);
-        fdc_sense_interrupt(&st0, &cyl);
-        fdc_sense_interrupt(&st0, &cyl);
+/* Writes out the cached cylinder if it has been modified */
+static int flush_cylinder(bool *dirty)
+{
+        if (!*dirty)
+                return 0;
+        *dirty = false;
+        if (transfer_cylinder(cached_cyl, true)) {
+                cached_cyl = -1;
+                return -EIO;
+        }
+        return 0;
+}
+
+/*
+ * Reads or writes count sectors at lba through the cylinder cache, with the
+ * controller locked. Writes only modify the cache, setting *dirty, and the
+ * cylinder is written out once a transfer moves on to another one, or by the
+ * caller when it's done, so a run of writes within a cylinder writes it once.
+ */
+static int fdc_rw(uint32_t lba, uint32_t count, void *buf, bool write,
+                  bool *dirty)
+{
+        uint32_t off, n;
+        int cyl;
+
+        while (count) {
+                cyl = lba / CYLINDER_SECTORS;
+                off = lba % CYLINDER_SECTORS;
+                n = CYLINDER_SECTORS - off;
+                if (n > count)
+                        n = count;
+
+                if (cyl != cached_cyl && flush_cylinder(dirty))
+                        return -EIO;
+
+                /* Whole cylinders are written without reading them first */
+                if (write && n == CYLINDER_SECTORS)
+                        cached_cyl = cyl;
+                else if (load_cylinder(cyl))
+                        return -EIO;
+
+                if (write) {
+                        memcpy(dma_buf + off * FDC_SECTOR_SIZE, buf,
+                               n * FDC_SECTOR_SIZE);
+                        *dirty = true;
+                }
+                else {
+                        memcpy(buf, dma_buf + off * FDC_SECTOR_SIZE,
+                               n * FDC_SECTOR_SIZE);
+                }
+                buf = (uint8_t*) buf + n * FDC_SECTOR_SIZE;
+                lba += n;
+                count -= n;
+        }
+        return 0;
+}
+
+/*
+ * Reads count sectors starting at sector lba into buf. May sleep. Returns
+ * -EINVAL if the range is past the end of the disk, or -EIO on errors.
+ */
+int fdc_read(uint32_t lba, uint32_t count, void *buf)
+{
+        bool dirty = false;
+        int ret;
 
-        outb(FDC_CCR, 0); /* 500 kb/s transfer speed */
+        if (!present)
+                return -ENODEV;
+        if (lba > FDC_TOTAL_SECTORS || count > FDC_TOTAL_SECTORS - lba)
+                return -EINVAL;
 
-        fdc_configure();
-        fdc_specify(8, 20, 0);
-        int ret = fdc_calibrate(0);
-        timer_clear(id);
+        fdc_lock();
+        ret = fdc_rw(lba, count, buf, false, &dirty);
+        fdc_unlock();
         return ret;
 }
 
-int fdc_read_sector(uint8_t head, uint8_t track, uint8_t sector, void *buffer)
-{
-        uint8_t st0, st1, cyl;
-        uint8_t *buf = (uint8_t*) buffer;
-
-        fdc_set_motor(0, 1);
-
-        fdc_send_data(FDC_CMD_READ_SECTOR | 0xe0);
-        fdc_send_data(head << 2);
-        fdc_send_data(track);
-        fdc_send_data(head);
-        fdc_send_data(sector);
-        fdc_send_data(2);
-        fdc_send_data(18);
-        fdc_send_data(27);
-        fdc_send_data(0xff);
-
-        //fdc_wait_irq();
-        for (int i = 0; i < 512; i++)
-                *(buf++) = fdc_read_data();
-        
-        st0 = fdc_read_data();
-        st1 = fdc_read_data();
-        kprintf("fdc: read status %w %w\n", st0, st1);
-        for (int i = 0; i < 5; i++)
-                fdc_read_data();
-        
-        fdc_set_motor(0, 0);
-        return 0;
+/*
+ * Writes count sectors from buf starting at sector lba, a cylinder at a time,
+ * updating the cached copy first. May sleep. Returns -EINVAL if the range is
+ * past the end of the disk, or -EIO on errors.
+ */
+int fdc_write(uint32_t lba, uint32_t count, const void *buf)
+{
+        bool dirty = false;
+        int ret;
+
+        if (!present)
+                return -ENODEV;
+        if (lba > FDC_TOTAL_SECTORS || count > FDC_TOTAL_SECTORS - lba)
+                return -EINVAL;
+
+        fdc_lock();
+        ret = fdc_rw(lba, count, (void*) buf, true, &dirty);
+        if (flush_cylinder(&dirty))
+                ret = -EIO;
+        fdc_unlock();
+        return ret;
 }
 
-char buf[512] = {0};
+/* Carries out a run of requests from the queue, contiguous on the disk */
+static int fdc_xfer(struct blkdev *dev, struct blk_request *run)
+{
+        struct blk_request *req;
+        bool dirty = false;
+        int ret = 0;
+
+        fdc_lock();
+        for (req = run; req && !ret; req = req->next)
+                ret = fdc_rw(req->lba, req->count, req->buf, req->write,
+                             &dirty);
+        if (flush_cylinder(&dirty))
+                ret = -EIO;
+        fdc_unlock();
+        return ret;
+}
+
+static struct blkdev fd0 = {
+        .name = "fd0",
+        .sectors = FDC_TOTAL_SECTORS,
+};
+static struct request_queue fd0_queue;
 
-void fdc_init()
+/*
+ * Probes for a 1.44 MB drive 0 in the CMOS and brings up the controller.
+ * Returns -ENODEV if there's no such drive, or -EIO if the controller fails.
+ */
+int fdc_init()
 {
-        idt_install_isr(6, fdc_irq);
-        if (fdc_reset())
-                kpanic("fdc: failed to init");
-        else
-                kprintf("fdc: init success\n");
-        
-        fdc_read_sector(0, 0, 1, buf);
-        for (int i = 0; i < 512; i++)
-                *((char*) (0xff000 + 160*18 + 2*i)) = buf[i];
+        uint8_t types;
+        int ret;
+
+        outb(CMOS_ADDR, CMOS_FLOPPY_TYPES, false);
+        types = inb(CMOS_DATA, false);
+        if ((types >> 4) != CMOS_FLOPPY_1440K)
+                return -ENODEV;
+
+        timer_setup(&motor_timer, motor_off, NULL);
+        timer_setup(&timeout_timer, fdc_timeout, NULL);
+        if (irq_register(FDC_IRQ, fdc_irq, NULL, "fdc"))
+                return -EIO;
+
+        busy = true;
+        ret = fdc_reset();
+        fdc_unlock();
+        if (ret) {
+                kprintf("fdc: controller failed to reset\n");
+                irq_unregister(FDC_IRQ, NULL);
+                return ret;
+        }
+
+        present = true;
+        kprintf("fdc: 1.44 MB drive 0\n");
+        blk_init_queue(&fd0, &fd0_queue, fdc_xfer, CYLINDER_SECTORS);
+        return blkdev_register(&fd0);
 }
@@ -9,6 +9,9 @@
 .section .data
 .align 8
 
+.set INUM_SYSCALL, 255
+.set IDT_USER_GATE, 0xee  # Flags for an interrupt gate user mode can call
+
 idt:
 .rept 256
 	.quad 0x00008e0000080000  # Flags=0x8e, segment=0x08, addrs set later
@@ -24,67 +27,22 @@ isr_table:
 .rept 13
 	.long ignore
 .endr
-	.long irq0, irq1, irq2,  irq3,  irq4,  irq5,  irq6,  irq7
-	.long irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
-.rept 207
+	.long irq0,  irq1,  irq2,  irq3,  irq4,  irq5,  irq6,  irq7
+	.long irq8,  irq9,  irq10, irq11, irq12, irq13, irq14, irq15
+	.long irq16, irq17, irq18, irq19, irq20, irq21, irq22, irq23
+	.long irq24, irq25, irq26, irq27, irq28, irq29, irq30, irq31
+.rept 191
 	.long ignore
 .endr
 	.long isr_sys
 
-################################################################################
-# pic_remap programs the PICs to map the external interrupt requests to PIC
-# interrupt numbers starting at 32, so as not to interfere with the interrupt
-# numbers used by processor exceptions.
-################################################################################
-
-.section .text
-
-.set PIC0_CMD, 0x20
-.set PIC0_DATA, 0x21
-.set PIC1_CMD, 0xA0
-.set PIC1_DATA, 0xA1
-
-pic_remap:
-	mov $0x11, %al
-	out %al, $PIC0_CMD
-	out %al, $PIC1_CMD
-	call pic_wait
-
-	mov $0x20, %al
-	out %al, $PIC0_DATA
-	mov $0x28, %al
-	out %al, $PIC1_DATA
-	call pic_wait
-
-	mov $0x04, %al
-	out %al, $PIC0_DATA
-	mov $0x02, %al
-	out %al, $PIC1_DATA
-	call pic_wait
-
-	mov $0x01, %al
-	out %al, $PIC0_DATA
-	out %al, $PIC1_DATA
-	call pic_wait
-
-	mov $0x00, %al
-	out %al, $PIC0_DATA
-	out %al, $PIC1_DATA
-	call pic_wait
-
-	ret
-
-pic_wait:
-	mov $255, %cl
-1:	loop 1b
-	ret
-
 ################################################################################
 # setup_idt fills in the Interrupt Descriptor table with pointers to the
 # interrupt service routine stubs defined below. The mapping of interrupt number
 # to ISR is defined in isr_table above.
 ################################################################################
 
+.section .text
 .global setup_idt
 
 setup_idt:
@@ -105,9 +63,11 @@ setup_idt:
 	add $8, %edi
 
 	cmp $idt_desc, %edi
-	jl 1b
+	jb 1b
+
+	# User mode may only raise the system call interrupt itself
+	movb $IDT_USER_GATE, idt + 8 * INUM_SYSCALL + 5
 
-	call pic_remap
 	lidt idt_desc
 
 	pop %edi
@@ -115,7 +75,8 @@ setup_idt:
 	ret
 
 # Unused IDT entries are set to point here to ignore unknown interrupts (though
-# they shouldn't happen anyway) in isr_table.
+# they shouldn't happen anyway) in isr_table. This includes the local APIC's
+# spurious interrupt vector, which must not be acknowledged.
 ignore:
 	iret
 
@@ -126,27 +87,18 @@ ignore:
 #     exception number, error code, EIP, CS, EFLAGS, (ESP, SS)
 #
 # where SS:ESP was only pushed if we came from user mode. We also need to push
-# all the other registers to preserve task state, and then we can call the main
-# exception handling code in C.
-#
-# The last_interrupt variable stores the number of every interrupt that occurs,
-# and is used to determine whether to send an End of Interrupt command to the
-# PIC(s) before returning. It's a duplicate of the number put on the stack,
-# because a task switch might swap in a stack containing a different interrupt
-# number, which could prevent sending the EOI.
+# all the other registers to preserve task state, plus the control registers
+# for debug dumps, and then we can call the main exception handling code in C
+# with a pointer to the whole frame.
 ################################################################################
 
-.section .data
-
-last_interrupt:
-	.byte 0
-
 .section .text
 .extern handle_exception
+.extern handle_irq
 .global iret_to_task
 
 .set KERNEL_DS, 0x10
-.set PIC_EOI, 0x20
+.set PERCPU_DS, 0x30 # %fs points at the per-CPU block in the kernel
 
 isr_common:
 	push %gs
@@ -165,33 +117,19 @@ isr_common:
 	mov $KERNEL_DS, %ax
 	mov %ax, %ds
 	mov %ax, %es
-	mov %ax, %fs
 	mov %ax, %gs
+	mov $PERCPU_DS, %ax
+	mov %ax, %fs
 
-	mov 60(%esp), %eax
-	mov %al, last_interrupt
-
-        call handle_exception
+	push %esp
+	call handle_exception
+	add $4, %esp
 
 	# When a new task is created, its kernel stack is filled in so that when
 	# it's scheduled for the first time, it returns to here, where it does
 	# an iret to start running user code.
 iret_to_task:
-	add $12, %esp # Discard cr0, cr1, and cr3
-	mov last_interrupt, %bl
-	cmp $32, %bl
-	jl .skip_eoi
-	cmp $47, %bl
-	jg .skip_eoi
-
-	# The last exception was an IRQ, so send EOI command to the PIC(s).
-	mov $PIC_EOI, %al
-	cmp $40, %bl
-	jle 1f
-	out %al, $PIC1_CMD
-1:	out %al, $PIC0_CMD
-
-.skip_eoi:
+	add $12, %esp # Discard cr0, cr2, and cr3
 	popa
 	pop %ds
 	pop %es
@@ -200,260 +138,170 @@ iret_to_task:
 	add $8, %esp # Discard eno and err
 	iret
 
+################################################################################
+# Common hardware interrupt handler, called by the IRQ stubs below. It builds
+# the same frame as isr_common so that handlers and the task switching code can
+# treat both alike, but leaves the control register slots unfilled since they
+# only matter for faults. The interrupt controller is acknowledged from C, by
+# handle_irq.
+################################################################################
+
+irq_common:
+	push %gs
+	push %fs
+	push %es
+	push %ds
+	pusha
+	sub $12, %esp # Skip cr0, cr2, and cr3
+
+	mov $KERNEL_DS, %ax
+	mov %ax, %ds
+	mov %ax, %es
+	mov %ax, %gs
+	mov $PERCPU_DS, %ax
+	mov %ax, %fs
+
+	push %esp
+	call handle_irq
+	add $4, %esp
+	jmp iret_to_task
+
 ################################################################################
 # Start processor interrupt vectors. All of them push the interrupt number to
 # the stack, which becomes exception.ino. Some also push a dummy error code
 # before that, which becomes exception.err, in cases where the processor does
-# not push an actual error code itself.
+# not push an actual error code itself. Every IDT entry is an interrupt gate,
+# so the processor has already disabled interrupts by the time they run.
 ################################################################################
 
 .global isr0
 isr0:
-	cli
 	push $0
 	push $0
 	jmp isr_common
 
 .global isr1
 isr1:
-	cli
 	push $0
 	push $1
 	jmp isr_common
 
 .global isr2
 isr2:
-	cli
 	push $0
 	push $2
 	jmp isr_common
 
 .global isr3
 isr3:
-	cli
 	push $0
 	push $3
 	jmp isr_common
 
 .global isr4
 isr4:
-	cli
 	push $0
 	push $4
 	jmp isr_common
 
 .global isr5
 isr5:
-	cli
 	push $0
 	push $5
 	jmp isr_common
 
 .global isr6
 isr6:
-	cli
 	push $0
 	push $6
 	jmp isr_common
 
 .global isr7
 isr7:
-	cli
 	push $0
 	push $7
 	jmp isr_common
 
 .global isr8
 isr8:
-	cli
 	push $8
 	jmp isr_common
 
 .global isr9
 isr9:
-	cli
 	push $0
 	push $9
 	jmp isr_common
 
 .global isr10
 isr10:
-	cli
 	push $10
 	jmp isr_common
 
 .global isr11
 isr11:
-	cli
 	push $11
 	jmp isr_common
 
 .global isr12
 isr12:
-	cli
 	push $12
 	jmp isr_common
 
 .global isr13
 isr13:
-	cli
 	push $13
 	jmp isr_common
 
 .global isr14
 isr14:
-	cli
 	push $14
 	jmp isr_common
 
 .global isr15
 isr15:
-	cli
 	push $0
 	push $15
 	jmp isr_common
 
 .global isr16
 isr16:
-	cli
 	push $0
 	push $16
 	jmp isr_common
 
 .global isr17
 isr17:
-	cli
 	push $0
 	push $17
 	jmp isr_common
 
 .global isr18
 isr18:
-	cli
 	push $0
 	push $18
 	jmp isr_common
 
-# Start external interrupt request handlers
-
-.global irq0
-irq0:
-	cli
-	push $0
-	push $32
-	jmp isr_common
-
-.global irq1
-irq1:
-	cli
-	push $0
-	push $33
-	jmp isr_common
-
-.global irq2
-irq2:
-	cli
-	push $0
-	push $34
-	jmp isr_common
+# Start external interrupt request handlers, one for each of the NR_IRQS IRQ
+# vectors starting at 32
 
-.global irq3
-irq3:
-	cli
+.macro irq_stub n
+.global irq\n
+irq\n:
 	push $0
-	push $35
-	jmp isr_common
-
-.global irq4
-irq4:
-	cli
-	push $0
-	push $36
-	jmp isr_common
-
-.global irq5
-irq5:
-	cli
-	push $0
-	push $37
-	jmp isr_common
+	push $(32 + \n)
+	jmp irq_common
+.endm
 
-.global irq6
-irq6:
-	cli
-	push $0
-	push $38
-	jmp isr_common
-
-.global irq7
-irq7:
-	cli
-	push $0
-	push $39
-	jmp isr_common
-
-.global irq8
-irq8:
-	cli
-	push $0
-	push $40
-	jmp isr_common
-
-.global irq9
-irq9:
-	cli
-	push $0
-	push $41
-	jmp isr_common
-
-.global irq10
-irq10:
-	cli
-	push $0
-	push $42
-	jmp isr_common
-
-.global irq11
-irq11:
-	cli
-	push $0
-	push $43
-	jmp isr_common
-
-.global irq12
-irq12:
-	cli
-	push $0
-	push $44
-	jmp isr_common
-
-.global irq13
-irq13:
-	cli
-	push $0
-	push $45
-	jmp isr_common
-
-.global irq14
-irq14:
-	cli
-	push $0
-	push $46
-	jmp isr_common
-
-.global irq15
-irq15:
-	cli
-	push $0
-	push $47
-	jmp isr_common
+.irp n, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+	irq_stub \n
+.endr
 
 # System call interrupt handler
 
 .global isr_sys
 isr_sys:
-	cli
 	push $0
-	push $255
+	push $INUM_SYSCALL
 	jmp isr_common
 
@@ -47,3 +47,16 @@ void outl(uint16_t port, uint32_t data, bool wait)
         if (wait)
                 for (int i = 0; i < 255; i++);
 }
+
+/* Reads count 16-bit words from a port into buf, for PIO data transfers */
+void insw(uint16_t port, void *buf, uint32_t count)
+{
+        asm volatile("rep insw"
+                     : "+D" (buf), "+c" (count) : "d" (port) : "memory");
+}
+
+void outsw(uint16_t port, const void *buf, uint32_t count)
+{
+        asm volatile("rep outsw"
+                     : "+S" (buf), "+c" (count) : "d" (port) : "memory");
+}
@@ -0,0 +1,206 @@
+#include <asm/interrupt.h>
+#include <asm/tsc.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/malloc.h>
+#include <kernel/irq.h>
+#include <kernel/softirq.h>
+#include <kernel/sched.h>
+#include <kernel/irqstat.h>
+#include <kernel/spinlock.h>
+
+/* A handler installed on an IRQ line. Shared lines have a chain of them. */
+struct irq_action {
+        irq_handler_t handler;
+        void *dev;
+        char *name;
+        struct irq_action *next;
+};
+
+/* An IRQ line, and the controller it's routed through. Lines without a chip
+   can't be registered, and are ignored if their vector is raised anyway. */
+struct irq_desc {
+        struct irq_chip *chip;
+        bool level;
+        struct irq_action *actions;
+};
+
+static struct irq_desc irq_descs[NR_IRQS];
+
+/* Guards changes to the descriptors. handle_irq only runs with interrupts
+   disabled, so it doesn't need it as long as there is a single CPU. */
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+/*
+ * Routes an IRQ through an interrupt controller, which is done by the
+ * controller's setup code. Handlers already installed stay installed.
+ */
+void irq_set_chip(int irq, struct irq_chip *chip, bool level)
+{
+        struct irq_desc *desc;
+        uint32_t flags;
+
+        if (irq < 0 || irq >= NR_IRQS)
+                return;
+
+        desc = &irq_descs[irq];
+        flags = spin_lock_irqsave(&irq_lock);
+        if (desc->chip && desc->actions)
+                desc->chip->mask(irq);
+        desc->chip = chip;
+        desc->level = level;
+        if (chip && desc->actions)
+                chip->unmask(irq);
+        spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+/*
+ * Reserves n consecutive dynamic IRQs, edge triggered through chip, starting
+ * at a multiple of n as multiple message MSI needs. Returns the first of them,
+ * or -EBUSY if there's no such run free.
+ */
+int irq_alloc(int n, struct irq_chip *chip)
+{
+        int first, i, ret = -EBUSY;
+        uint32_t flags;
+
+        if (n < 1 || !chip)
+                return -EINVAL;
+
+        flags = spin_lock_irqsave(&irq_lock);
+        first = (IRQ_DYNAMIC_BASE + n - 1) / n * n;
+        for (; first + n <= NR_IRQS; first += n) {
+                for (i = 0; i < n; i++) {
+                        if (irq_descs[first + i].chip)
+                                break;
+                }
+                if (i < n)
+                        continue;
+                for (i = 0; i < n; i++) {
+                        irq_descs[first + i].chip = chip;
+                        irq_descs[first + i].level = false;
+                }
+                ret = first;
+                break;
+        }
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return ret;
+}
+
+/* Returns IRQs taken with irq_alloc, whose handlers must be gone already */
+void irq_free(int irq, int n)
+{
+        uint32_t flags;
+
+        if (irq < IRQ_DYNAMIC_BASE || irq + n > NR_IRQS)
+                return;
+
+        flags = spin_lock_irqsave(&irq_lock);
+        for (int i = irq; i < irq + n; i++)
+                irq_descs[i].chip = NULL;
+        spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+/*
+ * Installs a handler for an IRQ line, adding it to the chain if the line is
+ * already in use, and unmasks the line. dev identifies the registration to
+ * irq_unregister and is passed to the handler.
+ */
+int irq_register(int irq, irq_handler_t handler, void *dev, char *name)
+{
+        struct irq_action *action, **p;
+        uint32_t flags;
+
+        if (irq < 0 || irq >= NR_IRQS || !handler)
+                return -EINVAL;
+        if (!irq_descs[irq].chip)
+                return -ENODEV;
+
+        action = kmalloc(sizeof(*action), 0);
+        if (!action)
+                return -ENOMEM;
+        action->handler = handler;
+        action->dev = dev;
+        action->name = name;
+        action->next = NULL;
+
+        flags = spin_lock_irqsave(&irq_lock);
+        for (p = &irq_descs[irq].actions; *p; p = &(*p)->next);
+        *p = action;
+        irq_descs[irq].chip->unmask(irq);
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return 0;
+}
+
+/*
+ * Removes the handler registered with dev from an IRQ line, and masks the line
+ * if it was the last one.
+ */
+void irq_unregister(int irq, void *dev)
+{
+        struct irq_action *action, **p;
+        uint32_t flags;
+
+        if (irq < 0 || irq >= NR_IRQS)
+                return;
+
+        flags = spin_lock_irqsave(&irq_lock);
+        for (p = &irq_descs[irq].actions; *p; p = &(*p)->next) {
+                if ((*p)->dev == dev)
+                        break;
+        }
+        action = *p;
+        if (action)
+                *p = action->next;
+        if (!irq_descs[irq].actions && irq_descs[irq].chip)
+                irq_descs[irq].chip->mask(irq);
+        spin_unlock_irqrestore(&irq_lock, flags);
+
+        if (action)
+                kfree(action);
+}
+
+/*
+ * Entry point from irq_common for hardware interrupts. Edge triggered lines are
+ * acknowledged first, so an edge arriving while the handlers run is latched
+ * rather than lost, and level triggered ones only once the handlers have
+ * quietened their devices. Interrupts stay disabled while the handlers run.
+ * Handlers never switch tasks themselves, only set need_resched. Whatever
+ * work they deferred then runs as softirqs, with interrupts enabled, and
+ * preempt_schedule_irq() switches tasks last, after the EOI and every handler.
+ */
+void handle_irq(struct exception *e)
+{
+        int irq = e->eno - INUM_IRQ0;
+        uint32_t switches = percpu_read(nr_switches);
+        uint64_t start = rdtsc();
+        struct irq_action *action;
+        struct irq_desc *desc;
+
+        /* Interrupts went off on the way in */
+        if (e->eflags & EFLAGS_IF)
+                irqsoff_begin(IRQ_SITE);
+
+        if (irq < 0 || irq >= NR_IRQS)
+                goto out;
+        desc = &irq_descs[irq];
+        if (!desc->chip)
+                goto out;
+
+        if (!desc->level && !desc->chip->eoi(irq))
+                goto out;
+
+        for (action = desc->actions; action; action = action->next)
+                action->handler(irq, action->dev, e);
+
+        if (desc->level)
+                desc->chip->eoi(irq);
+
+        irqstat_account(e->eno, rdtsc() - start,
+                        switches != percpu_read(nr_switches));
+        do_softirq();
+        preempt_schedule_irq();
+out:
+        if (e->eflags & EFLAGS_IF)
+                irqsoff_end(IRQ_SITE);
+}
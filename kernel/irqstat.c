@@ -0,0 +1,152 @@
+#include <asm/interrupt.h>
+#include <asm/tsc.h>
+#include <kernel/kernel.h>
+#include <kernel/irqstat.h>
+
+/*
+ * Interrupt statistics: how often each vector fires and how many cycles its
+ * handlers take, and the longest stretches the kernel ran with interrupts
+ * disabled, which bound how late an interrupt can be serviced. Both are
+ * printed by irqstat_dump(), bound to Ctrl+Alt+F11.
+ */
+
+struct vector_stat {
+        uint32_t count;
+        uint32_t switched;
+        uint64_t cycles;
+        uint64_t max;
+};
+
+/* An IRQs-off section, named by where interrupts were disabled and where
+   they were enabled again */
+struct irqsoff_record {
+        const char *begin;
+        const char *end;
+        uint64_t cycles;
+};
+
+static struct vector_stat stats[256];
+
+static struct irqsoff_record worst[IRQSOFF_TOP];
+static uint64_t worst_min;
+
+/* The section currently open, if any */
+static uint64_t irqsoff_start;
+static const char *irqsoff_site;
+
+/*
+ * Counts an interrupt or exception on a vector and the cycles spent handling
+ * it. If the handler switched tasks, the cycles include whatever ran before
+ * switching back, so only the count is kept.
+ */
+void irqstat_account(int vector, uint64_t cycles, bool switched)
+{
+        struct vector_stat *s = &stats[vector & 0xff];
+
+        s->count++;
+        if (switched) {
+                s->switched++;
+                return;
+        }
+        s->cycles += cycles;
+        if (cycles > s->max)
+                s->max = cycles;
+}
+
+void irqsoff_begin(const char *site)
+{
+        irqsoff_site = site;
+        irqsoff_start = rdtsc();
+}
+
+/*
+ * Closes the open IRQs-off section, keeping it if it's among the longest seen.
+ * Each place interrupts are disabled at only gets one entry, its worst.
+ */
+void irqsoff_end(const char *site)
+{
+        uint64_t cycles = rdtsc() - irqsoff_start;
+        struct irqsoff_record *r, *slot = NULL;
+
+        if (!irqsoff_site)
+                return;
+        if (cycles <= worst_min) {
+                irqsoff_site = NULL;
+                return;
+        }
+
+        for (r = worst; r < worst + IRQSOFF_TOP; r++) {
+                if (r->begin == irqsoff_site) {
+                        slot = r;
+                        break;
+                }
+                if (!slot || r->cycles < slot->cycles)
+                        slot = r;
+        }
+        if (cycles > slot->cycles) {
+                slot->begin = irqsoff_site;
+                slot->end = site;
+                slot->cycles = cycles;
+        }
+        irqsoff_site = NULL;
+
+        worst_min = worst[0].cycles;
+        for (r = worst + 1; r < worst + IRQSOFF_TOP; r++) {
+                if (r->cycles < worst_min)
+                        worst_min = r->cycles;
+        }
+}
+
+static char *vector_name(int vector, char *buf, int size)
+{
+        if (vector == INUM_SYSCALL)
+                return "syscall";
+        if (vector >= INUM_IRQ0 && vector < INUM_IRQ0 + 32)
+                snprintf(buf, size, "irq %d", vector - INUM_IRQ0);
+        else
+                snprintf(buf, size, "exc %d", vector);
+        return buf;
+}
+
+void irqstat_dump()
+{
+        struct irqsoff_record top[IRQSOFF_TOP], tmp;
+        struct vector_stat s;
+        uint64_t avg;
+        uint32_t flags;
+        char name[16];
+        int i, j;
+
+        kprintf("vector   name        count  switched  avg cycles  max cycles\n");
+        for (i = 0; i < 256; i++) {
+                flags = raw_irq_save();
+                s = stats[i];
+                raw_irq_restore(flags);
+                if (!s.count)
+                        continue;
+
+                avg = s.cycles;
+                if (s.count > s.switched)
+                        div64(&avg, s.count - s.switched);
+                kprintf("%6d   %-8s %8u  %8u  %10llu  %10llu\n", i,
+                        vector_name(i, name, sizeof(name)), s.count,
+                        s.switched, avg, s.max);
+        }
+
+        flags = raw_irq_save();
+        memcpy(top, worst, sizeof(top));
+        raw_irq_restore(flags);
+
+        /* Longest first */
+        for (i = 1; i < IRQSOFF_TOP; i++) {
+                tmp = top[i];
+                for (j = i; j > 0 && top[j - 1].cycles < tmp.cycles; j--)
+                        top[j] = top[j - 1];
+                top[j] = tmp;
+        }
+
+        kprintf("longest IRQs-off sections, in cycles:\n");
+        for (i = 0; i < IRQSOFF_TOP && top[i].begin; i++)
+                kprintf("%12llu  %s -> %s\n", top[i].cycles, top[i].begin,
+                        top[i].end);
+}
@@ -1,8 +1,14 @@
 #include <asm/io.h>
+#include <asm/interrupt.h>
 
 #include <kernel/kernel.h>
 #include <kernel/console.h>
 #include <kernel/keyboard.h>
+#include <kernel/profile.h>
+#include <kernel/irq.h>
+#include <kernel/irqstat.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
 
 /* I/O ports */
 #define PS2_DATA 0x60
@@ -93,11 +99,24 @@ static const char shift_map[] = {
 /* Fx */ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
 };
 
-/* Last decoded key pressed */
+/* Scancodes read by the interrupt handler, waiting to be decoded. It only
+   overflows if the tasklet can't run for 16 keystrokes, so extra ones are
+   simply dropped. */
+#define SCANCODE_BUF 16
+static uint8_t scancodes[SCANCODE_BUF];
+static volatile uint32_t scancode_head, scancode_tail;
+static struct tasklet kbd_tasklet;
+
+/* Screen switches take a while, so they're left to the system workqueue */
+static struct work switch_work;
+static volatile int switch_to;
+
+/* Last decoded key pressed, and tasks waiting in getc() for the next one */
 static char key;
+static wait_queue_t key_wait;
 
 /* Inverted every keypress, used to detect new key */
-static bool phase = false;
+static volatile bool phase = false;
 
 /* Modifiers */
 static bool shift = false;
@@ -122,12 +141,21 @@ static uint8_t read_data()
 	return inb(PS2_DATA, false);
 }
 
-void handle_keyboard()
+static void switch_screen_work(struct work *work)
 {
-	unsigned char data = inb(PS2_DATA, false);
+	switch_screen(switch_to);
+}
 
-	if (data >= KEY_F1 && data <= KEY_F9 && ctrl && alt)
-		switch_screen(data - KEY_F1);
+static void decode(uint8_t data)
+{
+	if (data >= KEY_F1 && data <= KEY_F9 && ctrl && alt) {
+		switch_to = data - KEY_F1;
+		schedule_work(&switch_work);
+	}
+	else if (data == KEY_F10 && ctrl && alt)
+		prof_request_dump();
+	else if (data == KEY_F11 && ctrl && alt)
+		irqstat_dump();
 
 	else if (data == KEY_LSHIFT || data == KEY_RSHIFT)
 		shift = true;
@@ -145,15 +173,51 @@ void handle_keyboard()
 	else if ((data & KEY_RELEASE) == 0) {
 		key = shift ? shift_map[data] : noshift_map[data];
 		phase = !phase;
+		wake_up(&key_wait);
 	}
 }
 
+/* Bottom half, decoding the scancodes queued by handle_keyboard */
+static void keyboard_tasklet(void *data)
+{
+	uint32_t flags;
+	uint8_t code;
+
+	for (;;) {
+		flags = irq_save();
+		if (scancode_tail == scancode_head) {
+			irq_restore(flags);
+			break;
+		}
+		code = scancodes[scancode_tail++ % SCANCODE_BUF];
+		irq_restore(flags);
+
+		decode(code);
+	}
+}
+
+static int handle_keyboard(int irq, void *dev, struct exception *e)
+{
+	uint8_t data = inb(PS2_DATA, false);
+
+	if (scancode_head - scancode_tail < SCANCODE_BUF)
+		scancodes[scancode_head++ % SCANCODE_BUF] = data;
+	tasklet_schedule(&kbd_tasklet);
+	return IRQ_HANDLED;
+}
+
 /* Waits until next ASCII key is pressed and returns it. */
 char getc()
 {
+	uint32_t flags = irq_save();
 	bool p = phase;
-	while (phase == p);
-	return key;
+	char c;
+
+	while (phase == p)
+		sleep_on(&key_wait);
+	c = key;
+	irq_restore(flags);
+	return c;
 }
 
 void keyboard_init()
@@ -176,4 +240,9 @@ void keyboard_init()
 	/* Enable device and scanning */
 	controller_cmd(PS2CMD_ENABLE_1);
 	keyboard_cmd(KBDCMD_ENABLE);
+
+	tasklet_init(&kbd_tasklet, keyboard_tasklet, NULL);
+	work_init(&switch_work, switch_screen_work);
+	if (irq_register(1, handle_keyboard, NULL, "keyboard"))
+		kpanic("failed to register keyboard interrupt");
 }
@@ -0,0 +1,151 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/console.h>
+#include <kernel/serial.h>
+#include <kernel/sched.h>
+#include <kernel/log.h>
+
+/*
+ * The kernel log is a ring of fixed size entries. A writer claims the next
+ * sequence number with an atomic increment, formats its message directly into
+ * the matching slot, and then publishes it by storing the sequence number. No
+ * lock is taken, so messages can be logged from anywhere, including interrupt
+ * handlers that interrupt another writer. Readers copy entries out and check
+ * that the slot wasn't reused while they were copying.
+ */
+static struct log_entry log_ring[LOG_ENTRIES];
+static volatile uint32_t log_head;
+
+/* Output devices the log is copied to, each with its own read position */
+struct log_sink {
+        void (*write)(char *buf, int len);
+        bool timestamps;
+        bool line_start;
+        uint32_t seq;
+};
+
+static struct log_sink sinks[] = {
+        { console_write, false, true, 0 },
+        { serial_write, true, true, 0 },
+};
+
+#define NUM_SINKS (sizeof(sinks) / sizeof(*sinks))
+
+/* The log daemon, which drains the ring into the sinks */
+static struct task *klogd_task;
+static wait_queue_t klogd_wait;
+static volatile bool log_kick;
+
+void log_vprintf(char *fmt, va_list ap)
+{
+        uint32_t seq = __sync_fetch_and_add(&log_head, 1);
+        struct log_entry *e = &log_ring[seq % LOG_ENTRIES];
+
+        e->seq = 0;
+        barrier();
+        e->time = jiffies;
+        vsnprintf(e->msg, LOG_MSG_SIZE, fmt, ap);
+        barrier();
+        e->seq = seq + 1;
+
+        /* Until klogd is running, output happens synchronously */
+        if (klogd_task) {
+                log_kick = true;
+                wake_up(&klogd_wait);
+        }
+        else {
+                log_flush();
+        }
+}
+
+/*
+ * Copies the message with sequence number *seq into e and advances *seq.
+ * Messages that were overwritten before being read are skipped. Returns 0 if
+ * there is no complete message to read yet.
+ */
+int log_read(uint32_t *seq, struct log_entry *e)
+{
+        struct log_entry *slot;
+        uint32_t s;
+
+        for (;;) {
+                if (*seq == log_head)
+                        return 0;
+                if (log_head - *seq > LOG_ENTRIES)
+                        *seq = log_head - LOG_ENTRIES;
+
+                slot = &log_ring[*seq % LOG_ENTRIES];
+                s = slot->seq;
+                if (s == 0 || s < *seq + 1)
+                        return 0; /* Still being written */
+                if (s > *seq + 1) {
+                        (*seq)++; /* Lost to a newer message */
+                        continue;
+                }
+
+                memcpy(e, slot, sizeof(*e));
+                barrier();
+                if (slot->seq != s)
+                        continue;
+
+                (*seq)++;
+                return 1;
+        }
+}
+
+static void sink_emit(struct log_sink *sink, struct log_entry *e)
+{
+        char stamp[16];
+        int len;
+
+        if (sink->timestamps && sink->line_start) {
+                len = snprintf(stamp, sizeof(stamp), "[%5u.%02u] ",
+                               e->time / HZ, e->time % HZ);
+                sink->write(stamp, len);
+        }
+
+        for (len = 0; e->msg[len]; len++);
+        if (len) {
+                sink->write(e->msg, len);
+                sink->line_start = e->msg[len-1] == '\n';
+        }
+}
+
+/*
+ * Writes out every message the sinks haven't seen yet. Called by klogd, and
+ * directly when output can't wait, such as during boot and kernel panics.
+ */
+void log_flush()
+{
+        struct log_entry e;
+
+        for (int i = 0; i < NUM_SINKS; i++) {
+                while (log_read(&sinks[i].seq, &e))
+                        sink_emit(&sinks[i], &e);
+        }
+}
+
+static void klogd()
+{
+        uint32_t flags;
+
+        for (;;) {
+                log_kick = false;
+                log_flush();
+
+                flags = irq_save();
+                if (!log_kick)
+                        sleep_on(&klogd_wait);
+                irq_restore(flags);
+        }
+}
+
+/*
+ * Starts klogd, after which logging no longer waits on the output devices.
+ */
+void log_init()
+{
+        klogd_task = spawn_kthread(klogd);
+        if (!klogd_task)
+                kpanic("failed to start klogd");
+}
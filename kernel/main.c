@@ -1,14 +1,30 @@
 #include <kernel/kernel.h>
+#include <kernel/errno.h>
 #include <kernel/paging.h>
 #include <kernel/console.h>
 #include <kernel/keyboard.h>
 #include <kernel/malloc.h>
 #include <kernel/sched.h>
-
-static void printd(uint32_t val);
-static void printx16(uint32_t val);
-static void printx32(uint32_t val);
-static void prints(char *s);
+#include <kernel/serial.h>
+#include <kernel/log.h>
+#include <kernel/multiboot.h>
+#include <kernel/cmdline.h>
+#include <kernel/profile.h>
+#include <kernel/bench.h>
+#include <kernel/acpi.h>
+#include <kernel/pic.h>
+#include <kernel/apic.h>
+#include <kernel/softirq.h>
+#include <kernel/percpu.h>
+#include <kernel/buffer.h>
+#include <kernel/pci.h>
+#include <kernel/fdc.h>
+#include <kernel/ata.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/virtio_net.h>
+#include <kernel/net.h>
+#include <kernel/bootmod.h>
+#include <kernel/fat.h>
 
 void test1()
 {
@@ -26,15 +42,74 @@ void test2()
 	}
 }
 
-void main(const uint32_t *multiboot_info)
+/* Volume the kernel booted from */
+static struct fat_fs boot_fs;
+
+/*
+ * Mounts the first boot module if it holds a FAT volume, or else the boot
+ * floppy, and lists its root directory. Runs as a kernel thread, since
+ * reading the disk sleeps.
+ */
+static void mount_boot_fs()
 {
-	uint32_t mem_upper = multiboot_info[2];
+	static char *names[] = { "ram0", "fd0" };
+	struct fat_dirent ent;
+	struct fat_file dir;
+	struct blkdev *dev;
+	int i, ret = -ENODEV;
+
+	for (i = 0; i < 2 && ret; i++) {
+		dev = blkdev_get(names[i]);
+		if (dev)
+			ret = fat_mount(&boot_fs, dev);
+	}
+	if (ret) {
+		kprintf("fat: no boot volume mounted (%d)\n", ret);
+		do_exit(ret);
+	}
+
+	if (!fat_open(&boot_fs, "/", &dir)) {
+		while (fat_readdir(&dir, &ent) > 0) {
+			if (ent.attr & FAT_ATTR_DIR)
+				kprintf("fat: /%s/\n", ent.name);
+			else
+				kprintf("fat: /%s, %u bytes\n", ent.name,
+					ent.size);
+		}
+	}
+	do_exit(0);
+}
+
+void main(const struct multiboot_info *mbi)
+{
+	uint32_t mem_upper = mbi->mem_upper;
+
+	percpu_init();
+	sched_init();
+	if (mbi->flags & MULTIBOOT_INFO_CMDLINE)
+		cmdline_init(phys_to_virt(mbi->cmdline));
+	bootmod_init(mbi);
 
 	paging_init(mem_upper);
+	serial_init();
 	console_init();
+	heap_init(alloc_heap_page);
+	acpi_init();
+	pic_init();
+	apic_init();
 	keyboard_init();
-	heap_init();
-	sched_init();
+	timer_init();
+	softirq_init();
+	log_init();
+	prof_init();
+	buffer_init();
+	bootmod_setup();
+	fdc_init();
+	pci_init();
+	ata_init();
+	virtio_blk_init();
+	net_init();
+	virtio_net_init();
 
 	kprintf("System Alpha kernel v0.0.1\n");
 	kprintf("(C) 2023 Adam Judge\n");
@@ -45,91 +120,32 @@ void main(const uint32_t *multiboot_info)
 
 	//tty_init();
 
-	spawn_kthread(test1);
-	spawn_kthread(test2);
+	spawn_kthread(mount_boot_fs);
+
+	if (cmdline_get("bench")) {
+		spawn_kthread(bench_main);
+	}
+	else {
+		spawn_kthread(test1);
+		spawn_kthread(test2);
+	}
 
 	idle_task();
 }
 
 void kprintf(char *fmt, ...)
 {
-	char *c;
-	uint32_t *argptr = (uint32_t*) &fmt + 1;
-
-	for (c = fmt; *c != '\0'; c++) {
-		if (*c != '%') {
-			putc(*c);
-			continue;
-		}
+	va_list ap;
 
-		switch (*(++c)) {
-		case '%':
-			putc('%');
-			break;
-		case 'd':
-			printd(*(argptr++));
-			break;
-		case 'w':
-			printx16(*(argptr++));
-			break;
-		case 'x':
-			printx32(*(argptr++));
-			break;
-		case 's':
-			prints((char*) *(argptr++));
-			break;
-		case 'c':
-			putc((char) *(argptr++));
-			break;
-		default:
-			putc('%');
-			putc(*c);
-		}
-	}
+	va_start(ap, fmt);
+	log_vprintf(fmt, ap);
+	va_end(ap);
 }
 
 void kpanic(char *msg)
 {
 	asm("cli");
 	kprintf("Kernel panic: %s", msg);
+	log_flush();
 	for (;;);
 }
-
-static void printd(uint32_t val)
-{
-	if (val / 10)
-		printd(val / 10);
-	putc('0' + val % 10);
-}
-
-static void printx16(uint32_t val)
-{
-	int i, digit;
-
-	for (i = 12; i >= 0; i -= 4) {
-		digit = (val >> i) & 0xf;
-		if (digit < 10)
-			putc('0' + digit);
-		else
-			putc('a' + digit-10);
-	}
-}
-
-static void printx32(uint32_t val)
-{
-	int i, digit;
-
-	for (i = 28; i >= 0; i -= 4) {
-		digit = (val >> i) & 0xf;
-		if (digit < 10)
-			putc('0' + digit);
-		else
-			putc('a' + digit-10);
-	}
-}
-
-static void prints(char *s)
-{
-	while (*s)
-		putc(*(s++));
-}
@@ -1,62 +1,104 @@
 #include <kernel/kernel.h>
 #include <kernel/paging.h>
 #include <kernel/malloc.h>
+#include <kernel/spinlock.h>
 
 #define CHUNK_HEADER     0x80000000
 #define CHUNK_ALLOCATED  0x40000000
 #define SIZE_MASK        0x00ffffff
 
+/*
+ * The heap is a contiguous run of pages divided into chunks, each starting
+ * with a one dword header holding its size in dwords (header included) and
+ * whether it's in use. Apart from its page source this file has no kernel
+ * dependencies, so the host test harness in host/ builds it unmodified.
+ *
+ * The heap lock keeps interrupts enabled, since a first fit scan can take a
+ * while, so kmalloc and kfree must not be called from interrupt handlers.
+ */
 static uint32_t *heap = NULL;
 static uint32_t *limit;
+static spinlock_t heap_lock = SPINLOCK_INIT;
 
-void heap_init()
+/*
+ * Sets up the heap on HEAP_PAGES pages taken from page_source, which must
+ * hand out consecutive pages.
+ */
+void heap_init(void *(*page_source)())
 {
-        uint32_t i, page;
+        uint32_t i;
+        uint8_t *page;
 
+        heap = NULL;
         for (i = 0; i < HEAP_PAGES; i++) {
-                page = alloc_kernel_page(PAGE_WRITABLE);
+                page = page_source();
                 if (!page)
                         kpanic("heap allocation failed");
                 else if (!heap)
                         heap = (uint32_t*) page;
+                else if (page != (uint8_t*) heap + i * PAGE_SIZE)
+                        kpanic("heap pages not contiguous");
         }
 
-        *heap = (HEAP_PAGES * PAGE_SIZE + 1) | CHUNK_HEADER;
+        *heap = (HEAP_PAGES * PAGE_SIZE / 4) | CHUNK_HEADER;
         limit = heap + (HEAP_PAGES * PAGE_SIZE / 4);
 }
 
 void *kmalloc(size_t size, uint32_t flags)
 {
-        uint32_t *ptr, chunk_size;
-        
-        /* Convert size to number of dwords, rounded up */
-        size = ((size + 3) & ~3) >> 2;
+        uint32_t *ptr, *next, chunk_size;
+        void *ret = NULL;
+
+        /* Convert size to number of dwords, rounded up, plus the header */
+        if (size == 0)
+                size = 1;
+        size = (((size + 3) & ~3) >> 2) + 1;
         if (size & ~SIZE_MASK)
                 return NULL;
 
-        for (ptr = heap; ptr < limit; ptr += *ptr & SIZE_MASK) {
+        spin_lock(&heap_lock);
+        for (ptr = heap; ptr < limit; ptr += chunk_size) {
                 if (!(*ptr & CHUNK_HEADER))
                         kpanic("heap corrupted");
 
-                if (!(*ptr & CHUNK_ALLOCATED)) {
-                        chunk_size = *ptr & SIZE_MASK;
-                        if (chunk_size - 1 < size)
-                                continue;
-                        if (ptr + size >= limit)
-                                return NULL;
+                chunk_size = *ptr & SIZE_MASK;
+                if (*ptr & CHUNK_ALLOCATED)
+                        continue;
 
-                        *ptr = (size + 1) | CHUNK_HEADER | CHUNK_ALLOCATED;
-                        *(ptr + size + 1) = (chunk_size - size) | CHUNK_HEADER;
-                        return ptr + 1;
+                /* kfree() doesn't coalesce, so merge any free chunks that
+                   follow this one before checking if it's big enough. */
+                next = ptr + chunk_size;
+                for (; next < limit; next = ptr + chunk_size) {
+                        if (!(*next & CHUNK_HEADER))
+                                kpanic("heap corrupted");
+                        if (*next & CHUNK_ALLOCATED)
+                                break;
+                        chunk_size += *next & SIZE_MASK;
                 }
+                *ptr = chunk_size | CHUNK_HEADER;
+
+                if (chunk_size < size)
+                        continue;
+
+                if (chunk_size > size)
+                        *(ptr + size) = (chunk_size - size) | CHUNK_HEADER;
+                *ptr = size | CHUNK_HEADER | CHUNK_ALLOCATED;
+                ret = ptr + 1;
+                break;
         }
-        return NULL;
+        spin_unlock(&heap_lock);
+        return ret;
 }
 
 void kfree(void *ptr)
 {
         uint32_t *head = (uint32_t*) ptr - 1;
+        if (head < heap || head >= limit)
+                kpanic("kfree with invalid pointer");
+
+        spin_lock(&heap_lock);
         if (!(*head & CHUNK_HEADER) || !(*head & CHUNK_ALLOCATED))
                 kpanic("kfree with invalid pointer");
         *head &= ~CHUNK_ALLOCATED;
+        spin_unlock(&heap_lock);
 }
@@ -0,0 +1,303 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/apic.h>
+#include <kernel/irq.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+
+/*
+ * Message signalled interrupts. Instead of asserting a pin shared with other
+ * devices, a device writes a message straight to the local APIC, naming the
+ * vector of an IRQ of its own. Such IRQs are edge triggered and never shared,
+ * so their handlers don't have to ask their devices whether they interrupted,
+ * and a device can have one for each of its queues. MSI-X vectors are set up
+ * and masked one by one in a table in device memory; plain MSI gives a device
+ * a power of two block of consecutive vectors, which it can only mask if it
+ * implements per-vector masking.
+ */
+
+/* The device and vector number an allocated IRQ belongs to */
+struct msi_desc {
+        struct pci_device *dev;
+        int index;
+};
+
+static struct msi_desc msi_descs[NR_IRQS];
+
+static inline volatile uint32_t *msix_entry(struct pci_device *dev, int index,
+                                            int reg)
+{
+        return (volatile uint32_t*) (dev->msix_table
+                                     + index * PCI_MSIX_ENTRY_SIZE + reg);
+}
+
+static void msix_mask(int irq)
+{
+        struct msi_desc *d = &msi_descs[irq];
+
+        *msix_entry(d->dev, d->index, PCI_MSIX_ENTRY_CTRL)
+                |= PCI_MSIX_ENTRY_MASKED;
+}
+
+static void msix_unmask(int irq)
+{
+        struct msi_desc *d = &msi_descs[irq];
+
+        *msix_entry(d->dev, d->index, PCI_MSIX_ENTRY_CTRL)
+                &= ~PCI_MSIX_ENTRY_MASKED;
+}
+
+static struct irq_chip msix_chip = {
+        .name = "MSI-X",
+        .mask = msix_mask,
+        .unmask = msix_unmask,
+        .eoi = lapic_eoi,
+};
+
+/* Offset of the per-vector mask bits, if the function has them */
+static uint8_t msi_mask_reg(struct pci_device *dev)
+{
+        uint16_t ctrl = pci_config_read16(dev->addr,
+                                          dev->msi_cap + PCI_MSI_CTRL);
+
+        if (!(ctrl & PCI_MSI_CTRL_MASKABLE))
+                return 0;
+        return dev->msi_cap + (ctrl & PCI_MSI_CTRL_64BIT ? PCI_MSI_MASK_64
+                                                         : PCI_MSI_MASK_32);
+}
+
+static void msi_set_mask(int irq, bool masked)
+{
+        struct msi_desc *d = &msi_descs[irq];
+        uint8_t reg = msi_mask_reg(d->dev);
+        uint32_t bits;
+
+        if (!reg)
+                return;
+        bits = pci_config_read32(d->dev->addr, reg);
+        if (masked)
+                bits |= 1 << d->index;
+        else
+                bits &= ~(1 << d->index);
+        pci_config_write32(d->dev->addr, reg, bits);
+}
+
+static void msi_mask(int irq)
+{
+        msi_set_mask(irq, true);
+}
+
+static void msi_unmask(int irq)
+{
+        msi_set_mask(irq, false);
+}
+
+static struct irq_chip msi_chip = {
+        .name = "MSI",
+        .mask = msi_mask,
+        .unmask = msi_unmask,
+        .eoi = lapic_eoi,
+};
+
+/* Maps the MSI-X vector table, once, from the memory BAR it lives in */
+static int msix_map_table(struct pci_device *dev, int size)
+{
+        uint32_t table = pci_config_read32(dev->addr,
+                                           dev->msix_cap + PCI_MSIX_TABLE);
+        struct pci_bar *bar = &dev->bars[table & PCI_MSIX_BIR_MASK];
+        uint32_t offset = table & ~PCI_MSIX_BIR_MASK;
+
+        if (dev->msix_table)
+                return 0;
+        if ((table & PCI_MSIX_BIR_MASK) >= PCI_NUM_BARS || bar->io
+            || offset + size * PCI_MSIX_ENTRY_SIZE > bar->size)
+                return -ENODEV;
+        dev->msix_table = (uint8_t*) map_phys(bar->base + offset,
+                                              size * PCI_MSIX_ENTRY_SIZE,
+                                              PAGE_WRITABLE | PAGE_NOCACHE);
+        return dev->msix_table ? 0 : -ENOMEM;
+}
+
+/*
+ * Gives a device up to max MSI-X vectors, each its own IRQ, settling for fewer
+ * if the dynamic IRQs run out but not for fewer than min. All of them start
+ * out masked until a handler is registered.
+ */
+static int msix_alloc(struct pci_device *dev, int min, int max)
+{
+        uint16_t ctrl = pci_config_read16(dev->addr,
+                                          dev->msix_cap + PCI_MSIX_CTRL);
+        int size = PCI_MSIX_CTRL_SIZE(ctrl), irq, ret;
+        uint32_t addr, data;
+
+        if (max > size)
+                max = size;
+        if (max < min)
+                return -ENODEV;
+        ret = msix_map_table(dev, size);
+        if (ret)
+                return ret;
+
+        /* Masked as a whole while the entries are written */
+        pci_config_write16(dev->addr, dev->msix_cap + PCI_MSIX_CTRL,
+                           ctrl | PCI_MSIX_CTRL_ENABLE | PCI_MSIX_CTRL_MASKALL);
+        for (dev->nirqs = 0; dev->nirqs < max; dev->nirqs++) {
+                irq = irq_alloc(1, &msix_chip);
+                if (irq < 0)
+                        break;
+                apic_msi_msg(irq, &addr, &data);
+                msi_descs[irq].dev = dev;
+                msi_descs[irq].index = dev->nirqs;
+                dev->irqs[dev->nirqs] = irq;
+
+                *msix_entry(dev, dev->nirqs, PCI_MSIX_ENTRY_CTRL)
+                        |= PCI_MSIX_ENTRY_MASKED;
+                *msix_entry(dev, dev->nirqs, PCI_MSIX_ENTRY_ADDR_LO) = addr;
+                *msix_entry(dev, dev->nirqs, PCI_MSIX_ENTRY_ADDR_HI) = 0;
+                *msix_entry(dev, dev->nirqs, PCI_MSIX_ENTRY_DATA) = data;
+        }
+        dev->irq_type = PCI_IRQ_MSIX;
+        if (dev->nirqs < min) {
+                pci_free_irqs(dev);
+                return -EBUSY;
+        }
+        pci_config_write16(dev->addr, dev->msix_cap + PCI_MSIX_CTRL,
+                           (ctrl & ~PCI_MSIX_CTRL_MASKALL)
+                           | PCI_MSIX_CTRL_ENABLE);
+        return 0;
+}
+
+/*
+ * Gives a device a block of MSI vectors, the largest power of two it supports
+ * up to max, halving it while the dynamic IRQs can't fit it.
+ */
+static int msi_alloc(struct pci_device *dev, int min, int max)
+{
+        uint8_t cap = dev->msi_cap, mask_reg;
+        uint16_t ctrl = pci_config_read16(dev->addr, cap + PCI_MSI_CTRL);
+        int n = 1 << PCI_MSI_CTRL_MMC(ctrl), order, irq = -EBUSY;
+        uint32_t addr, data;
+
+        while (n > max)
+                n >>= 1;
+        if (n < min)
+                return -ENODEV;
+        for (; n >= min; n >>= 1) {
+                irq = irq_alloc(n, &msi_chip);
+                if (irq >= 0)
+                        break;
+        }
+        if (irq < 0)
+                return irq;
+
+        for (order = 0; (1 << order) < n; order++);
+        for (int i = 0; i < n; i++) {
+                msi_descs[irq + i].dev = dev;
+                msi_descs[irq + i].index = i;
+                dev->irqs[i] = irq + i;
+        }
+        dev->nirqs = n;
+        dev->irq_type = PCI_IRQ_MSI;
+
+        /* The device sets the low bits of data to the vector's index */
+        apic_msi_msg(irq, &addr, &data);
+        pci_config_write32(dev->addr, cap + PCI_MSI_ADDR_LO, addr);
+        if (ctrl & PCI_MSI_CTRL_64BIT) {
+                pci_config_write32(dev->addr, cap + PCI_MSI_ADDR_HI, 0);
+                pci_config_write16(dev->addr, cap + PCI_MSI_DATA_64, data);
+        }
+        else {
+                pci_config_write16(dev->addr, cap + PCI_MSI_DATA_32, data);
+        }
+        mask_reg = msi_mask_reg(dev);
+        if (mask_reg)
+                pci_config_write32(dev->addr, mask_reg, 0xffffffff);
+
+        ctrl &= ~PCI_MSI_CTRL_MME_MASK;
+        ctrl |= order << PCI_MSI_CTRL_MME_SHIFT | PCI_MSI_CTRL_ENABLE;
+        pci_config_write16(dev->addr, cap + PCI_MSI_CTRL, ctrl);
+        return 0;
+}
+
+/*
+ * Gives a device between min and max IRQs of one of the given types, trying
+ * MSI-X, then MSI, then its INTx line, which counts as a single shared IRQ.
+ * The device must be enabled already. Message signalled IRQs start out masked,
+ * and irq_register unmasks them; the n-th is pci_irq(dev, n). Returns the
+ * number of IRQs, -ENODEV if none of the types fits the device, or -EBUSY if
+ * the IRQs ran out.
+ */
+int pci_alloc_irqs(struct pci_device *dev, int min, int max, int types)
+{
+        uint32_t addr, data;
+        uint16_t command;
+        int ret = -ENODEV;
+
+        if (dev->nirqs)
+                return -EBUSY;
+        if (min < 1 || max < min)
+                return -EINVAL;
+        if (max > PCI_MAX_IRQS)
+                max = PCI_MAX_IRQS;
+
+        /* Messages need the local APIC to take them */
+        if (apic_msi_msg(0, &addr, &data))
+                types &= PCI_IRQ_INTX;
+
+        if ((types & PCI_IRQ_MSIX) && dev->msix_cap)
+                ret = msix_alloc(dev, min, max);
+        if (ret && (types & PCI_IRQ_MSI) && dev->msi_cap)
+                ret = msi_alloc(dev, min, max);
+        if (!ret) {
+                command = pci_config_read16(dev->addr, PCI_COMMAND);
+                pci_config_write16(dev->addr, PCI_COMMAND,
+                                   command | PCI_COMMAND_INTX_DISABLE);
+                return dev->nirqs;
+        }
+
+        if ((types & PCI_IRQ_INTX) && min == 1 && dev->irq
+            && dev->irq < NR_IRQS) {
+                dev->irq_type = PCI_IRQ_INTX;
+                dev->irqs[0] = dev->irq;
+                dev->nirqs = 1;
+                return 1;
+        }
+        return ret;
+}
+
+/* Returns the IRQ of a device's vector n, or -EINVAL if it has no such one */
+int pci_irq(struct pci_device *dev, int n)
+{
+        if (n < 0 || n >= dev->nirqs)
+                return -EINVAL;
+        return dev->irqs[n];
+}
+
+/* Turns off message signalled interrupts, once their handlers are gone */
+void pci_free_irqs(struct pci_device *dev)
+{
+        uint16_t ctrl, command;
+
+        if (dev->irq_type == PCI_IRQ_MSIX) {
+                ctrl = pci_config_read16(dev->addr,
+                                         dev->msix_cap + PCI_MSIX_CTRL);
+                pci_config_write16(dev->addr, dev->msix_cap + PCI_MSIX_CTRL,
+                                   ctrl & ~PCI_MSIX_CTRL_ENABLE);
+                for (int i = 0; i < dev->nirqs; i++)
+                        irq_free(dev->irqs[i], 1);
+        }
+        else if (dev->irq_type == PCI_IRQ_MSI) {
+                ctrl = pci_config_read16(dev->addr,
+                                         dev->msi_cap + PCI_MSI_CTRL);
+                pci_config_write16(dev->addr, dev->msi_cap + PCI_MSI_CTRL,
+                                   ctrl & ~PCI_MSI_CTRL_ENABLE);
+                irq_free(dev->irqs[0], dev->nirqs);
+        }
+        if (dev->irq_type != PCI_IRQ_INTX && dev->nirqs) {
+                command = pci_config_read16(dev->addr, PCI_COMMAND);
+                pci_config_write16(dev->addr, PCI_COMMAND,
+                                   command & ~PCI_COMMAND_INTX_DISABLE);
+        }
+        dev->irq_type = 0;
+        dev->nirqs = 0;
+}
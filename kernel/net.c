@@ -0,0 +1,446 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/cmdline.h>
+#include <kernel/net.h>
+#include <kernel/netdev.h>
+#include <kernel/spinlock.h>
+
+/*
+ * A minimal Ethernet, ARP, IPv4 and UDP stack. Frames are parsed in the
+ * buffer they arrived in, and answers to ARP requests and UDP datagrams are
+ * built over the request and sent back in the same buffer, so turning a packet
+ * around costs no allocation or copy. There's no IP fragment reassembly or
+ * routing beyond one gateway, and datagrams to an address not yet in the ARP
+ * cache are dropped while it's being resolved.
+ */
+
+#define ARP_HTYPE_ETHER 1
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+
+#define IP_VERSION 4
+#define IP_TTL 64
+#define IP_FRAG_MF 0x2000
+#define IP_FRAG_OFFSET 0x1fff
+#define IP_BROADCAST 0xffffffff
+
+struct arp_entry {
+        struct netdev *dev;
+        uint32_t ip;
+        uint8_t mac[ETH_ALEN];
+};
+
+struct udp_port {
+        uint16_t port;
+        udp_handler_t handler;
+};
+
+static uint8_t eth_broadcast[ETH_ALEN] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/* Replaced round robin once full */
+static struct arp_entry arp_cache[ARP_CACHE_SIZE];
+static int arp_next;
+static spinlock_t arp_lock = SPINLOCK_INIT;
+
+/* Only bound at boot, so lookups from softirqs don't lock */
+static struct udp_port udp_ports[MAX_UDP_PORTS];
+
+static uint16_t ip_id;
+
+/* Adds data to a one's complement sum of big endian 16-bit words */
+static uint32_t csum_add(uint32_t sum, void *data, uint32_t len)
+{
+        uint8_t *p = data;
+
+        for (; len > 1; len -= 2, p += 2)
+                sum += p[0] << 8 | p[1];
+        if (len)
+                sum += p[0] << 8;
+        return sum;
+}
+
+/* Folds a sum into the checksum, which verifies to 0 over a valid packet */
+static uint16_t csum_fold(uint32_t sum)
+{
+        while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+        return ~sum;
+}
+
+/* Checksum of a UDP datagram and the pseudo header, addresses as on the wire */
+static uint16_t udp_csum(uint32_t src, uint32_t dst, struct udp_hdr *udp,
+                         uint32_t len)
+{
+        uint32_t sum;
+
+        src = ntohl(src);
+        dst = ntohl(dst);
+        sum = (src >> 16) + (src & 0xffff) + (dst >> 16) + (dst & 0xffff)
+              + IP_PROTO_UDP + len;
+        return csum_fold(csum_add(sum, udp, len));
+}
+
+static void drop(struct netbuf *nb)
+{
+        nb->dev->rx_dropped++;
+        netbuf_free(nb);
+}
+
+static void eth_header(struct netbuf *nb, uint8_t *dst, uint16_t type)
+{
+        struct eth_hdr *eth = (struct eth_hdr*) nb->data;
+
+        memcpy(eth->dst, dst, ETH_ALEN);
+        memcpy(eth->src, nb->dev->mac, ETH_ALEN);
+        eth->type = htons(type);
+}
+
+static void arp_learn(struct netdev *dev, uint32_t ip, uint8_t *mac)
+{
+        struct arp_entry *e = NULL;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&arp_lock);
+        for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+                if (arp_cache[i].dev == dev && arp_cache[i].ip == ip) {
+                        e = &arp_cache[i];
+                        break;
+                }
+        }
+        if (!e) {
+                e = &arp_cache[arp_next];
+                arp_next = (arp_next + 1) % ARP_CACHE_SIZE;
+        }
+        e->dev = dev;
+        e->ip = ip;
+        memcpy(e->mac, mac, ETH_ALEN);
+        spin_unlock_irqrestore(&arp_lock, flags);
+}
+
+static bool arp_lookup(struct netdev *dev, uint32_t ip, uint8_t *mac)
+{
+        bool found = false;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&arp_lock);
+        for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+                if (arp_cache[i].dev == dev && arp_cache[i].ip == ip) {
+                        memcpy(mac, arp_cache[i].mac, ETH_ALEN);
+                        found = true;
+                        break;
+                }
+        }
+        spin_unlock_irqrestore(&arp_lock, flags);
+        return found;
+}
+
+static void arp_request(struct netdev *dev, uint32_t ip)
+{
+        struct netbuf *nb = netbuf_alloc(dev);
+        struct arp_pkt *arp;
+
+        if (!nb)
+                return;
+        arp = (struct arp_pkt*) (nb->data + sizeof(struct eth_hdr));
+        eth_header(nb, eth_broadcast, ETH_P_ARP);
+        arp->htype = htons(ARP_HTYPE_ETHER);
+        arp->ptype = htons(ETH_P_IP);
+        arp->hlen = ETH_ALEN;
+        arp->plen = 4;
+        arp->op = htons(ARP_REQUEST);
+        memcpy(arp->sha, dev->mac, ETH_ALEN);
+        arp->spa = htonl(dev->ip);
+        memset(arp->tha, 0, ETH_ALEN);
+        arp->tpa = htonl(ip);
+        nb->len = sizeof(struct eth_hdr) + sizeof(*arp);
+        netdev_xmit(nb);
+}
+
+/* Learns the sender of requests for us and replies to them in place */
+static void arp_rx(struct netbuf *nb)
+{
+        struct arp_pkt *arp = (struct arp_pkt*) (nb->data
+                                                 + sizeof(struct eth_hdr));
+        struct netdev *dev = nb->dev;
+
+        if (nb->len < sizeof(struct eth_hdr) + sizeof(*arp)
+            || ntohs(arp->htype) != ARP_HTYPE_ETHER
+            || ntohs(arp->ptype) != ETH_P_IP
+            || arp->hlen != ETH_ALEN || arp->plen != 4
+            || ntohl(arp->tpa) != dev->ip) {
+                drop(nb);
+                return;
+        }
+        arp_learn(dev, ntohl(arp->spa), arp->sha);
+        if (ntohs(arp->op) != ARP_REQUEST) {
+                netbuf_free(nb);
+                return;
+        }
+
+        arp->op = htons(ARP_REPLY);
+        memcpy(arp->tha, arp->sha, ETH_ALEN);
+        arp->tpa = arp->spa;
+        memcpy(arp->sha, dev->mac, ETH_ALEN);
+        arp->spa = htonl(dev->ip);
+        eth_header(nb, arp->tha, ETH_P_ARP);
+        nb->len = sizeof(struct eth_hdr) + sizeof(*arp);
+        netdev_xmit(nb);
+}
+
+/*
+ * Writes the headers of a UDP datagram with a len byte payload, which must be
+ * in place already, to dst at the link address mac.
+ */
+static void udp_build(struct netbuf *nb, uint8_t *mac, uint32_t dst,
+                      uint16_t sport, uint16_t dport, uint32_t len)
+{
+        struct ip_hdr *ip = (struct ip_hdr*) (nb->data
+                                              + sizeof(struct eth_hdr));
+        struct udp_hdr *udp = (struct udp_hdr*) (ip + 1);
+        uint16_t csum;
+
+        len += sizeof(*udp);
+        udp->sport = htons(sport);
+        udp->dport = htons(dport);
+        udp->len = htons(len);
+        udp->csum = 0;
+
+        ip->ver_ihl = IP_VERSION << 4 | sizeof(*ip) / 4;
+        ip->tos = 0;
+        ip->len = htons(sizeof(*ip) + len);
+        ip->id = htons(ip_id++);
+        ip->frag = 0;
+        ip->ttl = IP_TTL;
+        ip->proto = IP_PROTO_UDP;
+        ip->csum = 0;
+        ip->src = htonl(nb->dev->ip);
+        ip->dst = htonl(dst);
+        ip->csum = htons(csum_fold(csum_add(0, ip, sizeof(*ip))));
+
+        /* A sum of 0 is sent as all ones, as 0 means there's none */
+        csum = udp_csum(ip->src, ip->dst, udp, len);
+        udp->csum = htons(csum ? csum : 0xffff);
+
+        eth_header(nb, mac, ETH_P_IP);
+        nb->len = sizeof(struct eth_hdr) + sizeof(*ip) + len;
+}
+
+static void udp_rx(struct netbuf *nb, struct ip_hdr *ip, uint32_t hlen)
+{
+        struct udp_hdr *udp = (struct udp_hdr*) ((uint8_t*) ip + hlen);
+        uint32_t len = ntohs(ip->len) - hlen;
+        uint16_t dport;
+
+        if (len < sizeof(*udp) || ntohs(udp->len) < sizeof(*udp)
+            || ntohs(udp->len) > len) {
+                drop(nb);
+                return;
+        }
+        len = ntohs(udp->len);
+        if (udp->csum && udp_csum(ip->src, ip->dst, udp, len)) {
+                drop(nb);
+                return;
+        }
+
+        dport = ntohs(udp->dport);
+        for (int i = 0; i < MAX_UDP_PORTS; i++) {
+                if (udp_ports[i].handler && udp_ports[i].port == dport) {
+                        udp_ports[i].handler(nb, (uint8_t*) (udp + 1),
+                                             len - sizeof(*udp),
+                                             ntohl(ip->src),
+                                             ntohs(udp->sport));
+                        return;
+                }
+        }
+        drop(nb);
+}
+
+static void ip_rx(struct netbuf *nb)
+{
+        struct ip_hdr *ip = (struct ip_hdr*) (nb->data
+                                              + sizeof(struct eth_hdr));
+        uint32_t hlen, len;
+
+        if (nb->len < sizeof(struct eth_hdr) + sizeof(*ip))
+                goto drop;
+        hlen = (ip->ver_ihl & 0xf) * 4;
+        len = ntohs(ip->len);
+        if (ip->ver_ihl >> 4 != IP_VERSION || hlen < sizeof(*ip)
+            || len < hlen || sizeof(struct eth_hdr) + len > nb->len)
+                goto drop;
+        if (csum_fold(csum_add(0, ip, hlen)))
+                goto drop;
+        if (ntohl(ip->dst) != nb->dev->ip && ip->dst != IP_BROADCAST)
+                goto drop;
+
+        /* Fragments aren't reassembled */
+        if (ntohs(ip->frag) & (IP_FRAG_MF | IP_FRAG_OFFSET))
+                goto drop;
+
+        /* Ethernet pads short frames */
+        nb->len = sizeof(struct eth_hdr) + len;
+        if (ip->proto == IP_PROTO_UDP) {
+                udp_rx(nb, ip, hlen);
+                return;
+        }
+drop:
+        drop(nb);
+}
+
+/* Takes a received frame, addressed to us or broadcast, up the stack */
+void eth_rx(struct netbuf *nb)
+{
+        struct eth_hdr *eth = (struct eth_hdr*) nb->data;
+
+        if (nb->len < sizeof(*eth)
+            || (memcmp(eth->dst, nb->dev->mac, ETH_ALEN)
+                && memcmp(eth->dst, eth_broadcast, ETH_ALEN))) {
+                drop(nb);
+                return;
+        }
+
+        switch (ntohs(eth->type)) {
+        case ETH_P_ARP:
+                arp_rx(nb);
+                break;
+        case ETH_P_IP:
+                ip_rx(nb);
+                break;
+        default:
+                drop(nb);
+        }
+}
+
+/*
+ * Sends a datagram of len bytes, already written at udp_payload(nb), to dst
+ * through the gateway unless it's on the local network. The buffer is always
+ * consumed. Returns -EAGAIN if the next hop's link address isn't known yet,
+ * which it will be shortly as it's asked for.
+ */
+int udp_send(struct netbuf *nb, uint32_t dst, uint16_t sport, uint16_t dport,
+             uint32_t len)
+{
+        struct netdev *dev = nb->dev;
+        uint32_t hop = dst;
+        uint8_t mac[ETH_ALEN];
+
+        if (len > UDP_PAYLOAD_MAX) {
+                dev->tx_dropped++;
+                netbuf_free(nb);
+                return -EINVAL;
+        }
+        if ((dst & dev->netmask) != (dev->ip & dev->netmask))
+                hop = dev->gateway;
+
+        if (dst == IP_BROADCAST) {
+                memcpy(mac, eth_broadcast, ETH_ALEN);
+        }
+        else if (!arp_lookup(dev, hop, mac)) {
+                arp_request(dev, hop);
+                dev->tx_dropped++;
+                netbuf_free(nb);
+                return -EAGAIN;
+        }
+        udp_build(nb, mac, dst, sport, dport, len);
+        return netdev_xmit(nb);
+}
+
+/*
+ * Answers a received datagram with len bytes at data, which is in its buffer,
+ * sending them back where it came from in the same buffer. The sender's link
+ * address is taken from the frame, so this never waits on ARP.
+ */
+int udp_reply(struct netbuf *nb, uint8_t *data, uint32_t len)
+{
+        struct eth_hdr *eth = (struct eth_hdr*) nb->data;
+        struct ip_hdr *ip = (struct ip_hdr*) (eth + 1);
+        struct udp_hdr *udp = (struct udp_hdr*) ((uint8_t*) ip
+                                                 + (ip->ver_ihl & 0xf) * 4);
+        uint32_t src = ntohl(ip->src);
+        uint16_t sport = ntohs(udp->sport), dport = ntohs(udp->dport);
+        uint8_t mac[ETH_ALEN];
+
+        if (len > UDP_PAYLOAD_MAX) {
+                nb->dev->tx_dropped++;
+                netbuf_free(nb);
+                return -EINVAL;
+        }
+        memcpy(mac, eth->src, ETH_ALEN);
+
+        /* Only moves with IP options on the request, and then towards the
+           front, which memcpy copying forwards handles */
+        if (data != udp_payload(nb))
+                memcpy(udp_payload(nb), data, len);
+        udp_build(nb, mac, src, dport, sport, len);
+        return netdev_xmit(nb);
+}
+
+/* Has datagrams to port handed to handler. Only to be called at boot. */
+int udp_bind(uint16_t port, udp_handler_t handler)
+{
+        struct udp_port *free = NULL;
+
+        for (int i = 0; i < MAX_UDP_PORTS; i++) {
+                if (udp_ports[i].handler && udp_ports[i].port == port)
+                        return -EBUSY;
+                if (!udp_ports[i].handler && !free)
+                        free = &udp_ports[i];
+        }
+        if (!free)
+                return -ENOMEM;
+        free->port = port;
+        barrier();
+        free->handler = handler;
+        return 0;
+}
+
+/* Parses a dotted quad, returning false if it isn't one */
+static bool parse_ip(char *s, uint32_t *ip)
+{
+        uint32_t addr = 0, part;
+
+        for (int i = 0; i < 4; i++) {
+                if (*s < '0' || *s > '9')
+                        return false;
+                for (part = 0; *s >= '0' && *s <= '9'; s++)
+                        part = part * 10 + *s - '0';
+                if (part > 255 || *s != (i < 3 ? '.' : '\0'))
+                        return false;
+                s++;
+                addr = addr << 8 | part;
+        }
+        *ip = addr;
+        return true;
+}
+
+static uint32_t config_ip(char *name, uint32_t def)
+{
+        char *val = cmdline_get(name);
+        uint32_t ip;
+
+        return val && parse_ip(val, &ip) ? ip : def;
+}
+
+/* Sets an interface's address from the ip, netmask and gw options */
+void net_config(struct netdev *dev)
+{
+        dev->ip = config_ip("ip", NET_DEFAULT_IP);
+        dev->netmask = config_ip("netmask", NET_DEFAULT_NETMASK);
+        dev->gateway = config_ip("gw", NET_DEFAULT_GATEWAY);
+        kprintf("net: %s is %u.%u.%u.%u\n", dev->name, dev->ip >> 24,
+                dev->ip >> 16 & 0xff, dev->ip >> 8 & 0xff, dev->ip & 0xff);
+}
+
+/* Sends every datagram straight back */
+static void echo_rx(struct netbuf *nb, uint8_t *data, uint32_t len,
+                    uint32_t src, uint16_t sport)
+{
+        udp_reply(nb, data, len);
+}
+
+void net_init()
+{
+        udp_bind(UDP_ECHO_PORT, echo_rx);
+}
@@ -0,0 +1,132 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/malloc.h>
+#include <kernel/net.h>
+#include <kernel/netdev.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+
+/*
+ * Network interfaces and their packet buffers. Each interface gets a fixed
+ * pool of buffers at registration, physically contiguous so a device can
+ * write frames straight into them, and the same buffers carry packets all the
+ * way through the stack and back out again. Nothing on the data path
+ * allocates or copies.
+ */
+
+static struct netdev *netdevs[MAX_NETDEVS];
+
+/*
+ * Registers an interface with a pool of nbufs packet buffers, giving it the
+ * address from the ip option, or QEMU's user networking default. Returns
+ * -ENOMEM if out of memory or interfaces.
+ */
+int netdev_register(struct netdev *dev, int nbufs)
+{
+        struct netbuf *bufs;
+        uint32_t paddr = 0;
+        int slot;
+
+        for (slot = 0; slot < MAX_NETDEVS && netdevs[slot]; slot++);
+        if (slot == MAX_NETDEVS)
+                return -ENOMEM;
+
+        bufs = kmalloc(nbufs * sizeof(*bufs), 0);
+        if (!bufs)
+                return -ENOMEM;
+        spin_lock_init(&dev->pool_lock);
+        dev->pool = NULL;
+        dev->pool_free = 0;
+        for (int i = 0; i < nbufs; i++) {
+                if (i % (PAGE_SIZE / NETBUF_SIZE) == 0) {
+                        paddr = pmm_alloc();
+                        if (!paddr)
+                                break;
+                }
+                bufs[i].dev = dev;
+                bufs[i].paddr = paddr + (i % (PAGE_SIZE / NETBUF_SIZE))
+                                        * NETBUF_SIZE;
+                bufs[i].head = phys_to_virt(bufs[i].paddr);
+                bufs[i].next = dev->pool;
+                dev->pool = &bufs[i];
+                dev->pool_free++;
+        }
+
+        net_config(dev);
+        netdevs[slot] = dev;
+        kprintf("netdev: %s, %02x:%02x:%02x:%02x:%02x:%02x, %d buffers\n",
+                dev->name, dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3],
+                dev->mac[4], dev->mac[5], dev->pool_free);
+        return 0;
+}
+
+/* Looks up a registered interface by name, returning NULL if there's none */
+struct netdev *netdev_get(char *name)
+{
+        for (int i = 0; i < MAX_NETDEVS; i++) {
+                if (netdevs[i] && str_eq(netdevs[i]->name, name))
+                        return netdevs[i];
+        }
+        return NULL;
+}
+
+/*
+ * Takes a buffer from an interface's pool, with its frame empty and starting
+ * after the headroom. Returns NULL if they're all in use.
+ */
+struct netbuf *netbuf_alloc(struct netdev *dev)
+{
+        struct netbuf *nb;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&dev->pool_lock);
+        nb = dev->pool;
+        if (nb) {
+                dev->pool = nb->next;
+                dev->pool_free--;
+        }
+        spin_unlock_irqrestore(&dev->pool_lock, flags);
+
+        if (nb) {
+                nb->data = nb->head + NETBUF_HEADROOM;
+                nb->len = 0;
+                nb->next = NULL;
+        }
+        return nb;
+}
+
+void netbuf_free(struct netbuf *nb)
+{
+        struct netdev *dev = nb->dev;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&dev->pool_lock);
+        nb->next = dev->pool;
+        dev->pool = nb;
+        dev->pool_free++;
+        spin_unlock_irqrestore(&dev->pool_lock, flags);
+}
+
+/* Sends the frame in a buffer out of the interface it belongs to */
+int netdev_xmit(struct netbuf *nb)
+{
+        struct netdev *dev = nb->dev;
+
+        if (nb->len > ETH_FRAME_MAX
+            || nb->data + nb->len > nb->head + NETBUF_SIZE) {
+                dev->tx_dropped++;
+                netbuf_free(nb);
+                return -EINVAL;
+        }
+        return dev->xmit(dev, nb);
+}
+
+/*
+ * Called by drivers, from softirq context, with each frame received. The
+ * buffer belongs to the stack from then on.
+ */
+void netif_rx(struct netbuf *nb)
+{
+        nb->dev->rx_packets++;
+        eth_rx(nb);
+}
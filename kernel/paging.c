@@ -1,24 +1,15 @@
 #include <kernel/kernel.h>
+#include <kernel/console.h>
 #include <kernel/malloc.h>
+#include <kernel/bootmod.h>
 #include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/sched.h>
 
 #define PAGE_ALIGN(n) ((n + 0xfff) & ~0xfff)
 
-/* Free page stack, used to allocate physical pages */
-static uint32_t page_stack[4096];
-static uint32_t stackp;
-
-static inline uint32_t pop_page()
-{
-	return stackp > 0 ? page_stack[--stackp] : 0;
-}
-
-static inline void push_page(uint32_t addr)
-{
-	page_stack[stackp++] = addr;
-}
-
-/* Kernel starter page map, defined in boot.s */
+/* Kernel page directory, and the page table for the first 4 MiB of the direct
+   map, defined in start.s */
 extern uint32_t page_directory[];
 extern uint32_t page_table[];
 
@@ -26,186 +17,337 @@ extern uint32_t page_table[];
 extern uint8_t kernel_code_end[];
 extern uint8_t kernel_end[];
 
-/* Defined in boot.s */
-extern void enable_paging();
+/* Defined in start.s */
 extern void flush_tlb();
 
-/* 
- * Initializes the starter kernel page map, then fills the free page stack with
- * available physical pages after the kernel up to at most mem_upper, the
- * boundary in KiB of the upper memory region given by multiboot.
+/* End of the physical memory covered by the direct map */
+static uint32_t direct_map_end;
+
+static uint32_t *get_pte(uint32_t *pdir, uint32_t vaddr, uint32_t flags);
+
+/*
+ * Replaces the boot page map set up by start.s with the kernel's own, then
+ * fills the free page stack with available physical pages after the kernel up
+ * to at most mem_upper, the boundary in KiB of the upper memory region given by
+ * multiboot.
+ *
+ * The boot map only covers the first 16 MiB, both identity mapped and at
+ * KERNEL_BASE, with 4 MiB pages. The kernel's map drops the identity mapping,
+ * maps the first 4 MiB with a page table so kernel code can be read-only, and
+ * the rest of physical memory with 4 MiB pages.
  */
 void paging_init(uint32_t mem_upper)
 {
-	uint32_t i, addr;
+	uint32_t i, addr, mem_end, code_end;
 
-	memset(page_directory, 0, PAGE_SIZE);
-	memset(page_table, 0, PAGE_SIZE);
+	mem_end = 0x100000 + mem_upper * 1024;
+	if (mem_end > DIRECT_MAP_SIZE)
+		mem_end = DIRECT_MAP_SIZE;
 
-	for (i = 256; i < 1024; i++) {
+	/* Mark kernel code read-only, and everything else read-write */
+	code_end = virt_to_phys(kernel_code_end);
+	for (i = 0; i < 1024; i++) {
 		addr = i * PAGE_SIZE;
-		if (addr > (uint32_t) kernel_end)
-			break;
-
-		/* Mark kernel code read-only, and everything else read-write */
-		if (addr < (uint32_t) kernel_code_end)
+		if (addr >= 0x100000 && addr < code_end)
 			page_table[i] = addr | PAGE_PRESENT;
 		else
 			page_table[i] = addr | PAGE_PRESENT | PAGE_WRITABLE;
 	}
 
-	/* Map VGA text memory to 0xff000 */
-	page_table[255] = 0xb8000 | PAGE_PRESENT | PAGE_WRITABLE;
-
-	page_directory[0] = (uint32_t) page_table
-			    | PAGE_PRESENT | PAGE_WRITABLE;
-	page_directory[1] = (uint32_t) page_directory
-			    | PAGE_PRESENT | PAGE_WRITABLE;
-
-	enable_paging();
-
-	/* Fill free page stack */
-	stackp = 0;
-	for (i = 0; i < sizeof(page_stack); i++) {
-		if (i == mem_upper)
-			break;
-		
-		addr = PAGE_ALIGN((uint32_t) kernel_end) + i * 1024;
-		if (addr % PAGE_SIZE == 0)
-			push_page(addr);
+	/* Entries are replaced one at a time, as the directory is live and
+	   maps the code doing this */
+	page_directory[KERNEL_PDE] = virt_to_phys(page_table)
+				     | PAGE_PRESENT | PAGE_WRITABLE;
+	for (i = KERNEL_PDE + 1; i < (VMALLOC_START >> 22); i++) {
+		addr = (i - KERNEL_PDE) * LARGE_PAGE_SIZE;
+		if (addr < mem_end) {
+			page_directory[i] = addr | PAGE_PRESENT | PAGE_WRITABLE
+					    | PAGE_LARGE;
+			direct_map_end = addr + LARGE_PAGE_SIZE;
+		}
+		else {
+			page_directory[i] = 0;
+		}
+	}
+	if (!direct_map_end)
+		direct_map_end = LARGE_PAGE_SIZE;
+	memset(page_directory, 0, KERNEL_PDE * sizeof(uint32_t));
+	flush_tlb();
+
+	/* Fill free page stack with the upper memory after the kernel */
+	addr = PAGE_ALIGN(virt_to_phys(kernel_end));
+	for (i = 0; i < PMM_MAX_PAGES && addr + PAGE_SIZE <= mem_end;
+	     addr += PAGE_SIZE) {
+		/* Boot modules stay where the bootloader put them */
+		if (bootmod_reserved(addr))
+			continue;
+		pmm_free(addr);
+		i++;
+	}
+
+	/* Allocate every page table of the vmalloc window up front. Page
+	   directories only copy the kernel's entries when they're created, so
+	   the kernel must never add one later or existing address spaces would
+	   miss it. */
+	for (addr = VMALLOC_START; addr < VMALLOC_END; addr += LARGE_PAGE_SIZE) {
+		if (!get_pte(page_directory, addr, 0))
+			kpanic("out of memory for kernel page tables");
 	}
 }
 
-uint32_t alloc_page(uint32_t vaddr, uint32_t flags)
+/*
+ * Returns a pointer to the page table entry for vaddr in the given page
+ * directory, reaching the page table through the direct map, and allocating and
+ * clearing a new one if there isn't one for that region yet, which after boot
+ * only happens in user space. Returns NULL if out of memory.
+ */
+static uint32_t *get_pte(uint32_t *pdir, uint32_t vaddr, uint32_t flags)
 {
 	int dirent = (vaddr >> 22) & 0x3ff;
 	int tabent = (vaddr >> 12) & 0x3ff;
-
-	uint32_t *pdir = (uint32_t*) 0x401000;
-	uint32_t *ptab = (uint32_t*) (0x400000 + dirent * PAGE_SIZE);
 	uint32_t paddr;
 
-	/* We may need to allocate a new page table within the page directory
-	   in order to setup the requested virtual address. */
 	if (!(pdir[dirent] & PAGE_PRESENT)) {
-		paddr = pop_page();
+		paddr = pmm_alloc();
 		if (!paddr)
-			return 0;
-		pdir[dirent] = paddr | PAGE_PRESENT | PAGE_WRITABLE | flags;
+			return NULL;
+		memset(phys_to_virt(paddr), 0, PAGE_SIZE);
+		pdir[dirent] = paddr | PAGE_PRESENT | PAGE_WRITABLE
+			       | (flags & PAGE_USER);
 	}
+	return (uint32_t*) phys_to_virt(pdir[dirent] & ~0xfff) + tabent;
+}
+
+/*
+ * Page directory to look up vaddr in. Kernel page tables are shared by every
+ * address space, and user addresses belong to the loaded one.
+ */
+static inline uint32_t *pdir_of(uint32_t vaddr)
+{
+	return vaddr >= KERNEL_BASE ? page_directory : percpu_read(active_pdir);
+}
+
+uint32_t alloc_page(uint32_t vaddr, uint32_t flags)
+{
+	uint32_t *pte, paddr;
+
+	/* We may need to allocate a new page table within the page directory
+	   in order to setup the requested virtual address. */
+	pte = get_pte(pdir_of(vaddr), vaddr, flags);
+	if (!pte)
+		return 0;
 
 	/* Now we can set the page table entry. */
-	paddr = pop_page();
+	paddr = pmm_alloc();
 	if (!paddr)
 		return 0;
-	ptab[tabent] = paddr | PAGE_PRESENT | flags;
+	*pte = paddr | PAGE_PRESENT | flags;
 	return paddr;
 }
 
+/* Next free address in the vmalloc window */
+static uint32_t kernel_vaddr = VMALLOC_START;
+
 uint32_t alloc_kernel_page(uint32_t flags)
 {
-	static uint32_t vaddr = 0x800000;
-	if (alloc_page(vaddr, flags)) {
-		vaddr += PAGE_SIZE;
-		return vaddr - PAGE_SIZE;
+	if (kernel_vaddr >= VMALLOC_END)
+		return 0;
+	if (alloc_page(kernel_vaddr, flags)) {
+		kernel_vaddr += PAGE_SIZE;
+		return kernel_vaddr - PAGE_SIZE;
 	}
 	return 0;
 }
 
+/*
+ * Maps size bytes of physical memory at paddr, which need not be page aligned,
+ * into kernel space, for firmware tables and memory-mapped device registers.
+ * Device registers must be mapped with PAGE_NOCACHE. Cacheable memory covered
+ * by the direct map is returned from there without mapping anything. Returns
+ * the virtual address of paddr, or 0 if out of memory.
+ */
+uint32_t map_phys(uint32_t paddr, uint32_t size, uint32_t flags)
+{
+	uint32_t offset = paddr & 0xfff;
+	uint32_t npages = PAGE_ALIGN(offset + size) / PAGE_SIZE;
+	uint32_t vaddr = kernel_vaddr, i, *pte;
+
+	if (!(flags & (PAGE_NOCACHE | PAGE_WRITETHROUGH))
+	    && paddr < direct_map_end && size <= direct_map_end - paddr)
+		return (uint32_t) phys_to_virt(paddr);
+
+	if (npages > (VMALLOC_END - kernel_vaddr) / PAGE_SIZE)
+		return 0;
+	paddr -= offset;
+	for (i = 0; i < npages; i++) {
+		pte = get_pte(page_directory, vaddr + i * PAGE_SIZE, flags);
+		if (!pte)
+			return 0;
+		*pte = (paddr + i * PAGE_SIZE) | PAGE_PRESENT | flags;
+	}
+
+	kernel_vaddr += npages * PAGE_SIZE;
+	return vaddr + offset;
+}
+
+/* Page source for the kernel heap. Consecutive calls return consecutive
+   pages as long as nothing else allocates kernel pages in between. */
+void *alloc_heap_page()
+{
+	return (void*) alloc_kernel_page(PAGE_WRITABLE);
+}
+
 void free_page(uint32_t vaddr)
 {
+	uint32_t *pdir = pdir_of(vaddr);
 	int dirent = (vaddr >> 22) & 0x3ff;
-	int tabent = (vaddr >> 12) & 0x3ff;
-
-	uint32_t *pdir = (uint32_t*) 0x401000;
-	uint32_t *ptab = (uint32_t*) (0x400000 + dirent * PAGE_SIZE);
-	uint32_t paddr;
+	uint32_t *pte, paddr;
 
-	if (!(pdir[dirent] & PAGE_PRESENT) || !(ptab[tabent] & PAGE_PRESENT))
+	if (!(pdir[dirent] & PAGE_PRESENT) || (pdir[dirent] & PAGE_LARGE))
+		kpanic("tried to free unallocated page!");
+	pte = get_pte(pdir, vaddr, 0);
+	if (!(*pte & PAGE_PRESENT))
 		kpanic("tried to free unallocated page!");
 
-	paddr = ptab[tabent] & ~0xfff;
-	ptab[tabent] = 0;
-	push_page(paddr);
+	paddr = *pte & ~0xfff;
+	*pte = 0;
+	pmm_free(paddr);
 	flush_tlb();
 }
 
 uint32_t vtophys(uint32_t vaddr)
 {
+	uint32_t *pdir = pdir_of(vaddr);
 	int dirent = (vaddr >> 22) & 0x3ff;
-	int tabent = (vaddr >> 12) & 0x3ff;
+	uint32_t pte;
 
-	uint32_t *pdir = (uint32_t*) 0x401000;
-	uint32_t *ptab = (uint32_t*) (0x400000 + dirent * PAGE_SIZE);
+	if (vaddr >= KERNEL_BASE && vaddr < VMALLOC_START)
+		return virt_to_phys(vaddr);
+	if (!(pdir[dirent] & PAGE_PRESENT))
+		return 0;
 
-	if (!(pdir[dirent] & PAGE_PRESENT) || !(ptab[tabent] & PAGE_PRESENT))
+	pte = *get_pte(pdir, vaddr, 0);
+	if (!(pte & PAGE_PRESENT))
 		return 0;
-	
-	return (ptab[tabent] & ~0xfff) | (vaddr & 0xfff);
+	return (pte & ~0xfff) | (vaddr & 0xfff);
+}
+
+/*
+ * Returns the access a user address is mapped with, as the PAGE_ flags that
+ * both its page directory and page table entries allow, or 0 if it's not
+ * mapped. Large pages only ever map the kernel.
+ */
+uint32_t page_flags(uint32_t vaddr)
+{
+	uint32_t *pdir = pdir_of(vaddr);
+	int dirent = (vaddr >> 22) & 0x3ff;
+	uint32_t pte;
+
+	if (vaddr >= KERNEL_BASE || !(pdir[dirent] & PAGE_PRESENT))
+		return 0;
+
+	pte = *get_pte(pdir, vaddr, 0);
+	if (!(pte & PAGE_PRESENT))
+		return 0;
+	return pte & pdir[dirent] & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+}
+
+/*
+ * Allocates and initializes a page directory for a new address space, sharing
+ * the kernel's page tables and mapping nothing in user space. Only the kernel
+ * entries are copied, as the kernel range never gains new page tables. Returns
+ * the page directory's address in the direct map and sets *cr3 to its physical
+ * address, or returns NULL if out of memory.
+ */
+uint32_t *alloc_page_directory(uint32_t *cr3)
+{
+	uint32_t paddr = pmm_alloc(), *pdir;
+
+	if (!paddr)
+		return NULL;
+	pdir = phys_to_virt(paddr);
+	*cr3 = paddr;
+
+	memset(pdir, 0, KERNEL_PDE * sizeof(uint32_t));
+	memcpy(pdir + KERNEL_PDE, page_directory + KERNEL_PDE,
+	       PAGE_SIZE - KERNEL_PDE * sizeof(uint32_t));
+	return pdir;
 }
 
 /*
  * Allocates a page for use by a user process at the specified address within
- * that process's virtual address space. This page is also mapped into kernel
- * space so that the kernel can access it, and this kernel virtual address is
- * returned on success.
+ * that process's virtual address space. The kernel reaches the page through
+ * the direct map, and that address is returned on success.
  */
 uint32_t alloc_user_page(struct task *t, uint32_t uvaddr)
 {
-	struct user_page *newpg, *newtab;
-	int dirent = (uvaddr >> 22) & 0x3ff;
-	int tabent = (uvaddr >> 12) & 0x3ff;
-	uint32_t tabpage;
-
-	if (!(t->pdir[dirent] & PAGE_PRESENT)) {
-		/* If a page table covering the address we want to map to does
-		   not already exist, we need to allocate one and add it to the
-		   process's page directory. */
-		newtab = kmalloc(sizeof(struct user_page), 0);
-		if (!newtab)
-			return 0;
-		
-		tabpage = alloc_kernel_page(PAGE_WRITABLE);
-		if (!tabpage)
-			return 0;
-		newtab->kvaddr = tabpage;
-		t->pdir[dirent] = vtophys(tabpage) | PAGE_PRESENT
-		                  | PAGE_WRITABLE | PAGE_USER;
+	struct user_page *newpg;
+	uint32_t *pte, paddr;
+
+	if (uvaddr >= KERNEL_BASE)
+		return 0;
 
-		/* Add to the list of the process's page tables. */
-		newtab->next = t->ptabs;
-		t->ptabs = newtab;
-	}
-	else {
-		/* If the page table already exists, find it in the list. */
-		newtab = t->ptabs;
-		while (vtophys(newtab->kvaddr) != (t->pdir[dirent] & ~0xfff))
-			newtab = newtab->next;
-		tabpage = newtab->kvaddr;
-	}
-	
-	/* Now we can create a new entry in the process's page list, and
-	   allocate a page in the kernel's virtual address space to use. */
 	newpg = kmalloc(sizeof(struct user_page), 0);
 	if (!newpg)
 		return 0;
 
-	newpg->kvaddr = alloc_kernel_page(PAGE_USER | PAGE_WRITABLE);
-	if (!newpg->kvaddr) {
+	/* The page table, if a new one is needed, goes straight into the
+	   process's page directory */
+	pte = get_pte(t->pdir, uvaddr, PAGE_USER);
+	paddr = pte ? pmm_alloc() : 0;
+	if (!paddr) {
 		kfree(newpg);
 		return 0;
 	}
+	*pte = paddr | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
 
-	/* We *also* map this same page into user address space by adding it to
-	   the page table we either found or created earlier. */
+	newpg->kvaddr = (uint32_t) phys_to_virt(paddr);
 	newpg->uvaddr = uvaddr;
-	((uint32_t*) tabpage)[tabent] = vtophys(newpg->kvaddr) | PAGE_PRESENT
-	                                | PAGE_WRITABLE | PAGE_USER;
-
 	newpg->next = t->pages;
 	t->pages = newpg;
 
-	if (t == current)
+	if (t->pdir == percpu_read(active_pdir))
 		flush_tlb();
 	return newpg->kvaddr;
 }
+
+/*
+ * Frees a process's page directory along with every page and page table in
+ * its user address space. If the address space is loaded, which it is when a
+ * process exits, the kernel's page directory is loaded in its place, and the
+ * task carries on without an address space like a kernel thread.
+ */
+void free_address_space(struct task *t)
+{
+	uint32_t *pdir = t->pdir, cr3 = t->cr3, *ptab, flags;
+	struct user_page *pg;
+	int i, j;
+
+	flags = irq_save();
+	t->pdir = NULL;
+	t->cr3 = 0;
+	if (pdir == percpu_read(active_pdir)) {
+		asm volatile("mov %0, %%cr3"
+			     : : "r" (virt_to_phys(page_directory)) : "memory");
+		percpu_write(active_pdir, page_directory);
+	}
+	irq_restore(flags);
+
+	for (i = 0; i < KERNEL_PDE; i++) {
+		if (!(pdir[i] & PAGE_PRESENT))
+			continue;
+		ptab = phys_to_virt(pdir[i] & ~0xfff);
+		for (j = 0; j < 1024; j++) {
+			if (ptab[j] & PAGE_PRESENT)
+				pmm_free(ptab[j] & ~0xfff);
+		}
+		pmm_free(pdir[i] & ~0xfff);
+	}
+	pmm_free(cr3);
+
+	while (t->pages) {
+		pg = t->pages;
+		t->pages = pg->next;
+		kfree(pg);
+	}
+}
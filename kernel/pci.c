@@ -5,32 +5,45 @@
 #define PCI_ADDR 0xcf8
 #define PCI_DATA 0xcfc
 
-static inline uint32_t pci_set_config(struct pci_addr addr, uint8_t offset)
+static inline void pci_set_config(struct pci_addr addr, uint8_t offset)
 {
         uint32_t address = ((uint32_t) addr.bus << 16)
                            | ((uint32_t) addr.device << 11)
                            | ((uint32_t) addr.function << 8)
                            | (offset & 0xfc)
                            | (1 << 31);
-        outl(PCI_ADDR, address);
+        outl(PCI_ADDR, address, false);
 }
 
-static uint8_t pci_config_read8(struct pci_addr addr, uint8_t offset)
+uint8_t pci_config_read8(struct pci_addr addr, uint8_t offset)
 {
         pci_set_config(addr, offset);
-        return inl(PCI_DATA) >> ((offset & 0x3) * 8);
+        return inl(PCI_DATA, false) >> ((offset & 0x3) * 8);
 }
 
-static uint16_t pci_config_read16(struct pci_addr addr, uint8_t offset)
+uint16_t pci_config_read16(struct pci_addr addr, uint8_t offset)
 {
         pci_set_config(addr, offset);
-        return inl(PCI_DATA) >> (((offset >> 1) & 0x1) * 16);
+        return inl(PCI_DATA, false) >> (((offset >> 1) & 0x1) * 16);
 }
 
-static uint32_t pci_config_read32(struct pci_addr addr, uint8_t offset)
+uint32_t pci_config_read32(struct pci_addr addr, uint8_t offset)
 {
         pci_set_config(addr, offset);
-        return inl(PCI_DATA);
+        return inl(PCI_DATA, false);
+}
+
+/* Narrow writes go through the 16-bit port window of the data register */
+void pci_config_write16(struct pci_addr addr, uint8_t offset, uint16_t val)
+{
+        pci_set_config(addr, offset);
+        outw(PCI_DATA + (offset & 0x2), val, false);
+}
+
+void pci_config_write32(struct pci_addr addr, uint8_t offset, uint32_t val)
+{
+        pci_set_config(addr, offset);
+        outl(PCI_DATA, val, false);
 }
 
 /* The jankiest possible way to do this. Hopefully temporary. */
@@ -51,13 +64,8 @@ char *pci_bdf_string(struct pci_addr addr)
         return buf;
 }
 
-char *pci_class_string(struct pci_addr addr)
+char *pci_class_string(uint8_t class, uint8_t subclass)
 {
-        uint8_t class, subclass;
-
-        class = pci_config_read8(addr, 11);
-        subclass = pci_config_read8(addr, 10);
-
         switch (class) {
         case 1:
                 switch (subclass) {
@@ -161,41 +169,244 @@ char *pci_class_string(struct pci_addr addr)
         return "Unkown Device";
 }
 
-static void pci_check_device(int bus, int dev)
+/*
+ * Sizes a function's BARs by writing all ones to each and reading back which
+ * bits stick, with decoding off meanwhile so the probe values don't claim
+ * anyone's addresses. The upper half of a 64-bit BAR takes the next slot, and
+ * memory above 4 GiB is left out as it can't be reached anyway.
+ */
+static void pci_read_bars(struct pci_device *dev, int nbars)
 {
-        struct pci_addr addr;
-        int func;
-        uint16_t vid;
+        uint16_t command = pci_config_read16(dev->addr, PCI_COMMAND);
+        uint32_t orig, mask;
+        struct pci_bar *bar;
+        uint8_t offset;
 
-        for (func = 0; func < 8; func++) {
-                addr.bus = bus;
-                addr.device = dev;
-                addr.function = func;
+        pci_config_write16(dev->addr, PCI_COMMAND,
+                           command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+        for (int i = 0; i < nbars; i++) {
+                offset = PCI_BAR0 + 4 * i;
+                orig = pci_config_read32(dev->addr, offset);
+                pci_config_write32(dev->addr, offset, 0xffffffff);
+                mask = pci_config_read32(dev->addr, offset);
+                pci_config_write32(dev->addr, offset, orig);
 
-                vid = pci_config_read16(addr, 0);
-                if (vid == 0xffff) {
-                        /* Device not present */
-                        return;
+                bar = &dev->bars[i];
+                bar->io = orig & PCI_BAR_IO;
+                if (bar->io) {
+                        bar->base = orig & PCI_BAR_IO_MASK;
+                        mask &= PCI_BAR_IO_MASK & 0xffff;
                 }
                 else {
-                        kprintf("pci: found %s vid=0x%w %s\n",
-                                pci_bdf_string(addr), vid,
-                                pci_class_string(addr));
+                        bar->base = orig & PCI_BAR_MEM_MASK;
+                        bar->prefetch = orig & PCI_BAR_PREFETCH;
+                        mask &= PCI_BAR_MEM_MASK;
+                }
+                bar->size = mask ? ~mask + 1 : 0;
+                if (bar->io)
+                        bar->size &= 0xffff;
+
+                if (!bar->io && (orig & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64
+                    && i + 1 < nbars) {
+                        i++;
+                        if (pci_config_read32(dev->addr, offset + 4))
+                                bar->size = 0;
                 }
+                if (!bar->size)
+                        bar->base = 0;
         }
+        pci_config_write16(dev->addr, PCI_COMMAND, command);
 }
 
-static void pci_enumerate()
+/*
+ * Walks a function's capability list, returning the offset of the capability
+ * with the given ID, or 0 if it has none. The walk is bounded, so a corrupt
+ * list that loops can't hang it.
+ */
+uint8_t pci_find_capability(struct pci_addr addr, uint8_t id)
+{
+        uint8_t pos;
+
+        if (!(pci_config_read16(addr, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+                return 0;
+        pos = pci_config_read8(addr, PCI_CAP_PTR) & ~0x3;
+        for (int i = 0; pos && i < 48; i++) {
+                if (pci_config_read8(addr, pos) == id)
+                        return pos;
+                pos = pci_config_read8(addr, pos + 1) & ~0x3;
+        }
+        return 0;
+}
+
+static struct pci_device pci_devices[PCI_MAX_DEVICES];
+static int pci_ndevices;
+static struct pci_driver *pci_drivers;
+
+/* Buses scanned so far, one bit each */
+static uint32_t pci_buses_seen[256 / 32];
+
+static void pci_scan_bus(uint8_t bus);
+
+/* Records a present function, descending into the bus behind a bridge */
+static void pci_add_function(struct pci_addr addr)
+{
+        struct pci_device *dev;
+        uint32_t id, class;
+        uint8_t header, secondary;
+
+        if (pci_ndevices == PCI_MAX_DEVICES) {
+                kprintf("pci: too many devices, %s left out\n",
+                        pci_bdf_string(addr));
+                return;
+        }
+        dev = &pci_devices[pci_ndevices++];
+        id = pci_config_read32(addr, PCI_VENDOR_ID);
+        class = pci_config_read32(addr, PCI_REVISION);
+        header = pci_config_read8(addr, PCI_HEADER_TYPE) & PCI_HEADER_MASK;
+
+        dev->addr = addr;
+        dev->vendor = id & 0xffff;
+        dev->device = id >> 16;
+        dev->revision = class & 0xff;
+        dev->prog_if = (class >> 8) & 0xff;
+        dev->subclass = (class >> 16) & 0xff;
+        dev->class = class >> 24;
+        dev->irq = pci_config_read8(addr, PCI_INTERRUPT_LINE);
+
+        kprintf("pci: %s %04x:%04x %s\n", pci_bdf_string(addr), dev->vendor,
+                dev->device, pci_class_string(dev->class, dev->subclass));
+
+        if (header == PCI_HEADER_NORMAL) {
+                pci_read_bars(dev, PCI_NUM_BARS);
+                dev->msi_cap = pci_find_capability(addr, PCI_CAP_ID_MSI);
+                dev->msix_cap = pci_find_capability(addr, PCI_CAP_ID_MSIX);
+        }
+        else if (header == PCI_HEADER_BRIDGE) {
+                pci_read_bars(dev, 2);
+                /* A bridge the firmware left unconfigured has a secondary
+                   bus of 0, which would lead back to a scanned bus */
+                secondary = pci_config_read8(addr, PCI_SECONDARY_BUS);
+                if (secondary > addr.bus)
+                        pci_scan_bus(secondary);
+        }
+}
+
+/*
+ * Scans the devices on a bus. Only function 0 is checked for a missing device,
+ * and the others only on multi-function devices, so an empty slot costs a
+ * single config read. A bus is only scanned once.
+ */
+static void pci_scan_bus(uint8_t bus)
 {
-        int bus, dev;
+        struct pci_addr addr = { bus, 0, 0 };
+        int nfuncs;
 
-        for (bus = 0; bus < 256; bus++) {
-                for (dev = 0; dev < 32; dev++) {
-                        pci_check_device(bus, dev);
+        if (pci_buses_seen[bus / 32] & (1 << bus % 32))
+                return;
+        pci_buses_seen[bus / 32] |= 1 << bus % 32;
+
+        for (addr.device = 0; addr.device < 32; addr.device++) {
+                addr.function = 0;
+                if (pci_config_read16(addr, PCI_VENDOR_ID) == 0xffff)
+                        continue;
+                nfuncs = pci_config_read8(addr, PCI_HEADER_TYPE)
+                         & PCI_HEADER_MULTI ? 8 : 1;
+                for (; addr.function < nfuncs; addr.function++) {
+                        if (pci_config_read16(addr, PCI_VENDOR_ID) != 0xffff)
+                                pci_add_function(addr);
                 }
         }
 }
 
+/*
+ * Builds the device table by walking the bus tree from bus 0, through bridges.
+ * A multi-function host bridge means there are several host controllers, with
+ * function n the root of bus n.
+ */
+static void pci_enumerate()
+{
+        struct pci_addr host = { 0, 0, 0 };
+
+        if (!(pci_config_read8(host, PCI_HEADER_TYPE) & PCI_HEADER_MULTI)) {
+                pci_scan_bus(0);
+                return;
+        }
+        for (host.function = 0; host.function < 8; host.function++) {
+                if (pci_config_read16(host, PCI_VENDOR_ID) != 0xffff)
+                        pci_scan_bus(host.function);
+        }
+}
+
+static bool pci_match(const struct pci_device_id *id, struct pci_device *dev)
+{
+        return (id->vendor == PCI_ANY_ID || id->vendor == dev->vendor)
+               && (id->device == PCI_ANY_ID || id->device == dev->device)
+               && (id->class == PCI_ANY_ID || id->class == dev->class)
+               && (id->subclass == PCI_ANY_ID || id->subclass == dev->subclass);
+}
+
+/* Offers a device to a driver, binding them if it matches and probes fine */
+static void pci_bind(struct pci_driver *drv, struct pci_device *dev)
+{
+        const struct pci_device_id *id;
+
+        if (dev->driver)
+                return;
+        for (id = drv->ids; id->vendor; id++) {
+                if (!pci_match(id, dev))
+                        continue;
+                if (!drv->probe(dev))
+                        dev->driver = drv;
+                return;
+        }
+}
+
+/*
+ * Registers a driver and probes it against every unclaimed device it matches,
+ * binding it to those whose probe returns 0. Returns the number bound.
+ */
+int pci_register_driver(struct pci_driver *drv)
+{
+        int n = 0;
+
+        drv->next = pci_drivers;
+        pci_drivers = drv;
+        for (int i = 0; i < pci_ndevices; i++) {
+                pci_bind(drv, &pci_devices[i]);
+                if (pci_devices[i].driver == drv)
+                        n++;
+        }
+        return n;
+}
+
+/*
+ * Iterates over the devices with the given IDs, either of which may be
+ * PCI_ANY_ID, returning the next after from, or the first if from is NULL.
+ */
+struct pci_device *pci_get_device(uint16_t vendor, uint16_t device,
+                                  struct pci_device *from)
+{
+        struct pci_device_id id = { vendor, device, PCI_ANY_ID, PCI_ANY_ID };
+        struct pci_device *dev = from ? from + 1 : pci_devices;
+
+        for (; dev < pci_devices + pci_ndevices; dev++) {
+                if (pci_match(&id, dev))
+                        return dev;
+        }
+        return NULL;
+}
+
+/* Enables a device's I/O and memory decoding, and bus mastering if asked */
+void pci_enable_device(struct pci_device *dev, bool master)
+{
+        uint16_t command = pci_config_read16(dev->addr, PCI_COMMAND);
+
+        command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY;
+        if (master)
+                command |= PCI_COMMAND_MASTER;
+        pci_config_write16(dev->addr, PCI_COMMAND, command);
+}
+
 void pci_init()
 {
         pci_enumerate();
@@ -0,0 +1,50 @@
+#include <asm/segment.h>
+#include <kernel/kernel.h>
+#include <kernel/percpu.h>
+
+/* Offsets switch_task relies on */
+_Static_assert(__builtin_offsetof(struct percpu, curr_task) == 4, "curr_task");
+_Static_assert(__builtin_offsetof(struct percpu, next_task) == 8, "next_task");
+_Static_assert(__builtin_offsetof(struct percpu, tss) == 32, "tss");
+_Static_assert(sizeof(struct tss) == 104, "tss size");
+
+/* Defined in start.s */
+extern uint64_t gdt[];
+
+static struct percpu percpu_area[NR_CPUS];
+
+/* Sets the base address and byte granular limit of a GDT descriptor */
+static void gdt_set_segment(uint16_t sel, uint32_t base, uint32_t limit)
+{
+        uint8_t *d = (uint8_t*) &gdt[sel / 8];
+
+        d[0] = limit & 0xff;
+        d[1] = (limit >> 8) & 0xff;
+        d[2] = base & 0xff;
+        d[3] = (base >> 8) & 0xff;
+        d[4] = (base >> 16) & 0xff;
+        d[6] = (d[6] & 0xf0) | ((limit >> 16) & 0x0f);
+        d[7] = (base >> 24) & 0xff;
+}
+
+/*
+ * Sets up the boot CPU's per-CPU block, its TSS, and the segments pointing at
+ * them, then loads the task register and %fs. Must run before anything uses
+ * per-CPU data, including current.
+ */
+void percpu_init()
+{
+        struct percpu *cpu = &percpu_area[0];
+
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->self = cpu;
+        cpu->cpu = 0;
+        cpu->tss.ss0 = KERNEL_DS;
+        cpu->tss.iomap_base = sizeof(struct tss);
+
+        gdt_set_segment(GDT_TSS, (uint32_t) &cpu->tss, sizeof(struct tss) - 1);
+        gdt_set_segment(GDT_PERCPU, (uint32_t) cpu, sizeof(*cpu) - 1);
+
+        asm volatile("ltr %w0" : : "r" (GDT_TSS));
+        asm volatile("mov %w0, %%fs" : : "r" (GDT_PERCPU) : "memory");
+}
@@ -0,0 +1,100 @@
+#include <asm/io.h>
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/irq.h>
+#include <kernel/pic.h>
+
+/*
+ * Driver for the legacy pair of 8259 PICs, which route the ISA IRQs unless the
+ * APIC code takes over from them.
+ */
+
+/* 8259 PIC I/O ports and commands */
+#define PIC0_CMD 0x20
+#define PIC0_DATA 0x21
+#define PIC1_CMD 0xa0
+#define PIC1_DATA 0xa1
+#define PIC_EOI 0x20
+#define PIC_READ_ISR 0x0b
+
+/* Initialization command words */
+#define ICW1_INIT 0x11 /* edge triggered, cascaded, ICW4 follows */
+#define ICW3_MASTER 0x04 /* slave on IRQ 2 */
+#define ICW3_SLAVE 0x02
+#define ICW4_8086 0x01
+
+static void pic_mask(int irq)
+{
+        uint16_t port = irq < 8 ? PIC0_DATA : PIC1_DATA;
+        outb(port, inb(port, false) | (1 << (irq & 7)), false);
+}
+
+static void pic_unmask(int irq)
+{
+        uint16_t port = irq < 8 ? PIC0_DATA : PIC1_DATA;
+        outb(port, inb(port, false) & ~(1 << (irq & 7)), false);
+}
+
+/*
+ * Acknowledges an IRQ at the PIC(s). Returns false if it turns out to be a
+ * spurious IRQ 7 or 15, which is not in service and must not be acknowledged
+ * (except at the master, for a spurious IRQ 15 coming through the cascade).
+ */
+static bool pic_eoi(int irq)
+{
+        uint16_t cmd = irq < 8 ? PIC0_CMD : PIC1_CMD;
+
+        if ((irq & 7) == 7) {
+                outb(cmd, PIC_READ_ISR, false);
+                if (!(inb(cmd, false) & 0x80)) {
+                        if (irq == 15)
+                                outb(PIC0_CMD, PIC_EOI, false);
+                        return false;
+                }
+        }
+
+        if (irq >= 8)
+                outb(PIC1_CMD, PIC_EOI, false);
+        outb(PIC0_CMD, PIC_EOI, false);
+        return true;
+}
+
+static struct irq_chip pic_chip = {
+        .name = "8259",
+        .mask = pic_mask,
+        .unmask = pic_unmask,
+        .eoi = pic_eoi,
+};
+
+/*
+ * Programs the PICs to deliver the ISA IRQs on vectors starting at INUM_IRQ0,
+ * clear of the processor exceptions, and routes those IRQs through them. Every
+ * line but the cascade starts masked until a driver registers for it.
+ */
+void pic_init()
+{
+        outb(PIC0_CMD, ICW1_INIT, true);
+        outb(PIC1_CMD, ICW1_INIT, true);
+        outb(PIC0_DATA, INUM_IRQ0, true);
+        outb(PIC1_DATA, INUM_IRQ0 + 8, true);
+        outb(PIC0_DATA, ICW3_MASTER, true);
+        outb(PIC1_DATA, ICW3_SLAVE, true);
+        outb(PIC0_DATA, ICW4_8086, true);
+        outb(PIC1_DATA, ICW4_8086, true);
+
+        outb(PIC0_DATA, 0xfb, true);
+        outb(PIC1_DATA, 0xff, true);
+
+        for (int irq = 0; irq < NR_ISA_IRQS; irq++)
+                irq_set_chip(irq, &pic_chip, false);
+}
+
+/*
+ * Masks every line, for when the I/O APIC takes over. The PICs stay remapped,
+ * so an interrupt that was already on its way still lands on an IRQ vector.
+ */
+void pic_disable()
+{
+        outb(PIC0_DATA, 0xff, true);
+        outb(PIC1_DATA, 0xff, true);
+}
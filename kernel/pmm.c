@@ -0,0 +1,40 @@
+#include <kernel/kernel.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+
+/*
+ * Physical page allocator. Free pages are kept on a stack of their physical
+ * addresses, so allocating and freeing are both O(1). This file has no
+ * hardware dependencies so it can also be built into the host test harness.
+ */
+
+static uint32_t page_stack[PMM_MAX_PAGES];
+static uint32_t stackp;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+/* Returns the physical address of a free page, or 0 if there are none */
+uint32_t pmm_alloc()
+{
+	uint32_t paddr = 0;
+
+	spin_lock(&pmm_lock);
+	if (stackp > 0)
+		paddr = page_stack[--stackp];
+	spin_unlock(&pmm_lock);
+	return paddr;
+}
+
+void pmm_free(uint32_t paddr)
+{
+	spin_lock(&pmm_lock);
+	if (stackp == PMM_MAX_PAGES)
+		kpanic("free page stack overflow");
+	page_stack[stackp++] = paddr;
+	spin_unlock(&pmm_lock);
+}
+
+/* Returns the number of free pages */
+uint32_t pmm_count()
+{
+	return stackp;
+}
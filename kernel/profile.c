@@ -0,0 +1,170 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/cmdline.h>
+#include <kernel/irq.h>
+#include <kernel/apic.h>
+#include <kernel/paging.h>
+#include <kernel/sched.h>
+#include <kernel/serial.h>
+#include <kernel/profile.h>
+
+/*
+ * A sampling profiler driven by a timer interrupt. When enabled with the
+ * prof=<hz> command line option, the local APIC timer is started at that rate,
+ * or failing that the PIT is sped up to it, and every tick records where the
+ * interrupted task was. Samples are written out over
+ * the serial port on request (Ctrl+Alt+F10), to be symbolized on the host by
+ * tools/profsym.py into folded stacks for flame graphs.
+ */
+
+static struct prof_sample samples[PROF_SAMPLES];
+static uint32_t nsamples;
+static uint32_t dropped;
+static uint32_t prof_hz;
+static bool paused;
+
+/* Kernel thread which writes out the samples, since that's far too slow to
+   do from the keyboard interrupt */
+static struct task *profd_task;
+static wait_queue_t profd_wait;
+static volatile bool dump_requested;
+
+/*
+ * Records a sample of the interrupted context on every tick of the sampling
+ * timer. On the PIT this shares IRQ 0 with the scheduler's handler, which runs
+ * first but only sets need_resched, so the sample is taken within the same
+ * interrupt, of the task that was interrupted. Any switch comes after every
+ * handler has run, in preempt_schedule_irq().
+ */
+static int prof_sample(int irq, void *dev, struct exception *e)
+{
+        struct prof_sample *s;
+        uint32_t ebp, next, stack;
+
+        if (paused)
+                return IRQ_HANDLED;
+        if (nsamples == PROF_SAMPLES) {
+                dropped++;
+                return IRQ_HANDLED;
+        }
+
+        s = &samples[nsamples++];
+        s->pid = current->pid;
+        s->user = user_exception(*e);
+        s->pc[0] = e->eip;
+        s->depth = 1;
+        if (s->user)
+                return IRQ_HANDLED;
+
+        /* Follow the saved frame pointers up the interrupted kernel stack.
+           The exception frame itself was pushed onto that same stack page, so
+           anything pointing outside of it is not a frame pointer. */
+        stack = (uint32_t) e & ~(PAGE_SIZE - 1);
+        ebp = e->ebp;
+        while (s->depth < PROF_DEPTH) {
+                if ((ebp & 3) || ebp < stack || ebp + 8 > stack + PAGE_SIZE)
+                        break;
+                s->pc[s->depth] = ((uint32_t*) ebp)[1];
+                if (!s->pc[s->depth])
+                        break;
+                s->depth++;
+
+                next = ((uint32_t*) ebp)[0];
+                if (next <= ebp)
+                        break;
+                ebp = next;
+        }
+        return IRQ_HANDLED;
+}
+
+static void prof_dump()
+{
+        char line[16 + PROF_DEPTH * 9];
+        struct prof_sample *s;
+        int len;
+
+        paused = true;
+
+        len = snprintf(line, sizeof(line),
+                       "PROF-BEGIN hz=%u samples=%u dropped=%u\n",
+                       prof_hz, nsamples, dropped);
+        serial_write(line, len);
+
+        for (s = samples; s < samples + nsamples; s++) {
+                len = snprintf(line, sizeof(line), "S %u %c",
+                               s->pid, s->user ? 'u' : 'k');
+                for (int i = 0; i < s->depth; i++)
+                        len += snprintf(line + len, sizeof(line) - len,
+                                        " %08x", s->pc[i]);
+                line[len++] = '\n';
+                serial_write(line, len);
+        }
+        serial_write("PROF-END\n", 9);
+
+        nsamples = 0;
+        dropped = 0;
+        paused = false;
+}
+
+static void profd()
+{
+        uint32_t flags;
+
+        for (;;) {
+                flags = irq_save();
+                while (!dump_requested)
+                        sleep_on(&profd_wait);
+                dump_requested = false;
+                irq_restore(flags);
+
+                prof_dump();
+        }
+}
+
+/*
+ * Asks for the samples collected so far to be written out and discarded.
+ * Safe to call from interrupts.
+ */
+void prof_request_dump()
+{
+        if (!profd_task)
+                return;
+        dump_requested = true;
+        wake_up(&profd_wait);
+}
+
+void prof_init()
+{
+        uint32_t hz = cmdline_uint("prof", 0);
+        char *source = "LAPIC timer";
+        int irq = IRQ_LAPIC_TIMER;
+
+        if (!hz)
+                return;
+        if (hz > PROF_MAX_HZ)
+                hz = PROF_MAX_HZ;
+
+        profd_task = spawn_kthread(profd);
+        if (!profd_task) {
+                kprintf("prof: failed to start profd\n");
+                return;
+        }
+
+        /* The PIT also drives the scheduler, so it must run at a whole
+           multiple of the jiffy rate */
+        if (lapic_timer_start(hz)) {
+                hz = hz < HZ ? HZ : hz - hz % HZ;
+                timer_set_rate(hz);
+                source = "PIT";
+                irq = 0;
+        }
+
+        prof_hz = hz;
+        if (irq_register(irq, prof_sample, &prof_hz, "prof")) {
+                kprintf("prof: failed to register timer interrupt\n");
+                lapic_timer_stop();
+                return;
+        }
+        kprintf("prof: sampling at %u Hz from the %s, Ctrl+Alt+F10 dumps "
+                "to serial\n", hz, source);
+}
@@ -1,9 +1,14 @@
 #include <asm/io.h>
 #include <asm/interrupt.h>
+#include <asm/segment.h>
 
 #include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/irq.h>
 #include <kernel/paging.h>
+#include <kernel/pmm.h>
 #include <kernel/sched.h>
+#include <kernel/timer.h>
 
 extern void switch_task();
 extern void iret_to_task();
@@ -14,8 +19,11 @@ static struct task process_table[NUM_TASKS];
 static uint32_t next_pid;
 static uint32_t schedule_timer;
 
-struct task *current;
-struct task *_next;
+/* The PIT can run faster than HZ, e.g. for profiling, so count the ticks
+   making up each jiffy */
+static uint32_t ticks_per_jiffy;
+static uint32_t tick;
+
 uint32_t jiffies;
 
 static struct task *find_empty_task()
@@ -39,9 +47,18 @@ struct task *get_process(int pid)
         return NULL;
 }
 
-/* Initial kernel stack for a newly created process. */
+/* Kernel stacks are single pages, used through the direct map */
+static uint32_t alloc_kstack()
+{
+        uint32_t paddr = pmm_alloc();
+
+        return paddr ? (uint32_t) phys_to_virt(paddr) : 0;
+}
+
+/* Initial kernel stack for a newly created process. The registers are the
+   callee-saved ones switch_task pops. */
 struct kstack_template {
-        uint32_t regs[8];
+        uint32_t regs[4];
         uint32_t ret;
         struct exception e;
 };
@@ -54,7 +71,6 @@ struct kstack_template {
 struct task *spawn_task(uint32_t entry)
 {
         struct task *t;
-        uint32_t tmp;
         struct kstack_template *kstack;
         
         t = find_empty_task();
@@ -62,19 +78,17 @@ struct task *spawn_task(uint32_t entry)
                 return NULL;
         memset(t, 0, sizeof(*t));
 
-        t->pdir = (uint32_t*) alloc_kernel_page(PAGE_WRITABLE);
+        t->pdir = alloc_page_directory(&t->cr3);
         if (!t->pdir)
                 return NULL;
-        t->cr3 = vtophys((uint32_t) t->pdir);
-        memcpy(t->pdir, process_table[0].pdir, PAGE_SIZE);
 
-        tmp = alloc_kernel_page(PAGE_WRITABLE);
-        if (!tmp) {
-                free_page(t->cr3);
+        t->kstack = alloc_kstack();
+        if (!t->kstack) {
+                pmm_free(t->cr3);
                 return NULL;
         }
-        t->tss_esp0 = tmp + PAGE_SIZE;
-        t->esp = tmp + PAGE_SIZE - sizeof(struct kstack_template);
+        t->tss_esp0 = t->kstack + PAGE_SIZE;
+        t->esp = t->kstack + PAGE_SIZE - sizeof(struct kstack_template);
         kstack = (struct kstack_template*) t->esp;
         memset(kstack, 0, sizeof(*kstack));
         
@@ -86,10 +100,11 @@ struct task *spawn_task(uint32_t entry)
         kstack->e.gs = 0x23;
         kstack->e.eflags = 1 << 9; /* Enable interrupts */
         kstack->e.eip = entry;
-        kstack->e.esp = 0xfffff000;
+        kstack->e.esp = KERNEL_BASE;
         kstack->ret = (uint32_t) iret_to_task;
 
         t->pid = next_pid++;
+        t->ppid = current->pid;
         t->state = TASK_SLEEP;
         return t;
 }
@@ -104,66 +119,273 @@ struct task *spawn_kthread(void (*code)())
                 return NULL;
         memset(t, 0, sizeof(*t));
 
-        t->esp = alloc_kernel_page(PAGE_WRITABLE);
-        if (!t->esp)
+        t->kstack = alloc_kstack();
+        if (!t->kstack)
                 return NULL;
-        t->esp += PAGE_SIZE - sizeof(struct kstack_template);
+        t->esp = t->kstack + PAGE_SIZE - sizeof(struct kstack_template);
         kstack = (struct kstack_template*) t->esp;
         memset(kstack, 0, sizeof(*kstack));
 
-        kstack->e.cs = 0x08;
-        kstack->e.ds = 0x10;
-        kstack->e.es = 0x10;
-        kstack->e.fs = 0x10;
-        kstack->e.gs = 0x10;
+        kstack->e.cs = KERNEL_CS;
+        kstack->e.ds = KERNEL_DS;
+        kstack->e.es = KERNEL_DS;
+        kstack->e.fs = GDT_PERCPU;
+        kstack->e.gs = KERNEL_DS;
         kstack->e.eflags = 1 << 9; /* Enable interrupts */
         kstack->e.eip = (uint32_t) code;
         kstack->ret = (uint32_t) iret_to_task;
 
-        t->pdir = page_directory;
-        t->cr3 = (uint32_t) page_directory;
+        /* Kernel threads only touch kernel memory, which every address space
+           maps, so they run on the previous task's and skip a TLB flush */
+        t->pid = next_pid++;
+        t->ppid = current->pid;
         t->state = TASK_RUN;
         return t;
 }
 
+/*
+ * Frees what's left of a task after it has exited and switched away for good,
+ * which is its kernel stack, and frees its process table entry.
+ */
+static void release_task(struct task *t)
+{
+        pmm_free(virt_to_phys(t->kstack));
+        memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Ends the current task. Its address space is freed right away, but it keeps
+ * its kernel stack and process table entry, as a zombie holding the exit
+ * status, until its parent collects them with do_wait(). Tasks without a
+ * parent to wait for them are freed by the next schedule() instead, as they
+ * can't free the stack they're running on. Children of the task lose their
+ * parent, and any that are already zombies are freed.
+ */
+void do_exit(int status)
+{
+        struct task *parent, *t;
+        uint32_t flags;
+        int i;
+
+        if (current == process_table)
+                kpanic("idle task exited");
+        if (current->pdir)
+                free_address_space(current);
+
+        flags = irq_save();
+        for (i = 1; i < NUM_TASKS; i++) {
+                t = process_table + i;
+                if (t->state == TASK_NONE || t->ppid != current->pid)
+                        continue;
+                t->ppid = 0;
+                if (t->state == TASK_ZOMBIE)
+                        release_task(t);
+        }
+
+        current->exit_status = status;
+        parent = get_process(current->ppid);
+        if (parent && parent->state != TASK_ZOMBIE
+            && parent->state != TASK_DEAD) {
+                current->state = TASK_ZOMBIE;
+                wake_up(&parent->child_exit);
+        }
+        else {
+                current->state = TASK_DEAD;
+        }
+        schedule();
+
+        irq_restore(flags);
+        kpanic("exited task was scheduled");
+}
+
+/*
+ * Waits for a child of the current task to exit and frees it, storing its exit
+ * status in *status unless status is NULL. Returns the child's pid, or -ECHILD
+ * if the task has no children.
+ */
+int do_wait(int *status)
+{
+        uint32_t flags = irq_save();
+        struct task *t;
+        bool children;
+        int i, pid;
+
+        for (;;) {
+                children = false;
+                for (i = 1; i < NUM_TASKS; i++) {
+                        t = process_table + i;
+                        if (t->state == TASK_NONE || t->state == TASK_DEAD
+                            || t->ppid != current->pid)
+                                continue;
+                        children = true;
+                        if (t->state != TASK_ZOMBIE)
+                                continue;
+
+                        pid = t->pid;
+                        if (status)
+                                *status = t->exit_status;
+                        release_task(t);
+                        irq_restore(flags);
+                        return pid;
+                }
+                if (!children)
+                        break;
+                sleep_on(&current->child_exit);
+        }
+
+        irq_restore(flags);
+        return -ECHILD;
+}
+
 /*
  * Selects the next running task to grant CPU time and switches to it.
  * NOTE: Interrupts should be disabled before calling this!
  */
 void schedule()
 {
+        struct task *next = process_table;
         int i;
 
-        _next = process_table;
         for (i = 1; i < NUM_TASKS; i++) {
+                if (process_table[i].state == TASK_DEAD
+                    && process_table + i != current)
+                        release_task(process_table + i);
                 if (process_table[i].state != TASK_RUN)
                         continue;
-                if (_next == process_table + 0)
+                if (next == process_table + 0)
                         /* Idle task only picked if everything else is asleep */
-                        _next = process_table + i;
-                if (process_table[i].counter > _next->counter)
-                        _next = process_table + i;
+                        next = process_table + i;
+                if (process_table[i].counter > next->counter)
+                        next = process_table + i;
         }
 
         for (i = 1; i < NUM_TASKS; i++)
                 process_table[i].counter++;
-        _next->counter = 0;
+        next->counter = 0;
         
         schedule_timer = 10;
+        percpu_write(need_resched, 0);
+        if (next != current)
+                percpu_inc(nr_switches);
+        if (next->pdir)
+                percpu_write(active_pdir, next->pdir);
+        percpu_write(next_task, next);
         switch_task();
 }
 
 /*
- * Handles interrupts from the PIT. Checks if any task's sleep timer has expired
- * and switches to that task if it has. Otherwise invokes the scheduler on a
- * regular basis.
+ * Reschedules if a reschedule is pending and the current task can be preempted.
+ * Called by preempt_enable, so it does nothing with interrupts disabled, as the
+ * caller is still in a critical section; the next interrupt exit catches it.
+ */
+void preempt_schedule()
+{
+        uint32_t flags;
+
+        if (!preemptible() || irqs_disabled())
+                return;
+
+        flags = irq_save();
+        if (percpu_read(need_resched))
+                schedule();
+        irq_restore(flags);
+}
+
+/*
+ * Called on the way out of interrupts and exceptions, with interrupts
+ * disabled, to preempt the interrupted task if something asked for it.
+ */
+void preempt_schedule_irq()
+{
+        if (percpu_read(need_resched) && preemptible())
+                schedule();
+}
+
+/*
+ * Lets long running kernel code give up the CPU at a convenient point if its
+ * time is up.
+ */
+void cond_resched()
+{
+        if (percpu_read(need_resched))
+                preempt_schedule();
+}
+
+/*
+ * Gives up the CPU to any other running task.
+ */
+void yield()
+{
+        uint32_t flags = irq_save();
+        schedule();
+        irq_restore(flags);
+}
+
+/*
+ * Puts the current task to sleep on a wait queue until wake_up() is called on
+ * it. Wakeups can be spurious, so callers should loop on their condition, with
+ * interrupts disabled between checking it and sleeping so no wakeup is lost.
+ * The idle task can't sleep, so it just halts until the next interrupt.
+ */
+void sleep_on(wait_queue_t *wq)
+{
+        uint32_t flags = irq_save();
+
+        if (current == process_table) {
+                irqsoff_end(IRQ_SITE);
+                asm volatile("sti; hlt; cli");
+                irqsoff_begin(IRQ_SITE);
+        }
+        else {
+                current->wait_next = *wq;
+                *wq = current;
+                current->state = TASK_SLEEP;
+                schedule();
+        }
+        irq_restore(flags);
+}
+
+/*
+ * Wakes every task sleeping on a wait queue. Safe to call from interrupts. If
+ * the CPU was idle, the woken tasks get it at the next chance rather than at
+ * the end of the idle task's time slice.
+ */
+void wake_up(wait_queue_t *wq)
+{
+        uint32_t flags = irq_save();
+        struct task *t = *wq, *next;
+
+        *wq = NULL;
+        while (t) {
+                next = t->wait_next;
+                t->wait_next = NULL;
+                if (t->state == TASK_SLEEP) {
+                        t->state = TASK_RUN;
+                        if (current == process_table)
+                                percpu_write(need_resched, 1);
+                }
+                t = next;
+        }
+        irq_restore(flags);
+}
+
+/*
+ * Handles interrupts from the PIT. Counts down the tasks' alarms, and asks for
+ * a reschedule when the current time slice is up, which happens on the way out
+ * of the interrupt if the interrupted task is preemptible.
  */
-void handle_timer()
+static int handle_timer(int irq, void *dev, struct exception *e)
 {
         int i;
 
+        if (++tick < ticks_per_jiffy)
+                return IRQ_HANDLED;
+        tick = 0;
+
         jiffies++;
-        schedule_timer--;
+        timer_tick();
+        if (schedule_timer)
+                schedule_timer--;
 
         for (i = 0; i < NUM_TASKS; i++) {
                 if (!process_table[i].alarm)
@@ -174,8 +396,9 @@ void handle_timer()
                         process_table[i].alarm -= 10;
         }
 
-        if (schedule_timer == 0)
-                schedule();
+        if (!schedule_timer)
+                percpu_write(need_resched, 1);
+        return IRQ_HANDLED;
 }
 
 void sched_init()
@@ -184,17 +407,39 @@ void sched_init()
         next_pid = 1;
         jiffies = 0;
         schedule_timer = 10;
-        current = process_table;
+        percpu_write(curr_task, process_table);
 
         /* Initialize the idle task, which main() jumps to later */
         process_table[0].pdir = page_directory;
-        process_table[0].cr3 = (uint32_t) page_directory;
+        process_table[0].cr3 = virt_to_phys(page_directory);
         process_table[0].state = TASK_RUN;
+        percpu_write(active_pdir, page_directory);
+}
+
+/* Starts the PIT ticking the scheduler */
+void timer_init()
+{
+        timer_set_rate(HZ);
+        if (irq_register(0, handle_timer, NULL, "timer"))
+                kpanic("failed to register timer interrupt");
+}
+
+/*
+ * Programs the PIT to interrupt hz times per second, which must be a multiple
+ * of HZ. Jiffies keep counting at HZ regardless.
+ */
+void timer_set_rate(uint32_t hz)
+{
+        uint32_t divider = (PIT_FREQ + hz/2) / hz;
+        uint32_t flags = irq_save();
+
+        ticks_per_jiffy = hz / HZ;
+        tick = 0;
 
-        /* Set up the PIT */
         outb(PIT_CMD, 0x36, false); /* binary, rate gen, 16-bit, counter 0 */
-        outb(PIT_DATA, TIMER_DIVIDER & 0xff, false);
-        outb(PIT_DATA, (TIMER_DIVIDER >> 8) & 0xff, false);
+        outb(PIT_DATA, divider & 0xff, false);
+        outb(PIT_DATA, (divider >> 8) & 0xff, false);
+        irq_restore(flags);
 }
 
 /*
@@ -203,6 +448,6 @@ void sched_init()
  */
 void idle_task()
 {
-        asm("sti");
+        irq_enable();
         for (;;) {}
 }
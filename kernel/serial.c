@@ -0,0 +1,60 @@
+#include <asm/io.h>
+#include <kernel/kernel.h>
+#include <kernel/serial.h>
+
+/* 16550 UART registers, as offsets from the port base */
+#define UART_DATA 0
+#define UART_IER 1
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_SCRATCH 7
+
+/* UART_LSR bits */
+#define LSR_THR_EMPTY 0x20
+
+/* UART_LCR bits */
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+
+static bool present;
+
+/*
+ * Sets up COM1 for polled output at SERIAL_BAUD, 8N1. If no UART answers at
+ * that address, output is silently discarded.
+ */
+void serial_init()
+{
+	uint16_t divisor = 115200 / SERIAL_BAUD;
+
+	outb(COM1 + UART_SCRATCH, 0x5a, false);
+	if (inb(COM1 + UART_SCRATCH, false) != 0x5a)
+		return;
+
+	outb(COM1 + UART_IER, 0, false);
+	outb(COM1 + UART_LCR, LCR_DLAB, false);
+	outb(COM1 + UART_DATA, divisor & 0xff, false);
+	outb(COM1 + UART_IER, (divisor >> 8) & 0xff, false);
+	outb(COM1 + UART_LCR, LCR_8N1, false);
+	outb(COM1 + UART_FCR, 0xc7, false); /* Enable and clear FIFOs */
+	outb(COM1 + UART_MCR, 0x03, false); /* DTR, RTS */
+	present = true;
+}
+
+void serial_putc(char c)
+{
+	if (!present)
+		return;
+	if (c == '\n')
+		serial_putc('\r');
+
+	while (!(inb(COM1 + UART_LSR, false) & LSR_THR_EMPTY));
+	outb(COM1 + UART_DATA, c, false);
+}
+
+void serial_write(char *buf, int len)
+{
+	while (len--)
+		serial_putc(*(buf++));
+}
@@ -0,0 +1,222 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+/*
+ * Deferred interrupt work. IRQ handlers only acknowledge their device and queue
+ * whatever else needs doing, which then runs with interrupts enabled:
+ *
+ *  - softirqs, a fixed set of slots run by handle_irq on the way out of an
+ *    interrupt, unless it interrupted softirqs already running
+ *  - kernel timers, run from the timer softirq once they expire (timer.c)
+ *  - tasklets, one-off functions run from the tasklet softirq
+ *  - workqueues, lists of work items run by a kernel thread of their own, for
+ *    anything long or which needs to sleep
+ */
+
+/* Pending and running softirqs are tracked per CPU, see struct percpu */
+static void (*softirq_handlers[NR_SOFTIRQS])();
+
+static struct tasklet *tasklet_head;
+static struct tasklet **tasklet_tail = &tasklet_head;
+static spinlock_t tasklet_lock = SPINLOCK_INIT;
+
+static struct workqueue workqueues[MAX_WORKQUEUES];
+static int nworkqueues;
+struct workqueue *system_wq;
+
+void open_softirq(int nr, void (*handler)())
+{
+        softirq_handlers[nr] = handler;
+}
+
+/* Marks a softirq to be run on the next IRQ exit. Safe to call anywhere. */
+void raise_softirq(int nr)
+{
+        uint32_t flags = irq_save();
+        percpu_write(softirq_pending, percpu_read(softirq_pending) | 1 << nr);
+        irq_restore(flags);
+}
+
+/* True while softirqs are running. They run with preemption disabled. */
+bool in_softirq()
+{
+        return percpu_read(softirq_running);
+}
+
+/*
+ * Runs pending softirqs with interrupts enabled. Called with interrupts
+ * disabled, which they are again on return. Interrupts arriving meanwhile
+ * raise more softirqs and leave running them to this loop, which gives up
+ * after a few rounds so a flood of interrupts can't starve the interrupted
+ * task; what's left runs on the next IRQ exit.
+ */
+void do_softirq()
+{
+        uint32_t pending;
+        int restarts = SOFTIRQ_RESTARTS, nr;
+
+        if (percpu_read(softirq_running) || !percpu_read(softirq_pending))
+                return;
+        percpu_write(softirq_running, 1);
+        preempt_disable();
+
+        while ((pending = percpu_read(softirq_pending)) && restarts--) {
+                percpu_write(softirq_pending, 0);
+                irq_enable();
+                for (nr = 0; nr < NR_SOFTIRQS; nr++) {
+                        if ((pending & (1 << nr)) && softirq_handlers[nr])
+                                softirq_handlers[nr]();
+                }
+                irq_disable();
+        }
+
+        preempt_enable_no_resched();
+        percpu_write(softirq_running, 0);
+}
+
+void tasklet_init(struct tasklet *t, void (*func)(void *data), void *data)
+{
+        t->func = func;
+        t->data = data;
+        t->scheduled = false;
+        t->next = NULL;
+}
+
+void tasklet_schedule(struct tasklet *t)
+{
+        uint32_t flags = spin_lock_irqsave(&tasklet_lock);
+
+        if (!t->scheduled) {
+                t->scheduled = true;
+                t->next = NULL;
+                *tasklet_tail = t;
+                tasklet_tail = &t->next;
+                percpu_write(softirq_pending, percpu_read(softirq_pending)
+                             | 1 << SOFTIRQ_TASKLET);
+        }
+        spin_unlock_irqrestore(&tasklet_lock, flags);
+}
+
+/*
+ * Takes the whole list of scheduled tasklets and runs them. Each one is marked
+ * unscheduled before it runs, so it can be scheduled again while running.
+ */
+static void tasklet_action()
+{
+        struct tasklet *t, *next;
+        uint32_t flags = spin_lock_irqsave(&tasklet_lock);
+
+        t = tasklet_head;
+        tasklet_head = NULL;
+        tasklet_tail = &tasklet_head;
+        spin_unlock_irqrestore(&tasklet_lock, flags);
+
+        for (; t; t = next) {
+                next = t->next;
+                t->scheduled = false;
+                t->func(t->data);
+        }
+}
+
+/*
+ * Worker thread body. Kernel threads don't get arguments, so each worker finds
+ * its queue by looking itself up.
+ */
+static void worker()
+{
+        struct workqueue *wq = NULL;
+        struct work *work;
+        uint32_t flags;
+
+        flags = irq_save();
+        for (int i = 0; i < nworkqueues; i++) {
+                if (workqueues[i].worker == current)
+                        wq = &workqueues[i];
+        }
+        irq_restore(flags);
+        if (!wq)
+                kpanic("worker thread without a workqueue");
+
+        for (;;) {
+                flags = irq_save();
+                while (!wq->head)
+                        sleep_on(&wq->wait);
+                work = wq->head;
+                wq->head = work->next;
+                if (!wq->head)
+                        wq->tail = &wq->head;
+                work->pending = false;
+                irq_restore(flags);
+
+                work->func(work);
+        }
+}
+
+/*
+ * Creates a workqueue served by a new kernel thread. Returns NULL if out of
+ * workqueues or tasks.
+ */
+struct workqueue *workqueue_create(char *name)
+{
+        struct workqueue *wq = NULL;
+        uint32_t flags = irq_save();
+
+        if (nworkqueues < MAX_WORKQUEUES) {
+                wq = &workqueues[nworkqueues];
+                wq->name = name;
+                wq->wait = NULL;
+                wq->head = NULL;
+                wq->tail = &wq->head;
+
+                /* The worker can't run before it's been recorded, since
+                   interrupts are off */
+                wq->worker = spawn_kthread(worker);
+                if (wq->worker)
+                        nworkqueues++;
+                else
+                        wq = NULL;
+        }
+        irq_restore(flags);
+        return wq;
+}
+
+void work_init(struct work *work, void (*func)(struct work *work))
+{
+        work->func = func;
+        work->pending = false;
+        work->next = NULL;
+}
+
+/* Queues a work item to be run by wq's worker. Safe to call from interrupts. */
+void queue_work(struct workqueue *wq, struct work *work)
+{
+        uint32_t flags = irq_save();
+
+        if (!work->pending) {
+                work->pending = true;
+                work->next = NULL;
+                *wq->tail = work;
+                wq->tail = &work->next;
+                wake_up(&wq->wait);
+        }
+        irq_restore(flags);
+}
+
+void schedule_work(struct work *work)
+{
+        queue_work(system_wq, work);
+}
+
+void softirq_init()
+{
+        open_softirq(SOFTIRQ_TIMER, run_timers);
+        open_softirq(SOFTIRQ_TASKLET, tasklet_action);
+
+        system_wq = workqueue_create("events");
+        if (!system_wq)
+                kpanic("failed to create the system workqueue");
+}
@@ -16,42 +16,68 @@
 ################################################################################
 # Here we statically define a few buffers used in kernel initialization before
 # we have dynamic memory allocation. These are the kernel stack, which is used
-# during startup, and the initial page directory and page table, needed to set
-# up virtual memory paging.
+# during startup, and the page directory and the page table for the first 4 MiB
+# of physical memory, needed to set up virtual memory paging.
+#
+# The kernel is linked at KERNEL_BASE + 1 MiB but loaded at 1 MiB, so the page
+# directory starts out mapping the first 16 MiB both there and at 0, with 4 MiB
+# pages. The low mapping keeps the code running while paging is turned on, and
+# the bootloader's data reachable until main() has copied what it needs.
+# paging_init replaces this with the kernel's own map.
 ################################################################################
 
+.set KERNEL_BASE, 0xc0000000
+.set KERNEL_PDE, KERNEL_BASE >> 22
+.set BOOT_PDES, 4
+.set BOOT_PDE_FLAGS, 0x83  # Present, writable, 4 MiB page
+
 .section .bss
 .align 4096
 
 .global kstack_top
-.global page_directory
 .global page_table
 
 kstack_bottom:
 	.skip 4096
 kstack_top:
 
-page_directory:
-	.skip 4096
-
 page_table:
 	.skip 4096
 
+.section .data
+.align 4096
+
+.global page_directory
+
+page_directory:
+	.set addr, 0
+	.rept BOOT_PDES
+	.long addr | BOOT_PDE_FLAGS
+	.set addr, addr + 0x400000
+	.endr
+	.skip (KERNEL_PDE - BOOT_PDES) * 4
+
+	.set addr, 0
+	.rept BOOT_PDES
+	.long addr | BOOT_PDE_FLAGS
+	.set addr, addr + 0x400000
+	.endr
+	.skip (1024 - KERNEL_PDE - BOOT_PDES) * 4
+
 ################################################################################
 # One of the peculiarities of x86 is the Global Descriptor Table, which defines
 # segments. We need to create segments for code and data for both kernel and
 # user access, but since we just use a flat memory model, each of these segments
-# is configured to span the entire address range. We also need to define a Task
-# State Segment (TSS), which we don't use to its full extent, but it is still
+# is configured to span the entire address range. We also need a Task State
+# Segment (TSS), which we don't use to its full extent, but it is still
 # required as it contains values for SS:ESP to switch to when interrupting from
 # user to kernel mode. The GDT is pointed to by a GDT descriptor, which we later
 # use with the lgdt instruction to load the GDT.
 #
-# We could set up the GDT the fancy way in C using structs and lots of bit
-# manipulations and having a function to install entries properly, but since
-# it's an ugly x86-specific feature, we'll just keep it here in assembly, and
-# also just define it with constants for simplicity. Fortunately, once it and
-# the TSS are set up they never have to be modified again.
+# Since it's an ugly x86-specific feature, we'll just keep the GDT here in
+# assembly, and also just define it with constants for simplicity. The TSS and
+# the per-CPU data segment live in each CPU's per-CPU block, so percpu_init
+# fills in their base and limit at runtime.
 ################################################################################
 
 .section .data
@@ -59,7 +85,8 @@ page_table:
 
 .set KERNEL_CS, 0x8
 .set KERNEL_DS, 0x10
-.set KERNEL_TS, 0x28
+
+.global gdt
 
 gdt:
 	.quad 0x0000000000000000  # Null segment
@@ -67,25 +94,20 @@ gdt:
 	.quad 0x00cf92000000ffff  # Kernel data
 	.quad 0x00cffa000000ffff  # User code
 	.quad 0x00cff2000000ffff  # User data
-	.quad 0x0000890000000068  # TSS (base address field set later)
+	.quad 0x0000890000000000  # TSS (base and limit set by percpu_init)
+	.quad 0x0040920000000000  # Per-CPU data (base and limit set likewise)
 
 gdt_desc:
 	.word gdt_desc - gdt - 1  # Size of GDT - 1
 	.long gdt                 # GDT pointer
 
-.align 4
-tss:
-	.long 0                   # Reserved
-	.long 0                   # ESP0, set when task switching
-	.long KERNEL_DS           # SS0
-	.skip 192
-
 ################################################################################
-# Kernel entry point code. Sets the stack pointer and segment registers, loads
-# the GDT and TSS, calls external code to setup the IDT, and then calls the C
-# main() function to fully initialize the kernel, with a pointer to the info
-# struct Multiboot gives us as the single argument. main() should not return,
-# but if it does we just lock up with an infinite loop.
+# Kernel entry point code. Turns on paging and jumps up to where the kernel is
+# linked, then sets the stack pointer and segment registers, loads the GDT,
+# calls external code to setup the IDT, and then calls the C main() function to
+# fully initialize the kernel, with a pointer to the info struct Multiboot gives
+# us as the single argument. main() should not return, but if it does we just
+# lock up with an infinite loop.
 ################################################################################
 
 .section .text
@@ -94,15 +116,24 @@ tss:
 .extern main
 .global start
 
+.set CR4_PSE, 1 << 4
+
 start:
 	cli
-	mov $kstack_top, %esp
 
-	# Set TSS segment base pointer here because the assembler won't let us
-	# do logical operations to compute constants. This simple method is fine
-	# because we know the address will have the highest 8 bits cleared.
-	mov $tss, %eax
-	or %eax, gdt + KERNEL_TS + 2
+	# Until the jump below, only physical addresses can be used
+	mov $(page_directory - KERNEL_BASE), %ecx
+	mov %ecx, %cr3
+	mov %cr4, %ecx
+	or $CR4_PSE, %ecx
+	mov %ecx, %cr4
+	mov %cr0, %ecx
+	or $0x80010000, %ecx
+	mov %ecx, %cr0
+	mov $1f, %ecx
+	jmp *%ecx
+
+1:	mov $kstack_top, %esp
 
 	mov $KERNEL_DS, %ax
 	mov %ax, %ds
@@ -113,11 +144,9 @@ start:
 
 	lgdt gdt_desc
 	jmp $KERNEL_CS, $1f
-1:	mov $KERNEL_TS, %ax
-	ltr %ax
-
-	call setup_idt
+1:	call setup_idt
 
+	add $KERNEL_BASE, %ebx
 	push %ebx
 	call main
 
@@ -128,20 +157,10 @@ start:
 # Miscellaneous assembly functions called externally.
 ################################################################################
 
-.global enable_paging
 .global flush_tlb
 .global load_idt
 .global switch_task
 
-# Enable paging and virtual address translation.
-enable_paging:
-	mov $page_directory, %eax
-	mov %eax, %cr3
-	mov %cr0, %eax
-	or $0x80010000, %eax
-	mov %eax, %cr0
-	ret
-
 # Flush the TLB by reinstalling the same CR3 value.
 flush_tlb:
 	mov %cr3, %eax
@@ -149,21 +168,41 @@ flush_tlb:
 	ret
 
 # Performs the switch to the next task by swapping the current kernel stack,
-# TSS.ESP0, CR3, and the global current task pointer.
-.extern current
-.extern _next
+# TSS.ESP0, CR3, and the current task pointer. The current and next tasks and
+# the TSS are found in the per-CPU block through %fs, at the offsets below,
+# which must match struct percpu. Only the registers the C calling convention
+# preserves are saved, since schedule() calls this like any other function.
+.set PERCPU_CURR_TASK, 4
+.set PERCPU_NEXT_TASK, 8
+.set PERCPU_TSS_ESP0, 32 + 4
+
 switch_task:
-	pusha
-	mov current, %edi
-	mov _next, %esi
+	push %ebp
+	push %edi
+	push %esi
+	push %ebx
+	mov %fs:PERCPU_CURR_TASK, %edi
+	mov %fs:PERCPU_NEXT_TASK, %esi
 
 	mov %esp, 0(%edi)
 	mov 0(%esi), %esp
 	mov 4(%esi), %eax
-	mov %eax, tss+4
+	mov %eax, %fs:PERCPU_TSS_ESP0
+
+	# Kernel threads have no CR3 of their own and run on whatever address
+	# space is loaded. Otherwise only write CR3 when it changes, as that
+	# flushes the TLB.
 	mov 8(%esi), %eax
+	test %eax, %eax
+	jz 1f
+	mov %cr3, %ecx
+	cmp %eax, %ecx
+	je 1f
 	mov %eax, %cr3
 
-	mov %esi, current
-	popa
+1:	mov %esi, %fs:PERCPU_CURR_TASK
+	pop %ebx
+	pop %esi
+	pop %edi
+	pop %ebp
 	ret
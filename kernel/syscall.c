@@ -1,14 +1,57 @@
 #include <asm/interrupt.h>
 #include <kernel/kernel.h>
+#include <kernel/paging.h>
+#include <kernel/sched.h>
 #include <kernel/syscall.h>
 
-static int no_sys()
+/*
+ * Checks that a user process may write len bytes at uaddr, which must be
+ * mapped writable and user accessible in its own address space, below the
+ * kernel. CR0.WP makes the kernel fault on read-only pages too, so anything
+ * less would let a process panic the kernel.
+ */
+static bool user_writable(uint32_t uaddr, uint32_t len)
+{
+        uint32_t page, need = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+
+        if (uaddr >= KERNEL_BASE || len > KERNEL_BASE - uaddr)
+                return false;
+        for (page = uaddr & ~0xfff; page < uaddr + len; page += PAGE_SIZE) {
+                if ((page_flags(page) & need) != need)
+                        return false;
+        }
+        return true;
+}
+
+static int no_sys(struct syscall_args *args)
 {
         return -ENOSYS;
 }
 
-static int (*syscall_vectors[])() = {
-        no_sys,
+/* exit(status) */
+static int sys_exit(struct syscall_args *args)
+{
+        do_exit(args->_1);
+}
+
+/* wait(int *status), where status may be NULL */
+static int sys_wait(struct syscall_args *args)
+{
+        int *ustatus = (int*) args->_1, status, pid;
+
+        if (ustatus && !user_writable((uint32_t) ustatus, sizeof(int)))
+                return -EINVAL;
+
+        pid = do_wait(&status);
+        if (pid > 0 && ustatus)
+                *ustatus = status;
+        return pid;
+}
+
+static int (*syscall_vectors[])(struct syscall_args *args) = {
+        [SYS_NONE] = no_sys,
+        [SYS_EXIT] = sys_exit,
+        [SYS_WAIT] = sys_wait,
 };
 
 /*
@@ -16,10 +59,11 @@ static int (*syscall_vectors[])() = {
  */
 void handle_syscall(struct exception *e)
 {
-        int callno, ret;
+        struct syscall_args args = { e->ebx, e->ecx, e->edx, e->esi, e->edi };
+        int callno;
 
         /* Other interrupts are allowed while servicing a system call. */
-        asm("sti");
+        irq_enable();
         
         callno = e->eax & 0xff;
         if (callno >= sizeof(syscall_vectors) / sizeof(*syscall_vectors)) {
@@ -27,8 +71,8 @@ void handle_syscall(struct exception *e)
                 goto end_syscall;
         }
 
-        e->eax = syscall_vectors[callno]();
+        e->eax = syscall_vectors[callno](&args);
 
 end_syscall:
-        asm("cli");
+        irq_disable();
 }
@@ -0,0 +1,133 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/tar.h>
+
+/*
+ * Lookup of files in a ustar archive held in memory, such as a boot module.
+ * Nothing is copied: a file found is returned as a pointer to its data inside
+ * the archive, which is used for as long as the archive stays where it is.
+ */
+
+/* Header block of a file */
+struct tar_hdr {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char chksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[155];
+        char pad[12];
+} __attribute__((packed));
+
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_OLDFILE '\0'
+
+static uint32_t octal(char *s, int len)
+{
+        uint32_t n = 0;
+
+        for (int i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++)
+                n = n * 8 + s[i] - '0';
+        return n;
+}
+
+/* The checksum is the byte sum of the header with its own field as spaces */
+static bool tar_valid(struct tar_hdr *hdr)
+{
+        uint8_t *p = (uint8_t*) hdr;
+        uint32_t sum = 0;
+
+        if (memcmp(hdr->magic, "ustar", 5))
+                return false;
+        for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+                if (i >= 148 && i < 156)
+                        sum += ' ';
+                else
+                        sum += p[i];
+        }
+        return sum == octal(hdr->chksum, sizeof(hdr->chksum));
+}
+
+static char *skip_root(char *s)
+{
+        for (;;) {
+                if (s[0] == '/')
+                        s++;
+                else if (s[0] == '.' && s[1] == '/')
+                        s += 2;
+                else
+                        return s;
+        }
+}
+
+/* Appends a header field, which is only null-terminated if it's short */
+static int copy_field(char *dst, char *field, int len)
+{
+        int i;
+
+        for (i = 0; i < len && field[i]; i++)
+                dst[i] = field[i];
+        return i;
+}
+
+/* Matches the header's name, with its prefix if it has one, to path */
+static bool name_matches(struct tar_hdr *hdr, char *path)
+{
+        char name[sizeof(hdr->prefix) + 1 + sizeof(hdr->name) + 1];
+        int len = 0;
+
+        if (hdr->prefix[0]) {
+                len = copy_field(name, hdr->prefix, sizeof(hdr->prefix));
+                name[len++] = '/';
+        }
+        len += copy_field(name + len, hdr->name, sizeof(hdr->name));
+        name[len] = '\0';
+        return str_eq(skip_root(name), skip_root(path));
+}
+
+/*
+ * Looks up the regular file at path in the archive of size bytes, returning
+ * its data and length in place. Leading slashes and ./ are ignored on both
+ * sides. Returns -EINVAL if the archive isn't a ustar one, or -ENOENT if it
+ * has no such file.
+ */
+int tar_find(void *archive, uint32_t size, char *path, void **data,
+             uint32_t *len)
+{
+        uint8_t *p = archive;
+        struct tar_hdr *hdr;
+        uint32_t off = 0, fsize;
+
+        while (off + TAR_BLOCK_SIZE <= size) {
+                hdr = (struct tar_hdr*) (p + off);
+                /* The archive ends with zeroed blocks */
+                if (!hdr->name[0])
+                        return -ENOENT;
+                if (!tar_valid(hdr))
+                        return off ? -ENOENT : -EINVAL;
+
+                fsize = octal(hdr->size, sizeof(hdr->size));
+                off += TAR_BLOCK_SIZE;
+                if (fsize > size - off)
+                        return -ENOENT;
+                if ((hdr->typeflag == TAR_TYPE_FILE
+                     || hdr->typeflag == TAR_TYPE_OLDFILE)
+                    && name_matches(hdr, path)) {
+                        *data = p + off;
+                        *len = fsize;
+                        return 0;
+                }
+                off += (fsize + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+        }
+        return -ENOENT;
+}
@@ -0,0 +1,131 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+/*
+ * Pending timers, sorted by expiry time, so the timer interrupt only has to
+ * look at the first one and arming a timer walks the list only as far as its
+ * slot. There are few timers pending at any time.
+ */
+static struct timer *timer_head;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+void timer_setup(struct timer *t, void (*func)(void *data), void *data)
+{
+        t->func = func;
+        t->data = data;
+        t->pending = false;
+        t->next = NULL;
+}
+
+/* Unlinks a pending timer. Called with timer_lock held. */
+static void unlink_timer(struct timer *t)
+{
+        struct timer **p;
+
+        for (p = &timer_head; *p; p = &(*p)->next) {
+                if (*p == t) {
+                        *p = t->next;
+                        break;
+                }
+        }
+        t->pending = false;
+}
+
+/*
+ * Arms a timer to expire at the given jiffies value, moving it if it was
+ * already pending. Safe to call from interrupts.
+ */
+void mod_timer(struct timer *t, uint32_t expires)
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+        struct timer **p;
+
+        if (t->pending)
+                unlink_timer(t);
+
+        t->expires = expires;
+        for (p = &timer_head; *p; p = &(*p)->next) {
+                if (time_after((*p)->expires, expires))
+                        break;
+        }
+        t->next = *p;
+        *p = t;
+        t->pending = true;
+        spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/*
+ * Disarms a timer. Returns true if it was pending, or false if it had already
+ * expired or was never armed.
+ */
+bool del_timer(struct timer *t)
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+        bool pending = t->pending;
+
+        if (pending)
+                unlink_timer(t);
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return pending;
+}
+
+/* Called from the timer interrupt once jiffies has advanced */
+void timer_tick()
+{
+        if (timer_head && !time_after(timer_head->expires, jiffies))
+                raise_softirq(SOFTIRQ_TIMER);
+}
+
+/*
+ * Timer softirq, running every expired timer. Each timer is disarmed before
+ * its function is called, so it may be rearmed from there.
+ */
+void run_timers()
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+        struct timer *t;
+
+        while ((t = timer_head) && !time_after(t->expires, jiffies)) {
+                timer_head = t->next;
+                t->pending = false;
+                spin_unlock_irqrestore(&timer_lock, flags);
+                t->func(t->data);
+                flags = spin_lock_irqsave(&timer_lock);
+        }
+        spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+struct sleeper {
+        wait_queue_t wait;
+        bool done;
+};
+
+static void wake_sleeper(void *data)
+{
+        struct sleeper *s = data;
+
+        s->done = true;
+        wake_up(&s->wait);
+}
+
+/*
+ * Puts the current task to sleep for at least ms milliseconds, rounded up to
+ * whole jiffies.
+ */
+void msleep(uint32_t ms)
+{
+        struct sleeper s = { NULL, false };
+        struct timer t;
+        uint32_t flags;
+
+        timer_setup(&t, wake_sleeper, &s);
+        flags = irq_save();
+        mod_timer(&t, jiffies + (ms * HZ + 999) / 1000 + 1);
+        while (!s.done)
+                sleep_on(&s.wait);
+        irq_restore(flags);
+}
@@ -19,6 +19,18 @@ void memcpy(void *dst, void *src, uint32_t n)
 		d[i] = s[i];
 }
 
+int memcmp(void *a, void *b, uint32_t n)
+{
+	uint8_t *p = (uint8_t*) a;
+	uint8_t *q = (uint8_t*) b;
+
+	for (; n; n--, p++, q++) {
+		if (*p != *q)
+			return *p - *q;
+	}
+	return 0;
+}
+
 int str_eq(char *a, char *b)
 {
 	while (*a || *b) {
@@ -27,3 +39,21 @@ int str_eq(char *a, char *b)
 	}
 	return 1;
 }
+
+/*
+ * Divides *n by base in place and returns the remainder. There is no libgcc to
+ * provide 64-bit division, so this does it in two 32-bit divl steps.
+ */
+uint32_t div64(uint64_t *n, uint32_t base)
+{
+	uint32_t high = *n >> 32;
+	uint32_t low = *n;
+	uint32_t qhigh, rem;
+
+	qhigh = high / base;
+	high %= base;
+	asm("divl %4" : "=a" (low), "=d" (rem) : "0" (low), "1" (high), "rm" (base));
+
+	*n = ((uint64_t) qhigh << 32) | low;
+	return rem;
+}
@@ -0,0 +1,309 @@
+#include <asm/io.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+#include <kernel/virtio.h>
+
+/*
+ * Legacy virtio PCI transport and split virtqueues, shared by the virtio
+ * drivers. Buffers added to a queue are only made visible to the device by
+ * virtq_kick(), so a batch of them costs a single notification, and with
+ * VIRTIO_F_EVENT_IDX both sides only signal the other when it asked to be.
+ */
+
+/* Legacy registers, from the I/O BAR */
+enum {
+        VIRTIO_REG_DEVICE_FEATURES = 0x00,
+        VIRTIO_REG_GUEST_FEATURES = 0x04,
+        VIRTIO_REG_QUEUE_PFN = 0x08,
+        VIRTIO_REG_QUEUE_SIZE = 0x0c,
+        VIRTIO_REG_QUEUE_SELECT = 0x0e,
+        VIRTIO_REG_QUEUE_NOTIFY = 0x10,
+        VIRTIO_REG_STATUS = 0x12,
+        VIRTIO_REG_ISR = 0x13,
+        VIRTIO_REG_CONFIG = 0x14,
+
+        /* With MSI-X on, these come first, and move the config along */
+        VIRTIO_REG_MSI_CONFIG_VECTOR = 0x14,
+        VIRTIO_REG_MSI_QUEUE_VECTOR = 0x16,
+        VIRTIO_REG_CONFIG_MSIX = 0x18
+};
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+/* Event indexes, in the entry after the end of each ring */
+#define used_event(vq) ((vq)->avail->ring[(vq)->size])
+#define avail_event(vq) \
+        (*(volatile uint16_t*) ((uint8_t*) (vq)->used + 4 + 8 * (vq)->size))
+
+/*
+ * True if the other side asked to be signalled at index event, which lies in
+ * the entries published since it was last signalled at old.
+ */
+static inline bool need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+        return (uint16_t) (new - event - 1) < (uint16_t) (new - old);
+}
+
+/*
+ * Resets a device and acknowledges it, enabling its I/O ports and bus
+ * mastering. Returns -ENODEV if its BAR 0 isn't an I/O BAR, as it is on every
+ * legacy device.
+ */
+int virtio_pci_init(struct virtio_dev *dev, struct pci_device *pdev)
+{
+        struct pci_bar *bar = &pdev->bars[0];
+
+        if (!bar->io || !bar->size)
+                return -ENODEV;
+        dev->pdev = pdev;
+        dev->io = bar->base;
+        pci_enable_device(pdev, true);
+
+        outb(dev->io + VIRTIO_REG_STATUS, 0, false);
+        outb(dev->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK, false);
+        outb(dev->io + VIRTIO_REG_STATUS,
+             VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER, false);
+        return 0;
+}
+
+/*
+ * Gives a device up to n MSI-X vectors, so each of its queues can interrupt on
+ * an IRQ of its own, or falls back to its shared INTx line, where the ISR says
+ * what happened. Configuration changes aren't signalled with MSI-X. Must come
+ * before the config is read, since it moves with MSI-X on. Returns the number
+ * of vectors, 1 for the INTx line, or an error.
+ */
+int virtio_setup_irqs(struct virtio_dev *dev, int n)
+{
+        int ret = pci_alloc_irqs(dev->pdev, 1, n, PCI_IRQ_MSIX | PCI_IRQ_INTX);
+
+        if (ret < 0)
+                return ret;
+        dev->msix = dev->pdev->irq_type == PCI_IRQ_MSIX;
+        if (dev->msix)
+                outw(dev->io + VIRTIO_REG_MSI_CONFIG_VECTOR,
+                     VIRTIO_MSI_NO_VECTOR, false);
+        return ret;
+}
+
+/* Returns the IRQ of vector n, as set up by virtio_setup_irqs */
+int virtio_irq(struct virtio_dev *dev, int n)
+{
+        return pci_irq(dev->pdev, n);
+}
+
+static inline uint16_t config_reg(struct virtio_dev *dev, int offset)
+{
+        return dev->io + offset
+               + (dev->msix ? VIRTIO_REG_CONFIG_MSIX : VIRTIO_REG_CONFIG);
+}
+
+/* Enables the wanted features the device offers, and returns them */
+uint32_t virtio_negotiate(struct virtio_dev *dev, uint32_t wanted)
+{
+        dev->features = inl(dev->io + VIRTIO_REG_DEVICE_FEATURES, false)
+                        & wanted;
+        outl(dev->io + VIRTIO_REG_GUEST_FEATURES, dev->features, false);
+        return dev->features;
+}
+
+/* Tells the device its queues are set up and it can start */
+void virtio_driver_ok(struct virtio_dev *dev)
+{
+        outb(dev->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK
+             | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK, false);
+}
+
+/* Gives up on a device, releasing its vectors, whose handlers must be gone */
+void virtio_fail(struct virtio_dev *dev)
+{
+        outb(dev->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED, false);
+        pci_free_irqs(dev->pdev);
+        dev->msix = false;
+}
+
+/* Reads and clears the interrupt status, acknowledging the interrupt */
+uint8_t virtio_isr(struct virtio_dev *dev)
+{
+        return inb(dev->io + VIRTIO_REG_ISR, false);
+}
+
+uint8_t virtio_config_read8(struct virtio_dev *dev, int offset)
+{
+        return inb(config_reg(dev, offset), false);
+}
+
+uint32_t virtio_config_read32(struct virtio_dev *dev, int offset)
+{
+        return inl(config_reg(dev, offset), false);
+}
+
+/*
+ * Sets up queue number index of a device in mem, which must be page aligned,
+ * physically contiguous, and VIRTQ_MEM_SIZE(VIRTQ_MAX_SIZE) bytes. Returns
+ * -ENODEV if the device has no such queue, or -EINVAL if it's too large.
+ */
+int virtq_init(struct virtq *vq, struct virtio_dev *dev, uint16_t index,
+               void *mem)
+{
+        uint16_t size;
+
+        outw(dev->io + VIRTIO_REG_QUEUE_SELECT, index, false);
+        size = inw(dev->io + VIRTIO_REG_QUEUE_SIZE, false);
+        if (!size)
+                return -ENODEV;
+        if (size > VIRTQ_MAX_SIZE)
+                return -EINVAL;
+
+        memset(mem, 0, VIRTQ_MEM_SIZE(size));
+        vq->dev = dev;
+        vq->index = index;
+        vq->size = size;
+        vq->event_idx = dev->features & VIRTIO_F_EVENT_IDX;
+        vq->desc = mem;
+        vq->avail = (struct virtq_avail*) ((uint8_t*) mem + 16 * size);
+        vq->used = (struct virtq_used*) ((uint8_t*) mem
+                   + VIRTQ_ALIGN(16 * size + 2 * (3 + size)));
+
+        for (int i = 0; i < size; i++)
+                vq->desc[i].next = i + 1;
+        vq->free_head = 0;
+        vq->num_free = size;
+        vq->avail_idx = 0;
+        vq->kicked_idx = 0;
+        vq->last_used = 0;
+
+        outl(dev->io + VIRTIO_REG_QUEUE_PFN, vtophys((uint32_t) mem) >> 12,
+             false);
+        return 0;
+}
+
+/*
+ * Has a queue interrupt on MSI-X vector n, or does nothing without MSI-X.
+ * Returns -EBUSY if the device couldn't take the vector.
+ */
+int virtq_set_vector(struct virtq *vq, int n)
+{
+        uint16_t io = vq->dev->io;
+
+        if (!vq->dev->msix)
+                return 0;
+        outw(io + VIRTIO_REG_QUEUE_SELECT, vq->index, false);
+        outw(io + VIRTIO_REG_MSI_QUEUE_VECTOR, n, false);
+        if (inw(io + VIRTIO_REG_MSI_QUEUE_VECTOR, false)
+            == VIRTIO_MSI_NO_VECTOR)
+                return -EBUSY;
+        return 0;
+}
+
+/*
+ * Adds a chain of n buffers to a queue, to be returned with cookie by
+ * virtq_get() once the device has used them. The device only sees it after
+ * the next virtq_kick(). Returns -EAGAIN if the queue is too full.
+ */
+int virtq_add(struct virtq *vq, struct virtq_buf *bufs, int n, void *cookie)
+{
+        uint16_t head = vq->free_head, i = head;
+        struct virtq_desc *d = NULL;
+
+        if (!n || n > vq->num_free)
+                return -EAGAIN;
+
+        /* Free descriptors are linked through next, so taking them in list
+           order leaves the chain linked already */
+        for (int k = 0; k < n; k++) {
+                d = &vq->desc[i];
+                d->addr = bufs[k].paddr;
+                d->len = bufs[k].len;
+                d->flags = (bufs[k].write ? VIRTQ_DESC_WRITE : 0)
+                           | (k < n - 1 ? VIRTQ_DESC_NEXT : 0);
+                i = d->next;
+        }
+        vq->free_head = i;
+        vq->num_free -= n;
+
+        vq->cookies[head] = cookie;
+        vq->avail->ring[vq->avail_idx % vq->size] = head;
+        vq->avail_idx++;
+        return 0;
+}
+
+/*
+ * Publishes the chains added since the last kick, and notifies the device if
+ * it wants to be told about them.
+ */
+void virtq_kick(struct virtq *vq)
+{
+        uint16_t old = vq->kicked_idx, new = vq->avail_idx;
+        bool notify;
+
+        if (old == new)
+                return;
+
+        /* The ring entries must be visible before the index, and the index
+           before the device's suppression state is read */
+        barrier();
+        vq->avail->idx = new;
+        mb();
+        vq->kicked_idx = new;
+
+        if (vq->event_idx)
+                notify = need_event(avail_event(vq), new, old);
+        else
+                notify = !(*(volatile uint16_t*) &vq->used->flags
+                           & VIRTQ_USED_NO_NOTIFY);
+        if (notify)
+                outw(vq->dev->io + VIRTIO_REG_QUEUE_NOTIFY, vq->index, false);
+}
+
+/*
+ * Takes the next chain the device has finished with, returning its cookie and
+ * setting *len to the number of bytes the device wrote. Returns NULL if there
+ * are none.
+ */
+void *virtq_get(struct virtq *vq, uint32_t *len)
+{
+        struct virtq_used_elem *e;
+        uint16_t head, i;
+        int n = 1;
+
+        if (vq->last_used == *(volatile uint16_t*) &vq->used->idx)
+                return NULL;
+        barrier();
+
+        e = &vq->used->ring[vq->last_used % vq->size];
+        vq->last_used++;
+        head = e->id;
+        if (len)
+                *len = e->len;
+
+        /* Put the chain back on the free list */
+        for (i = head; vq->desc[i].flags & VIRTQ_DESC_NEXT; i = vq->desc[i].next)
+                n++;
+        vq->desc[i].next = vq->free_head;
+        vq->free_head = head;
+        vq->num_free += n;
+        return vq->cookies[head];
+}
+
+/* Asks the device not to interrupt for used buffers, as a hint */
+void virtq_disable_cb(struct virtq *vq)
+{
+        vq->avail->flags |= VIRTQ_AVAIL_NO_INTERRUPT;
+}
+
+/*
+ * Asks the device to interrupt for the next buffer it uses. Returns false if
+ * some were already used meanwhile, which the caller must then take itself,
+ * as no interrupt may come for them.
+ */
+bool virtq_enable_cb(struct virtq *vq)
+{
+        vq->avail->flags &= ~VIRTQ_AVAIL_NO_INTERRUPT;
+        if (vq->event_idx)
+                used_event(vq) = vq->last_used;
+        mb();
+        return vq->last_used == *(volatile uint16_t*) &vq->used->idx;
+}
@@ -0,0 +1,385 @@
+#include <asm/interrupt.h>
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/blkdev.h>
+#include <kernel/irq.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/virtio.h>
+#include <kernel/virtio_blk.h>
+
+/*
+ * Driver for a virtio block device, registered as vda. Requests are queued by
+ * submit and only go out to the device when it's unplugged, as one batch with
+ * a single notification. Completions are taken in the interrupt handler, which
+ * with event indexes keeps the device from interrupting again until it has
+ * caught up with everything already taken, so a busy queue costs far fewer
+ * interrupts than requests. Requests larger than one descriptor chain can map
+ * are carried out a chunk at a time.
+ */
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO (1 << 5)
+
+/* Device configuration */
+#define VIRTIO_BLK_CFG_CAPACITY 0
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+
+#define VIRTIO_BLK_S_OK 0
+
+/* Requests in flight at once, and data buffers per request */
+#define VBLK_SLOTS 64
+#define VBLK_MAX_SEGS 32
+
+struct virtio_blk_hdr {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+} __attribute__((packed));
+
+/* A chunk of a request in flight, with the header and status the device
+   reads and writes */
+struct vblk_slot {
+        struct virtio_blk_hdr hdr;
+        uint8_t status;
+        struct blk_request *req;
+        uint32_t sectors;
+        struct vblk_slot *next;
+};
+
+struct vblk {
+        struct virtio_dev vdev;
+        struct virtq vq;
+        struct blkdev blkdev;
+        bool ro;
+
+        /* Most sectors one chunk may cover, so its buffer fits in the
+           device's limit of data descriptors */
+        uint32_t max_sectors;
+
+        /* Protects the queue, slots and pending list, as completions are
+           taken in the interrupt handler */
+        spinlock_t lock;
+        struct vblk_slot slots[VBLK_SLOTS];
+        struct vblk_slot *free_slots;
+
+        /* Requests submitted but not yet in flight */
+        struct blk_request *pending;
+        struct blk_request *pending_tail;
+};
+
+static struct vblk vblk;
+static uint8_t vq_mem[VIRTQ_MEM_SIZE(VIRTQ_MAX_SIZE)]
+        __attribute__((aligned(PAGE_SIZE)));
+
+static void push_pending(struct vblk *v, struct blk_request *req)
+{
+        req->next = NULL;
+        if (v->pending_tail)
+                v->pending_tail->next = req;
+        else
+                v->pending = req;
+        v->pending_tail = req;
+}
+
+static struct blk_request *pop_pending(struct vblk *v)
+{
+        struct blk_request *req = v->pending;
+
+        v->pending = req->next;
+        if (!v->pending)
+                v->pending_tail = NULL;
+        return req;
+}
+
+/* Requests are finished with the lock dropped, as their callbacks may
+   submit more */
+static void complete_list(struct blk_request *req)
+{
+        struct blk_request *next;
+
+        for (; req; req = next) {
+                next = req->next;
+                blk_complete(req, req->status);
+        }
+}
+
+static void finish(struct blk_request **done, struct blk_request *req,
+                   int status)
+{
+        req->status = status;
+        req->next = *done;
+        *done = req;
+}
+
+/*
+ * Describes len bytes at vaddr as buffers of physically contiguous memory,
+ * appending them to bufs without merging into those already there. Returns
+ * -EINVAL if that would take more than max buffers in all, or the memory isn't
+ * mapped.
+ */
+static int add_segments(struct virtq_buf *bufs, int *n, int max, void *vaddr,
+                        uint32_t len, bool write)
+{
+        uint32_t va = (uint32_t) vaddr, paddr, chunk;
+        int first = *n;
+
+        while (len) {
+                paddr = vtophys(va);
+                if (!paddr)
+                        return -EINVAL;
+                chunk = PAGE_SIZE - (va & 0xfff);
+                if (chunk > len)
+                        chunk = len;
+
+                if (*n > first
+                    && bufs[*n - 1].paddr + bufs[*n - 1].len == paddr) {
+                        bufs[*n - 1].len += chunk;
+                }
+                else {
+                        if (*n == max)
+                                return -EINVAL;
+                        bufs[*n].paddr = paddr;
+                        bufs[*n].len = chunk;
+                        bufs[*n].write = write;
+                        (*n)++;
+                }
+                va += chunk;
+                len -= chunk;
+        }
+        return 0;
+}
+
+/*
+ * Moves pending requests into the queue, the next chunk of each, until slots
+ * or descriptors run out. Requests that can't be mapped are failed onto done.
+ * Nothing reaches the device until the queue is kicked.
+ */
+static void dispatch(struct vblk *v, struct blk_request **done)
+{
+        struct virtq_buf bufs[VBLK_MAX_SEGS + 2];
+        struct blk_request *req;
+        struct vblk_slot *slot;
+        uint32_t sectors;
+        int n;
+
+        while (v->pending && v->free_slots) {
+                req = v->pending;
+                slot = v->free_slots;
+                sectors = req->count - req->progress;
+                if (sectors > v->max_sectors)
+                        sectors = v->max_sectors;
+
+                slot->hdr.type = req->write ? VIRTIO_BLK_T_OUT
+                                            : VIRTIO_BLK_T_IN;
+                slot->hdr.reserved = 0;
+                slot->hdr.sector = req->lba + req->progress;
+                slot->status = 0xff;
+                slot->req = req;
+                slot->sectors = sectors;
+
+                bufs[0].paddr = vtophys((uint32_t) &slot->hdr);
+                bufs[0].len = sizeof(slot->hdr);
+                bufs[0].write = false;
+                n = 1;
+                if (add_segments(bufs, &n, VBLK_MAX_SEGS + 1,
+                                 (uint8_t*) req->buf
+                                 + req->progress * SECTOR_SIZE,
+                                 sectors * SECTOR_SIZE, !req->write)) {
+                        pop_pending(v);
+                        finish(done, req, -EINVAL);
+                        continue;
+                }
+                bufs[n].paddr = vtophys((uint32_t) &slot->status);
+                bufs[n].len = 1;
+                bufs[n].write = true;
+                n++;
+
+                if (virtq_add(&v->vq, bufs, n, slot))
+                        break;
+                pop_pending(v);
+                v->free_slots = slot->next;
+        }
+}
+
+/* Takes a finished chunk, requeueing its request if there's more to do */
+static void chunk_done(struct vblk *v, struct vblk_slot *slot,
+                       struct blk_request **done)
+{
+        struct blk_request *req = slot->req;
+
+        slot->next = v->free_slots;
+        v->free_slots = slot;
+
+        if (slot->status != VIRTIO_BLK_S_OK) {
+                finish(done, req, -EIO);
+                return;
+        }
+        req->progress += slot->sectors;
+        if (req->progress < req->count) {
+                /* At the front, so its chunks stay in order */
+                req->next = v->pending;
+                v->pending = req;
+                if (!v->pending_tail)
+                        v->pending_tail = req;
+        }
+        else {
+                finish(done, req, 0);
+        }
+}
+
+static int vblk_irq(int irq, void *dev, struct exception *e)
+{
+        struct vblk *v = dev;
+        struct blk_request *done = NULL;
+        struct vblk_slot *slot;
+        uint8_t isr;
+
+        /* The INTx line may be shared, but an MSI-X vector is the queue's */
+        if (!v->vdev.msix) {
+                isr = virtio_isr(&v->vdev);
+                if (!(isr & VIRTIO_ISR_QUEUE))
+                        return isr ? IRQ_HANDLED : IRQ_NONE;
+        }
+
+        spin_lock(&v->lock);
+        do {
+                virtq_disable_cb(&v->vq);
+                while ((slot = virtq_get(&v->vq, NULL)))
+                        chunk_done(v, slot, &done);
+        } while (!virtq_enable_cb(&v->vq));
+
+        /* Freed slots go straight to waiting requests */
+        dispatch(v, &done);
+        virtq_kick(&v->vq);
+        spin_unlock(&v->lock);
+
+        complete_list(done);
+        return IRQ_HANDLED;
+}
+
+static void vblk_submit(struct blkdev *dev, struct blk_request *req)
+{
+        struct vblk *v = dev->private;
+        uint32_t flags;
+
+        if (req->write && v->ro) {
+                blk_complete(req, -EPERM);
+                return;
+        }
+        flags = spin_lock_irqsave(&v->lock);
+        push_pending(v, req);
+        spin_unlock_irqrestore(&v->lock, flags);
+}
+
+static void vblk_unplug(struct blkdev *dev)
+{
+        struct vblk *v = dev->private;
+        struct blk_request *done = NULL;
+        uint32_t flags;
+
+        flags = spin_lock_irqsave(&v->lock);
+        dispatch(v, &done);
+        virtq_kick(&v->vq);
+        spin_unlock_irqrestore(&v->lock, flags);
+        complete_list(done);
+}
+
+/*
+ * Sets up a virtio block device and registers it as vda. Only one is driven,
+ * so any others are refused with -EBUSY.
+ */
+static int vblk_probe(struct pci_device *dev)
+{
+        struct vblk *v = &vblk;
+        uint32_t features, segs, seg_max, hi;
+        int ret;
+
+        if (v->vdev.pdev)
+                return -EBUSY;
+        ret = virtio_pci_init(&v->vdev, dev);
+        if (ret)
+                return ret;
+        ret = virtio_setup_irqs(&v->vdev, 1);
+        if (ret < 0)
+                goto fail;
+
+        features = virtio_negotiate(&v->vdev, VIRTIO_F_EVENT_IDX
+                                    | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO);
+        v->ro = features & VIRTIO_BLK_F_RO;
+        segs = VBLK_MAX_SEGS;
+        if (features & VIRTIO_BLK_F_SEG_MAX) {
+                seg_max = virtio_config_read32(&v->vdev,
+                                               VIRTIO_BLK_CFG_SEG_MAX);
+                if (seg_max >= 2 && seg_max < VBLK_MAX_SEGS)
+                        segs = seg_max;
+        }
+        /* A buffer spanning segs pages may start partway into the first */
+        v->max_sectors = (segs - 1) * PAGE_SIZE / SECTOR_SIZE;
+
+        ret = virtq_init(&v->vq, &v->vdev, 0, vq_mem);
+        if (!ret)
+                ret = virtq_set_vector(&v->vq, 0);
+        if (ret)
+                goto fail;
+
+        spin_lock_init(&v->lock);
+        v->free_slots = NULL;
+        for (int i = 0; i < VBLK_SLOTS; i++) {
+                v->slots[i].next = v->free_slots;
+                v->free_slots = &v->slots[i];
+        }
+
+        ret = irq_register(virtio_irq(&v->vdev, 0), vblk_irq, v, "virtio-blk");
+        if (ret)
+                goto fail;
+
+        v->blkdev.name = "vda";
+        v->blkdev.sectors = virtio_config_read32(&v->vdev,
+                                                 VIRTIO_BLK_CFG_CAPACITY);
+        hi = virtio_config_read32(&v->vdev, VIRTIO_BLK_CFG_CAPACITY + 4);
+        if (hi)
+                v->blkdev.sectors = 0xffffffff;
+        v->blkdev.submit = vblk_submit;
+        v->blkdev.unplug = vblk_unplug;
+        v->blkdev.private = v;
+        ret = blkdev_register(&v->blkdev);
+        if (ret) {
+                irq_unregister(virtio_irq(&v->vdev, 0), v);
+                goto fail;
+        }
+
+        virtio_driver_ok(&v->vdev);
+        kprintf("virtio-blk: queue of %u%s%s%s\n", v->vq.size,
+                v->vq.event_idx ? ", event index" : "",
+                v->vdev.msix ? ", MSI-X" : "",
+                v->ro ? ", read-only" : "");
+        return 0;
+
+fail:
+        virtio_fail(&v->vdev);
+        v->vdev.pdev = NULL;
+        return ret;
+}
+
+static const struct pci_device_id vblk_ids[] = {
+        { VIRTIO_VENDOR, VIRTIO_DEV_BLK, PCI_ANY_ID, PCI_ANY_ID },
+        { 0 }
+};
+
+static struct pci_driver vblk_driver = {
+        .name = "virtio-blk",
+        .ids = vblk_ids,
+        .probe = vblk_probe,
+};
+
+/* Returns -ENODEV if no virtio block device could be set up */
+int virtio_blk_init()
+{
+        return pci_register_driver(&vblk_driver) ? 0 : -ENODEV;
+}
@@ -0,0 +1,270 @@
+#include <kernel/kernel.h>
+#include <kernel/errno.h>
+#include <kernel/irq.h>
+#include <kernel/netdev.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+#include <kernel/softirq.h>
+#include <kernel/spinlock.h>
+#include <kernel/virtio.h>
+#include <kernel/virtio_net.h>
+
+/*
+ * Driver for a virtio network device, registered as eth0. Buffers from the
+ * interface's pool are posted to the receive queue, and the device writes
+ * frames straight into them, which are then passed up the stack as they are.
+ * The interrupt handler only turns the receive interrupt off and schedules a
+ * tasklet, which takes a budget of frames at a time and turns it back on once
+ * the queue is empty, so a busy link costs about one interrupt per batch
+ * rather than per frame. Sent buffers are taken back lazily, whenever the
+ * driver next looks at the queues, so transmitting takes no interrupts at all.
+ */
+
+/* Feature bits */
+#define VIRTIO_NET_F_MAC (1 << 5)
+
+/* Device configuration */
+#define VIRTIO_NET_CFG_MAC 0
+
+#define VNET_RXQ 0
+#define VNET_TXQ 1
+
+/* Buffers in the pool, and most of them posted for receiving at once */
+#define VNET_BUFS 128
+#define VNET_RX_BUFS 64
+
+/* Frames taken per tasklet run, before giving other softirqs a turn */
+#define VNET_BUDGET 32
+
+/* Header the device puts before every frame, with no offloads negotiated */
+struct virtio_net_hdr {
+        uint8_t flags;
+        uint8_t gso_type;
+        uint16_t hdr_len;
+        uint16_t gso_size;
+        uint16_t csum_start;
+        uint16_t csum_offset;
+} __attribute__((packed));
+
+struct vnet {
+        struct virtio_dev vdev;
+        struct virtq rxq;
+        struct virtq txq;
+        struct netdev netdev;
+        struct tasklet poll;
+
+        /* Protects the queues */
+        spinlock_t lock;
+        int rx_posted;
+};
+
+static struct vnet vnet;
+static uint8_t rxq_mem[VIRTQ_MEM_SIZE(VIRTQ_MAX_SIZE)]
+        __attribute__((aligned(PAGE_SIZE)));
+static uint8_t txq_mem[VIRTQ_MEM_SIZE(VIRTQ_MAX_SIZE)]
+        __attribute__((aligned(PAGE_SIZE)));
+
+/* The header goes at the start of the buffer, before the headroom ends */
+static void netbuf_bufs(struct netbuf *nb, struct virtq_buf *bufs,
+                        uint32_t len, bool write)
+{
+        bufs[0].paddr = nb->paddr;
+        bufs[0].len = sizeof(struct virtio_net_hdr);
+        bufs[0].write = write;
+        bufs[1].paddr = nb->paddr + (nb->data - nb->head);
+        bufs[1].len = len;
+        bufs[1].write = write;
+}
+
+/* Posts free buffers to receive into */
+static void refill_rx(struct vnet *v)
+{
+        struct virtq_buf bufs[2];
+        struct netbuf *nb;
+
+        while (v->rx_posted < VNET_RX_BUFS) {
+                nb = netbuf_alloc(&v->netdev);
+                if (!nb)
+                        break;
+                netbuf_bufs(nb, bufs, NETBUF_SIZE - NETBUF_HEADROOM, true);
+                if (virtq_add(&v->rxq, bufs, 2, nb)) {
+                        netbuf_free(nb);
+                        break;
+                }
+                v->rx_posted++;
+        }
+}
+
+/* Returns sent buffers to the pool */
+static void reclaim_tx(struct vnet *v)
+{
+        struct netbuf *nb;
+
+        while ((nb = virtq_get(&v->txq, NULL))) {
+                v->netdev.tx_packets++;
+                netbuf_free(nb);
+        }
+}
+
+static void vnet_poll(void *data)
+{
+        struct vnet *v = data;
+        struct netbuf *head = NULL, **tail = &head, *nb, *next;
+        uint32_t flags, len;
+        int n = 0;
+        bool more;
+
+        flags = spin_lock_irqsave(&v->lock);
+        reclaim_tx(v);
+        while (n < VNET_BUDGET && (nb = virtq_get(&v->rxq, &len))) {
+                v->rx_posted--;
+                nb->data = nb->head + NETBUF_HEADROOM;
+                nb->len = len > sizeof(struct virtio_net_hdr)
+                          ? len - sizeof(struct virtio_net_hdr) : 0;
+                nb->next = NULL;
+                *tail = nb;
+                tail = &nb->next;
+                n++;
+        }
+        spin_unlock_irqrestore(&v->lock, flags);
+
+        /* Without the lock, as the stack may transmit right away */
+        for (nb = head; nb; nb = next) {
+                next = nb->next;
+                netif_rx(nb);
+        }
+
+        flags = spin_lock_irqsave(&v->lock);
+        refill_rx(v);
+        virtq_kick(&v->rxq);
+        more = n == VNET_BUDGET || !virtq_enable_cb(&v->rxq);
+        if (more)
+                virtq_disable_cb(&v->rxq);
+        spin_unlock_irqrestore(&v->lock, flags);
+        if (more)
+                tasklet_schedule(&v->poll);
+}
+
+static int vnet_irq(int irq, void *dev, struct exception *e)
+{
+        struct vnet *v = dev;
+        uint8_t isr;
+
+        if (!v->vdev.msix) {
+                isr = virtio_isr(&v->vdev);
+                if (!(isr & VIRTIO_ISR_QUEUE))
+                        return isr ? IRQ_HANDLED : IRQ_NONE;
+        }
+        virtq_disable_cb(&v->rxq);
+        tasklet_schedule(&v->poll);
+        return IRQ_HANDLED;
+}
+
+static int vnet_xmit(struct netdev *dev, struct netbuf *nb)
+{
+        struct vnet *v = dev->private;
+        struct virtq_buf bufs[2];
+        uint32_t flags;
+        int ret;
+
+        memset(nb->head, 0, sizeof(struct virtio_net_hdr));
+        netbuf_bufs(nb, bufs, nb->len, false);
+
+        flags = spin_lock_irqsave(&v->lock);
+        reclaim_tx(v);
+        ret = virtq_add(&v->txq, bufs, 2, nb);
+        if (!ret)
+                virtq_kick(&v->txq);
+        spin_unlock_irqrestore(&v->lock, flags);
+
+        if (ret) {
+                dev->tx_dropped++;
+                netbuf_free(nb);
+        }
+        return ret;
+}
+
+/*
+ * Sets up a virtio network device and registers it as eth0. Only one is
+ * driven, so any others are refused with -EBUSY. The receive queue gets an
+ * MSI-X vector of its own if there's one; the transmit queue needs none.
+ */
+static int vnet_probe(struct pci_device *dev)
+{
+        struct vnet *v = &vnet;
+        uint32_t features;
+        int ret;
+
+        if (v->vdev.pdev)
+                return -EBUSY;
+        ret = virtio_pci_init(&v->vdev, dev);
+        if (ret)
+                return ret;
+        ret = virtio_setup_irqs(&v->vdev, 1);
+        if (ret < 0)
+                goto fail;
+
+        features = virtio_negotiate(&v->vdev, VIRTIO_F_EVENT_IDX
+                                    | VIRTIO_NET_F_MAC);
+        if (!(features & VIRTIO_NET_F_MAC)) {
+                ret = -ENODEV;
+                goto fail;
+        }
+        for (int i = 0; i < ETH_ALEN; i++)
+                v->netdev.mac[i] = virtio_config_read8(&v->vdev,
+                                                       VIRTIO_NET_CFG_MAC + i);
+
+        ret = virtq_init(&v->rxq, &v->vdev, VNET_RXQ, rxq_mem);
+        if (!ret)
+                ret = virtq_init(&v->txq, &v->vdev, VNET_TXQ, txq_mem);
+        if (!ret)
+                ret = virtq_set_vector(&v->rxq, 0);
+        if (ret)
+                goto fail;
+        virtq_disable_cb(&v->txq);
+
+        spin_lock_init(&v->lock);
+        tasklet_init(&v->poll, vnet_poll, v);
+        ret = irq_register(virtio_irq(&v->vdev, 0), vnet_irq, v, "virtio-net");
+        if (ret)
+                goto fail;
+
+        v->netdev.name = "eth0";
+        v->netdev.xmit = vnet_xmit;
+        v->netdev.private = v;
+        ret = netdev_register(&v->netdev, VNET_BUFS);
+        if (ret) {
+                irq_unregister(virtio_irq(&v->vdev, 0), v);
+                goto fail;
+        }
+
+        refill_rx(v);
+        virtio_driver_ok(&v->vdev);
+        virtq_kick(&v->rxq);
+        kprintf("virtio-net: queues of %u/%u%s%s\n", v->rxq.size, v->txq.size,
+                v->rxq.event_idx ? ", event index" : "",
+                v->vdev.msix ? ", MSI-X" : "");
+        return 0;
+
+fail:
+        virtio_fail(&v->vdev);
+        v->vdev.pdev = NULL;
+        return ret;
+}
+
+static const struct pci_device_id vnet_ids[] = {
+        { VIRTIO_VENDOR, VIRTIO_DEV_NET, PCI_ANY_ID, PCI_ANY_ID },
+        { 0 }
+};
+
+static struct pci_driver vnet_driver = {
+        .name = "virtio-net",
+        .ids = vnet_ids,
+        .probe = vnet_probe,
+};
+
+/* Returns -ENODEV if no virtio network device could be set up */
+int virtio_net_init()
+{
+        return pci_register_driver(&vnet_driver) ? 0 : -ENODEV;
+}
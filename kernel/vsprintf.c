@@ -0,0 +1,198 @@
+#include <kernel/kernel.h>
+
+#define FLAG_LEFT  0x1
+#define FLAG_ZERO  0x2
+#define FLAG_SIGN  0x4
+#define FLAG_UPPER 0x8
+
+/* Output cursor which silently stops storing once the buffer is full, but keeps
+   counting so the caller can learn the untruncated length. */
+struct outbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static inline void emit(struct outbuf *out, char c)
+{
+	if (out->len + 1 < out->size)
+		out->buf[out->len] = c;
+	out->len++;
+}
+
+static void emit_padding(struct outbuf *out, char c, int n)
+{
+	while (n-- > 0)
+		emit(out, c);
+}
+
+static void emit_string(struct outbuf *out, const char *s, int width,
+			int prec, int flags)
+{
+	int len = 0;
+
+	if (!s)
+		s = "(null)";
+	while (s[len] && (prec < 0 || len < prec))
+		len++;
+
+	if (!(flags & FLAG_LEFT))
+		emit_padding(out, ' ', width - len);
+	for (int i = 0; i < len; i++)
+		emit(out, s[i]);
+	if (flags & FLAG_LEFT)
+		emit_padding(out, ' ', width - len);
+}
+
+static void emit_number(struct outbuf *out, uint64_t val, uint32_t base,
+			int width, int flags)
+{
+	char *digits = (flags & FLAG_UPPER) ? "0123456789ABCDEF"
+					    : "0123456789abcdef";
+	char tmp[24];
+	int n = 0, len;
+	bool neg = false;
+
+	if ((flags & FLAG_SIGN) && (int64_t) val < 0) {
+		neg = true;
+		val = -(int64_t) val;
+	}
+
+	/* Stay in 32-bit arithmetic whenever possible, it's much cheaper */
+	do {
+		if (val >> 32) {
+			tmp[n++] = digits[div64(&val, base)];
+		}
+		else {
+			tmp[n++] = digits[(uint32_t) val % base];
+			val = (uint32_t) val / base;
+		}
+	} while (val);
+	len = n + neg;
+
+	if (!(flags & (FLAG_LEFT | FLAG_ZERO)))
+		emit_padding(out, ' ', width - len);
+	if (neg)
+		emit(out, '-');
+	if ((flags & FLAG_ZERO) && !(flags & FLAG_LEFT))
+		emit_padding(out, '0', width - len);
+	while (n)
+		emit(out, tmp[--n]);
+	if (flags & FLAG_LEFT)
+		emit_padding(out, ' ', width - len);
+}
+
+/*
+ * Formats a string into buf, writing at most size bytes including the
+ * terminating null. Supports the usual %d %i %u %x %X %p %s %c %% conversions
+ * with '-' and '0' flags, field width, string precision, and the l and ll
+ * length modifiers. Returns the length the full output would have had.
+ */
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list ap)
+{
+	struct outbuf out = { buf, size, 0 };
+	int flags, width, prec, lng;
+	uint64_t val;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			emit(&out, *fmt);
+			continue;
+		}
+
+		flags = 0;
+		for (;;) {
+			fmt++;
+			if (*fmt == '-')
+				flags |= FLAG_LEFT;
+			else if (*fmt == '0')
+				flags |= FLAG_ZERO;
+			else
+				break;
+		}
+
+		width = 0;
+		if (*fmt == '*') {
+			width = va_arg(ap, int);
+			fmt++;
+		}
+		while (*fmt >= '0' && *fmt <= '9')
+			width = width * 10 + *(fmt++) - '0';
+
+		prec = -1;
+		if (*fmt == '.') {
+			prec = 0;
+			fmt++;
+			while (*fmt >= '0' && *fmt <= '9')
+				prec = prec * 10 + *(fmt++) - '0';
+		}
+
+		lng = 0;
+		while (*fmt == 'l') {
+			lng++;
+			fmt++;
+		}
+
+		switch (*fmt) {
+		case 'd':
+		case 'i':
+			if (lng >= 2)
+				val = va_arg(ap, int64_t);
+			else
+				val = (int64_t) va_arg(ap, int32_t);
+			emit_number(&out, val, 10, width, flags | FLAG_SIGN);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			if (lng >= 2)
+				val = va_arg(ap, uint64_t);
+			else
+				val = va_arg(ap, uint32_t);
+			if (*fmt == 'X')
+				flags |= FLAG_UPPER;
+			emit_number(&out, val, *fmt == 'u' ? 10 : 16, width,
+				    flags);
+			break;
+		case 'p':
+			val = (uint32_t) va_arg(ap, void*);
+			emit_number(&out, val, 16, 8, FLAG_ZERO);
+			break;
+		case 's':
+			emit_string(&out, va_arg(ap, char*), width, prec,
+				    flags);
+			break;
+		case 'c':
+			if (!(flags & FLAG_LEFT))
+				emit_padding(&out, ' ', width - 1);
+			emit(&out, (char) va_arg(ap, int));
+			if (flags & FLAG_LEFT)
+				emit_padding(&out, ' ', width - 1);
+			break;
+		case '%':
+			emit(&out, '%');
+			break;
+		case '\0':
+			fmt--;
+			break;
+		default:
+			emit(&out, '%');
+			emit(&out, *fmt);
+		}
+	}
+
+	if (size)
+		buf[out.len < size ? out.len : size - 1] = '\0';
+	return out.len;
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	return ret;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# Symbolizes a profiler dump captured from the kernel's serial port and prints
+# it as folded stacks, one line per unique stack with its sample count, which
+# is the input format of flamegraph.pl and most other flame graph tools.
+#
+#     make run-prof                      # press Ctrl+Alt+F10, then quit
+#     tools/profsym.py kernel.bin serial.log > kernel.folded
+#     flamegraph.pl kernel.folded > kernel.svg
+#
+# Anything in the log outside the PROF-BEGIN/PROF-END markers is ignored, and
+# samples from every dump in the log are added together.
+
+import bisect
+import subprocess
+import sys
+from collections import Counter
+
+
+def load_symbols(kernel):
+    out = subprocess.run(["nm", "-n", "--defined-only", kernel],
+                         capture_output=True, text=True, check=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1] in "tT":
+            addrs.append(int(fields[0], 16))
+            names.append(fields[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, pc):
+    i = bisect.bisect_right(addrs, pc) - 1
+    return names[i] if i >= 0 else "0x%08x" % pc
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s kernel.bin serial.log" % sys.argv[0])
+
+    addrs, names = load_symbols(sys.argv[1])
+    stacks = Counter()
+    inside = False
+
+    with open(sys.argv[2], errors="replace") as log:
+        for line in log:
+            line = line.strip()
+            if line.startswith("PROF-BEGIN"):
+                inside = True
+            elif line.startswith("PROF-END"):
+                inside = False
+            elif inside and line.startswith("S "):
+                fields = line.split()
+                pid, mode = fields[1], fields[2]
+                pcs = [int(f, 16) for f in fields[3:]]
+                if mode == "u":
+                    frames = ["[user]"]
+                else:
+                    # Return addresses point after the call instruction, so
+                    # look up the byte before to land inside the caller.
+                    frames = [symbolize(addrs, names, pcs[0])]
+                    frames += [symbolize(addrs, names, pc - 1)
+                               for pc in pcs[1:]]
+                frames.append("pid %s" % pid)
+                stacks[";".join(reversed(frames))] += 1
+
+    for stack, count in sorted(stacks.items()):
+        print("%s %d" % (stack, count))
+
+
+if __name__ == "__main__":
+    main()